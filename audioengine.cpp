@@ -3,20 +3,56 @@
  */
 
 #include "audioengine.h"
+#include "debuglog.h"
+#include "profiler.h"
 
 AudioEngine::AudioEngine() {
   lastSampleTime = 0;
   sampleInterval = 1000000 / SAMPLE_RATE; // microseconds
-  bufferPosition = 0;
+  bufferPosition = AUDIO_BLOCK_SIZE; // Empty, first update renders a block
   isInitialized = false;
+  eventCount = 0;
+  renderedFrames = 0;
+  playedFrames = 0;
+  underruns = 0;
+  droppedHits = 0;
+  envelopesEnabled = true;
+  retriggerReuse = true;
+  limiterEnabled = true;
+  clockFrame = 0;
+  clockTick = 0;
+  clockFramesPerStep = 1 << 16;
+  clockRunning = false;
+  automation = nullptr;
+  modMatrix = nullptr;
+  audibleTracks = 0xFF;
+  for (int i = 0; i < MAX_ENVELOPES; i++) {
+    trackMute[i] = VOLUME_UNITY;
+  }
+  setVelocityCurve(VELOCITY_LINEAR);
+  resetTrackParams();
+  
+  // Every slot plays samples out unshaped until configured
+  for (int i = 0; i < MAX_ENVELOPES; i++) {
+    envelopeSetup(envelopes[i], ENV_OFF, 0, 0, 0);
+  }
   
   // Initialize sample slots
   for (int i = 0; i < MAX_CONCURRENT_SAMPLES; i++) {
     activeSamples[i].data = nullptr;
     activeSamples[i].size = 0;
     activeSamples[i].position = 0;
+    activeSamples[i].start = 0;
     activeSamples[i].active = false;
-    activeSamples[i].volume = 1.0;
+    activeSamples[i].volume = VOLUME_UNITY;
+    activeSamples[i].startOffset = 0;
+    activeSamples[i].gain = 0;
+    activeSamples[i].track = ENVELOPE_NONE;
+    activeSamples[i].fraction = 0;
+    activeSamples[i].filter = 0;
+    activeSamples[i].restartOffset = AUDIO_BLOCK_SIZE;
+    activeSamples[i].restartVolume = VOLUME_UNITY;
+    activeSamples[i].restartShape = nullptr;
   }
 }
 
@@ -38,55 +74,236 @@ void AudioEngine::init() {
   Serial.println(" microseconds");
 }
 
-void AudioEngine::update() {
-  if (!isInitialized) return;
+bool AudioEngine::update() {
+  if (!isInitialized) return false;
   
   unsigned long currentTime = micros();
   
   // Check if it's time for next sample
   if (currentTime - lastSampleTime >= sampleInterval) {
+    if (currentTime - lastSampleTime >= 2 * sampleInterval) {
+      underruns++;
+    }
     lastSampleTime = currentTime;
     
-    // Mix all active samples
-    mixSamples();
-    
-    // Output current buffer position
-    if (bufferPosition < AUDIO_BUFFER_SIZE) {
-      ledcWrite(0, outputBuffer[bufferPosition]);
-      bufferPosition++;
-    } else {
+    // Render the next block once the current one has been played out
+    if (bufferPosition >= AUDIO_BLOCK_SIZE) {
+      renderBlock();
       bufferPosition = 0;
     }
+    
+    ledcWrite(0, outputBuffer[bufferPosition]);
+    bufferPosition++;
+    playedFrames++;
+    return true;
   }
+  return false;
 }
 
-void AudioEngine::playSample(uint8_t* sampleData, uint32_t sampleSize, float volume) {
+void AudioEngine::playSample(uint8_t* sampleData, uint32_t sampleSize, float volume, uint8_t envelope,
+                             uint8_t velocity) {
   if (!sampleData || sampleSize == 0) return;
   
+  // Starts with the next rendered block
+  if (startVoice(sampleData, sampleSize, volume, min(velocity, (uint8_t)MAX_VELOCITY), 0, envelope) < 0) {
+    LOG_WARN("Warning: No available sample slots");
+  }
+}
+
+bool AudioEngine::scheduleSample(uint32_t frame, uint8_t* sampleData, uint32_t sampleSize, float volume,
+                                 uint8_t envelope, uint8_t velocity) {
+  return scheduleRatchet(frame, sampleData, sampleSize, volume, envelope, 1, 0, 0, velocity);
+}
+
+bool AudioEngine::scheduleRatchet(uint32_t frame, uint8_t* sampleData, uint32_t sampleSize, float volume,
+                                  uint8_t envelope, uint8_t hits, uint16_t interval, float volumeStep,
+                                  uint8_t velocity) {
+  if (!sampleData || sampleSize == 0 || hits == 0) return false;
+  
+  // Each hit is re-queued when the one before it starts, so later hits
+  // must land in a later block to keep their exact frame
+  if (hits > 1 && interval < AUDIO_BLOCK_SIZE) interval = AUDIO_BLOCK_SIZE;
+  
+  AudioEvent event;
+  event.frame = frame;
+  event.data = sampleData;
+  event.size = sampleSize;
+  event.volume = volume;
+  event.velocity = min(velocity, (uint8_t)MAX_VELOCITY);
+  event.envelope = envelope;
+  event.repeats = hits - 1;
+  event.interval = interval;
+  event.volumeStep = volumeStep;
+  event.voice = -1;
+  return queueEvent(event);
+}
+
+bool AudioEngine::queueEvent(const AudioEvent& event) {
+  if (eventCount >= MAX_SCHEDULED_EVENTS) {
+    LOG_WARN("Warning: Audio event queue full");
+    return false;
+  }
+  
+  // Insertion sort from the back, events mostly arrive in time order
+  int i = eventCount;
+  while (i > 0 && (int32_t)(eventQueue[i - 1].frame - event.frame) > 0) {
+    eventQueue[i] = eventQueue[i - 1];
+    i--;
+  }
+  
+  eventQueue[i] = event;
+  eventCount++;
+  return true;
+}
+
+const EnvelopeShape* AudioEngine::envelopeFor(uint8_t envelope) {
+  if (envelopesEnabled && envelope < MAX_ENVELOPES) {
+    return &envelopes[envelope];
+  }
+  return nullptr;
+}
+
+uint32_t AudioEngine::startFrame(uint8_t track, uint32_t size) {
+  if (track >= MAX_ENVELOPES) return 0;
+  return (uint32_t)(((uint64_t)size * trackStart[track]) >> 8);
+}
+
+void AudioEngine::setVelocityCurve(uint8_t curve) {
+  if (curve >= NUM_VELOCITY_CURVES) return;
+  velocityCurve = curve;
+  
+  // Velocity 0 is silent on both, so a ghost step can be turned right down
+  velocityGain[0] = 0;
+  for (int velocity = 1; velocity <= MAX_VELOCITY; velocity++) {
+    float gain = (float)velocity / MAX_VELOCITY;
+    if (curve == VELOCITY_EXP) {
+      gain = powf(10.0f, -(float)VELOCITY_RANGE_DB * (MAX_VELOCITY - velocity) / (MAX_VELOCITY - 1) / 20.0f);
+    }
+    velocityGain[velocity] = (uint16_t)(gain * VOLUME_UNITY + 0.5f);
+  }
+}
+
+int32_t AudioEngine::voiceVolume(float volume, uint8_t velocity) {
+  return ((int32_t)(volume * VOLUME_UNITY) * velocityGain[velocity]) >> 8;
+}
+
+int AudioEngine::startVoice(uint8_t* sampleData, uint32_t sampleSize, float volume, uint8_t velocity, uint8_t offset,
+                            uint8_t envelope) {
+  const EnvelopeShape* shape = envelopeFor(envelope);
+  
   // Find available sample slot
   for (int i = 0; i < MAX_CONCURRENT_SAMPLES; i++) {
     if (!activeSamples[i].active) {
-      activeSamples[i].data = sampleData;
-      activeSamples[i].size = sampleSize;
-      activeSamples[i].position = 0;
-      activeSamples[i].active = true;
-      activeSamples[i].volume = volume;
+      AudioSample* sample = &activeSamples[i];
+      sample->data = sampleData;
+      sample->size = sampleSize;
+      sample->start = startFrame(envelope, sampleSize);
+      sample->position = sample->start;
+      sample->active = true;
+      sample->volume = voiceVolume(volume, velocity);
+      sample->startOffset = offset;
+      sample->envelope.start(shape);
+      sample->track = envelope;
+      sample->gain = trackGain((sample->envelope.getLevel() * sample->volume) >> 8, envelope);
+      sample->fraction = 0;
+      sample->filter = 0;
+      sample->restartOffset = AUDIO_BLOCK_SIZE;
       
-      Serial.print("Started sample in slot ");
-      Serial.print(i);
-      Serial.print(", size: ");
-      Serial.println(sampleSize);
-      return;
+      LOG_DEBUG("Started sample in slot ", i, ", size: ", sampleSize, ", offset: ", offset);
+      return i;
     }
   }
+  return -1;
+}
+
+int AudioEngine::retriggerVoice(const AudioEvent* event, uint8_t offset) {
+  if (!retriggerReuse || event->voice < 0) return -1;
   
-  Serial.println("Warning: No available sample slots");
+  // Only while the previous hit is still sounding and has been mixed at
+  // least once, a late hit can land in the block its voice started in
+  AudioSample* sample = &activeSamples[event->voice];
+  if (!sample->active || sample->data != event->data ||
+      sample->position == sample->start || sample->restartOffset < AUDIO_BLOCK_SIZE) {
+    return -1;
+  }
+  
+  sample->restartOffset = offset;
+  sample->restartVolume = voiceVolume(event->volume, event->velocity);
+  sample->restartShape = envelopeFor(event->envelope);
+  return event->voice;
+}
+
+void AudioEngine::renderBlock() {
+  PROF_SCOPE(PROF_AUDIO_RENDER);
+  
+  if (automation || modMatrix) {
+    applyTrackParams();
+  }
+  applyTrackMutes();
+  
+  // Start every voice due inside this block at its exact frame
+  uint32_t blockEnd = renderedFrames + AUDIO_BLOCK_SIZE;
+  AudioEvent retriggers[MAX_BLOCK_RETRIGGERS];
+  uint8_t retriggerCount = 0;
+  uint8_t consumed = 0;
+  while (consumed < eventCount && (int32_t)(eventQueue[consumed].frame - blockEnd) < 0) {
+    AudioEvent* event = &eventQueue[consumed];
+    
+    // Hits queued before a mute are dropped, ratchets included
+    if (event->envelope < NUM_TRACKS && !(audibleTracks & (1 << event->envelope))) {
+      consumed++;
+      continue;
+    }
+    
+    int32_t offset = (int32_t)(event->frame - renderedFrames);
+    if (offset < 0) offset = 0; // Late event, play as soon as possible
+    
+    int voice = retriggerVoice(event, (uint8_t)offset);
+    if (voice < 0) {
+      voice = startVoice(event->data, event->size, event->volume, event->velocity, (uint8_t)offset,
+                         event->envelope);
+    }
+    if (voice < 0) {
+      LOG_WARN("Warning: No available sample slots");
+    }
+    
+    // Next hit of a ratchet, queued once this block's events are out of the way
+    if (event->repeats > 0 && retriggerCount < MAX_BLOCK_RETRIGGERS) {
+      AudioEvent& next = retriggers[retriggerCount++];
+      next = *event;
+      next.frame = event->frame + event->interval;
+      next.repeats--;
+      next.volume += event->volumeStep;
+      next.voice = voice;
+    } else if (event->repeats > 0) {
+      droppedHits += event->repeats;
+      LOG_WARN("Warning: Ratchet hits dropped: ", event->repeats);
+    }
+    consumed++;
+  }
+  
+  if (consumed > 0) {
+    for (uint8_t i = consumed; i < eventCount; i++) {
+      eventQueue[i - consumed] = eventQueue[i];
+    }
+    eventCount -= consumed;
+  }
+  for (uint8_t i = 0; i < retriggerCount; i++) {
+    if (!queueEvent(retriggers[i])) {
+      droppedHits += retriggers[i].repeats + 1;
+    }
+  }
+  
+  mixSamples();
+  renderedFrames = blockEnd;
 }
 
 void AudioEngine::mixSamples() {
-  // Clear buffer section
-  for (int i = 0; i < min(32, AUDIO_BUFFER_SIZE - bufferPosition); i++) {
-    outputBuffer[bufferPosition + i] = 128; // 8-bit mid-level
+  PROF_SCOPE(PROF_MIX);
+  
+  int16_t mixBuffer[AUDIO_BLOCK_SIZE];
+  for (int i = 0; i < AUDIO_BLOCK_SIZE; i++) {
+    mixBuffer[i] = 0;
   }
   
   // Mix active samples
@@ -94,26 +311,197 @@ void AudioEngine::mixSamples() {
     if (!activeSamples[slot].active) continue;
     
     AudioSample* sample = &activeSamples[slot];
+    uint8_t restart = sample->restartOffset;
+    mixVoice(sample, mixBuffer, sample->startOffset, restart);
+    
+    if (restart < AUDIO_BLOCK_SIZE) {
+      // Ratchet hit on the same voice, cut the previous hit at its frame
+      sample->start = startFrame(sample->track, sample->size);
+      sample->position = sample->start;
+      sample->fraction = 0;
+      sample->active = true;
+      sample->volume = sample->restartVolume;
+      sample->envelope.start(sample->restartShape);
+      sample->gain = trackGain((sample->envelope.getLevel() * sample->volume) >> 8, sample->track);
+      sample->restartOffset = AUDIO_BLOCK_SIZE;
+      mixVoice(sample, mixBuffer, restart, AUDIO_BLOCK_SIZE);
+    }
     
-    // Process a small chunk of samples
-    for (int i = 0; i < min(32, AUDIO_BUFFER_SIZE - bufferPosition); i++) {
-      if (sample->position >= sample->size) {
-        // Sample finished
-        sample->active = false;
-        Serial.print("Sample finished in slot ");
-        Serial.println(slot);
-        break;
+    sample->startOffset = 0;
+    
+    // Faded out, hand the voice back before the sample data runs out
+    if (sample->active && sample->envelope.isDone()) {
+      sample->active = false;
+      LOG_DEBUG("Envelope finished in slot ", slot);
+    }
+    if (sample->active && sample->track < MAX_ENVELOPES && trackMute[sample->track] == 0) {
+      sample->active = false;
+    }
+  }
+  
+  // Peaks are brought under full scale ahead of time, the clip after it
+  // only does anything with the limiter off
+  if (limiterEnabled) {
+    limiter.process(mixBuffer, AUDIO_BLOCK_SIZE);
+  }
+  for (int i = 0; i < AUDIO_BLOCK_SIZE; i++) {
+    outputBuffer[i] = clipSample(mixBuffer[i] + 128);
+  }
+}
+
+void AudioEngine::mixVoice(AudioSample* sample, int16_t* mixBuffer, int from, int to) {
+  // Envelope runs once per block, the gain ramps linearly across it
+  int32_t gain = sample->gain;
+  int32_t endGain = trackGain((sample->envelope.advance() * sample->volume) >> 8, sample->track);
+  uint8_t track = sample->track;
+  int32_t gainStep = (endGain - gain) / (AUDIO_BLOCK_SIZE - from);
+  sample->gain = endGain;
+  
+  // Pitch or filter automation takes the slower path
+  if (track < MAX_ENVELOPES && (trackRate[track] != PITCH_UNITY || trackCutoff[track] != ENV_LEVEL_FULL)) {
+    mixVoiceShaped(sample, mixBuffer, from, to, gain, gainStep);
+    return;
+  }
+  
+  int32_t sampleValue = 0;
+  for (int i = from; i < to; i++) {
+    if (sample->position >= sample->size) {
+      // Sample finished
+      sample->active = false;
+      LOG_DEBUG("Sample finished at offset ", i);
+      break;
+    }
+    
+    // Get sample value, apply gain and accumulate around zero
+    sampleValue = (int32_t)sample->data[sample->position] - 128;
+    mixBuffer[i] += (int16_t)((sampleValue * gain) >> ENV_LEVEL_BITS);
+    gain += gainStep;
+    
+    sample->position++;
+  }
+  
+  // Keeps the filter in step, so closing it later does not click
+  if (to > from) {
+    sample->filter = sampleValue << 8;
+  }
+}
+
+void AudioEngine::mixVoiceShaped(AudioSample* sample, int16_t* mixBuffer, int from, int to,
+                                 int32_t gain, int32_t gainStep) {
+  uint32_t rate = trackRate[sample->track];
+  int32_t cutoff = trackCutoff[sample->track];
+  int32_t filter = sample->filter;
+  
+  for (int i = from; i < to; i++) {
+    if (sample->position >= sample->size) {
+      sample->active = false;
+      LOG_DEBUG("Sample finished at offset ", i);
+      break;
+    }
+    
+    // Nearest source frame, then a one-pole low-pass
+    int32_t sampleValue = (int32_t)sample->data[sample->position] - 128;
+    filter += ((sampleValue << 8) - filter) * cutoff >> ENV_LEVEL_BITS;
+    mixBuffer[i] += (int16_t)(((filter >> 8) * gain) >> ENV_LEVEL_BITS);
+    gain += gainStep;
+    
+    uint32_t step = sample->fraction + rate;
+    sample->position += step >> 16;
+    sample->fraction = step & 0xFFFF;
+  }
+  
+  sample->filter = filter;
+}
+
+int32_t AudioEngine::trackGain(int32_t gain, uint8_t track) {
+  if (track >= MAX_ENVELOPES) return gain;
+  gain = (gain * trackVolume[track]) >> 8;
+  return (gain * trackMute[track]) >> 8;
+}
+
+void AudioEngine::applyTrackMutes() {
+  for (int track = 0; track < NUM_TRACKS; track++) {
+    int32_t target = (audibleTracks & (1 << track)) ? VOLUME_UNITY : 0;
+    if (trackMute[track] < target) {
+      trackMute[track] = min(trackMute[track] + MUTE_RAMP_STEP, target);
+    } else if (trackMute[track] > target) {
+      trackMute[track] = max(trackMute[track] - MUTE_RAMP_STEP, target);
+    }
+  }
+}
+
+void AudioEngine::setClock(uint32_t frame, int32_t tick, uint32_t framesPerStep, bool running) {
+  clockFrame = frame;
+  clockTick = tick;
+  clockFramesPerStep = framesPerStep > 0 ? framesPerStep : 1;
+  clockRunning = running;
+}
+
+int32_t AudioEngine::tickAtFrame(uint32_t frame) {
+  if (!clockRunning) return clockTick;
+  
+  int64_t frames = (int32_t)(frame - clockFrame);
+  return clockTick + (int32_t)(((frames * TICKS_PER_STEP) << 16) / clockFramesPerStep);
+}
+
+void AudioEngine::setAutomation(Automation* lanes) {
+  automation = lanes;
+  resetTrackParams();
+}
+
+void AudioEngine::setModMatrix(ModMatrix* matrix) {
+  modMatrix = matrix;
+  resetTrackParams();
+}
+
+void AudioEngine::resetTrackParams() {
+  for (int i = 0; i < MAX_ENVELOPES; i++) {
+    trackVolume[i] = VOLUME_UNITY;
+    trackRate[i] = PITCH_UNITY;
+    trackCutoff[i] = ENV_LEVEL_FULL;
+    trackStart[i] = 0;
+  }
+  for (int track = 0; track < NUM_TRACKS; track++) {
+    for (int param = 0; param < NUM_AUTOMATION_PARAMS; param++) {
+      automationValues[track][param] = Automation::defaultValue(param);
+    }
+  }
+}
+
+void AudioEngine::applyTrackParams() {
+  PROF_SCOPE(PROF_AUTOMATION);
+  
+  int32_t tick = tickAtFrame(renderedFrames);
+  if (modMatrix) {
+    modMatrix->evaluate(tick);
+    for (int track = 0; track < NUM_TRACKS; track++) {
+      trackStart[track] = constrain(modMatrix->getOffset(MOD_START, track), 0, AUTOMATION_MAX_VALUE);
+    }
+  }
+  
+  for (int track = 0; track < NUM_TRACKS; track++) {
+    for (int param = 0; param < NUM_AUTOMATION_PARAMS; param++) {
+      int value = automation ? automation->getValue(track, param, tick) : Automation::defaultValue(param);
+      if (modMatrix) {
+        value = constrain(value + modMatrix->getOffset(param, track), 0, AUTOMATION_MAX_VALUE);
       }
+      if (value == automationValues[track][param]) continue;
+      automationValues[track][param] = value;
       
-      // Get sample value and apply volume
-      uint8_t sampleValue = sample->data[sample->position];
-      int16_t scaledValue = (int16_t)((sampleValue - 128) * sample->volume) + 128;
-      
-      // Mix with existing buffer (simple addition with clipping)
-      int16_t mixed = outputBuffer[bufferPosition + i] + (scaledValue - 128);
-      outputBuffer[bufferPosition + i] = clipSample(mixed + 128);
-      
-      sample->position++;
+      // Converted only on change, the float math stays off most blocks
+      switch (param) {
+        case AUTO_VOLUME:
+          trackVolume[track] = (value * VOLUME_UNITY + AUTOMATION_MAX_VALUE / 2) / AUTOMATION_MAX_VALUE;
+          break;
+        case AUTO_PITCH:
+          trackRate[track] = (uint32_t)(PITCH_UNITY * powf(2.0f, (value - 128) / 128.0f));
+          break;
+        case AUTO_CUTOFF:
+          // Eight octaves down from open, open at the top
+          trackCutoff[track] = value == AUTOMATION_MAX_VALUE ? ENV_LEVEL_FULL :
+                               (int32_t)(ENV_LEVEL_FULL * powf(2.0f, (value - AUTOMATION_MAX_VALUE) / 32.0f));
+          break;
+      }
     }
   }
 }
@@ -124,27 +512,78 @@ uint8_t AudioEngine::clipSample(int16_t sample) {
   return (uint8_t)sample;
 }
 
+void AudioEngine::setLimiterEnabled(bool enabled) {
+  if (enabled && !limiterEnabled) {
+    limiter.reset();
+  }
+  limiterEnabled = enabled;
+}
+
 void AudioEngine::stopAllSamples() {
   for (int i = 0; i < MAX_CONCURRENT_SAMPLES; i++) {
     activeSamples[i].active = false;
     activeSamples[i].position = 0;
+    activeSamples[i].restartOffset = AUDIO_BLOCK_SIZE;
   }
+  eventCount = 0;
   
   // Reset output to mid-level
   ledcWrite(0, 128);
   
-  Serial.println("All samples stopped");
+  LOG_INFO("All samples stopped");
+}
+
+void AudioEngine::stopSample(const uint8_t* sampleData, uint32_t sampleSize) {
+  if (!sampleData) return;
+  
+  // Slices play from inside the buffer, so anything starting in it goes
+  uintptr_t base = (uintptr_t)sampleData;
+  for (int i = 0; i < MAX_CONCURRENT_SAMPLES; i++) {
+    if (activeSamples[i].active && (uintptr_t)activeSamples[i].data - base < sampleSize) {
+      activeSamples[i].active = false;
+      activeSamples[i].restartOffset = AUDIO_BLOCK_SIZE;
+    }
+  }
+  
+  uint8_t kept = 0;
+  for (uint8_t i = 0; i < eventCount; i++) {
+    if ((uintptr_t)eventQueue[i].data - base >= sampleSize) {
+      eventQueue[kept++] = eventQueue[i];
+    }
+  }
+  eventCount = kept;
 }
 
 void AudioEngine::setMasterVolume(float volume) {
   // Apply volume to all active samples
   for (int i = 0; i < MAX_CONCURRENT_SAMPLES; i++) {
     if (activeSamples[i].active) {
-      activeSamples[i].volume = volume;
+      activeSamples[i].volume = (int32_t)(volume * VOLUME_UNITY);
     }
   }
 }
 
+void AudioEngine::setEnvelope(uint8_t slot, const EnvelopeShape& shape) {
+  if (slot >= MAX_ENVELOPES) return;
+  
+  // Voices point at the slot. Sounding ones restart their current stage
+  // with the new times, a sustain moving to the new level.
+  envelopes[slot] = shape;
+  for (int i = 0; i < MAX_CONCURRENT_SAMPLES; i++) {
+    if (activeSamples[i].active && activeSamples[i].track == slot) {
+      activeSamples[i].envelope.reshape();
+    }
+  }
+}
+
+int AudioEngine::getActiveVoices() {
+  int count = 0;
+  for (int i = 0; i < MAX_CONCURRENT_SAMPLES; i++) {
+    if (activeSamples[i].active) count++;
+  }
+  return count;
+}
+
 bool AudioEngine::isPlaying() {
   for (int i = 0; i < MAX_CONCURRENT_SAMPLES; i++) {
     if (activeSamples[i].active) {
@@ -6,18 +6,69 @@
 #define AUDIOENGINE_H
 
 #include <Arduino.h>
+#include "envelope.h"
+#include "automation.h"
+#include "modmatrix.h"
+#include "limiter.h"
 
 #define AUDIO_OUTPUT_PIN    25    // ESP32 internal DAC
 #define SAMPLE_RATE         22050 // Hz
-#define AUDIO_BUFFER_SIZE   512
+#define AUDIO_BLOCK_SIZE    32    // Frames mixed per render pass
 #define MAX_CONCURRENT_SAMPLES 4
+#define MAX_SCHEDULED_EVENTS   32
+#define MAX_ENVELOPES          8     // Envelope slots, one per track in practice
+#define ENVELOPE_NONE          0xFF
+#define VOLUME_UNITY           256   // Voice volume is Q8
+#define MAX_BLOCK_RETRIGGERS   8     // Ratchet hits re-queued per rendered block
+#define PITCH_UNITY            65536 // Playback rate, 16.16 source frames per output frame
+#define MUTE_RAMP_STEP         64    // Q8 per block, a mute fades over 4 blocks (5.8 ms)
+#define VELOCITY_RANGE_DB      40    // Exponential curve, velocity 1 to MAX_VELOCITY
+
+// Every track can be ratcheting at once and each needs its next hit
+// re-queued in the same block
+static_assert(MAX_BLOCK_RETRIGGERS >= NUM_TRACKS, "Not enough ratchet re-queues per block for every track");
+
+// How a hit's velocity maps to its gain
+enum VelocityCurve {
+  VELOCITY_LINEAR,
+  VELOCITY_EXP,       // Equal steps in dB, closer to how loudness is heard
+  NUM_VELOCITY_CURVES
+};
 
 struct AudioSample {
   uint8_t* data;
   uint32_t size;
   uint32_t position;
+  uint32_t start;         // Frame the current hit started from, see MOD_START
   bool active;
+  int32_t volume;       // Q8
+  uint8_t startOffset;  // First frame of the current block this voice plays in
+  int32_t gain;         // Volume times envelope at the start of the next block, Q15
+  Envelope envelope;
+  uint8_t track;          // Envelope and automation slot, ENVELOPE_NONE for neither
+  uint16_t fraction;      // Position between source frames when pitched, 0.16
+  int32_t filter;         // Low-pass state, 8.8
+  
+  // Ratchet hit that restarts this voice partway through the current block
+  uint8_t restartOffset;  // AUDIO_BLOCK_SIZE when none
+  int32_t restartVolume;
+  const EnvelopeShape* restartShape;
+};
+
+// A sample start at an absolute output frame
+struct AudioEvent {
+  uint32_t frame;
+  uint8_t* data;
+  uint32_t size;
   float volume;
+  uint8_t velocity;     // 0 - MAX_VELOCITY, looked up in the velocity curve as it starts
+  uint8_t envelope;     // Slot index (the track) or ENVELOPE_NONE
+  
+  // Ratchets: the event re-queues itself after it starts, one hit at a time
+  uint8_t repeats;      // Hits still to follow this one
+  uint16_t interval;    // Frames between hits
+  float volumeStep;     // Added to the volume for each following hit
+  int8_t voice;         // Voice the previous hit played on, -1 if none
 };
 
 class AudioEngine {
@@ -25,21 +76,141 @@ private:
   AudioSample activeSamples[MAX_CONCURRENT_SAMPLES];
   unsigned long lastSampleTime;
   uint32_t sampleInterval; // microseconds between samples
-  uint8_t outputBuffer[AUDIO_BUFFER_SIZE];
-  uint16_t bufferPosition;
+  uint8_t outputBuffer[AUDIO_BLOCK_SIZE];
+  uint8_t bufferPosition;
   bool isInitialized;
   
+  // Pending sample starts, kept sorted by frame
+  AudioEvent eventQueue[MAX_SCHEDULED_EVENTS];
+  uint8_t eventCount;
+  
+  uint32_t renderedFrames;  // Absolute frame after the last rendered block
+  uint32_t playedFrames;    // Absolute frame of the next output sample
+  uint32_t underruns;       // Output samples written a period or more late
+  uint32_t droppedHits;     // Ratchet hits that found no room to be re-queued
+  
+  EnvelopeShape envelopes[MAX_ENVELOPES];
+  bool envelopesEnabled;
+  bool retriggerReuse;
+  
+  // Master bus limiter, bypassed to hard clipping when off
+  Limiter limiter;
+  bool limiterEnabled;
+  
+  // Audio frame to master tick, refreshed from loop()
+  uint32_t clockFrame;
+  int32_t clockTick;
+  uint32_t clockFramesPerStep;  // 16.16
+  bool clockRunning;
+  
+  // Per-track parameters driven by automation and modulation, refreshed
+  // once per block
+  Automation* automation;
+  ModMatrix* modMatrix;
+  uint8_t automationValues[NUM_TRACKS][NUM_AUTOMATION_PARAMS];
+  int32_t trackVolume[MAX_ENVELOPES];   // Q8
+  uint32_t trackRate[MAX_ENVELOPES];    // 16.16
+  int32_t trackCutoff[MAX_ENVELOPES];   // One-pole coefficient, Q15, full = open
+  uint8_t trackStart[MAX_ENVELOPES];    // Sample start, 256ths of the sample
+  
+  // Mute and solo: each track's gain ramps toward its bit in the mask, a
+  // step per block, and its voices are freed once it reaches zero
+  uint8_t audibleTracks;
+  int32_t trackMute[MAX_ENVELOPES];     // Q8, unity past NUM_TRACKS
+  
+  // Gain for each velocity, Q8, rebuilt only when the curve changes
+  uint16_t velocityGain[MAX_VELOCITY + 1];
+  uint8_t velocityCurve;
+  
+  void renderBlock();
   void mixSamples();
+  void mixVoice(AudioSample* sample, int16_t* mixBuffer, int from, int to);
+  void mixVoiceShaped(AudioSample* sample, int16_t* mixBuffer, int from, int to, int32_t gain, int32_t gainStep);
+  void applyTrackParams();
+  void applyTrackMutes();
+  int32_t trackGain(int32_t gain, uint8_t track);
+  void resetTrackParams();
+  bool queueEvent(const AudioEvent& event);
+  int startVoice(uint8_t* sampleData, uint32_t sampleSize, float volume, uint8_t velocity, uint8_t offset,
+                 uint8_t envelope);
+  int32_t voiceVolume(float volume, uint8_t velocity);
+  int retriggerVoice(const AudioEvent* event, uint8_t offset);
+  const EnvelopeShape* envelopeFor(uint8_t envelope);
+  uint32_t startFrame(uint8_t track, uint32_t size);
   uint8_t clipSample(int16_t sample);
   
 public:
   AudioEngine();
   
   void init();
-  void update();
-  void playSample(uint8_t* sampleData, uint32_t sampleSize, float volume = 1.0);
+  
+  // Put out the next sample once it is due, true when one went out
+  bool update();
+  void playSample(uint8_t* sampleData, uint32_t sampleSize, float volume = 1.0, uint8_t envelope = ENVELOPE_NONE,
+                  uint8_t velocity = MAX_VELOCITY);
+  bool scheduleSample(uint32_t frame, uint8_t* sampleData, uint32_t sampleSize, float volume = 1.0,
+                      uint8_t envelope = ENVELOPE_NONE, uint8_t velocity = MAX_VELOCITY);
+                      
+  // A ratchet: plays hits interval frames apart from frame, the volume
+  // changing by volumeStep each time. Hits after the first are queued by
+  // the renderer itself, so loop() schedules a ratchet once.
+  bool scheduleRatchet(uint32_t frame, uint8_t* sampleData, uint32_t sampleSize, float volume,
+                       uint8_t envelope, uint8_t hits, uint16_t interval, float volumeStep,
+                       uint8_t velocity = MAX_VELOCITY);
+                       
+  // Velocity scales each hit's volume through a 128-entry table, one
+  // lookup per voice start. MAX_VELOCITY is unity on either curve.
+  void setVelocityCurve(uint8_t curve);
+  uint8_t getVelocityCurve() { return velocityCurve; }
+  uint16_t getVelocityGain(uint8_t velocity) { return velocityGain[min(velocity, (uint8_t)MAX_VELOCITY)]; }
+  
+  // Let ratchet hits restart the voice of the previous hit rather than
+  // taking another one, so a roll holds a single voice
+  void setRetriggerReuse(bool reuse) { retriggerReuse = reuse; }
+  
+  // Where playback is, call every loop() pass. Automation and modulation
+  // are read at the master tick each block starts on.
+  void setClock(uint32_t frame, int32_t tick, uint32_t framesPerStep, bool running);
+  int32_t tickAtFrame(uint32_t frame);
+  
+  // Lanes and modulation read at the start of every block, nullptr for none
+  void setAutomation(Automation* lanes);
+  
+  // Bit per track that should sound. Tracks leaving it fade out and drop
+  // their queued hits; tracks joining it fade back in.
+  void setAudibleTracks(uint8_t mask) { audibleTracks = mask; }
+  void setModMatrix(ModMatrix* matrix);
   void stopAllSamples();
   void setMasterVolume(float volume);
   
+  // Silence and unqueue everything playing from a sample buffer or a slice
+  // of it, before it is freed
+  void stopSample(const uint8_t* sampleData, uint32_t sampleSize);
+  
+  // Amplitude envelopes, picked per sample start by slot index. Voices
+  // whose envelope has finished are freed before the sample ends.
+  void setEnvelope(uint8_t slot, const EnvelopeShape& shape);
+  const EnvelopeShape& getEnvelope(uint8_t slot) { return envelopes[slot]; }
+  void setEnvelopesEnabled(bool enabled) { envelopesEnabled = enabled; }
+  
+  // The limiter delays the output by LIMITER_LOOKAHEAD frames while on
+  void setLimiterEnabled(bool enabled);
+  bool getLimiterEnabled() { return limiterEnabled; }
+  int32_t takeLimiterGain() { return limiter.takeMinGain(); }   // Q15, lowest since the last call
+  bool getEnvelopesEnabled() { return envelopesEnabled; }
+  
   bool isPlaying();
+  int getActiveVoices();
+  
+  // Frame clock: events must be scheduled before getRenderFrame() passes them
+  uint32_t getRenderFrame() { return renderedFrames; }
+  uint32_t getPlayFrame() { return playedFrames; }
+  uint32_t getUnderruns() { return underruns; }
+  
+  // A block re-queues at most MAX_BLOCK_RETRIGGERS ratchets, the rest of
+  // any others lose their remaining hits. The sequencer has one ratchet
+  // per track running at a time, so it never gets here.
+  uint32_t getDroppedHits() { return droppedHits; }
 };
+
+#endif
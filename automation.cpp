@@ -0,0 +1,303 @@
+/*
+ * DriftRiff Mini - Parameter Automation Implementation
+ */
+
+#include "automation.h"
+#include "debuglog.h"
+
+Automation::Automation() {
+  poolUsed = 0;
+  for (int i = 0; i < AUTOMATION_LANES; i++) {
+    lanes[i].offset = 0;
+    lanes[i].length = 0;
+    lanes[i].points = 0;
+    lanes[i].startValue = 0;
+    lanes[i].loopTicks = 0;
+    rewind(lanes[i], cursors[i]);
+  }
+  
+  state = AUTO_IDLE;
+  recordLane = -1;
+  recordLoopTicks = 0;
+  armedPass = -1;
+  recordStart = 0;
+  recordLength = 0;
+  recordPoints = 0;
+  recordStartValue = 0;
+  lastTick = 0;
+  lastValue = 0;
+  recordOverflow = false;
+  liveTouch = false;
+  liveValue = 0;
+}
+
+uint8_t Automation::defaultValue(int param) {
+  return param == AUTO_PITCH ? 128 : AUTOMATION_MAX_VALUE;
+}
+
+// ---- Lane encoding ----
+
+bool Automation::nextPoint(const uint8_t* data, uint16_t length, AutomationCursor& cursor) {
+  if (cursor.read >= length) return false;
+  
+  const uint8_t* p = data + cursor.read;
+  uint32_t delta;
+  uint8_t value;
+  if (p[0] & AUTOMATION_LONG_POINT) {
+    delta = ((p[0] & 0x7F) << 8) | p[1];
+    value = p[2];
+    cursor.read += 3;
+  } else {
+    delta = (p[0] >> 4) + 1;
+    value = cursor.toValue + ((int8_t)(p[0] << 4) >> 4);
+    cursor.read += 1;
+  }
+  
+  cursor.fromTick = cursor.toTick;
+  cursor.fromValue = cursor.toValue;
+  cursor.toTick += delta;
+  cursor.toValue = value;
+  return true;
+}
+
+void Automation::rewind(const AutomationLane& lane, AutomationCursor& cursor) {
+  cursor.read = 0;
+  cursor.fromTick = 0;
+  cursor.toTick = 0;
+  cursor.fromValue = lane.startValue;
+  cursor.toValue = lane.startValue;
+}
+
+uint8_t Automation::evaluate(int lane, AutomationCursor& cursor, uint32_t tick) {
+  const AutomationLane& l = lanes[lane];
+  uint32_t t = tick % l.loopTicks;
+  
+  // Wrapped into the next pass, or jumped back
+  if (t < cursor.fromTick) {
+    rewind(l, cursor);
+  }
+  while (t >= cursor.toTick) {
+    // Past the last point the lane holds its value to the end of the pass
+    if (!nextPoint(pool + l.offset, l.length, cursor)) return cursor.toValue;
+  }
+  
+  int32_t span = cursor.toTick - cursor.fromTick;
+  int32_t rise = (int32_t)cursor.toValue - cursor.fromValue;
+  return cursor.fromValue + rise * (int32_t)(t - cursor.fromTick) / span;
+}
+
+uint8_t Automation::getValue(int track, int param, int32_t tick) {
+  int lane = track * NUM_AUTOMATION_PARAMS + param;
+  
+  // What is being recorded is heard straight away
+  if (liveTouch && lane == recordLane) return liveValue;
+  
+  if (lanes[lane].loopTicks == 0 || tick < 0) return defaultValue(param);
+  return evaluate(lane, cursors[lane], tick);
+}
+
+void Automation::appendPoint(uint32_t delta, uint8_t value) {
+  // Nothing more once a point is lost, a later one that fits would be
+  // timed from it
+  if (recordOverflow) return;
+  
+  // Gaps longer than a point can hold become flat points
+  while (delta > AUTOMATION_MAX_DELTA) {
+    appendPoint(AUTOMATION_MAX_DELTA, lastValue);
+    delta -= AUTOMATION_MAX_DELTA;
+  }
+  
+  // The pass is written into the free end of the pool
+  uint8_t* end = pool + poolUsed + recordLength;
+  uint16_t space = AUTOMATION_POOL_SIZE - poolUsed - recordLength;
+  int change = (int)value - lastValue;
+  if (delta <= AUTOMATION_SHORT_TICKS && change >= -8 && change <= 7) {
+    if (space < 1) {
+      recordOverflow = true;
+      return;
+    }
+    end[0] = ((delta - 1) << 4) | (change & 0x0F);
+    recordLength += 1;
+  } else {
+    if (space < 3) {
+      recordOverflow = true;
+      return;
+    }
+    end[0] = AUTOMATION_LONG_POINT | (delta >> 8);
+    end[1] = delta & 0xFF;
+    end[2] = value;
+    recordLength += 3;
+  }
+  recordPoints++;
+  lastValue = value;
+}
+
+// ---- Recording ----
+
+bool Automation::arm(int track, int param, uint32_t loopTicks) {
+  if (track < 0 || track >= NUM_TRACKS || param < 0 || param >= NUM_AUTOMATION_PARAMS || loopTicks == 0) {
+    return false;
+  }
+  recordLane = track * NUM_AUTOMATION_PARAMS + param;
+  recordLoopTicks = loopTicks;
+  armedPass = -1;
+  liveTouch = false;
+  state = AUTO_ARMED;
+  return true;
+}
+
+void Automation::cancel() {
+  state = AUTO_IDLE;
+  liveTouch = false;
+  recordLane = -1;
+}
+
+void Automation::beginPass(int32_t pass, bool touching, uint8_t value) {
+  recordStart = pass * (int32_t)recordLoopTicks;
+  recordLength = 0;
+  recordPoints = 0;
+  recordOverflow = false;
+  lastTick = 0;
+  
+  // The old lane, if any, is followed wherever the pass is not touched
+  const AutomationLane& old = lanes[recordLane];
+  rewind(old, recordCursor);
+  if (touching) {
+    recordStartValue = value;
+  } else if (old.loopTicks > 0) {
+    recordStartValue = evaluate(recordLane, recordCursor, 0);
+  } else {
+    recordStartValue = defaultValue(recordLane % NUM_AUTOMATION_PARAMS);
+  }
+  lastValue = recordStartValue;
+  state = AUTO_RECORDING;
+  LOG_INFO("Automation recording, lane ", recordLane);
+}
+
+void Automation::recordTick(uint32_t tick, uint8_t value) {
+  if (tick <= lastTick || value == lastValue) return;
+  
+  // Hold the old value up to the tick before, playback interpolates
+  // between points and a jump should stay a jump
+  if (tick - lastTick > 1) {
+    appendPoint(tick - 1 - lastTick, lastValue);
+    lastTick = tick - 1;
+  }
+  appendPoint(tick - lastTick, value);
+  lastTick = tick;
+}
+
+void Automation::record(int32_t tick, bool touching, uint8_t value) {
+  if (state == AUTO_IDLE || tick < 0) return;
+  
+  liveTouch = touching;
+  liveValue = value;
+  
+  int32_t pass = tick / (int32_t)recordLoopTicks;
+  if (state == AUTO_ARMED) {
+    if (armedPass < 0) {
+      armedPass = pass;
+      return;
+    }
+    if (pass == armedPass) return;
+    beginPass(pass, touching, value);
+  }
+  
+  // Transport went back to the start, keep the old lane
+  if (tick < recordStart) {
+    LOG_INFO("Automation recording cancelled");
+    cancel();
+    return;
+  }
+  
+  uint32_t t = tick - recordStart;
+  if (t >= recordLoopTicks) {
+    commit();
+    cancel();
+    return;
+  }
+  
+  const AutomationLane& old = lanes[recordLane];
+  if (!touching) {
+    value = old.loopTicks > 0 ? evaluate(recordLane, recordCursor, t)
+                              : defaultValue(recordLane % NUM_AUTOMATION_PARAMS);
+  }
+  recordTick(t, value);
+}
+
+static void reverseBytes(uint8_t* first, uint8_t* last) {
+  while (first < last) {
+    uint8_t swap = *first;
+    *first++ = *--last;
+    *last = swap;
+  }
+}
+
+void Automation::commit() {
+  if (recordOverflow) {
+    LOG_INFO("Automation: pool full, the end of the pass holds its last value");
+  }
+  
+  // Drop the old lane, then rotate the pass from the end of the pool into
+  // its place, the pool has no room for a second copy
+  removeLane(recordLane, recordLength);
+  AutomationLane& lane = lanes[recordLane];
+  uint8_t* start = pool + lane.offset;
+  uint8_t* end = pool + poolUsed + recordLength;
+  reverseBytes(start, end);
+  reverseBytes(start, start + recordLength);
+  reverseBytes(start + recordLength, end);
+  for (int i = recordLane + 1; i < AUTOMATION_LANES; i++) {
+    lanes[i].offset += recordLength;
+  }
+  poolUsed += recordLength;
+  
+  lane.length = recordLength;
+  lane.points = recordPoints;
+  lane.startValue = recordStartValue;
+  lane.loopTicks = recordLoopTicks;
+  rewind(lane, cursors[recordLane]);
+  
+  LOG_INFO("Automation lane ", recordLane, ": ", lane.points, " points, ", lane.length, " bytes");
+}
+
+void Automation::clearLane(int track, int param) {
+  if (track < 0 || track >= NUM_TRACKS || param < 0 || param >= NUM_AUTOMATION_PARAMS) return;
+  
+  int index = track * NUM_AUTOMATION_PARAMS + param;
+  if (state != AUTO_IDLE && index == recordLane) {
+    cancel();
+  }
+  
+  // A pass being recorded into another lane moves down with the pool
+  removeLane(index, state == AUTO_RECORDING ? recordLength : 0);
+}
+
+void Automation::removeLane(int index, uint16_t pending) {
+  AutomationLane& lane = lanes[index];
+  uint16_t tail = lane.offset + lane.length;
+  memmove(pool + lane.offset, pool + tail, poolUsed + pending - tail);
+  for (int i = index + 1; i < AUTOMATION_LANES; i++) {
+    lanes[i].offset -= lane.length;
+  }
+  poolUsed -= lane.length;
+  
+  lane.length = 0;
+  lane.points = 0;
+  lane.loopTicks = 0;
+  rewind(lane, cursors[index]);
+}
+
+// ---- Memory use ----
+
+bool Automation::isLaneUsed(int track, int param) {
+  return lanes[track * NUM_AUTOMATION_PARAMS + param].loopTicks > 0;
+}
+
+uint16_t Automation::getLaneBytes(int track, int param) {
+  return lanes[track * NUM_AUTOMATION_PARAMS + param].length;
+}
+
+uint16_t Automation::getLanePoints(int track, int param) {
+  return lanes[track * NUM_AUTOMATION_PARAMS + param].points;
+}
@@ -0,0 +1,115 @@
+/*
+ * DriftRiff Mini - Parameter Automation Header
+ *
+ * Per-track lanes for volume, pitch and filter cutoff, recorded from touch
+ * over one pass of the track and played back by the audio engine once per
+ * block. Points sit on the master tick grid (1/96 step) and are stored as
+ * deltas in one pool shared by every lane, so a lane only takes the bytes
+ * its gesture needs.
+ */
+
+#ifndef AUTOMATION_H
+#define AUTOMATION_H
+
+#include <Arduino.h>
+#include "sequencer.h"
+
+#define AUTOMATION_POOL_SIZE    4096    // Bytes shared by every lane and the pass being recorded
+#define AUTOMATION_MAX_DELTA    0x7FFF  // Longest tick gap a single point holds
+#define AUTOMATION_MAX_VALUE    255
+
+// Points are one byte when they move at most 8 ticks and -8..7 in value,
+// otherwise three: 1ttttttt tttttttt vvvvvvvv (tick delta, absolute value)
+#define AUTOMATION_LONG_POINT   0x80
+#define AUTOMATION_SHORT_TICKS  8
+
+enum AutomationParam {
+  AUTO_VOLUME,    // 255 = unity
+  AUTO_PITCH,     // 128 = unity, one octave either way
+  AUTO_CUTOFF,    // 255 = filter open
+  NUM_AUTOMATION_PARAMS
+};
+
+#define AUTOMATION_LANES (NUM_TRACKS * NUM_AUTOMATION_PARAMS)
+
+enum AutomationState {
+  AUTO_IDLE,
+  AUTO_ARMED,     // Waiting for the track to come round to its first step
+  AUTO_RECORDING
+};
+
+struct AutomationLane {
+  uint16_t offset;      // Into the pool, lanes are packed in index order
+  uint16_t length;      // Encoded bytes
+  uint16_t points;
+  uint8_t startValue;   // Value at tick 0 of the pass
+  uint32_t loopTicks;   // 0 when the lane is empty
+};
+
+// Segment of a lane around the last tick looked up
+struct AutomationCursor {
+  uint16_t read;        // Bytes decoded so far
+  uint32_t fromTick;
+  uint32_t toTick;
+  uint8_t fromValue;
+  uint8_t toValue;
+};
+
+class Automation {
+private:
+  uint8_t pool[AUTOMATION_POOL_SIZE];
+  uint16_t poolUsed;
+  AutomationLane lanes[AUTOMATION_LANES];
+  AutomationCursor cursors[AUTOMATION_LANES];   // Playback, used by the audio engine
+  
+  // Pass being recorded
+  uint8_t state;
+  int recordLane;
+  uint32_t recordLoopTicks;
+  int32_t armedPass;
+  int32_t recordStart;
+  uint16_t recordLength;        // Bytes written after the last lane
+  uint16_t recordPoints;
+  uint8_t recordStartValue;
+  uint32_t lastTick;
+  uint8_t lastValue;
+  bool recordOverflow;
+  AutomationCursor recordCursor;  // Through the old lane, kept where not touched
+  bool liveTouch;
+  uint8_t liveValue;
+  
+  static bool nextPoint(const uint8_t* data, uint16_t length, AutomationCursor& cursor);
+  static void rewind(const AutomationLane& lane, AutomationCursor& cursor);
+  uint8_t evaluate(int lane, AutomationCursor& cursor, uint32_t tick);
+  void appendPoint(uint32_t delta, uint8_t value);
+  void beginPass(int32_t pass, bool touching, uint8_t value);
+  void recordTick(uint32_t tick, uint8_t value);
+  void commit();
+  void removeLane(int index, uint16_t pending);
+  
+public:
+  Automation();
+  
+  // Lane value at a master tick, the default when the lane is empty.
+  // Moves the lane's playback cursor, so ticks should mostly increase.
+  uint8_t getValue(int track, int param, int32_t tick);
+  static uint8_t defaultValue(int param);
+  
+  // Record a pass of loopTicks master ticks, starting at the next multiple
+  // of it. record() is called every loop() pass with the tick being played;
+  // touched values replace the lane, the rest of the pass keeps it.
+  bool arm(int track, int param, uint32_t loopTicks);
+  void cancel();
+  void record(int32_t tick, bool touching, uint8_t value);
+  void clearLane(int track, int param);
+  
+  int getState() { return state; }
+  
+  // Memory use
+  bool isLaneUsed(int track, int param);
+  uint16_t getLaneBytes(int track, int param);
+  uint16_t getLanePoints(int track, int param);
+  uint16_t getPoolUsed() { return poolUsed; }
+};
+
+#endif
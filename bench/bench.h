@@ -0,0 +1,50 @@
+/*
+ * DriftRiff Mini - Benchmark Harness Header
+ *
+ * Each scenario repeats one unit of work and records a wall-clock sample
+ * per unit. The runner reports median/p99 and compares against a baseline.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <chrono>
+#include <vector>
+
+class BenchTimer {
+private:
+  std::vector<double> samples;  // Microseconds per unit of work
+  std::chrono::steady_clock::time_point started;
+
+public:
+  void start() { started = std::chrono::steady_clock::now(); }
+  void stop() {
+    std::chrono::duration<double, std::micro> elapsed =
+        std::chrono::steady_clock::now() - started;
+    samples.push_back(elapsed.count());
+  }
+
+  // For scenarios timed on the virtual clock rather than the wall clock
+  void record(double micros) { samples.push_back(micros); }
+
+  const std::vector<double>& getSamples() const { return samples; }
+  void clear() { samples.clear(); }
+};
+
+typedef void (*BenchFunction)(BenchTimer& timer);
+
+struct BenchScenario {
+  const char* name;
+  const char* unit;      // What one sample measures
+  BenchFunction run;
+};
+
+extern const BenchScenario benchScenarios[];
+extern const int benchScenarioCount;
+
+// Scratch SD card shared by scenarios that need files
+const char* benchSDRoot();
+
+#endif
@@ -0,0 +1,215 @@
+/*
+ * DriftRiff Mini - Benchmark Runner
+ *
+ * Runs every scenario in bench_scenarios.cpp on the host HAL, prints a
+ * median/p99 table, optionally writes JSON and fails when a scenario's
+ * median regresses past a threshold against a saved baseline.
+ */
+
+#include <Arduino.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "bench.h"
+#include "hostsim.h"
+
+struct BenchSummary {
+  const BenchScenario* scenario;
+  size_t count;
+  double median;
+  double p99;
+  double mean;
+};
+
+static char sdRoot[] = "/tmp/driftone_bench_XXXXXX";
+
+const char* benchSDRoot() {
+  return sdRoot;
+}
+
+// Nearest-rank percentile of a sorted sample set
+static double percentile(const std::vector<double>& sorted, double percent) {
+  if (sorted.empty()) return 0.0;
+  size_t rank = (size_t)(percent / 100.0 * sorted.size() + 0.999999);
+  if (rank < 1) rank = 1;
+  if (rank > sorted.size()) rank = sorted.size();
+  return sorted[rank - 1];
+}
+
+static BenchSummary summarize(const BenchScenario* scenario, std::vector<double> samples) {
+  BenchSummary s;
+  s.scenario = scenario;
+  s.count = samples.size();
+  std::sort(samples.begin(), samples.end());
+  s.median = percentile(samples, 50.0);
+  s.p99 = percentile(samples, 99.0);
+
+  double total = 0.0;
+  for (double v : samples) total += v;
+  s.mean = samples.empty() ? 0.0 : total / samples.size();
+  return s;
+}
+
+static bool writeJson(const char* path, const std::vector<BenchSummary>& results) {
+  FILE* f = fopen(path, "w");
+  if (!f) return false;
+
+  fprintf(f, "{\n  \"scenarios\": {\n");
+  for (size_t i = 0; i < results.size(); i++) {
+    const BenchSummary& r = results[i];
+    fprintf(f, "    \"%s\": {\"unit\": \"%s\", \"samples\": %zu, "
+               "\"median_us\": %.3f, \"p99_us\": %.3f, \"mean_us\": %.3f}%s\n",
+            r.scenario->name, r.scenario->unit, r.count,
+            r.median, r.p99, r.mean, i + 1 < results.size() ? "," : "");
+  }
+  fprintf(f, "  }\n}\n");
+
+  fclose(f);
+  return true;
+}
+
+// Pull "median_us" for one scenario out of a file written by writeJson()
+static bool baselineMedian(const std::string& json, const char* name, double* median) {
+  std::string key = std::string("\"") + name + "\"";
+  size_t pos = json.find(key);
+  if (pos == std::string::npos) return false;
+
+  size_t end = json.find('}', pos);
+  size_t field = json.find("\"median_us\"", pos);
+  if (field == std::string::npos || field > end) return false;
+
+  size_t colon = json.find(':', field);
+  if (colon == std::string::npos) return false;
+  *median = atof(json.c_str() + colon + 1);
+  return true;
+}
+
+static bool readFile(const char* path, std::string* out) {
+  FILE* f = fopen(path, "r");
+  if (!f) return false;
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    out->append(buf, n);
+  }
+  fclose(f);
+  return true;
+}
+
+static int removeEntry(const char* path, const struct stat*, int, struct FTW*) {
+  return remove(path);
+}
+
+static void usage(const char* argv0) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  --json FILE        Write results as JSON\n"
+          "  --baseline FILE    Compare medians against a previous --json output\n"
+          "  --threshold PCT    Allowed median regression in percent (default: 10)\n"
+          "  --filter TEXT      Only run scenarios whose name contains TEXT\n"
+          "  --list             List scenarios and exit\n",
+          argv0);
+}
+
+int main(int argc, char** argv) {
+  const char* jsonPath = nullptr;
+  const char* baselinePath = nullptr;
+  const char* filter = nullptr;
+  double threshold = 10.0;
+
+  static const struct option options[] = {
+    {"json",      required_argument, nullptr, 'j'},
+    {"baseline",  required_argument, nullptr, 'b'},
+    {"threshold", required_argument, nullptr, 't'},
+    {"filter",    required_argument, nullptr, 'f'},
+    {"list",      no_argument,       nullptr, 'l'},
+    {"help",      no_argument,       nullptr, 'h'},
+    {nullptr, 0, nullptr, 0}
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", options, nullptr)) != -1) {
+    switch (opt) {
+      case 'j': jsonPath = optarg; break;
+      case 'b': baselinePath = optarg; break;
+      case 't': threshold = atof(optarg); break;
+      case 'f': filter = optarg; break;
+      case 'l':
+        for (int i = 0; i < benchScenarioCount; i++) {
+          printf("%-20s %s\n", benchScenarios[i].name, benchScenarios[i].unit);
+        }
+        return 0;
+      default:
+        usage(argv[0]);
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  std::string baseline;
+  if (baselinePath && !readFile(baselinePath, &baseline)) {
+    fprintf(stderr, "Cannot read baseline '%s'\n", baselinePath);
+    return 1;
+  }
+
+  if (!mkdtemp(sdRoot)) {
+    perror("mkdtemp");
+    return 1;
+  }
+  hostSDSetRoot(sdRoot);
+  hostClockSetMode(HOST_CLOCK_VIRTUAL);
+
+  // Firmware log output would only skew the timings
+  int devNull = open("/dev/null", O_WRONLY);
+  Serial.attach(-1, devNull);
+
+  std::vector<BenchSummary> results;
+  int regressions = 0;
+
+  printf("%-20s %-18s %8s %12s %12s %10s\n",
+         "scenario", "unit", "samples", "median_us", "p99_us", "vs_base");
+
+  for (int i = 0; i < benchScenarioCount; i++) {
+    const BenchScenario* scenario = &benchScenarios[i];
+    if (filter && !strstr(scenario->name, filter)) continue;
+
+    BenchTimer timer;
+    scenario->run(timer);
+    BenchSummary summary = summarize(scenario, timer.getSamples());
+    results.push_back(summary);
+
+    char delta[32] = "-";
+    double base;
+    if (!baseline.empty() && baselineMedian(baseline, scenario->name, &base) && base > 0.0) {
+      double change = (summary.median - base) / base * 100.0;
+      bool regressed = change > threshold;
+      snprintf(delta, sizeof(delta), "%+.1f%%%s", change, regressed ? " FAIL" : "");
+      if (regressed) regressions++;
+    }
+
+    printf("%-20s %-18s %8zu %12.3f %12.3f %10s\n", scenario->name, scenario->unit,
+           summary.count, summary.median, summary.p99, delta);
+    fflush(stdout);
+  }
+
+  close(devNull);
+  nftw(sdRoot, removeEntry, 8, FTW_DEPTH | FTW_PHYS);
+
+  if (jsonPath && !writeJson(jsonPath, results)) {
+    fprintf(stderr, "Cannot write '%s'\n", jsonPath);
+    return 1;
+  }
+
+  if (regressions > 0) {
+    fprintf(stderr, "%d scenario(s) regressed more than %.1f%%\n", regressions, threshold);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,775 @@
+/*
+ * DriftRiff Mini - Benchmark Scenarios
+ */
+
+#include <Arduino.h>
+#include <SD.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "hostsim.h"
+#include "audioengine.h"
+#include "automation.h"
+#include "inputlog.h"
+#include "limiter.h"
+#include "midifile.h"
+#include "modmatrix.h"
+#include "patternbank.h"
+#include "sampleanalysis.h"
+#include "sequencer.h"
+#include "sdloader.h"
+#include "seriallink.h"
+#include "slicer.h"
+#include "project.h"
+#include "tasks.h"
+#include "touchscreen.h"
+#include "ui.h"
+
+#define BENCH_MIX_SECONDS     10
+#define BENCH_MIX_UNIT_FRAMES 1024
+#define BENCH_PATTERN_BPM     200
+#define BENCH_PATTERN_STEPS   256
+#define BENCH_GRID_STEPS      256
+#define BENCH_TRIG_STEPS      4096
+#define BENCH_AUTOMATION_BPM  120
+#define BENCH_TOUCH_POINTS    10000
+#define BENCH_TOUCH_BATCH     100
+#define BENCH_LINK_FRAMES     10000
+#define BENCH_LINK_PINGS      2000
+#define BENCH_LINK_PING_BYTES 32
+#define BENCH_INPUT_PASSES    100000
+#define BENCH_TASK_COMMANDS   20000
+#define BENCH_LOAD_REPEATS    100
+#define BENCH_LOAD_SIZE       32768
+#define BENCH_TRIM_REPEATS    200
+#define BENCH_TRIM_PAD        4096  // Silent frames either side of the hit
+#define BENCH_THUMB_REPEATS   200
+#define BENCH_SLICE_REPEATS   100
+#define BENCH_SLICE_HITS      16    // Hits in the test break
+#define BENCH_PROJECT_REPEATS 20
+#define BENCH_BOOT_REPEATS    10
+#define BENCH_MIDI_REPEATS    20
+#define BENCH_KIT_FILES       64    // Sample folder size, lookups scan it
+
+// Rough SPI-mode SD card at 20 MHz: FAT lookups on open, per-command
+// overhead, a cluster chain walk on seeks and about 1 MB/s of transfer
+static const HostSDTiming benchCardTiming = {1000, 100, 300, 1000, 1000};
+
+static const uint32_t frameMicros = 1000000 / SAMPLE_RATE;
+
+// Deterministic noise-ish test signal, decaying like a drum hit
+static void fillTestSample(uint8_t* data, uint32_t size, uint32_t seed) {
+  uint32_t state = seed * 2654435761u + 1;
+  for (uint32_t i = 0; i < size; i++) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    int32_t decay = 127 - (int32_t)((i * 127) / size);
+    data[i] = (uint8_t)(128 + ((int32_t)(state & 0xFF) - 128) * decay / 128);
+  }
+}
+
+// Render one output frame the way loop() does on the device
+static inline void renderFrame(AudioEngine& engine) {
+  hostClockAdvance(frameMicros);
+  engine.update();
+}
+
+template <int Voices, bool Envelopes = false>
+static void benchMixVoices(BenchTimer& timer) {
+  static uint8_t data[Voices][MAX_SAMPLE_SIZE];
+  for (int v = 0; v < Voices; v++) {
+    fillTestSample(data[v], MAX_SAMPLE_SIZE, v + 1);
+  }
+
+  AudioEngine engine;
+  engine.init();
+
+  // Sustains past the end of the test sample, so both variants keep every
+  // voice busy and only the envelope work differs
+  EnvelopeShape shape;
+  envelopeSetup(shape, ENV_ADSR, 5, 0, 200, 70, 100);
+  engine.setEnvelope(0, shape);
+  uint8_t envelope = Envelopes ? 0 : ENVELOPE_NONE;
+
+  uint32_t units = (uint32_t)BENCH_MIX_SECONDS * SAMPLE_RATE / BENCH_MIX_UNIT_FRAMES;
+  for (uint32_t unit = 0; unit < units; unit++) {
+    timer.start();
+    // Keep every voice busy, playSample() ignores requests while full
+    for (int v = 0; v < Voices; v++) {
+      engine.playSample(data[v], MAX_SAMPLE_SIZE, 1.0, envelope);
+    }
+    for (int i = 0; i < BENCH_MIX_UNIT_FRAMES; i++) {
+      renderFrame(engine);
+    }
+    timer.stop();
+  }
+}
+
+// Four voices on tracks 0-3 under six lanes: pitch and cutoff on tracks
+// 0-1, volume on 2-3, each a recorded sweep changing on every tick
+static void benchMixAutomation(BenchTimer& timer) {
+  static uint8_t data[MAX_CONCURRENT_SAMPLES][MAX_SAMPLE_SIZE];
+  for (int v = 0; v < MAX_CONCURRENT_SAMPLES; v++) {
+    fillTestSample(data[v], MAX_SAMPLE_SIZE, v + 1);
+  }
+
+  static Automation automation;
+  static const uint8_t lanes[6][2] = {
+    {0, AUTO_PITCH}, {0, AUTO_CUTOFF}, {1, AUTO_PITCH}, {1, AUTO_CUTOFF}, {2, AUTO_VOLUME}, {3, AUTO_VOLUME}
+  };
+  const uint32_t loopTicks = NUM_STEPS * TICKS_PER_STEP;
+  for (int lane = 0; lane < 6; lane++) {
+    automation.arm(lanes[lane][0], lanes[lane][1], loopTicks);
+    automation.record(0, false, 0);
+    for (uint32_t t = loopTicks; t <= 2 * loopTicks; t++) {
+      uint32_t phase = (t * (lane + 1) * 2) % (2 * AUTOMATION_MAX_VALUE);
+      uint8_t value = phase < AUTOMATION_MAX_VALUE ? phase : 2 * AUTOMATION_MAX_VALUE - phase;
+      automation.record(t, true, value);
+    }
+  }
+
+  AudioEngine engine;
+  engine.init();
+  engine.setAutomation(&automation);
+  uint32_t framesPerStep = (uint32_t)(((uint64_t)SAMPLE_RATE * 60 << 16) / (BENCH_AUTOMATION_BPM * 4));
+  engine.setClock(0, 0, framesPerStep, true);
+
+  uint32_t units = (uint32_t)BENCH_MIX_SECONDS * SAMPLE_RATE / BENCH_MIX_UNIT_FRAMES;
+  for (uint32_t unit = 0; unit < units; unit++) {
+    timer.start();
+    for (int v = 0; v < MAX_CONCURRENT_SAMPLES; v++) {
+      engine.playSample(data[v], MAX_SAMPLE_SIZE, 1.0, v);
+    }
+    for (int i = 0; i < BENCH_MIX_UNIT_FRAMES; i++) {
+      renderFrame(engine);
+    }
+    timer.stop();
+  }
+}
+
+// Four voices on tracks 0-3 under all eight routes: every LFO shape and
+// both step sources, on every destination
+static void benchMixModulation(BenchTimer& timer) {
+  static uint8_t data[MAX_CONCURRENT_SAMPLES][MAX_SAMPLE_SIZE];
+  for (int v = 0; v < MAX_CONCURRENT_SAMPLES; v++) {
+    fillTestSample(data[v], MAX_SAMPLE_SIZE, v + 1);
+  }
+
+  static ModMatrix matrix;
+  for (int lfo = 0; lfo < MOD_LFOS; lfo++) {
+    matrix.setLfo(lfo, lfo, lfo + 1);
+  }
+  for (int step = 0; step < MOD_SEQUENCE_STEPS; step++) {
+    matrix.setSequenceStep(0, step, step * 16 - MOD_LEVEL_MAX);
+    matrix.setSequenceStep(1, step, (step * 37) % 255 - MOD_LEVEL_MAX);
+  }
+  for (int route = 0; route < MAX_MOD_ROUTES; route++) {
+    matrix.setRoute(route % NUM_MOD_SOURCES, route % MAX_CONCURRENT_SAMPLES,
+                    route % NUM_MOD_DESTINATIONS, route % 2 ? -100 : 100);
+  }
+
+  AudioEngine engine;
+  engine.init();
+  engine.setModMatrix(&matrix);
+  uint32_t framesPerStep = (uint32_t)(((uint64_t)SAMPLE_RATE * 60 << 16) / (BENCH_AUTOMATION_BPM * 4));
+  engine.setClock(0, 0, framesPerStep, true);
+
+  uint32_t units = (uint32_t)BENCH_MIX_SECONDS * SAMPLE_RATE / BENCH_MIX_UNIT_FRAMES;
+  for (uint32_t unit = 0; unit < units; unit++) {
+    timer.start();
+    for (int v = 0; v < MAX_CONCURRENT_SAMPLES; v++) {
+      engine.playSample(data[v], MAX_SAMPLE_SIZE, 1.0, v);
+    }
+    for (int i = 0; i < BENCH_MIX_UNIT_FRAMES; i++) {
+      renderFrame(engine);
+    }
+    timer.stop();
+  }
+}
+
+// Four test samples summed well past full scale, so the limiter is working
+static void benchLimiter(BenchTimer& timer) {
+  static int16_t mix[BENCH_MIX_UNIT_FRAMES];
+  static uint8_t data[MAX_SAMPLE_SIZE];
+  fillTestSample(data, MAX_SAMPLE_SIZE, 7);
+
+  Limiter limiter;
+  uint32_t units = (uint32_t)BENCH_MIX_SECONDS * SAMPLE_RATE / BENCH_MIX_UNIT_FRAMES;
+  for (uint32_t unit = 0; unit < units; unit++) {
+    for (int i = 0; i < BENCH_MIX_UNIT_FRAMES; i++) {
+      mix[i] = ((int16_t)data[(unit * BENCH_MIX_UNIT_FRAMES + i) % MAX_SAMPLE_SIZE] - 128) * MAX_CONCURRENT_SAMPLES;
+    }
+    timer.start();
+    for (int i = 0; i < BENCH_MIX_UNIT_FRAMES; i += AUDIO_BLOCK_SIZE) {
+      limiter.process(mix + i, AUDIO_BLOCK_SIZE);
+    }
+    timer.stop();
+  }
+}
+
+static void benchPatternPlayback(BenchTimer& timer) {
+  static uint8_t data[NUM_TRACKS][4096];
+  for (int t = 0; t < NUM_TRACKS; t++) {
+    fillTestSample(data[t], sizeof(data[t]), t + 11);
+  }
+
+  Sequencer sequencer;
+  AudioEngine engine;
+  sequencer.init();
+  sequencer.setBPM(BENCH_PATTERN_BPM);
+  engine.init();
+
+  uint32_t stepMicros = 60000000UL / (BENCH_PATTERN_BPM * 4);
+  SequencerTrigger triggers[NUM_TRACKS * 2];
+
+  // Same scheduling path as loop(), one sample is one 16th of playback
+  for (int s = 0; s < BENCH_PATTERN_STEPS; s++) {
+    timer.start();
+    for (uint32_t t = 0; t < stepMicros; t += frameMicros) {
+      uint32_t horizon = engine.getRenderFrame() + AUDIO_BLOCK_SIZE;
+      int count = sequencer.schedule(horizon, triggers, NUM_TRACKS * 2);
+      for (int i = 0; i < count; i++) {
+        engine.scheduleSample(triggers[i].frame, data[triggers[i].track], sizeof(data[triggers[i].track]));
+      }
+      sequencer.updatePlayhead(engine.getPlayFrame());
+      renderFrame(engine);
+    }
+    timer.stop();
+  }
+}
+
+// schedule() alone over a full pattern, every step of every track active,
+// either plain or with a mix of trig conditions on every step, optionally
+// with half the tracks muted or with velocities and accents on every step
+template <bool Conditional, bool Muted = false, bool Velocity = false>
+static void benchTriggerEval(BenchTimer& timer) {
+  static Sequencer sequencer;
+  sequencer.setBPM(BENCH_PATTERN_BPM);
+  for (int track = 0; track < NUM_TRACKS; track++) {
+    for (int step = 0; step < NUM_STEPS; step++) {
+      static const uint8_t mix[4] = {50, TRIG_PRE, TRIG_LOOP_BASE + 9, TRIG_NOT_FILL};
+      sequencer.setStep(track, step, true);
+      sequencer.setTrigCondition(track, step, Conditional ? mix[step % 4] : TRIG_ALWAYS);
+      sequencer.setStepVelocity(track, step, Velocity ? 40 + step * 5 : MAX_VELOCITY);
+      sequencer.setStepAccent(track, step, Velocity && (step & 1));
+    }
+    sequencer.setTrackAccent(track, Velocity ? 32 : 0);
+  }
+  for (int track = 0; track < NUM_TRACKS; track += 2) {
+    sequencer.setMute(track, Muted);
+  }
+  sequencer.reset();
+
+  uint32_t stepFrames = (uint32_t)SAMPLE_RATE * 60 / (BENCH_PATTERN_BPM * 4);
+  uint32_t horizon = 0;
+  SequencerTrigger triggers[NUM_TRACKS * 2];
+  volatile uint32_t sink = 0;
+
+  for (int s = 0; s < BENCH_TRIG_STEPS; s++) {
+    horizon += stepFrames;
+    timer.start();
+    int count;
+    while ((count = sequencer.schedule(horizon, triggers, NUM_TRACKS * 2)) > 0) {
+      sink += count;
+    }
+    timer.stop();
+    sequencer.updatePlayhead(horizon);
+  }
+}
+
+static void benchGridRedraw(BenchTimer& timer) {
+  Adafruit_ILI9341 tft(5, 2, 4);
+  tft.begin();
+  tft.setRotation(3);
+
+  Sequencer sequencer;
+  sequencer.init();
+
+  UI ui;
+  ui.init(&tft);
+  ui.drawInterface();
+
+  GridState grid;
+  for (int s = 0; s < BENCH_GRID_STEPS; s++) {
+    sequencer.nextStep();
+    sequencer.getGridState(grid);
+    timer.start();
+    ui.updateGrid(grid);
+    timer.stop();
+  }
+}
+
+static void benchTouchDecode(BenchTimer& timer) {
+  TouchHandler handler;
+  volatile int sink = 0;
+
+  // Sweep the whole raw range so grid, button and dead zones are all hit
+  uint32_t state = 12345;
+  for (int batch = 0; batch < BENCH_TOUCH_POINTS / BENCH_TOUCH_BATCH; batch++) {
+    timer.start();
+    for (int i = 0; i < BENCH_TOUCH_BATCH; i++) {
+      state = state * 1664525u + 1013904223u;
+      int rawX = TS_MINX + (int)((state >> 8) % (TS_MAXX - TS_MINX));
+      int rawY = TS_MINY + (int)((state >> 20) % (TS_MAXY - TS_MINY));
+      TouchAction action = handler.processTouchInput(rawX, rawY);
+      sink += action.type;
+    }
+    timer.stop();
+  }
+}
+
+// A status frame through the link: encode, CRC, ring and drain to a port
+// that takes everything
+static void benchLinkStatus(BenchTimer& timer) {
+  static HardwareSerial port(-1, -1);
+  static SerialLink link;
+  link.init(&port);
+
+  // Connect with a ping, as a client would
+  uint8_t ping[LINK_MAX_ENCODED];
+  size_t size = linkEncodeFrame(LINK_CMD_PING, 0, nullptr, 0, ping);
+  for (size_t i = 0; i < size; i++) {
+    port.inject(ping[i], 0);
+  }
+  LinkFrame frame;
+  char key;
+  link.receive(frame, key);
+
+  LinkStatus status;
+  memset(&status, 0x5A, sizeof(status));
+  for (int unit = 0; unit < BENCH_LINK_FRAMES; unit++) {
+    timer.start();
+    link.send(LINK_TLM_STATUS, &status, sizeof(status));
+    link.drain();
+    timer.stop();
+    status.millis++;
+  }
+}
+
+// What recording adds to a loop() pass at its busiest: the stylus moving
+// every pass, a console byte every eighth, and the log going to the card
+static void benchInputLogPass(BenchTimer& timer) {
+  static Sequencer sequencer;
+  SDLoader loader;
+  PatternBank bank;
+  ProjectStore store;
+  static InputLog log;
+  bank.init(&sequencer);
+  bank.reset();
+  store.init(&sequencer, &loader, &bank);
+  log.beginRecording(store, false);
+
+  uint32_t now = 0;
+  for (int unit = 0; unit < BENCH_INPUT_PASSES; unit++) {
+    now += 1000000 / SAMPLE_RATE;
+    TSPoint point(400 + (unit & 63), 500 - (unit & 31), 300);
+    timer.start();
+    log.beginPass(now);
+    log.touch(point);
+    if ((unit & 7) == 0) {
+      log.recordSerial('p');
+    }
+    log.flush(now / 1000);
+    timer.stop();
+  }
+  log.close();
+}
+
+// A command handed to a running task and answered, then the state it
+// published read back: control() with the audio step cut down to taking
+// commands
+static SpscQueue<uint32_t, 8> benchCommands;
+static std::atomic<uint32_t> benchAnswered(0);
+static Snapshot<GridState> benchState;
+
+static bool benchCommandStep() {
+  uint32_t command;
+  bool worked = false;
+  while (benchCommands.pop(command)) {
+    GridState state;
+    memset(&state, 0, sizeof(state));
+    state.steps[0] = command;
+    benchState.publish(state);
+    benchAnswered.store(command, std::memory_order_release);
+    worked = true;
+  }
+  return worked;
+}
+
+static void benchTaskCommand(BenchTimer& timer) {
+  Task task;
+  task.init("bench", benchCommandStep, TASK_AUDIO_CORE, TASK_AUDIO_PRIORITY, TASK_AUDIO_STACK, 0);
+  benchAnswered.store(0);
+  if (!task.start()) return;
+
+  for (uint32_t unit = 1; unit <= BENCH_TASK_COMMANDS; unit++) {
+    timer.start();
+    benchCommands.push(unit);
+    while (benchAnswered.load(std::memory_order_acquire) != unit) {
+      taskYield();
+    }
+    GridState state;
+    benchState.read(state);
+    timer.stop();
+  }
+  task.stop();
+}
+
+// Ping round trips through a pty, the simulator's stand-in for the USB
+// serial port: client frame in, firmware receive, pong queued and drained,
+// client decode
+static void benchLinkPing(BenchTimer& timer) {
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) return;
+  int client = open(ptsname(master), O_RDWR | O_NOCTTY);
+  if (client < 0) {
+    close(master);
+    return;
+  }
+  struct termios tio;
+  tcgetattr(master, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(master, TCSANOW, &tio);
+
+  static HardwareSerial port(-1, -1);
+  static SerialLink link;
+  port.attach(master, master);
+  link.init(&port);
+
+  uint8_t payload[BENCH_LINK_PING_BYTES];
+  for (int i = 0; i < BENCH_LINK_PING_BYTES; i++) {
+    payload[i] = i;
+  }
+  for (int unit = 0; unit < BENCH_LINK_PINGS; unit++) {
+    uint8_t encoded[LINK_MAX_ENCODED];
+    size_t size = linkEncodeFrame(LINK_CMD_PING, unit, payload, sizeof(payload), encoded);
+
+    timer.start();
+    if (write(client, encoded, size) != (ssize_t)size) break;
+
+    LinkFrame frame;
+    char key;
+    while (link.receive(frame, key) != LINK_RX_FRAME) {
+    }
+    link.send(LINK_TLM_PONG, frame.payload, frame.length);
+    link.drain();
+
+    // The pong is the only thing on the line, read up to its closing zero
+    uint8_t reply[LINK_MAX_ENCODED];
+    size_t length = 0;
+    int zeros = 0;
+    while (zeros < 2 && length < sizeof(reply)) {
+      if (read(client, reply + length, 1) == 1 && reply[length++] == 0) zeros++;
+    }
+    bool decoded = linkDecodeFrame(reply + 1, length - 2, frame);
+    timer.stop();
+    if (!decoded || frame.type != LINK_TLM_PONG) break;
+  }
+
+  port.attach(-1, -1);
+  close(client);
+  close(master);
+}
+
+// A break of evenly spaced hits, the detector also pays for each onset found
+static void benchSliceDetect(BenchTimer& timer) {
+  static uint8_t data[BENCH_LOAD_SIZE];
+  const uint32_t hitSize = sizeof(data) / BENCH_SLICE_HITS;
+  for (int hit = 0; hit < BENCH_SLICE_HITS; hit++) {
+    fillTestSample(data + hit * hitSize, hitSize, hit);
+  }
+
+  static SliceTable table;
+  for (int i = 0; i < BENCH_SLICE_REPEATS; i++) {
+    timer.start();
+    Slicer::detect(data, sizeof(data), table);
+    timer.stop();
+  }
+}
+
+static void benchSampleLoad(BenchTimer& timer) {
+  static uint8_t data[BENCH_LOAD_SIZE];
+  fillTestSample(data, sizeof(data), 99);
+
+  SD.mkdir("/bench");
+  File file = SD.open("/bench/sample32k.raw", FILE_WRITE);
+  file.write(data, sizeof(data));
+  file.close();
+
+  SDLoader loader;
+  for (int i = 0; i < BENCH_LOAD_REPEATS; i++) {
+    timer.start();
+    loader.loadCustomSample(0, "/bench/sample32k.raw");
+    timer.stop();
+  }
+}
+
+// A hit with silence and a DC offset around it, restored before each pass
+static void benchSampleAnalysis(BenchTimer& timer) {
+  static uint8_t source[BENCH_LOAD_SIZE];
+  static uint8_t data[BENCH_LOAD_SIZE];
+  memset(source, 131, sizeof(source));
+  fillTestSample(source + BENCH_TRIM_PAD, sizeof(source) - 2 * BENCH_TRIM_PAD, 7);
+  for (uint32_t i = BENCH_TRIM_PAD; i < sizeof(source) - BENCH_TRIM_PAD; i++) {
+    source[i] = min(source[i] + 3, 255);
+  }
+
+  SampleStats stats;
+  for (int i = 0; i < BENCH_TRIM_REPEATS; i++) {
+    memcpy(data, source, sizeof(data));
+    timer.start();
+    sampleAnalyze(data, sizeof(data), stats);
+    timer.stop();
+  }
+}
+
+static void benchThumbnail(BenchTimer& timer) {
+  static uint8_t data[BENCH_LOAD_SIZE];
+  fillTestSample(data, sizeof(data), 11);
+
+  SampleThumbnail thumb;
+  for (int i = 0; i < BENCH_THUMB_REPEATS; i++) {
+    timer.start();
+    sampleThumbnail(data, sizeof(data), SAMPLE_GAIN_UNITY, thumb);
+    timer.stop();
+  }
+}
+
+// Drawing one slot's thumbnail, the way a reload redraws it
+static void benchThumbnailDraw(BenchTimer& timer) {
+  Adafruit_ILI9341 tft(5, 2, 4);
+  tft.begin();
+  tft.setRotation(3);
+
+  UI ui;
+  ui.init(&tft);
+  ui.drawInterface();
+
+  static uint8_t data[BENCH_LOAD_SIZE];
+  fillTestSample(data, sizeof(data), 11);
+  SampleThumbnail thumb;
+  sampleThumbnail(data, sizeof(data), SAMPLE_GAIN_UNITY, thumb);
+  for (int i = 0; i < BENCH_THUMB_REPEATS; i++) {
+    timer.start();
+    ui.drawSample(i % NUM_SAMPLE_SLOTS, thumb, "/samples/kick.raw", true);
+    timer.stop();
+  }
+}
+
+// Every pattern filled, so nothing about the file depends on content.
+// They go through the bank like an import does, leaving the first ones
+// resident.
+static void fillTestPatterns(Sequencer& sequencer, PatternBank& bank) {
+  static Pattern pattern;
+  uint32_t state = 777;
+  bank.init(&sequencer);
+  bank.reset();
+  for (int i = 0; i < NUM_PATTERNS; i++) {
+    Sequencer::clearPattern(pattern);
+    for (int track = 0; track < NUM_TRACKS; track++) {
+      for (int step = 0; step < MAX_STEPS; step++) {
+        state = state * 1664525u + 1013904223u;
+        if ((state >> 28) & 1) {
+          pattern.steps[track] |= 1ull << step;
+        }
+      }
+    }
+    bank.write(i, pattern);
+  }
+}
+
+static void benchProjectSave(BenchTimer& timer) {
+  static Sequencer sequencer;
+  SDLoader loader;
+  PatternBank bank;
+  ProjectStore store;
+  fillTestPatterns(sequencer, bank);
+  store.init(&sequencer, &loader, &bank);
+
+  for (int i = 0; i < BENCH_PROJECT_REPEATS; i++) {
+    sequencer.markEdited();
+    timer.start();
+    store.saveNow();
+    timer.stop();
+  }
+}
+
+static void benchProjectSaveChunk(BenchTimer& timer) {
+  static Sequencer sequencer;
+  SDLoader loader;
+  PatternBank bank;
+  ProjectStore store;
+  fillTestPatterns(sequencer, bank);
+  store.init(&sequencer, &loader, &bank);
+
+  // Cost of each background step, i.e. the worst stall loop() sees
+  for (int i = 0; i < BENCH_PROJECT_REPEATS; i++) {
+    store.requestSave();
+    store.update(millis());
+    while (store.isSaving()) {
+      timer.start();
+      store.update(millis());
+      timer.stop();
+    }
+  }
+}
+
+static void benchProjectLoad(BenchTimer& timer) {
+  static Sequencer sequencer;
+  SDLoader loader;
+  PatternBank bank;
+  ProjectStore store;
+  fillTestPatterns(sequencer, bank);
+  store.init(&sequencer, &loader, &bank);
+  store.saveNow();
+
+  for (int i = 0; i < BENCH_PROJECT_REPEATS; i++) {
+    timer.start();
+    store.load();
+    timer.stop();
+  }
+}
+
+// The bank of test patterns with micro-timing and velocity on every hit,
+// so the file has what a played-in groove would
+static void fillMidiPatterns(Sequencer& sequencer, PatternBank& bank) {
+  static Pattern pattern;
+  fillTestPatterns(sequencer, bank);
+  uint32_t state = 4242;
+  for (int i = 0; i < NUM_PATTERNS; i++) {
+    bank.read(i, pattern);
+    for (int track = 0; track < NUM_TRACKS; track++) {
+      pattern.tracks[track].length = MAX_STEPS;
+      for (int step = 0; step < MAX_STEPS; step++) {
+        state = state * 1664525u + 1013904223u;
+        pattern.microTiming[track][step] = (int8_t)((state >> 24) % (2 * MAX_MICRO_OFFSET + 1)) - MAX_MICRO_OFFSET;
+        pattern.velocities[track][step] = (state >> 8) & VELOCITY_MASK;
+      }
+    }
+    bank.write(i, pattern);
+  }
+}
+
+static void benchMidiExport(BenchTimer& timer) {
+  static Sequencer sequencer;
+  static MidiFile midiFile;
+  PatternBank bank;
+  fillMidiPatterns(sequencer, bank);
+
+  for (int i = 0; i < BENCH_MIDI_REPEATS; i++) {
+    timer.start();
+    midiFile.exportPatterns("/bench.mid", bank, 0, NUM_PATTERNS, MIDIFILE_MULTI_TRACK, 120);
+    timer.stop();
+  }
+}
+
+// Parse throughput: a full bank as one type 1 song, about 160 KB
+static void benchMidiImport(BenchTimer& timer) {
+  static Sequencer sequencer;
+  static MidiFile midiFile;
+  static Pattern staging[NUM_PATTERNS];
+  PatternBank bank;
+  fillMidiPatterns(sequencer, bank);
+  midiFile.exportPatterns("/bench.mid", bank, 0, NUM_PATTERNS, MIDIFILE_MULTI_TRACK, 120);
+
+  MidiFileStats stats;
+  for (int i = 0; i < BENCH_MIDI_REPEATS; i++) {
+    timer.start();
+    midiFile.importPatterns("/bench.mid", staging, NUM_PATTERNS, stats);
+    timer.stop();
+  }
+}
+
+static void writeBootKit() {
+  static uint8_t data[BENCH_LOAD_SIZE];
+  SD.mkdir("/samples");
+
+  // A folder with more than the loaded kit, like a real sample library
+  for (int i = 0; i < BENCH_KIT_FILES; i++) {
+    char path[32];
+    snprintf(path, sizeof(path), "/samples/extra%02d.raw", i);
+    File file = SD.open(path, FILE_WRITE);
+    file.write(data, 64);
+    file.close();
+  }
+
+  for (int slot = 0; slot < NUM_SAMPLE_SLOTS; slot++) {
+    SDLoader names;
+    fillTestSample(data, sizeof(data), slot);
+    File file = SD.open(names.getSamplePath(slot), FILE_WRITE);
+    file.write(data, sizeof(data));
+    file.close();
+  }
+}
+
+// One boot's worth of sample loading, timed on the virtual clock against
+// the card model, with or without a manifest from an earlier boot
+static void benchBootLoad(BenchTimer& timer, bool warm) {
+  writeBootKit();
+  SD.remove(SAMPLE_MANIFEST_PATH);
+  if (warm) {
+    SDLoader loader;
+    loader.init();
+    loader.loadAllSamples();
+  }
+
+  hostSDSetTiming(benchCardTiming);
+  for (int i = 0; i < BENCH_BOOT_REPEATS; i++) {
+    if (!warm) SD.remove(SAMPLE_MANIFEST_PATH);
+
+    SDLoader loader;
+    uint64_t start = hostClockMicros();
+    loader.init();
+    loader.beginLoading(0);
+    while (loader.update()) {
+    }
+    timer.record((double)(hostClockMicros() - start));
+  }
+  hostSDSetTiming(HostSDTiming());
+}
+
+static void benchBootCold(BenchTimer& timer) {
+  benchBootLoad(timer, false);
+}
+
+static void benchBootWarm(BenchTimer& timer) {
+  benchBootLoad(timer, true);
+}
+
+const BenchScenario benchScenarios[] = {
+  {"mix_1_voice",      "1024 frames",        benchMixVoices<1>},
+  {"mix_4_voices",     "1024 frames",        benchMixVoices<MAX_CONCURRENT_SAMPLES>},
+  {"mix_4_voices_env", "1024 frames",        benchMixVoices<MAX_CONCURRENT_SAMPLES, true>},
+  {"mix_4_voices_auto", "1024 frames",       benchMixAutomation},
+  {"mix_4_voices_mod", "1024 frames",        benchMixModulation},
+  {"limiter",          "1024 frames",        benchLimiter},
+  {"pattern_200bpm",   "16th step",          benchPatternPlayback},
+  {"trig_eval_plain",  "16th step, 6 tracks", benchTriggerEval<false>},
+  {"trig_eval_cond",   "16th step, 6 tracks", benchTriggerEval<true>},
+  {"trig_eval_muted",  "16th step, 3 muted", benchTriggerEval<false, true>},
+  {"trig_eval_velocity", "16th step, 6 tracks", benchTriggerEval<false, false, true>},
+  {"grid_redraw",      "updateGrid call",    benchGridRedraw},
+  {"touch_decode",     "100 touch points",   benchTouchDecode},
+  {"link_status",      "status frame",       benchLinkStatus},
+  {"link_ping_pty",    "32-byte round trip", benchLinkPing},
+  {"input_log_pass",   "loop() pass",        benchInputLogPass},
+  {"task_command",     "command round trip", benchTaskCommand},
+  {"sample_load_32k",  "32 KB load",         benchSampleLoad},
+  {"sample_analysis_32k", "32 KB sample",    benchSampleAnalysis},
+  {"thumbnail_32k",    "32 KB sample",       benchThumbnail},
+  {"thumbnail_draw",   "64-column thumbnail", benchThumbnailDraw},
+  {"slice_detect_32k", "32 KB sample",       benchSliceDetect},
+  {"project_save_128", "full save",          benchProjectSave},
+  {"project_save_step", "update() call",     benchProjectSaveChunk},
+  {"project_load_128", "boot load",          benchProjectLoad},
+  {"midi_export_128",  "128-pattern song",   benchMidiExport},
+  {"midi_import_128",  "128-pattern song",   benchMidiImport},
+  {"boot_samples_cold", "6 x 32 KB, modelled", benchBootCold},
+  {"boot_samples_warm", "6 x 32 KB, modelled", benchBootWarm},
+};
+
+const int benchScenarioCount = sizeof(benchScenarios) / sizeof(benchScenarios[0]);
@@ -0,0 +1,17 @@
+/*
+ * DriftRiff Mini - CRC Header
+ */
+
+#ifndef CRC_H
+#define CRC_H
+
+#include <Arduino.h>
+
+#define CRC32_INIT 0xFFFFFFFF
+
+// CRC-32 (IEEE 802.3), fed incrementally: start from CRC32_INIT, finish
+// with crc32Final()
+uint32_t crc32Update(uint32_t crc, const uint8_t* data, size_t length);
+inline uint32_t crc32Final(uint32_t crc) { return ~crc; }
+
+#endif
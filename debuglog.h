@@ -0,0 +1,66 @@
+/*
+ * DriftRiff Mini - Compile-time Log Levels
+ *
+ * LOG_* statements above DRIFTONE_LOG_LEVEL expand to nothing, so the
+ * Serial chatter in hot paths costs no code and no UART time. The rest go
+ * out as text, or as log frames once a serial link client is connected.
+ */
+
+#ifndef DEBUGLOG_H
+#define DEBUGLOG_H
+
+#include <Arduino.h>
+
+#define LOG_LEVEL_NONE  0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN  2
+#define LOG_LEVEL_INFO  3
+#define LOG_LEVEL_DEBUG 4
+
+#ifndef DRIFTONE_LOG_LEVEL
+#define DRIFTONE_LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+// Serial, or the link while it has a client (seriallink.cpp)
+Print& logOutput();
+void logEnd();
+
+// Serial for console text printed directly from the UI task, after any
+// link frame left half written (seriallink.cpp)
+Print& consoleOutput();
+
+inline void logLine() {
+  logEnd();
+}
+
+template <typename T, typename... Rest>
+inline void logLine(const T& value, const Rest&... rest) {
+  logOutput().print(value);
+  logLine(rest...);
+}
+
+#if DRIFTONE_LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) logLine(__VA_ARGS__)
+#else
+#define LOG_ERROR(...) ((void)0)
+#endif
+
+#if DRIFTONE_LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(...) logLine(__VA_ARGS__)
+#else
+#define LOG_WARN(...) ((void)0)
+#endif
+
+#if DRIFTONE_LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(...) logLine(__VA_ARGS__)
+#else
+#define LOG_INFO(...) ((void)0)
+#endif
+
+#if DRIFTONE_LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) logLine(__VA_ARGS__)
+#else
+#define LOG_DEBUG(...) ((void)0)
+#endif
+
+#endif
@@ -14,6 +14,18 @@
 #include "audioengine.h"
 #include "sdloader.h"
 #include "touchscreen.h"
+#include "midisync.h"
+#include "project.h"
+#include "midifile.h"
+#include "recorder.h"
+#include "automation.h"
+#include "slicer.h"
+#include "modmatrix.h"
+#include "seriallink.h"
+#include "inputlog.h"
+#include "profiler.h"
+#include "tasks.h"
+#include "debuglog.h"
 
 // Pin definitions for ILI9341
 #define TFT_CS     5
@@ -39,110 +51,933 @@ UI ui;
 AudioEngine audioEngine;
 SDLoader sdLoader;
 TouchHandler touchHandler;
+MidiSync midiSync;
+PatternBank patternBank;
+ProjectStore project;
+MidiFile midiFile;
+Recorder recorder;
+Automation automation;
+Slicer slicer;
+ModMatrix modMatrix;
+SerialLink serialLink;
+InputLog inputLog;
+
+// Audio and the sequencer clock on one, everything else on the other
+Task audioTask;
+Task uiTask;
 
 // Timing variables
-unsigned long lastStepTime = 0;
-unsigned long stepInterval = 125; // 120 BPM default (500ms / 4 = 125ms per 16th note)
+unsigned long lastOverlayTime = 0;
+unsigned long lastStatusTime = 0;
+unsigned long lastPublishMicros = 0;
 
-void setup() {
-  Serial.begin(115200);
-  Serial.println("DriftRiff Mini Starting...");
+#define OVERLAY_REFRESH_MS 500
+#define ENGINE_STATE_MS 50      // Longest between engine snapshots while no step passes
+#define CONTROL_QUEUE_SIZE 8
+
+// Steps are resolved into sample-accurate triggers one block ahead of the renderer
+#define SCHEDULE_LOOKAHEAD_FRAMES AUDIO_BLOCK_SIZE
+#define MAX_PENDING_TRIGGERS (NUM_TRACKS * 2)
+
+// Envelope presets applied to every track with 'e': attack, hold, decay (ms)
+#define NUM_ENVELOPE_PRESETS 3
+const uint16_t envelopePresets[NUM_ENVELOPE_PRESETS][3] = {
+  {0, 0, 0},      // Off, samples play out
+  {1, 20, 120},   // Tight, cuts long tails
+  {10, 60, 400}   // Soft attack
+};
+int envelopePreset = 0;
+
+// Track picked with '1'-'6', for sample recording and automation
+int selectedTrack = NUM_SAMPLE_SLOTS - 1;
+
+// Parameter the next automation pass records, cycled with 'k'
+int automationParam = AUTO_VOLUME;
+const char* const automationParamNames[NUM_AUTOMATION_PARAMS] = {"volume", "pitch", "cutoff"};
+
+// Modulation presets for the picked track, cycled with 'o'
+#define NUM_MOD_PRESETS 4
+const char* const modPresetNames[NUM_MOD_PRESETS] = {"off", "filter sweep", "vibrato", "start steps"};
+int modPreset = 0;
+
+void applyModPreset(int preset, int track) {
+  modMatrix.clear();
+  if (preset == 1) {
+    // Cutoff pulled down and back over a bar
+    modMatrix.setLfo(0, MOD_SINE, NUM_STEPS);
+    modMatrix.setRoute(0, track, MOD_CUTOFF, -100);
+  } else if (preset == 2) {
+    // Quarter-note wobble, a little under a semitone either way
+    modMatrix.setLfo(1, MOD_TRIANGLE, 4);
+    modMatrix.setRoute(1, track, MOD_PITCH, 8);
+  } else if (preset == 3) {
+    // Each 16th starts further into the sample, over 8 steps
+    for (int step = 0; step < 8; step++) {
+      modMatrix.setSequenceStep(0, step, step * 36 - MOD_LEVEL_MAX);
+    }
+    modMatrix.setSequenceLength(0, 8);
+    modMatrix.setRoute(MOD_SOURCE_STEP, track, MOD_START, 96);
+  }
+}
+
+// What the UI shows of the sequencer and the engine. The audio side
+// publishes it after every command and every step, the UI draws from its
+// copy and never reads the live objects.
+struct EngineState {
+  GridState grid;
+  int bpm;
+  bool playing;
+  int patternIndex;
+  int currentStep;
+  uint32_t playTick;
+  uint32_t playFrame;
+  uint32_t stepCount;         // Bumped each time playback reaches a step
+  int automationState;
+  int undoDepth;
+  int redoDepth;
+  int voices;
+  uint32_t underruns;
+};
+
+Snapshot<EngineState> engineSnapshot;
+uint32_t engineStepCount = 0;   // Audio side
+
+EngineState engine;             // UI side copy
+uint32_t engineVersion = 0;
+uint32_t drawnStepCount = 0;
+
+// Changes the UI asks of the audio side, applied between its steps
+enum ControlType {
+  CTRL_TOGGLE_STEP,           // a track, b step
+  CTRL_SET_STEP,              // a track, b step, c active
+  CTRL_SET_BPM,               // a BPM, returns the BPM now
+  CTRL_NUDGE_BPM,             // a +1 or -1, returns the BPM now
+  CTRL_TRANSPORT,             // a 0 pauses, 1 plays, 2 toggles, returns playing
+  CTRL_SELECT_PATTERN,        // a a resident pattern, returns the pattern index
+  CTRL_TOGGLE_FILL,           // Returns fill
+  CTRL_TOGGLE_MUTE,           // a track, returns muted
+  CTRL_TOGGLE_SOLO,           // a track, returns soloed
+  CTRL_HISTORY_PATTERN,       // a 0 undo, 1 redo, returns the pattern it edits or -1
+  CTRL_UNDO,                  // Returns false with nothing to undo
+  CTRL_REDO,
+  CTRL_NEXT_MIDI_MODE,
+  CTRL_ENVELOPE,              // a envelope preset, on every track
+  CTRL_TOGGLE_LIMITER,        // Returns enabled
+  CTRL_NEXT_VELOCITY_CURVE,   // Returns the curve now
+  CTRL_MOD_PRESET,            // a modulation preset, b track
+  CTRL_ARM_AUTOMATION,        // a track, b parameter, returns false when it cancelled a pass instead
+  CTRL_CLEAR_AUTOMATION,      // a track, b parameter
+  CTRL_STOP_SAMPLE,           // data, a sample buffer about to be freed, a its size
+  CTRL_MARK_EDITED,
+  CTRL_LOAD_PATTERN,          // a pattern, data a Pattern swapped in, returns one to write back or -1
+  CTRL_PATTERNS_LOADED        // After a run of pattern bank writes
+};
+
+struct ControlCommand {
+  uint8_t type;
+  int32_t a;
+  int32_t b;
+  int32_t c;
+  const uint8_t* data;
+};
+
+SpscQueue<ControlCommand, CONTROL_QUEUE_SIZE> controlQueue;
+std::atomic<uint32_t> controlApplied(0);
+std::atomic<int32_t> controlResult(0);
+uint32_t controlIssued = 0;
+
+// Automation fader position from the latest touch, -1 with no gesture
+std::atomic<int> touchGesture(-1);
+
+// ---- Audio side ----
+
+void publishEngineState() {
+  EngineState state;
+  sequencer.getGridState(state.grid);
+  state.bpm = sequencer.getBPM();
+  state.playing = sequencer.isPlaying();
+  state.patternIndex = sequencer.getPatternIndex();
+  state.currentStep = sequencer.getCurrentStep();
+  state.playTick = sequencer.getPlayTick();
+  state.playFrame = audioEngine.getPlayFrame();
+  state.stepCount = engineStepCount;
+  state.automationState = automation.getState();
+  state.undoDepth = sequencer.getUndoDepth();
+  state.redoDepth = sequencer.getRedoDepth();
+  state.voices = audioEngine.getActiveVoices();
+  state.underruns = audioEngine.getUnderruns();
+  engineSnapshot.publish(state);
+  lastPublishMicros = micros();
+}
+
+int32_t applyControl(const ControlCommand& command) {
+  switch (command.type) {
+    case CTRL_TOGGLE_STEP:
+      sequencer.toggleStep(command.a, command.b);
+      return 0;
+      
+    case CTRL_SET_STEP:
+      sequencer.setStep(command.a, command.b, command.c != 0);
+      return 0;
+      
+    case CTRL_SET_BPM:
+      sequencer.setBPM(command.a);
+      return sequencer.getBPM();
+      
+    case CTRL_NUDGE_BPM:
+      if (command.a > 0) {
+        sequencer.increaseBPM();
+      } else {
+        sequencer.decreaseBPM();
+      }
+      return sequencer.getBPM();
+      
+    case CTRL_TRANSPORT:
+      if (command.a == 2) {
+        sequencer.togglePlayback();
+      } else if (command.a) {
+        sequencer.play();
+      } else {
+        sequencer.pause();
+      }
+      return sequencer.isPlaying();
+      
+    case CTRL_SELECT_PATTERN:
+      sequencer.selectPattern(command.a);
+      return sequencer.getPatternIndex();
+      
+    case CTRL_TOGGLE_FILL:
+      sequencer.setFill(!sequencer.isFill());
+      return sequencer.isFill();
+      
+    case CTRL_TOGGLE_MUTE:
+      sequencer.setMute(command.a, !sequencer.isMuted(command.a));
+      audioEngine.setAudibleTracks(sequencer.getAudibleMask());
+      return sequencer.isMuted(command.a);
+      
+    case CTRL_TOGGLE_SOLO:
+      sequencer.setSolo(command.a, !sequencer.isSoloed(command.a));
+      audioEngine.setAudibleTracks(sequencer.getAudibleMask());
+      return sequencer.isSoloed(command.a);
+      
+    case CTRL_HISTORY_PATTERN:
+      return command.a ? sequencer.getRedoPattern() : sequencer.getUndoPattern();
+      
+    case CTRL_UNDO:
+      return sequencer.undo();
+      
+    case CTRL_REDO:
+      return sequencer.redo();
+      
+    case CTRL_NEXT_MIDI_MODE:
+      midiSync.setMode((midiSync.getMode() + 1) % (MIDI_SYNC_SLAVE + 1));
+      return midiSync.getMode();
+      
+    case CTRL_ENVELOPE: {
+      const uint16_t* times = envelopePresets[command.a];
+      EnvelopeShape shape;
+      envelopeSetup(shape, command.a == 0 ? ENV_OFF : ENV_AHD, times[0], times[1], times[2]);
+      for (int track = 0; track < NUM_TRACKS; track++) {
+        audioEngine.setEnvelope(track, shape);
+      }
+      return 0;
+    }
+    
+    case CTRL_TOGGLE_LIMITER:
+      audioEngine.setLimiterEnabled(!audioEngine.getLimiterEnabled());
+      return audioEngine.getLimiterEnabled();
+      
+    case CTRL_NEXT_VELOCITY_CURVE:
+      audioEngine.setVelocityCurve((audioEngine.getVelocityCurve() + 1) % NUM_VELOCITY_CURVES);
+      return audioEngine.getVelocityCurve();
+      
+    case CTRL_MOD_PRESET:
+      applyModPreset(command.a, command.b);
+      return 0;
+      
+    case CTRL_ARM_AUTOMATION: {
+      if (automation.getState() != AUTO_IDLE) {
+        automation.cancel();
+        return false;
+      }
+      
+      // One pass of the track as it is set up now
+      uint32_t loopTicks = (uint32_t)sequencer.getTrackLength(command.a) *
+                           Sequencer::ticksPerTrackStep(sequencer.getTrackRate(command.a));
+      automation.arm(command.a, command.b, loopTicks);
+      return true;
+    }
+    
+    case CTRL_CLEAR_AUTOMATION:
+      automation.clearLane(command.a, command.b);
+      return 0;
+      
+    case CTRL_STOP_SAMPLE:
+      audioEngine.stopSample(command.data, (uint32_t)command.a);
+      return 0;
+      
+    case CTRL_MARK_EDITED:
+      sequencer.markEdited();
+      return 0;
+      
+    case CTRL_LOAD_PATTERN:
+      // The bank's page, which takes back whatever the sequencer gives up
+      return sequencer.loadPattern(command.a, *(Pattern*)command.data);
+      
+    case CTRL_PATTERNS_LOADED:
+      // Rebuilds the current pattern's condition masks and counts as an edit
+      sequencer.selectPattern(sequencer.getPatternIndex());
+      sequencer.clearHistory();
+      return 0;
+  }
+  return 0;
+}
+
+// Audio render and the sequencer clock, true when a sample went out
+bool audioStep() {
+  // Commands first, each answered before the next is taken
+  ControlCommand command;
+  while (controlQueue.pop(command)) {
+    controlResult.store(applyControl(command));
+    publishEngineState();
+    controlApplied.fetch_add(1, std::memory_order_release);
+  }
   
-  // Initialize TFT
-  tft.begin();
-  tft.setRotation(3); // Landscape
-  tft.fillScreen(ILI9341_BLACK);
+  // Queue upcoming hits with the audio engine at their exact frames,
+  // including swing and micro-timing offsets
+  SequencerTrigger triggers[MAX_PENDING_TRIGGERS];
+  uint32_t horizon = audioEngine.getRenderFrame() + SCHEDULE_LOOKAHEAD_FRAMES;
+  int triggerCount = sequencer.schedule(horizon, triggers, MAX_PENDING_TRIGGERS);
   
-  // Initialize SD card
-  if (!SD.begin(SD_CS)) {
-    Serial.println("SD Card initialization failed!");
-    tft.setCursor(10, 10);
-    tft.setTextColor(ILI9341_RED);
-    tft.println("SD CARD ERROR");
-    while (1);
+  for (int i = 0; i < triggerCount; i++) {
+    uint8_t* sampleData = sdLoader.getSampleData(triggers[i].track);
+    uint32_t sampleSize = sdLoader.getSampleSize(triggers[i].track);
+    
+    // A sliced step plays part of the loaded sample, in place
+    if (triggers[i].slice != 0) {
+      slicer.getSlice(triggers[i].track, triggers[i].slice - 1, sampleData, sampleSize);
+    }
+    
+    if (sampleData && sampleSize > 0) {
+      // Ratchet ramps climb to or fall from full volume in equal steps,
+      // full volume being the sample's normalized level
+      float level = (float)sdLoader.getSampleGain(triggers[i].track) / SAMPLE_GAIN_UNITY;
+      float volume = level;
+      float volumeStep = 0;
+      if (triggers[i].ramp == RAMP_UP) {
+        volume = level / triggers[i].hits;
+        volumeStep = volume;
+      } else if (triggers[i].ramp == RAMP_DOWN) {
+        volumeStep = -level / triggers[i].hits;
+      }
+      audioEngine.scheduleRatchet(triggers[i].frame, sampleData, sampleSize, volume, triggers[i].track,
+                                  triggers[i].hits, triggers[i].interval, volumeStep, triggers[i].velocity);
+    }
   }
   
-  // Initialize modules
-  sequencer.init();
-  ui.init(&tft);
-  audioEngine.init();
-  sdLoader.init();
-  touchHandler.init(&ts, &tft);
+  // Follow external clock, or send ours, against the frame being played
+  midiSync.update(sequencer, audioEngine.getPlayFrame());
+  
+  // Automation and modulation are read by the renderer, which needs ticks
+  // for its frames
+  uint32_t playFrame = audioEngine.getPlayFrame();
+  int32_t playTick = sequencer.tickAtFrame(playFrame);
+  audioEngine.setClock(playFrame, playTick, sequencer.getFramesPerStep(), sequencer.isPlaying());
   
-  // Load samples
-  if (!sdLoader.loadAllSamples()) {
-    Serial.println("Warning: Some samples failed to load");
+  // Tell the UI once playback reaches the next step, and now and then
+  // regardless for the voice and underrun counts
+  if (sequencer.updatePlayhead(audioEngine.getPlayFrame())) {
+    engineStepCount++;
+    publishEngineState();
+  } else if (micros() - lastPublishMicros >= ENGINE_STATE_MS * 1000UL) {
+    publishEngineState();
   }
   
-  // Initial UI draw
-  ui.drawInterface();
-  ui.updateGrid(sequencer.getSteps(), sequencer.getCurrentStep());
+  int gesture = touchGesture.load(std::memory_order_relaxed);
+  automation.record(playTick, gesture >= 0, gesture >= 0 ? gesture : 0);
   
-  Serial.println("DriftRiff Mini Ready!");
+  // Audio engine update (handles PWM timing)
+  return audioEngine.update();
 }
 
-void loop() {
-  unsigned long currentTime = millis();
+// ---- UI side ----
+
+// Have the audio side apply a change and wait for its result. The engine
+// copy is brought up to date before returning, so whatever is drawn next
+// shows the change.
+int32_t control(uint8_t type, int32_t a = 0, int32_t b = 0, int32_t c = 0, const uint8_t* data = nullptr) {
+  ControlCommand command = {type, a, b, c, data};
+  int32_t result;
   
-  // Handle sequencer timing
-  if (currentTime - lastStepTime >= stepInterval) {
-    lastStepTime = currentTime;
-    
-    // Advance step
-    sequencer.nextStep();
+  if (!audioTask.isRunning()) {
+    result = applyControl(command);
+    publishEngineState();
+  } else {
+    // Answered within a step of the audio task, which never waits on us
+    while (!controlQueue.push(command)) {
+      taskYield();
+    }
+    controlIssued++;
+    while (controlApplied.load(std::memory_order_acquire) != controlIssued) {
+      taskYield();
+    }
+    result = controlResult.load();
+  }
+  
+  engineVersion = engineSnapshot.read(engine);
+  return result;
+}
+
+// The loader frees a buffer only once nothing plays from it
+void releaseSample(const uint8_t* data, uint32_t size) {
+  control(CTRL_STOP_SAMPLE, size, 0, 0, data);
+}
+
+// Patterns come off the card into a slot the audio side is not playing
+int swapPattern(int index, Pattern& page) {
+  return control(CTRL_LOAD_PATTERN, index, 0, 0, (const uint8_t*)&page);
+}
+
+// Redraw the step grid from the latest engine state
+void refreshGrid() {
+  ui.updateGrid(engine.grid);
+}
+
+// Binary commands from a serial link client, each acknowledged
+void handleLinkCommand(const LinkFrame& frame) {
+  uint8_t status = LINK_OK;
+  
+  if (frame.type == LINK_CMD_PING) {
+    serialLink.send(LINK_TLM_PONG, frame.payload, frame.length);
+    return;
+  } else if (frame.type == LINK_CMD_SET_STEP) {
+    LinkSetStep command;
+    memcpy(&command, frame.payload, sizeof(command));
+    if (frame.length != sizeof(command) || command.track >= NUM_TRACKS || command.step >= MAX_STEPS) {
+      status = LINK_BAD_ARGS;
+    } else {
+      control(CTRL_SET_STEP, command.track, command.step, command.active != 0);
+      refreshGrid();
+    }
+  } else if (frame.type == LINK_CMD_SET_BPM) {
+    uint16_t bpm = frame.payload[0] | (frame.payload[1] << 8);
+    if (frame.length != 2 || bpm < MIN_BPM || bpm > MAX_BPM) {
+      status = LINK_BAD_ARGS;
+    } else {
+      ui.updateBPM(control(CTRL_SET_BPM, bpm));
+    }
+  } else if (frame.type == LINK_CMD_LOAD_SAMPLE) {
+    char path[SAMPLE_PATH_LENGTH];
+    int slot = frame.payload[0];
+    int length = frame.length - 1;
+    if (frame.length < 2 || slot >= NUM_SAMPLE_SLOTS || length >= SAMPLE_PATH_LENGTH) {
+      status = LINK_BAD_ARGS;
+    } else {
+      memcpy(path, frame.payload + 1, length);
+      path[length] = 0;
+      if (sdLoader.loadCustomSample(slot, path)) {
+        control(CTRL_MARK_EDITED);
+      } else {
+        status = LINK_FAILED;
+      }
+    }
+  } else if (frame.type == LINK_CMD_TRANSPORT) {
+    if (frame.length != 1) {
+      status = LINK_BAD_ARGS;
+    } else {
+      ui.updatePlayState(control(CTRL_TRANSPORT, frame.payload[0] ? 1 : 0));
+    }
+  } else {
+    status = LINK_UNKNOWN;
+  }
+  serialLink.acknowledge(frame, status);
+}
+
+// Telemetry for a connected link client, a snapshot every LINK_STATUS_MS
+void sendLinkStatus(unsigned long now) {
+  const ProfileHistogram& render = profiler.getHistogram(PROF_AUDIO_RENDER);
+  LinkStatus status;
+  status.millis = now;
+  status.bpm = engine.bpm;
+  status.playing = engine.playing;
+  status.voices = engine.voices;
+  status.underruns = engine.underruns;
+  status.renderMeanMicros = min(render.getMean() / profCyclesPerMicro(), (uint32_t)0xFFFF);
+  status.renderMaxMicros = min(render.getMax() / profCyclesPerMicro(), (uint32_t)0xFFFF);
+  status.txDropped = serialLink.getDropped();
+  status.rxErrors = serialLink.getErrors();
+  serialLink.send(LINK_TLM_STATUS, &status, sizeof(status));
+}
+
+// CPU use over the last TASK_STATS_MS and stack headroom of each task
+void printTaskStats() {
+  Task* tasks[2] = {&audioTask, &uiTask};
+  char line[96];
+  consoleOutput().println(audioTask.isRunning() ? "--- Tasks ---" : "--- Tasks (run in turn from loop()) ---");
+  for (int i = 0; i < 2; i++) {
+    Task* task = tasks[i];
+    TaskStats stats;
+    if (!task->getStats(stats) || stats.windowMicros == 0) {
+      snprintf(line, sizeof(line), "%-5s: no complete window yet", task->getName());
+      consoleOutput().println(line);
+      continue;
+    }
     
-    // Check for active steps and trigger samples
-    for (int track = 0; track < 6; track++) {
-      if (sequencer.isStepActive(track, sequencer.getCurrentStep())) {
-        uint8_t* sampleData = sdLoader.getSampleData(track);
-        uint32_t sampleSize = sdLoader.getSampleSize(track);
-        
-        if (sampleData && sampleSize > 0) {
-          audioEngine.playSample(sampleData, sampleSize);
+    uint32_t permille = (uint64_t)stats.busyMicros * 1000 / stats.windowMicros;
+    uint32_t stepsPerSecond = (uint64_t)stats.steps * 1000000 / stats.windowMicros;
+    int length = snprintf(line, sizeof(line), "%-5s: %u.%u%% CPU, %u steps/s", task->getName(),
+                          (unsigned)(permille / 10), (unsigned)(permille % 10), (unsigned)stepsPerSecond);
+    if (task->isRunning()) {
+      length += snprintf(line + length, sizeof(line) - length, ", core %u, priority %u", task->getCore(),
+                         task->getPriority());
+      if (stats.stackFree > 0) {
+        snprintf(line + length, sizeof(line) - length, ", stack %u of %u bytes free",
+                 (unsigned)stats.stackFree, (unsigned)task->getStackBytes());
+      }
+    }
+    consoleOutput().println(line);
+  }
+  
+  if (serialLink.getLogDropped() > 0) {
+    consoleOutput().print("Audio task log lines dropped: ");
+    consoleOutput().println(serialLink.getLogDropped());
+  }
+}
+
+// Read MIDIFILE_IMPORT_PATH into the patterns from the current one on.
+// The file is parsed into a staging copy, then written to the bank a
+// pattern at a time, which hands any resident ones to the audio side.
+void importMidiFile() {
+  ui.updatePlayState(control(CTRL_TRANSPORT, 0));
+  
+  // As many patterns as the heap has room for, down to one
+  int first = engine.patternIndex;
+  int room = NUM_PATTERNS - first;
+  Pattern* staging = nullptr;
+  while (room > 0 && !(staging = (Pattern*)malloc(room * sizeof(Pattern)))) {
+    room /= 2;
+  }
+  if (!staging) {
+    consoleOutput().println("Import failed: out of memory");
+    return;
+  }
+  
+  MidiFileStats stats;
+  bool ok = midiFile.importPatterns(MIDIFILE_IMPORT_PATH, staging, room, stats);
+  for (int i = 0; i < stats.patterns; i++) {
+    if (!patternBank.write(first + i, staging[i])) ok = false;
+  }
+  free(staging);
+  
+  if (stats.patterns > 0) {
+    control(CTRL_PATTERNS_LOADED);
+    if (stats.bpm) {
+      ui.updateBPM(control(CTRL_SET_BPM, stats.bpm));
+    }
+    refreshGrid();
+  }
+  
+  char line[96];
+  snprintf(line, sizeof(line), "%s: type %u, %u patterns from %d, %u notes, %u skipped, %u us",
+           ok ? "Imported" : "Import failed", stats.format, stats.patterns, first + 1,
+           (unsigned)stats.notes, (unsigned)stats.skipped, (unsigned)stats.micros);
+  consoleOutput().println(line);
+}
+
+// Serial commands: 'p' dumps the performance counters, 'r' resets them,
+// 't' shows each task's CPU use and stack headroom, 'm' cycles MIDI sync
+// between off, master and slave, 'w' saves the project, '[' and ']'
+// select the previous/next pattern, 'e' cycles the track envelope preset,
+// 'a' arms (or stops) recording into the track picked with '1'-'6', 'f'
+// toggles fill for FILL/NOT FILL trig conditions, 'u' and 'v' toggle
+// mute and solo on the picked track, 'k' picks the
+// automation parameter, 'l' arms (or cancels) an automation pass on the
+// picked track, 'x' clears its lane, 'i' lists lane and undo journal
+// memory use, 'z' and 'y' undo and redo pattern edits, 'n' lists the
+// slices found in the picked track's sample, 's' lists the samples with
+// their load-time analysis and the RAM trimming saved, 'j' exports the
+// current pattern and 'q' the song (patterns up to the last one used) as
+// MIDI files, 'd' imports one from the current pattern on, 'g' switches the master
+// limiter off (hard clipping) and on, 'c' switches the velocity curve
+// between linear and exponential, 'o' cycles the modulation preset on
+// the picked track. Link frames (seriallink.h) come in on the same port.
+// Both are recorded to the input log, or taken from it during a replay.
+// Returns false when nothing came in.
+bool handleSerialCommands() {
+  LinkFrame frame;
+  char command;
+  int received;
+  bool any = false;
+  while ((received = serialLink.receive(frame, command)) != LINK_RX_NONE) {
+    any = true;
+    if (received == LINK_RX_FRAME) {
+      handleLinkCommand(frame);
+    } else if (command == 'p') {
+      char line[64];
+      consoleOutput().println("--- Performance counters ---");
+      for (int ch = 0; ch < PROF_NUM_CHANNELS; ch++) {
+        profiler.formatChannel((ProfileChannel)ch, line, sizeof(line));
+        consoleOutput().println(line);
+      }
+    } else if (command == 'r') {
+      profiler.reset();
+      consoleOutput().println("Performance counters reset");
+    } else if (command == 't') {
+      printTaskStats();
+    } else if (command == 'm') {
+      control(CTRL_NEXT_MIDI_MODE);
+    } else if (command == 'w') {
+      project.requestSave();
+    } else if (command == '[' || command == ']') {
+      int index = (engine.patternIndex + (command == ']' ? 1 : NUM_PATTERNS - 1)) % NUM_PATTERNS;
+      if (patternBank.fetch(index)) {
+        control(CTRL_SELECT_PATTERN, index);
+      }
+      refreshGrid();
+    } else if (command == 'e') {
+      envelopePreset = (envelopePreset + 1) % NUM_ENVELOPE_PRESETS;
+      control(CTRL_ENVELOPE, envelopePreset);
+      consoleOutput().print("Envelope preset: ");
+      consoleOutput().println(envelopePreset);
+    } else if (command == 'a') {
+      if (recorder.getState() == REC_IDLE) {
+        recorder.arm(selectedTrack);
+      } else {
+        recorder.stop();
+      }
+    } else if (command == 'f') {
+      bool fill = control(CTRL_TOGGLE_FILL);
+      consoleOutput().print("Fill ");
+      consoleOutput().println(fill ? "on" : "off");
+    } else if (command == 'u' || command == 'v') {
+      bool muting = command == 'u';
+      bool on = control(muting ? CTRL_TOGGLE_MUTE : CTRL_TOGGLE_SOLO, selectedTrack);
+      refreshGrid();
+      char line[40];
+      snprintf(line, sizeof(line), "Track %d %s %s", selectedTrack + 1, muting ? "mute" : "solo",
+               on ? "on" : "off");
+      consoleOutput().println(line);
+    } else if (command == 'k') {
+      automationParam = (automationParam + 1) % NUM_AUTOMATION_PARAMS;
+      consoleOutput().print("Automation parameter: ");
+      consoleOutput().println(automationParamNames[automationParam]);
+    } else if (command == 'l') {
+      if (control(CTRL_ARM_AUTOMATION, selectedTrack, automationParam)) {
+        consoleOutput().println("Automation armed, touch the grid to record");
+      } else {
+        consoleOutput().println("Automation cancelled");
+      }
+    } else if (command == 'x') {
+      control(CTRL_CLEAR_AUTOMATION, selectedTrack, automationParam);
+      consoleOutput().println("Automation lane cleared");
+    } else if (command == 'i') {
+      // Counters only, read as they stand
+      char line[64];
+      for (int track = 0; track < NUM_TRACKS; track++) {
+        for (int param = 0; param < NUM_AUTOMATION_PARAMS; param++) {
+          if (!automation.isLaneUsed(track, param)) continue;
+          snprintf(line, sizeof(line), "Track %d %s: %u points, %u bytes", track + 1,
+                   automationParamNames[param], automation.getLanePoints(track, param),
+                   automation.getLaneBytes(track, param));
+          consoleOutput().println(line);
         }
       }
+      snprintf(line, sizeof(line), "Automation pool: %u of %u bytes", automation.getPoolUsed(),
+               AUTOMATION_POOL_SIZE);
+      consoleOutput().println(line);
+      snprintf(line, sizeof(line), "Undo journal: %d of %d edits, %u bytes", engine.undoDepth,
+               JOURNAL_DEPTH, (unsigned)sequencer.getJournalMemory());
+      consoleOutput().println(line);
+    } else if (command == 'z' || command == 'y') {
+      bool undoing = command == 'z';
+      
+      // The edit may be on a pattern that has to come off the card first
+      int target = control(CTRL_HISTORY_PATTERN, !undoing);
+      if (target >= 0) {
+        patternBank.fetch(target);
+      }
+      if (control(undoing ? CTRL_UNDO : CTRL_REDO)) {
+        refreshGrid();
+        char line[48];
+        snprintf(line, sizeof(line), "%s, %d to undo, %d to redo", undoing ? "Undo" : "Redo",
+                 engine.undoDepth, engine.redoDepth);
+        consoleOutput().println(line);
+      } else {
+        consoleOutput().println(undoing ? "Nothing to undo" : "Nothing to redo");
+      }
+    } else if (command == 'g') {
+      bool enabled = control(CTRL_TOGGLE_LIMITER);
+      consoleOutput().print("Limiter ");
+      consoleOutput().println(enabled ? "on" : "off");
+    } else if (command == 'c') {
+      int curve = control(CTRL_NEXT_VELOCITY_CURVE);
+      consoleOutput().print("Velocity curve: ");
+      consoleOutput().println(curve == VELOCITY_EXP ? "exponential" : "linear");
+    } else if (command == 'o') {
+      modPreset = (modPreset + 1) % NUM_MOD_PRESETS;
+      control(CTRL_MOD_PRESET, modPreset, selectedTrack);
+      consoleOutput().print("Modulation: ");
+      consoleOutput().println(modPresetNames[modPreset]);
+    } else if (command == 's') {
+      sdLoader.listSamples();
+    } else if (command == 'j' || command == 'q') {
+      // Read through the bank like the project save, an edit meanwhile
+      // lands in the file or not at all
+      bool ok;
+      if (command == 'j') {
+        ok = midiFile.exportPatterns(MIDIFILE_PATTERN_PATH, patternBank, engine.patternIndex, 1,
+                                     MIDIFILE_SINGLE_TRACK, engine.bpm);
+      } else {
+        ok = midiFile.exportPatterns(MIDIFILE_SONG_PATH, patternBank, 0, patternBank.getSongLength(),
+                                     MIDIFILE_MULTI_TRACK, engine.bpm);
+      }
+      consoleOutput().print(ok ? "Exported " : "Export failed: ");
+      consoleOutput().println(command == 'j' ? MIDIFILE_PATTERN_PATH : MIDIFILE_SONG_PATH);
+    } else if (command == 'd') {
+      importMidiFile();
+    } else if (command == 'n') {
+      char line[48];
+      int count = slicer.getSliceCount(selectedTrack);
+      snprintf(line, sizeof(line), "Track %d: %d slices", selectedTrack + 1, count);
+      consoleOutput().println(line);
+      for (int slice = 0; slice < count; slice++) {
+        snprintf(line, sizeof(line), "  %d at frame %u", slice + 1,
+                 (unsigned)slicer.getSliceOffset(selectedTrack, slice));
+        consoleOutput().println(line);
+      }
+    } else if (command >= '1' && command < '1' + NUM_SAMPLE_SLOTS) {
+      selectedTrack = command - '1';
+      consoleOutput().print("Selected track: ");
+      consoleOutput().println(selectedTrack + 1);
     }
+  }
+  return any;
+}
+
+// Touch, display, console and the card. False when the pass found nothing
+// to do, so the UI task can sleep a little.
+bool uiStep() {
+  unsigned long currentTime = millis();
+  bool busy = false;
+  
+  // Inputs are logged against the pass that sees them, the UI task's own
+  // when it runs apart from loop()
+  if (uiTask.isRunning()) {
+    inputLog.beginPass(micros());
+  }
+  
+  // Drain the input DMA before anything slow can let it wrap
+  recorder.update();
+  if (recorder.getState() != REC_IDLE) {
+    busy = true;
+  }
+  
+  // Update UI once playback reaches the next step
+  if (engineSnapshot.getVersion() != engineVersion) {
+    engineVersion = engineSnapshot.read(engine);
+  }
+  if (engine.stepCount != drawnStepCount) {
+    drawnStepCount = engine.stepCount;
+    refreshGrid();
+    ui.updateBPM(engine.bpm);
+    busy = true;
     
-    // Update UI
-    ui.updateGrid(sequencer.getSteps(), sequencer.getCurrentStep());
-    ui.updateBPM(sequencer.getBPM());
+    if (serialLink.isConnected()) {
+      LinkStep step = {(uint8_t)engine.patternIndex, (uint8_t)engine.currentStep, engine.playTick,
+                       engine.playFrame};
+      serialLink.send(LINK_TLM_STEP, &step, sizeof(step));
+    }
   }
   
-  // Handle touch input
-  TSPoint p = touchHandler.getTouch();
+  // Thumbnails of any slot loaded, replaced or freed since the last pass
+  if (ui.updateSamples(&sdLoader)) {
+    busy = true;
+  }
+  
+  // Handle touch input. The panel reads through ADC1, which the recorder's
+  // I2S capture owns while it runs.
+  TSPoint p;
+  if (recorder.getState() == REC_IDLE) {
+    p = touchHandler.getTouch();
+  }
+  p = inputLog.touch(p);
+  int gesture = -1;
   if (p.z > MINPRESSURE && p.z < MAXPRESSURE) {
     TouchAction action = touchHandler.processTouchInput(p.x, p.y);
+    busy = true;
+    
+    // While automation records, the grid is a fader across its width,
+    // read every pass without the debounce
+    if (engine.automationState != AUTO_IDLE && action.y >= GRID_START_Y && action.y < CONTROL_Y) {
+      int gridWidth = NUM_STEPS * (STEP_WIDTH + STEP_SPACING);
+      gesture = constrain(map(action.x, GRID_START_X, GRID_START_X + gridWidth, 0, AUTOMATION_MAX_VALUE),
+                          0, AUTOMATION_MAX_VALUE);
+      action.type = TOUCH_NONE;
+    }
     
     switch (action.type) {
       case TOUCH_GRID:
-        sequencer.toggleStep(action.track, action.step);
-        ui.updateGrid(sequencer.getSteps(), sequencer.getCurrentStep());
+        // Grid columns show the current page of the track
+        control(CTRL_TOGGLE_STEP, action.track, ui.getPage() * NUM_STEPS + action.step);
+        refreshGrid();
+        break;
+        
+      case TOUCH_PAGE:
+        ui.nextPage();
+        refreshGrid();
         break;
         
       case TOUCH_BPM_UP:
-        sequencer.increaseBPM();
-        stepInterval = 60000 / (sequencer.getBPM() * 4); // Update timing
-        ui.updateBPM(sequencer.getBPM());
+        ui.updateBPM(control(CTRL_NUDGE_BPM, 1));
         break;
         
       case TOUCH_BPM_DOWN:
-        sequencer.decreaseBPM();
-        stepInterval = 60000 / (sequencer.getBPM() * 4); // Update timing
-        ui.updateBPM(sequencer.getBPM());
+        ui.updateBPM(control(CTRL_NUDGE_BPM, -1));
         break;
         
       case TOUCH_PLAY_PAUSE:
-        sequencer.togglePlayback();
-        ui.updatePlayState(sequencer.isPlaying());
+        ui.updatePlayState(control(CTRL_TRANSPORT, 2));
+        break;
+        
+      case TOUCH_PROFILER:
+        ui.toggleProfilerOverlay();
+        ui.drawProfilerOverlay();
         break;
         
       default:
         break;
     }
     
-    delay(50); // Simple debounce
+    if (gesture < 0) {
+      delay(50); // Simple debounce
+    }
   }
+  touchGesture.store(gesture, std::memory_order_relaxed);
   
-  // Audio engine update (handles PWM timing)
-  audioEngine.update();
+  // Refresh the profiling overlay at a low rate
+  if (ui.isProfilerOverlayVisible() && currentTime - lastOverlayTime >= OVERLAY_REFRESH_MS) {
+    lastOverlayTime = currentTime;
+    ui.drawProfilerOverlay();
+  }
+  
+  if (handleSerialCommands()) {
+    busy = true;
+  }
+  if (serialLink.isConnected() && currentTime - lastStatusTime >= LINK_STATUS_MS) {
+    lastStatusTime = currentTime;
+    sendLinkStatus(currentTime);
+  }
+  
+  // Background SD work, at most one chunk per pass: sample loading first,
+  // then the input log, then writing out recordings, then project saves.
+  // A replay leaves the card's project alone. Saves stream from the live
+  // patterns, an edit meanwhile is caught by the next save (project.h).
+  if (inputLog.updateLoader(sdLoader) || inputLog.flush(currentTime) || recorder.flush()) {
+    busy = true;
+  } else if (!inputLog.isReplaying()) {
+    project.update(currentTime);
+    if (project.isSaving()) {
+      busy = true;
+    }
+  }
+  
+  // Find the hits in newly loaded or recorded samples, a chunk at a time
+  if (slicer.update()) {
+    busy = true;
+  }
+  
+  // A saved recording changes the slot's path, which the project keeps
+  if (recorder.takeSavedFile()) {
+    control(CTRL_MARK_EDITED);
+  }
+  
+  // Telemetry goes out last, as much as the UART can take right now
+  serialLink.drain();
+  return busy;
+}
+
+void setup() {
+  Serial.begin(115200);
+  serialLink.init(&Serial);
+  serialLink.setInputLog(&inputLog);
+  Serial.println("DriftRiff Mini Starting...");
+  
+  // Initialize TFT
+  tft.begin();
+  tft.setRotation(3); // Landscape
+  tft.fillScreen(ILI9341_BLACK);
+  
+  // Initialize SD card
+  if (!SD.begin(SD_CS)) {
+    Serial.println("SD Card initialization failed!");
+    tft.setCursor(10, 10);
+    tft.setTextColor(ILI9341_RED);
+    tft.println("SD CARD ERROR");
+    while (1);
+  }
+  
+  // Initialize modules
+  sequencer.init();
+  ui.init(&tft);
+  audioEngine.init();
+  sdLoader.init();
+  sdLoader.setReleaseHook(releaseSample);
+  touchHandler.init(&ts, &tft);
+  midiSync.init(&Serial2);
+  midiSync.setInputLog(&inputLog);
+  patternBank.init(&sequencer);
+  patternBank.setSwapHook(swapPattern);
+  project.init(&sequencer, &sdLoader, &patternBank);
+  recorder.init(&sdLoader);
+  audioEngine.setAutomation(&automation);
+  audioEngine.setModMatrix(&modMatrix);
+  slicer.init(&sdLoader);
+  audioTask.init("audio", audioStep, TASK_AUDIO_CORE, TASK_AUDIO_PRIORITY, TASK_AUDIO_STACK, 0);
+  uiTask.init("ui", uiStep, TASK_UI_CORE, TASK_UI_PRIORITY, TASK_UI_STACK, TASK_UI_IDLE_MS);
+  tasksSetUiTask(&uiTask);
+  
+  // Restore the saved project before loading the samples it assigns. A
+  // replay starts from the project its recording booted with instead.
+  if (inputLog.isReplaying()) {
+    inputLog.restoreProject(project);
+  } else {
+    bool loaded = project.load();
+#if DRIFTONE_INPUT_LOG
+    inputLog.beginRecording(project, loaded);
+#endif
+  }
+  
+  // Stream samples in from the UI side, tracks the current pattern uses
+  // first, so the UI comes up without waiting on the card
+  sdLoader.beginLoading(sequencer.getUsedTrackMask());
+  
+  // Initial UI draw
+  publishEngineState();
+  engineVersion = engineSnapshot.read(engine);
+  ui.drawInterface();
+  refreshGrid();
+  
+  Serial.println("DriftRiff Mini Ready!");
+  
+  // A replay keeps both steps in loop(), in the order they were recorded
+  if (tasksThreaded() && !inputLog.isReplaying()) {
+    if (!audioTask.start() || !uiTask.start()) {
+      Serial.println("Task start failed!");
+      while (1);
+    }
+  }
+}
+
+void loop() {
+  // The tasks do everything once started. The audio task never blocks,
+  // so on the device this is not reached again.
+  if (audioTask.isRunning()) {
+    delay(100);
+    return;
+  }
+  
+  // Otherwise both steps in turn, against one input log pass
+  inputLog.beginPass(micros());
+  audioTask.runStep();
+  uiTask.runStep();
 }
@@ -0,0 +1,101 @@
+/*
+ * DriftRiff Mini - Edit Journal Implementation
+ */
+
+#include "editjournal.h"
+
+EditJournal::EditJournal() {
+  snapshots = nullptr;
+  snapshotSize = 0;
+  clear();
+}
+
+void EditJournal::init(uint8_t* snapshotStorage, uint16_t patternSize) {
+  snapshots = snapshotStorage;
+  snapshotSize = patternSize;
+  clear();
+}
+
+void EditJournal::clear() {
+  oldest = 0;
+  undoCount = 0;
+  redoCount = 0;
+  for (int i = 0; i < JOURNAL_SNAPSHOTS; i++) {
+    snapshotUsed[i] = false;
+  }
+}
+
+void EditJournal::release(const EditRecord& record) {
+  if (record.type == EDIT_SNAPSHOT) {
+    snapshotUsed[record.snapshot] = false;
+  }
+}
+
+void EditJournal::evictOldest() {
+  // A group goes as a whole, half of one could not be undone
+  do {
+    release(at(0));
+    oldest = (oldest + 1) % JOURNAL_DEPTH;
+    undoCount--;
+  } while (undoCount > 0 && (at(0).flags & EDIT_GROUPED));
+}
+
+void EditJournal::dropRedo() {
+  for (int i = 0; i < redoCount; i++) {
+    release(at(undoCount + i));
+  }
+  redoCount = 0;
+}
+
+void EditJournal::push(const EditRecord& record) {
+  dropRedo();
+  if (undoCount >= JOURNAL_DEPTH) {
+    evictOldest();
+  }
+  at(undoCount) = record;
+  undoCount++;
+}
+
+uint8_t EditJournal::takeSnapshot(const void* pattern) {
+  dropRedo();
+  
+  for (;;) {
+    for (uint8_t slot = 0; slot < JOURNAL_SNAPSHOTS; slot++) {
+      if (!snapshotUsed[slot]) {
+        snapshotUsed[slot] = true;
+        memcpy(snapshots + (uint32_t)slot * snapshotSize, pattern, snapshotSize);
+        return slot;
+      }
+    }
+    // Every slot belongs to an older clear, forget history up to it
+    if (undoCount == 0) {
+      clear();
+    } else {
+      evictOldest();
+    }
+  }
+}
+
+const EditRecord* EditJournal::undo() {
+  if (undoCount == 0) return nullptr;
+  undoCount--;
+  redoCount++;
+  return &at(undoCount);
+}
+
+const EditRecord* EditJournal::redo() {
+  if (redoCount == 0) return nullptr;
+  undoCount++;
+  redoCount--;
+  return &at(undoCount - 1);
+}
+
+const EditRecord* EditJournal::peekUndo() {
+  if (undoCount == 0) return nullptr;
+  return &at(undoCount - 1);
+}
+
+const EditRecord* EditJournal::peekRedo() {
+  if (redoCount == 0) return nullptr;
+  return &at(undoCount);
+}
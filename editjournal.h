@@ -0,0 +1,92 @@
+/*
+ * DriftRiff Mini - Edit Journal Header
+ *
+ * Fixed-size undo/redo history for pattern edits. Every edit is one small
+ * record holding its before and after values; only a clear that loses more
+ * than step bits keeps a copy of the whole pattern, in one of a few
+ * preallocated snapshot slots. Nothing is allocated after construction.
+ */
+
+#ifndef EDITJOURNAL_H
+#define EDITJOURNAL_H
+
+#include <Arduino.h>
+
+#define JOURNAL_DEPTH       64    // Records kept, the oldest go first
+#define JOURNAL_SNAPSHOTS   2     // Whole-pattern copies for clears
+#define JOURNAL_ALL_TRACKS  0xFF  // Track of a snapshot taken by clearAll()
+
+// Undone and redone together with the record before it
+#define EDIT_GROUPED        0x01
+
+enum EditType {
+  EDIT_STEP,          // before/after: step bit
+  EDIT_MICRO,         // before/after: int8_t offset
+  EDIT_CONDITION,
+  EDIT_RATCHET,
+  EDIT_SLICE,
+  EDIT_VELOCITY,      // before/after: stored velocity byte, accent flag included
+  EDIT_LENGTH,
+  EDIT_RATE,
+  EDIT_DIRECTION,
+  EDIT_ACCENT,
+  EDIT_CLEAR_STEPS,   // Track held nothing but steps, kept in steps
+  EDIT_SNAPSHOT       // Clear of a track (or all of them) kept in a snapshot slot
+};
+
+struct EditRecord {
+  uint64_t steps;
+  uint8_t type;
+  uint8_t pattern;
+  uint8_t track;
+  uint8_t step;
+  uint8_t before;
+  uint8_t after;
+  uint8_t snapshot;
+  uint8_t flags;
+};
+
+class EditJournal {
+private:
+  EditRecord records[JOURNAL_DEPTH];
+  uint8_t oldest;
+  uint8_t undoCount;          // Records before the cursor
+  uint8_t redoCount;          // Records after it
+  uint8_t* snapshots;         // JOURNAL_SNAPSHOTS copies, owned by the caller
+  uint16_t snapshotSize;
+  bool snapshotUsed[JOURNAL_SNAPSHOTS];
+  
+  EditRecord& at(int index) { return records[(oldest + index) % JOURNAL_DEPTH]; }
+  void release(const EditRecord& record);
+  void evictOldest();
+  void dropRedo();
+  
+public:
+  EditJournal();
+  
+  // The journal only copies patterns, so their layout stays with the
+  // sequencer. snapshotStorage holds JOURNAL_SNAPSHOTS of patternSize.
+  void init(uint8_t* snapshotStorage, uint16_t patternSize);
+  
+  void clear();
+  
+  // Append an edit, dropping anything that could have been redone
+  void push(const EditRecord& record);
+  
+  // Copy a pattern into a free slot ahead of a clear, evicting the oldest
+  // history if every slot is taken. Returns the slot for the record.
+  uint8_t takeSnapshot(const void* pattern);
+  const void* getSnapshot(uint8_t slot) { return snapshots + (uint32_t)slot * snapshotSize; }
+  
+  // Step the cursor, nullptr when there is nothing to undo or redo
+  const EditRecord* undo();
+  const EditRecord* redo();
+  const EditRecord* peekUndo();
+  const EditRecord* peekRedo();
+  
+  int getUndoDepth() { return undoCount; }
+  int getRedoDepth() { return redoCount; }
+  uint32_t getMemoryUsage() { return sizeof(records) + (uint32_t)snapshotSize * JOURNAL_SNAPSHOTS; }
+};
+
+#endif
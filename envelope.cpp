@@ -0,0 +1,161 @@
+/*
+ * DriftRiff Mini - Envelope Generator Implementation
+ */
+
+#include "envelope.h"
+#include "audioengine.h"
+
+#define ENV_STATE_FULL ((int32_t)ENV_LEVEL_FULL << ENV_STATE_SHIFT)
+
+// Rounded to whole control blocks, a non-zero time is at least one block
+static uint16_t msToBlocks(uint16_t ms) {
+  if (ms == 0) return 0;
+  ms = min(ms, (uint16_t)ENV_MAX_MS);
+  uint32_t blocks = ((uint32_t)ms * SAMPLE_RATE + 500UL * AUDIO_BLOCK_SIZE) / (1000UL * AUDIO_BLOCK_SIZE);
+  return blocks > 0 ? blocks : 1;
+}
+
+void envelopeSetup(EnvelopeShape& shape, uint8_t mode, uint16_t attackMs, uint16_t holdMs,
+                   uint16_t decayMs, uint8_t sustainPercent, uint16_t releaseMs) {
+  shape.mode = mode;
+  shape.attack = msToBlocks(attackMs);
+  shape.hold = msToBlocks(holdMs);
+  shape.decay = msToBlocks(decayMs);
+  shape.release = msToBlocks(releaseMs);
+  shape.sustain = mode == ENV_ADSR ? (int32_t)min(sustainPercent, (uint8_t)100) * ENV_LEVEL_FULL / 100 : 0;
+}
+
+Envelope::Envelope() {
+  shape = nullptr;
+  stage = ENV_SUSTAIN;
+  level = ENV_STATE_FULL;
+  target = ENV_STATE_FULL;
+  slope = 0;
+  remaining = 0;
+  nextStage = ENV_DONE;
+}
+
+void Envelope::start(const EnvelopeShape* envelopeShape) {
+  shape = envelopeShape;
+  
+  if (!shape || shape->mode == ENV_OFF) {
+    stage = ENV_SUSTAIN;
+    level = ENV_STATE_FULL;
+    slope = 0;
+    remaining = 0;
+    return;
+  }
+  
+  level = 0;
+  enterStage(ENV_ATTACK);
+}
+
+void Envelope::release() {
+  if (!shape || shape->mode == ENV_OFF) {
+    // No release segment to play, the voice ends on the next block
+    level = 0;
+    stage = ENV_DONE;
+    return;
+  }
+  if (stage < ENV_RELEASE) {
+    enterStage(ENV_RELEASE);
+  }
+}
+
+void Envelope::reshape() {
+  if (!shape || stage == ENV_DONE) return;
+  
+  if (shape->mode == ENV_OFF) {
+    // Nothing left to shape, the sample plays out at the level reached
+    stage = ENV_SUSTAIN;
+    target = level;
+    slope = 0;
+    remaining = 0;
+    return;
+  }
+  
+  // The stage under way again from the current level, with the new times.
+  // A stage the new mode does not have, or a sustain at the old level,
+  // goes on through the decay.
+  uint8_t current = stage;
+  if (current == ENV_SUSTAIN || (current == ENV_HOLD && shape->mode == ENV_ADSR)) {
+    current = ENV_DECAY;
+  }
+  enterStage(current);
+}
+
+void Envelope::enterStage(uint8_t next) {
+  // Zero-length segments are skipped within the same call, so a shape
+  // with no attack starts at full level
+  while (true) {
+    stage = next;
+    uint16_t blocks = 0;
+    
+    switch (stage) {
+      case ENV_ATTACK:
+        target = ENV_STATE_FULL;
+        blocks = shape->attack;
+        next = shape->mode == ENV_AHD ? ENV_HOLD : ENV_DECAY;
+        break;
+      case ENV_HOLD:
+        target = ENV_STATE_FULL;
+        blocks = shape->hold;
+        next = ENV_DECAY;
+        break;
+      case ENV_DECAY:
+        target = shape->sustain << ENV_STATE_SHIFT;
+        blocks = shape->decay;
+        next = shape->mode == ENV_AHD ? ENV_DONE : ENV_SUSTAIN;
+        break;
+      case ENV_SUSTAIN:
+        // Held at zero would be silence until the sample ran out, so the
+        // voice is handed back instead
+        if (level <= 0) {
+          target = 0;
+          next = ENV_DONE;
+          break;
+        }
+        
+        // Held until release(), or for the gate time when one is set
+        target = level;
+        slope = 0;
+        remaining = 0;
+        if (shape->hold == 0) return;
+        blocks = shape->hold;
+        next = ENV_RELEASE;
+        break;
+      case ENV_RELEASE:
+        target = 0;
+        blocks = shape->release;
+        next = ENV_DONE;
+        break;
+      default:
+        stage = ENV_DONE;
+        level = 0;
+        target = 0;
+        slope = 0;
+        remaining = 0;
+        return;
+    }
+    
+    if (blocks > 0) {
+      slope = (target - level) / blocks;
+      remaining = blocks;
+      nextStage = next;
+      return;
+    }
+    level = target;
+  }
+}
+
+int32_t Envelope::advance() {
+  if (remaining > 0) {
+    level += slope;
+    if (--remaining == 0) {
+      // Land exactly on the segment target, the slope is truncated
+      level = target;
+      enterStage(nextStage);
+    }
+  }
+  return level >> ENV_STATE_SHIFT;
+}
@@ -0,0 +1,80 @@
+/*
+ * DriftRiff Mini - Envelope Generator Header
+ *
+ * Fixed-point amplitude envelopes evaluated at control rate, once per
+ * AUDIO_BLOCK_SIZE frames. The mixer interpolates linearly between block
+ * levels, so a voice pays one multiply-add per output frame.
+ */
+
+#ifndef ENVELOPE_H
+#define ENVELOPE_H
+
+#include <Arduino.h>
+
+#define ENV_LEVEL_BITS  15
+#define ENV_LEVEL_FULL  (1 << ENV_LEVEL_BITS)     // Unity gain, Q15
+#define ENV_STATE_SHIFT 9                         // Internal level is Q24 for exact slopes
+#define ENV_MAX_MS      10000
+
+enum EnvelopeMode {
+  ENV_OFF,    // Constant unity gain, the sample plays out
+  ENV_AHD,    // Attack, hold at full, decay to silence
+  ENV_ADSR    // Attack, decay to sustain, release after the gate time
+};
+
+enum EnvelopeStage {
+  ENV_ATTACK,
+  ENV_HOLD,
+  ENV_DECAY,
+  ENV_SUSTAIN,
+  ENV_RELEASE,
+  ENV_DONE
+};
+
+// Segment times in control blocks, shared by every voice that uses it
+struct EnvelopeShape {
+  uint8_t mode;
+  uint16_t attack;
+  uint16_t hold;      // AHD: time at full level, ADSR: gate time, 0 holds until release()
+  uint16_t decay;
+  uint16_t release;
+  int32_t sustain;    // Q15
+};
+
+// Build a shape from milliseconds, sustain in percent (ADSR only)
+void envelopeSetup(EnvelopeShape& shape, uint8_t mode, uint16_t attackMs, uint16_t holdMs,
+                   uint16_t decayMs, uint8_t sustainPercent = 0, uint16_t releaseMs = 0);
+                   
+// Per-voice state
+class Envelope {
+private:
+  const EnvelopeShape* shape;
+  uint8_t stage;
+  int32_t level;        // Q24
+  int32_t target;
+  int32_t slope;        // Per block
+  uint16_t remaining;   // Blocks left in the current segment
+  uint8_t nextStage;
+  
+  void enterStage(uint8_t next);
+  
+public:
+  Envelope();
+  
+  // nullptr behaves like ENV_OFF
+  void start(const EnvelopeShape* envelopeShape);
+  void release();
+  
+  // The shape was changed while this envelope was using it
+  void reshape();
+  
+  // Level after the next control block, Q15
+  int32_t advance();
+  
+  // Current level, Q15
+  int32_t getLevel() { return level >> ENV_STATE_SHIFT; }
+  uint8_t getStage() { return stage; }
+  bool isDone() { return stage == ENV_DONE; }
+};
+
+#endif
@@ -0,0 +1,58 @@
+/*
+ * DriftRiff Mini - Host HAL: ILI9341 Display Stand-in
+ *
+ * An in-memory RGB565 framebuffer in panel (portrait) orientation.
+ * hostDisplayDumpPPM() writes it out as seen after setRotation().
+ */
+
+#ifndef HOST_ADAFRUIT_ILI9341_H
+#define HOST_ADAFRUIT_ILI9341_H
+
+#include "Adafruit_GFX.h"
+
+#define ILI9341_TFTWIDTH  240
+#define ILI9341_TFTHEIGHT 320
+
+#define ILI9341_BLACK       0x0000
+#define ILI9341_NAVY        0x000F
+#define ILI9341_DARKGREEN   0x03E0
+#define ILI9341_DARKCYAN    0x03EF
+#define ILI9341_MAROON      0x7800
+#define ILI9341_PURPLE      0x780F
+#define ILI9341_OLIVE       0x7BE0
+#define ILI9341_LIGHTGREY   0xC618
+#define ILI9341_DARKGREY    0x7BEF
+#define ILI9341_BLUE        0x001F
+#define ILI9341_GREEN       0x07E0
+#define ILI9341_CYAN        0x07FF
+#define ILI9341_RED         0xF800
+#define ILI9341_MAGENTA     0xF81F
+#define ILI9341_YELLOW      0xFFE0
+#define ILI9341_WHITE       0xFFFF
+#define ILI9341_ORANGE      0xFD20
+#define ILI9341_GREENYELLOW 0xAFE5
+#define ILI9341_PINK        0xFC18
+
+class Adafruit_ILI9341 : public Adafruit_GFX {
+private:
+  uint16_t framebuffer[ILI9341_TFTWIDTH * ILI9341_TFTHEIGHT];
+
+  void registerPrimary();
+
+public:
+  Adafruit_ILI9341(int8_t cs, int8_t dc, int8_t mosi, int8_t sclk,
+                   int8_t rst = -1, int8_t miso = -1);
+  Adafruit_ILI9341(int8_t cs, int8_t dc, int8_t rst = -1);
+
+  void begin(uint32_t freq = 0);
+
+  void drawPixel(int16_t x, int16_t y, uint16_t color) override;
+  void fillRect(int16_t x, int16_t y, int16_t w, int16_t h, uint16_t color) override;
+
+  // Host only: pixel as seen in the current rotation
+  uint16_t getPixel(int16_t x, int16_t y) const;
+
+  static Adafruit_ILI9341* primary;  // Last display constructed, for hostsim.h
+};
+
+#endif
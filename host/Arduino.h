@@ -0,0 +1,161 @@
+/*
+ * DriftRiff Mini - Host HAL: Arduino Core Stand-in
+ *
+ * Just enough of the ESP32 Arduino core for the firmware modules to build
+ * and run on Linux. Time comes from hostsim.h's clock, ledcWrite() feeds
+ * the audio file sink and Serial maps to stdin/stdout.
+ */
+
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <deque>
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define HIGH   1
+#define LOW    0
+#define INPUT  0x01
+#define OUTPUT 0x03
+#define INPUT_PULLUP 0x05
+
+#define DEC 10
+#define HEX 16
+#define BIN 2
+
+#define PI 3.1415926535897932384626433832795
+
+#define PROGMEM
+#define F(str) (str)
+
+template <class T, class L>
+inline auto min(const T& a, const L& b) -> decltype((b < a) ? b : a) {
+  return (b < a) ? b : a;
+}
+
+template <class T, class L>
+inline auto max(const T& a, const L& b) -> decltype((b < a) ? b : a) {
+  return (a < b) ? b : a;
+}
+
+template <class T, class L, class H>
+inline T constrain(T value, L low, H high) {
+  return value < low ? low : (value > high ? high : value);
+}
+
+long map(long x, long inMin, long inMax, long outMin, long outMax);
+long random(long howBig);
+long random(long howSmall, long howBig);
+void randomSeed(unsigned long seed);
+
+// Time
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield();
+
+// GPIO
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+uint16_t analogRead(uint8_t pin);
+
+// LEDC PWM, channel 0 is routed to the audio sink
+double ledcSetup(uint8_t channel, double freq, uint8_t resolutionBits);
+void ledcAttachPin(uint8_t pin, uint8_t channel);
+void ledcWrite(uint8_t channel, uint32_t duty);
+
+class Print {
+private:
+  size_t printNumber(unsigned long long n, uint8_t base);
+
+public:
+  virtual ~Print() {}
+
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t* buffer, size_t size);
+  size_t write(const char* str) { return str ? write((const uint8_t*)str, strlen(str)) : 0; }
+
+  size_t print(const char* str) { return write(str); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(unsigned char n, int base = DEC) { return print((unsigned long)n, base); }
+  size_t print(int n, int base = DEC) { return print((long)n, base); }
+  size_t print(unsigned int n, int base = DEC) { return print((unsigned long)n, base); }
+  size_t print(long n, int base = DEC);
+  size_t print(unsigned long n, int base = DEC);
+  size_t print(long long n, int base = DEC);
+  size_t print(unsigned long long n, int base = DEC);
+  size_t print(double n, int digits = 2);
+
+  size_t println() { return write((const uint8_t*)"\r\n", 2); }
+  template <typename T>
+  size_t println(const T& value) { size_t n = print(value); return n + println(); }
+  template <typename T>
+  size_t println(const T& value, int format) { size_t n = print(value, format); return n + println(); }
+
+  size_t printf(const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+  virtual void flush() {}
+};
+
+class Stream : public Print {
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+};
+
+#define SERIAL_8N1 0x800001c
+
+class HardwareSerial : public Stream {
+private:
+  int inFd;
+  int outFd;
+  bool inputClosed;
+  int peeked;
+
+  // Bytes injected for delivery at a given clock time (fake UART)
+  struct TimedByte {
+    uint64_t atMicros;
+    uint8_t data;
+  };
+  std::deque<TimedByte> injected;
+
+public:
+  HardwareSerial(int inputFd, int outputFd);
+
+  void begin(unsigned long baud);
+  void begin(unsigned long baud, uint32_t config, int8_t rxPin, int8_t txPin);
+  void end() {}
+
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t* buffer, size_t size) override;
+  using Print::write;
+
+  int available() override;
+  int read() override;
+  int peek() override;
+  void flush() override;
+  int availableForWrite();
+
+  // Host only: route the port to other file descriptors (e.g. a pty)
+  void attach(int inputFd, int outputFd);
+
+  // Host only: make a byte readable once the clock reaches atMicros.
+  // Bytes must be injected in time order.
+  void inject(uint8_t data, uint64_t atMicros);
+
+  operator bool() const { return true; }
+};
+
+extern HardwareSerial Serial;
+extern HardwareSerial Serial2;   // MIDI port, unconnected unless attached
+
+#endif
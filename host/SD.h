@@ -0,0 +1,70 @@
+/*
+ * DriftRiff Mini - Host HAL: SD Library Stand-in
+ *
+ * Card paths map onto a host directory set with hostSDSetRoot(). File is a
+ * shared handle like the ESP32 fs::File, so copies refer to one open file.
+ */
+
+#ifndef HOST_SD_H
+#define HOST_SD_H
+
+#include "Arduino.h"
+#include <stdio.h>
+#include <time.h>
+#include <memory>
+
+#define FILE_READ   "r"
+#define FILE_WRITE  "w"
+#define FILE_APPEND "a"
+
+struct HostFileHandle;
+
+class File : public Stream {
+private:
+  std::shared_ptr<HostFileHandle> handle;
+
+public:
+  File() {}
+  explicit File(std::shared_ptr<HostFileHandle> h) : handle(h) {}
+
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t* buffer, size_t size) override;
+  using Print::write;
+
+  int available() override;
+  int read() override;
+  int peek() override;
+  void flush() override;
+
+  size_t read(uint8_t* buffer, size_t size);
+  bool seek(uint32_t pos);
+  size_t position() const;
+  size_t size() const;
+  time_t getLastWrite();
+  void close();
+
+  const char* name() const;
+  const char* path() const;
+  bool isDirectory() const;
+  File openNextFile(const char* mode = FILE_READ);
+  void rewindDirectory();
+
+  operator bool() const;
+};
+
+class SDClass {
+public:
+  bool begin(uint8_t csPin = 5);
+  void end() {}
+
+  File open(const char* path, const char* mode = FILE_READ);
+  bool exists(const char* path);
+  bool remove(const char* path);
+  bool rename(const char* pathFrom, const char* pathTo);
+  bool mkdir(const char* path);
+  bool rmdir(const char* path);
+};
+
+extern SDClass SD;
+
+#endif
@@ -0,0 +1,18 @@
+/*
+ * DriftRiff Mini - Host HAL: SPI Stand-in
+ */
+
+#ifndef HOST_SPI_H
+#define HOST_SPI_H
+
+#include "Arduino.h"
+
+class SPIClass {
+public:
+  void begin() {}
+  void end() {}
+};
+
+extern SPIClass SPI;
+
+#endif
@@ -0,0 +1,34 @@
+/*
+ * DriftRiff Mini - Host HAL: Resistive TouchScreen Stand-in
+ *
+ * getPoint() reports whatever hostTouchSet() or a touch script says the
+ * stylus is doing at the current clock time.
+ */
+
+#ifndef HOST_TOUCHSCREEN_H
+#define HOST_TOUCHSCREEN_H
+
+#include "Arduino.h"
+
+class TSPoint {
+public:
+  TSPoint() : x(0), y(0), z(0) {}
+  TSPoint(int16_t x0, int16_t y0, int16_t z0) : x(x0), y(y0), z(z0) {}
+
+  bool operator==(TSPoint p) const { return p.x == x && p.y == y && p.z == z; }
+  bool operator!=(TSPoint p) const { return !(*this == p); }
+
+  int16_t x, y, z;
+};
+
+class TouchScreen {
+public:
+  TouchScreen(uint8_t xp, uint8_t yp, uint8_t xm, uint8_t ym, uint16_t rx);
+
+  TSPoint getPoint();
+  uint16_t pressure();
+  int readTouchX();
+  int readTouchY();
+};
+
+#endif
@@ -0,0 +1,356 @@
+/*
+ * DriftRiff Mini - Host HAL: Arduino Core Implementation
+ */
+
+#include "Arduino.h"
+#include "hostsim.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <chrono>
+#include <thread>
+#include <poll.h>
+#include <unistd.h>
+
+#define HOST_SERIAL_FIFO 128   // Bytes availableForWrite() reports, an ESP32 UART FIFO
+
+HardwareSerial Serial(STDIN_FILENO, STDOUT_FILENO);
+HardwareSerial Serial2(-1, -1);
+
+// ---- Clock ----
+
+static HostClockMode clockMode = HOST_CLOCK_VIRTUAL;
+static uint64_t virtualMicros = 0;
+static std::chrono::steady_clock::time_point realEpoch = std::chrono::steady_clock::now();
+
+// ---- Audio sink ----
+
+static FILE* sinkFile = nullptr;
+static uint32_t sinkRate = 0;
+static uint32_t sinkFrames = 0;
+static uint64_t sinkMicros = 0;   // Clock time up to which frames were emitted
+static uint8_t sinkLevel = 128;
+static HostAudioTap audioTap = nullptr;
+
+static void writeLE32(uint8_t* p, uint32_t v) {
+  p[0] = v & 0xFF;
+  p[1] = (v >> 8) & 0xFF;
+  p[2] = (v >> 16) & 0xFF;
+  p[3] = (v >> 24) & 0xFF;
+}
+
+static void writeWavHeader(FILE* f, uint32_t rate, uint32_t frames) {
+  uint8_t h[44];
+  memcpy(h, "RIFF", 4);
+  writeLE32(h + 4, 36 + frames);
+  memcpy(h + 8, "WAVEfmt ", 8);
+  writeLE32(h + 16, 16);
+  h[20] = 1; h[21] = 0;   // PCM
+  h[22] = 1; h[23] = 0;   // Mono
+  writeLE32(h + 24, rate);
+  writeLE32(h + 28, rate);
+  h[32] = 1; h[33] = 0;   // Block align
+  h[34] = 8; h[35] = 0;   // Bits per sample
+  memcpy(h + 36, "data", 4);
+  writeLE32(h + 40, frames);
+  fwrite(h, 1, sizeof(h), f);
+}
+
+// Emit held output level for every sample period elapsed up to 'now'
+static void sinkPump(uint64_t now) {
+  if (!sinkFile) return;
+
+  uint64_t due = now * sinkRate / 1000000;
+  uint64_t done = sinkMicros * sinkRate / 1000000;
+  for (uint64_t i = done; i < due; i++) {
+    fputc(sinkLevel, sinkFile);
+    sinkFrames++;
+  }
+  sinkMicros = now;
+}
+
+void hostClockSetMode(HostClockMode mode) {
+  clockMode = mode;
+  realEpoch = std::chrono::steady_clock::now();
+}
+
+HostClockMode hostClockGetMode() {
+  return clockMode;
+}
+
+uint64_t hostClockMicros() {
+  if (clockMode == HOST_CLOCK_VIRTUAL) {
+    return virtualMicros;
+  }
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - realEpoch).count();
+}
+
+void hostClockAdvance(uint32_t us) {
+  if (clockMode != HOST_CLOCK_VIRTUAL) return;
+  virtualMicros += us;
+  sinkPump(virtualMicros);
+}
+
+bool hostAudioSinkOpen(const char* path, uint32_t sampleRate) {
+  hostAudioSinkClose();
+
+  sinkFile = fopen(path, "wb");
+  if (!sinkFile) return false;
+
+  sinkRate = sampleRate;
+  sinkFrames = 0;
+  sinkMicros = hostClockMicros();
+  writeWavHeader(sinkFile, sinkRate, 0);
+  return true;
+}
+
+void hostAudioSinkClose() {
+  if (!sinkFile) return;
+
+  sinkPump(hostClockMicros());
+
+  // Patch sizes now that the frame count is known
+  fseek(sinkFile, 0, SEEK_SET);
+  writeWavHeader(sinkFile, sinkRate, sinkFrames);
+  fclose(sinkFile);
+  sinkFile = nullptr;
+}
+
+uint32_t hostAudioSinkFrames() {
+  return sinkFrames;
+}
+
+void hostAudioSetTap(HostAudioTap tap) {
+  audioTap = tap;
+}
+
+// ---- Arduino core ----
+
+unsigned long millis() {
+  return (unsigned long)(hostClockMicros() / 1000);
+}
+
+unsigned long micros() {
+  return (unsigned long)hostClockMicros();
+}
+
+void delay(unsigned long ms) {
+  delayMicroseconds(ms * 1000);
+}
+
+void delayMicroseconds(unsigned int us) {
+  if (clockMode == HOST_CLOCK_VIRTUAL) {
+    hostClockAdvance(us);
+  } else {
+    std::this_thread::sleep_for(std::chrono::microseconds(us));
+  }
+}
+
+void yield() {
+}
+
+long map(long x, long inMin, long inMax, long outMin, long outMax) {
+  return (x - inMin) * (outMax - outMin) / (inMax - inMin) + outMin;
+}
+
+static uint32_t randomState = 1;
+
+long random(long howBig) {
+  if (howBig <= 0) return 0;
+  randomState = randomState * 1103515245u + 12345u;
+  return (long)((randomState >> 1) % (uint32_t)howBig);
+}
+
+long random(long howSmall, long howBig) {
+  if (howSmall >= howBig) return howSmall;
+  return random(howBig - howSmall) + howSmall;
+}
+
+void randomSeed(unsigned long seed) {
+  if (seed != 0) randomState = (uint32_t)seed;
+}
+
+void pinMode(uint8_t, uint8_t) {
+}
+
+void digitalWrite(uint8_t, uint8_t) {
+}
+
+int digitalRead(uint8_t) {
+  return LOW;
+}
+
+uint16_t analogRead(uint8_t) {
+  return 0;
+}
+
+double ledcSetup(uint8_t, double freq, uint8_t) {
+  return freq;
+}
+
+void ledcAttachPin(uint8_t, uint8_t) {
+}
+
+void ledcWrite(uint8_t channel, uint32_t duty) {
+  if (channel != 0) return;
+
+  // Real-time mode has no clock hook, so catch the sink up on each write
+  if (clockMode == HOST_CLOCK_REAL) {
+    sinkPump(hostClockMicros());
+  }
+  sinkLevel = (uint8_t)(duty > 255 ? 255 : duty);
+  if (audioTap) audioTap(sinkLevel);
+}
+
+// ---- Print ----
+
+size_t Print::write(const uint8_t* buffer, size_t size) {
+  size_t n = 0;
+  while (size--) {
+    n += write(*buffer++);
+  }
+  return n;
+}
+
+size_t Print::printNumber(unsigned long long n, uint8_t base) {
+  char buf[8 * sizeof(n) + 1];
+  char* str = &buf[sizeof(buf) - 1];
+  *str = '\0';
+
+  if (base < 2) base = 10;
+  do {
+    unsigned long long m = n;
+    n /= base;
+    char c = (char)(m - base * n);
+    *--str = c < 10 ? c + '0' : c + 'A' - 10;
+  } while (n);
+
+  return write(str);
+}
+
+size_t Print::print(long n, int base) {
+  return print((long long)n, base);
+}
+
+size_t Print::print(unsigned long n, int base) {
+  return printNumber(n, (uint8_t)base);
+}
+
+size_t Print::print(long long n, int base) {
+  if (base == 10 && n < 0) {
+    size_t t = print('-');
+    return t + printNumber(0ULL - (unsigned long long)n, 10);
+  }
+  return printNumber((unsigned long long)n, (uint8_t)base);
+}
+
+size_t Print::print(unsigned long long n, int base) {
+  return printNumber(n, (uint8_t)base);
+}
+
+size_t Print::print(double n, int digits) {
+  char buf[64];
+  snprintf(buf, sizeof(buf), "%.*f", digits, n);
+  return write(buf);
+}
+
+size_t Print::printf(const char* format, ...) {
+  char buf[256];
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(buf, sizeof(buf), format, args);
+  va_end(args);
+  if (len < 0) return 0;
+  if ((size_t)len >= sizeof(buf)) len = sizeof(buf) - 1;
+  return write((const uint8_t*)buf, (size_t)len);
+}
+
+// ---- HardwareSerial ----
+
+HardwareSerial::HardwareSerial(int inputFd, int outputFd) {
+  inFd = inputFd;
+  outFd = outputFd;
+  inputClosed = false;
+  peeked = -1;
+}
+
+void HardwareSerial::begin(unsigned long) {
+}
+
+void HardwareSerial::begin(unsigned long, uint32_t, int8_t, int8_t) {
+}
+
+void HardwareSerial::attach(int inputFd, int outputFd) {
+  inFd = inputFd;
+  outFd = outputFd;
+  inputClosed = false;
+  peeked = -1;
+}
+
+void HardwareSerial::inject(uint8_t data, uint64_t atMicros) {
+  injected.push_back({atMicros, data});
+}
+
+size_t HardwareSerial::write(uint8_t c) {
+  return write(&c, 1);
+}
+
+size_t HardwareSerial::write(const uint8_t* buffer, size_t size) {
+  size_t done = 0;
+  if (outFd < 0) return size;
+  while (done < size) {
+    ssize_t n = ::write(outFd, buffer + done, size - done);
+    if (n <= 0) break;
+    done += (size_t)n;
+  }
+  return done;
+}
+
+int HardwareSerial::available() {
+  if (peeked >= 0) return 1;
+
+  if (!injected.empty() && injected.front().atMicros <= hostClockMicros()) {
+    peeked = injected.front().data;
+    injected.pop_front();
+    return 1;
+  }
+
+  if (inputClosed || inFd < 0) return 0;
+
+  struct pollfd pfd = { inFd, POLLIN, 0 };
+  if (poll(&pfd, 1, 0) <= 0) return 0;
+
+  uint8_t c;
+  ssize_t n = ::read(inFd, &c, 1);
+  if (n <= 0) {
+    // EOF or error, stop polling this descriptor
+    inputClosed = true;
+    return 0;
+  }
+  peeked = c;
+  return 1;
+}
+
+int HardwareSerial::read() {
+  if (!available()) return -1;
+  int c = peeked;
+  peeked = -1;
+  return c;
+}
+
+int HardwareSerial::peek() {
+  if (!available()) return -1;
+  return peeked;
+}
+
+void HardwareSerial::flush() {
+}
+
+int HardwareSerial::availableForWrite() {
+  // Room for a UART FIFO's worth whenever the descriptor would not block
+  if (outFd < 0) return HOST_SERIAL_FIFO;
+
+  struct pollfd pfd = { outFd, POLLOUT, 0 };
+  return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLOUT) ? HOST_SERIAL_FIFO : 0;
+}
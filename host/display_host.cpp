@@ -0,0 +1,276 @@
+/*
+ * DriftRiff Mini - Host HAL: Display Implementation
+ */
+
+#include "Adafruit_ILI9341.h"
+#include "SPI.h"
+#include "hostsim.h"
+
+#include <stdio.h>
+
+SPIClass SPI;
+
+Adafruit_ILI9341* Adafruit_ILI9341::primary = nullptr;
+
+static FILE* traceFile = nullptr;
+
+// Classic 5x7 glcd font, printable ASCII only. One byte per column, LSB on top.
+static const uint8_t font5x7[95][5] = {
+  {0x00, 0x00, 0x00, 0x00, 0x00}, {0x00, 0x00, 0x5F, 0x00, 0x00},  // ' ' !
+  {0x00, 0x07, 0x00, 0x07, 0x00}, {0x14, 0x7F, 0x14, 0x7F, 0x14},  // " #
+  {0x24, 0x2A, 0x7F, 0x2A, 0x12}, {0x23, 0x13, 0x08, 0x64, 0x62},  // $ %
+  {0x36, 0x49, 0x56, 0x20, 0x50}, {0x00, 0x05, 0x03, 0x00, 0x00},  // & '
+  {0x00, 0x1C, 0x22, 0x41, 0x00}, {0x00, 0x41, 0x22, 0x1C, 0x00},  // ( )
+  {0x14, 0x08, 0x3E, 0x08, 0x14}, {0x08, 0x08, 0x3E, 0x08, 0x08},  // * +
+  {0x00, 0x50, 0x30, 0x00, 0x00}, {0x08, 0x08, 0x08, 0x08, 0x08},  // , -
+  {0x00, 0x60, 0x60, 0x00, 0x00}, {0x20, 0x10, 0x08, 0x04, 0x02},  // . /
+  {0x3E, 0x51, 0x49, 0x45, 0x3E}, {0x00, 0x42, 0x7F, 0x40, 0x00},  // 0 1
+  {0x42, 0x61, 0x51, 0x49, 0x46}, {0x21, 0x41, 0x45, 0x4B, 0x31},  // 2 3
+  {0x18, 0x14, 0x12, 0x7F, 0x10}, {0x27, 0x45, 0x45, 0x45, 0x39},  // 4 5
+  {0x3C, 0x4A, 0x49, 0x49, 0x30}, {0x01, 0x71, 0x09, 0x05, 0x03},  // 6 7
+  {0x36, 0x49, 0x49, 0x49, 0x36}, {0x06, 0x49, 0x49, 0x29, 0x1E},  // 8 9
+  {0x00, 0x36, 0x36, 0x00, 0x00}, {0x00, 0x56, 0x36, 0x00, 0x00},  // : ;
+  {0x08, 0x14, 0x22, 0x41, 0x00}, {0x14, 0x14, 0x14, 0x14, 0x14},  // < =
+  {0x00, 0x41, 0x22, 0x14, 0x08}, {0x02, 0x01, 0x51, 0x09, 0x06},  // > ?
+  {0x32, 0x49, 0x79, 0x41, 0x3E}, {0x7E, 0x11, 0x11, 0x11, 0x7E},  // @ A
+  {0x7F, 0x49, 0x49, 0x49, 0x36}, {0x3E, 0x41, 0x41, 0x41, 0x22},  // B C
+  {0x7F, 0x41, 0x41, 0x22, 0x1C}, {0x7F, 0x49, 0x49, 0x49, 0x41},  // D E
+  {0x7F, 0x09, 0x09, 0x09, 0x01}, {0x3E, 0x41, 0x49, 0x49, 0x7A},  // F G
+  {0x7F, 0x08, 0x08, 0x08, 0x7F}, {0x00, 0x41, 0x7F, 0x41, 0x00},  // H I
+  {0x20, 0x40, 0x41, 0x3F, 0x01}, {0x7F, 0x08, 0x14, 0x22, 0x41},  // J K
+  {0x7F, 0x40, 0x40, 0x40, 0x40}, {0x7F, 0x02, 0x0C, 0x02, 0x7F},  // L M
+  {0x7F, 0x04, 0x08, 0x10, 0x7F}, {0x3E, 0x41, 0x41, 0x41, 0x3E},  // N O
+  {0x7F, 0x09, 0x09, 0x09, 0x06}, {0x3E, 0x41, 0x51, 0x21, 0x5E},  // P Q
+  {0x7F, 0x09, 0x19, 0x29, 0x46}, {0x46, 0x49, 0x49, 0x49, 0x31},  // R S
+  {0x01, 0x01, 0x7F, 0x01, 0x01}, {0x3F, 0x40, 0x40, 0x40, 0x3F},  // T U
+  {0x1F, 0x20, 0x40, 0x20, 0x1F}, {0x3F, 0x40, 0x38, 0x40, 0x3F},  // V W
+  {0x63, 0x14, 0x08, 0x14, 0x63}, {0x07, 0x08, 0x70, 0x08, 0x07},  // X Y
+  {0x61, 0x51, 0x49, 0x45, 0x43}, {0x00, 0x7F, 0x41, 0x41, 0x00},  // Z [
+  {0x02, 0x04, 0x08, 0x10, 0x20}, {0x00, 0x41, 0x41, 0x7F, 0x00},  // \ ]
+  {0x04, 0x02, 0x01, 0x02, 0x04}, {0x40, 0x40, 0x40, 0x40, 0x40},  // ^ _
+  {0x00, 0x01, 0x02, 0x04, 0x00}, {0x20, 0x54, 0x54, 0x54, 0x78},  // ` a
+  {0x7F, 0x48, 0x44, 0x44, 0x38}, {0x38, 0x44, 0x44, 0x44, 0x20},  // b c
+  {0x38, 0x44, 0x44, 0x48, 0x7F}, {0x38, 0x54, 0x54, 0x54, 0x18},  // d e
+  {0x08, 0x7E, 0x09, 0x01, 0x02}, {0x0C, 0x52, 0x52, 0x52, 0x3E},  // f g
+  {0x7F, 0x08, 0x04, 0x04, 0x78}, {0x00, 0x44, 0x7D, 0x40, 0x00},  // h i
+  {0x20, 0x40, 0x44, 0x3D, 0x00}, {0x7F, 0x10, 0x28, 0x44, 0x00},  // j k
+  {0x00, 0x41, 0x7F, 0x40, 0x00}, {0x7C, 0x04, 0x18, 0x04, 0x78},  // l m
+  {0x7C, 0x08, 0x04, 0x04, 0x78}, {0x38, 0x44, 0x44, 0x44, 0x38},  // n o
+  {0x7C, 0x14, 0x14, 0x14, 0x08}, {0x08, 0x14, 0x14, 0x18, 0x7C},  // p q
+  {0x7C, 0x08, 0x04, 0x04, 0x08}, {0x48, 0x54, 0x54, 0x54, 0x20},  // r s
+  {0x04, 0x3F, 0x44, 0x40, 0x20}, {0x3C, 0x40, 0x40, 0x20, 0x7C},  // t u
+  {0x1C, 0x20, 0x40, 0x20, 0x1C}, {0x3C, 0x40, 0x30, 0x40, 0x3C},  // v w
+  {0x44, 0x28, 0x10, 0x28, 0x44}, {0x0C, 0x50, 0x50, 0x50, 0x3C},  // x y
+  {0x44, 0x64, 0x54, 0x4C, 0x44}, {0x00, 0x08, 0x36, 0x41, 0x00},  // z {
+  {0x00, 0x00, 0x7F, 0x00, 0x00}, {0x00, 0x41, 0x36, 0x08, 0x00},  // | }
+  {0x08, 0x04, 0x08, 0x10, 0x08}                                   // ~
+};
+
+// ---- Adafruit_GFX ----
+
+Adafruit_GFX::Adafruit_GFX(int16_t w, int16_t h) {
+  WIDTH = _width = w;
+  HEIGHT = _height = h;
+  cursor_x = cursor_y = 0;
+  textcolor = textbgcolor = 0xFFFF;
+  textsize_x = textsize_y = 1;
+  rotation = 0;
+  wrap = true;
+}
+
+void Adafruit_GFX::setRotation(uint8_t r) {
+  rotation = r & 3;
+  if (rotation & 1) {
+    _width = HEIGHT;
+    _height = WIDTH;
+  } else {
+    _width = WIDTH;
+    _height = HEIGHT;
+  }
+}
+
+void Adafruit_GFX::drawFastVLine(int16_t x, int16_t y, int16_t h, uint16_t color) {
+  fillRect(x, y, 1, h, color);
+}
+
+void Adafruit_GFX::drawFastHLine(int16_t x, int16_t y, int16_t w, uint16_t color) {
+  fillRect(x, y, w, 1, color);
+}
+
+void Adafruit_GFX::fillRect(int16_t x, int16_t y, int16_t w, int16_t h, uint16_t color) {
+  for (int16_t j = y; j < y + h; j++) {
+    for (int16_t i = x; i < x + w; i++) {
+      drawPixel(i, j, color);
+    }
+  }
+}
+
+void Adafruit_GFX::fillScreen(uint16_t color) {
+  fillRect(0, 0, _width, _height, color);
+}
+
+void Adafruit_GFX::drawLine(int16_t x0, int16_t y0, int16_t x1, int16_t y1, uint16_t color) {
+  int16_t dx = abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
+  int16_t dy = -abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
+  int16_t err = dx + dy;
+
+  for (;;) {
+    drawPixel(x0, y0, color);
+    if (x0 == x1 && y0 == y1) break;
+    int16_t e2 = 2 * err;
+    if (e2 >= dy) { err += dy; x0 += sx; }
+    if (e2 <= dx) { err += dx; y0 += sy; }
+  }
+}
+
+void Adafruit_GFX::drawRect(int16_t x, int16_t y, int16_t w, int16_t h, uint16_t color) {
+  drawFastHLine(x, y, w, color);
+  drawFastHLine(x, y + h - 1, w, color);
+  drawFastVLine(x, y, h, color);
+  drawFastVLine(x + w - 1, y, h, color);
+}
+
+void Adafruit_GFX::drawChar(int16_t x, int16_t y, unsigned char c, uint16_t color,
+                            uint16_t bg, uint8_t sizeX, uint8_t sizeY) {
+  const uint8_t* glyph = (c >= 0x20 && c <= 0x7E) ? font5x7[c - 0x20] : font5x7['?' - 0x20];
+
+  // Sixth column is the inter-character gap, painted only with a background
+  for (int8_t col = 0; col < 6; col++) {
+    uint8_t bits = col < 5 ? glyph[col] : 0;
+    for (int8_t row = 0; row < 8; row++, bits >>= 1) {
+      if (bits & 1) {
+        fillRect(x + col * sizeX, y + row * sizeY, sizeX, sizeY, color);
+      } else if (bg != color) {
+        fillRect(x + col * sizeX, y + row * sizeY, sizeX, sizeY, bg);
+      }
+    }
+  }
+}
+
+size_t Adafruit_GFX::write(uint8_t c) {
+  if (c == '\n') {
+    cursor_x = 0;
+    cursor_y += textsize_y * 8;
+  } else if (c != '\r') {
+    if (wrap && (cursor_x + textsize_x * 6) > _width) {
+      cursor_x = 0;
+      cursor_y += textsize_y * 8;
+    }
+    drawChar(cursor_x, cursor_y, c, textcolor, textbgcolor, textsize_x, textsize_y);
+    cursor_x += textsize_x * 6;
+  }
+  return 1;
+}
+
+// ---- Adafruit_ILI9341 ----
+
+Adafruit_ILI9341::Adafruit_ILI9341(int8_t, int8_t, int8_t, int8_t, int8_t, int8_t)
+    : Adafruit_GFX(ILI9341_TFTWIDTH, ILI9341_TFTHEIGHT) {
+  registerPrimary();
+}
+
+Adafruit_ILI9341::Adafruit_ILI9341(int8_t, int8_t, int8_t)
+    : Adafruit_GFX(ILI9341_TFTWIDTH, ILI9341_TFTHEIGHT) {
+  registerPrimary();
+}
+
+void Adafruit_ILI9341::registerPrimary() {
+  memset(framebuffer, 0, sizeof(framebuffer));
+  primary = this;
+}
+
+void Adafruit_ILI9341::begin(uint32_t) {
+  memset(framebuffer, 0, sizeof(framebuffer));
+}
+
+// Map rotated coordinates back onto the portrait panel, as MADCTL does
+static inline bool panelIndex(uint8_t rotation, int16_t x, int16_t y, int16_t w, int16_t h,
+                              int* index) {
+  if (x < 0 || y < 0 || x >= w || y >= h) return false;
+
+  int16_t px, py;
+  switch (rotation) {
+    case 1:  px = ILI9341_TFTWIDTH - 1 - y; py = x; break;
+    case 2:  px = ILI9341_TFTWIDTH - 1 - x; py = ILI9341_TFTHEIGHT - 1 - y; break;
+    case 3:  px = y; py = ILI9341_TFTHEIGHT - 1 - x; break;
+    default: px = x; py = y; break;
+  }
+  *index = py * ILI9341_TFTWIDTH + px;
+  return true;
+}
+
+void Adafruit_ILI9341::drawPixel(int16_t x, int16_t y, uint16_t color) {
+  if (traceFile) {
+    fprintf(traceFile, "%llu P %d %d %04x\n", (unsigned long long)hostClockMicros(), x, y, color);
+  }
+
+  int index;
+  if (panelIndex(rotation, x, y, _width, _height, &index)) {
+    framebuffer[index] = color;
+  }
+}
+
+void Adafruit_ILI9341::fillRect(int16_t x, int16_t y, int16_t w, int16_t h, uint16_t color) {
+  if (traceFile) {
+    fprintf(traceFile, "%llu R %d %d %d %d %04x\n", (unsigned long long)hostClockMicros(), x, y, w, h,
+            color);
+  }
+
+  // Clip once up front instead of per pixel
+  if (w <= 0 || h <= 0) return;
+  int16_t x1 = x + w, y1 = y + h;
+  if (x < 0) x = 0;
+  if (y < 0) y = 0;
+  if (x1 > _width) x1 = _width;
+  if (y1 > _height) y1 = _height;
+
+  for (int16_t j = y; j < y1; j++) {
+    for (int16_t i = x; i < x1; i++) {
+      int index = 0;
+      panelIndex(rotation, i, j, _width, _height, &index);
+      framebuffer[index] = color;
+    }
+  }
+}
+
+uint16_t Adafruit_ILI9341::getPixel(int16_t x, int16_t y) const {
+  int index;
+  if (!panelIndex(rotation, x, y, _width, _height, &index)) return 0;
+  return framebuffer[index];
+}
+
+bool hostDisplayDumpPPM(const char* path) {
+  Adafruit_ILI9341* tft = Adafruit_ILI9341::primary;
+  if (!tft) return false;
+
+  FILE* f = fopen(path, "wb");
+  if (!f) return false;
+
+  fprintf(f, "P6\n%d %d\n255\n", tft->width(), tft->height());
+  for (int16_t y = 0; y < tft->height(); y++) {
+    for (int16_t x = 0; x < tft->width(); x++) {
+      uint16_t c = tft->getPixel(x, y);
+      uint8_t rgb[3] = {
+        (uint8_t)(((c >> 11) & 0x1F) * 255 / 31),
+        (uint8_t)(((c >> 5) & 0x3F) * 255 / 63),
+        (uint8_t)((c & 0x1F) * 255 / 31)
+      };
+      fwrite(rgb, 1, 3, f);
+    }
+  }
+
+  fclose(f);
+  return true;
+}
+
+bool hostDisplayTraceOpen(const char* path) {
+  hostDisplayTraceClose();
+  traceFile = fopen(path, "w");
+  return traceFile != nullptr;
+}
+
+void hostDisplayTraceClose() {
+  if (!traceFile) return;
+  fclose(traceFile);
+  traceFile = nullptr;
+}
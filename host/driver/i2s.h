@@ -0,0 +1,79 @@
+/*
+ * DriftRiff Mini - Host HAL: ESP-IDF I2S Driver Stand-in
+ *
+ * Only the built-in ADC capture path. The "DMA" fills at the configured
+ * sample rate against the host clock from the WAV file given to
+ * hostAudioInputOpen() (mid-scale silence without one). When the reader
+ * falls more than dma_buf_count * dma_buf_len frames behind, the oldest
+ * buffers are overwritten like on the device, and the loss is counted in
+ * hostAudioInputOverruns().
+ */
+
+#ifndef HOST_DRIVER_I2S_H
+#define HOST_DRIVER_I2S_H
+
+#include "Arduino.h"
+
+typedef int esp_err_t;
+#define ESP_OK    0
+#define ESP_FAIL  -1
+
+typedef uint32_t TickType_t;
+
+typedef enum {
+  I2S_NUM_0 = 0,
+  I2S_NUM_MAX
+} i2s_port_t;
+
+typedef enum {
+  I2S_MODE_MASTER = 1,
+  I2S_MODE_SLAVE = 2,
+  I2S_MODE_TX = 4,
+  I2S_MODE_RX = 8,
+  I2S_MODE_DAC_BUILT_IN = 16,
+  I2S_MODE_ADC_BUILT_IN = 32
+} i2s_mode_t;
+
+typedef enum {
+  I2S_BITS_PER_SAMPLE_16BIT = 16
+} i2s_bits_per_sample_t;
+
+typedef enum {
+  I2S_CHANNEL_FMT_ONLY_LEFT = 4
+} i2s_channel_fmt_t;
+
+typedef enum {
+  I2S_COMM_FORMAT_STAND_I2S = 1
+} i2s_comm_format_t;
+
+typedef enum {
+  ADC_UNIT_1 = 1
+} adc_unit_t;
+
+typedef enum {
+  ADC1_CHANNEL_0 = 0,   // GPIO36
+  ADC1_CHANNEL_6 = 6    // GPIO34
+} adc1_channel_t;
+
+typedef struct {
+  i2s_mode_t mode;
+  uint32_t sample_rate;
+  i2s_bits_per_sample_t bits_per_sample;
+  i2s_channel_fmt_t channel_format;
+  i2s_comm_format_t communication_format;
+  int intr_alloc_flags;
+  int dma_buf_count;
+  int dma_buf_len;
+  bool use_apll;
+} i2s_config_t;
+
+// Samples are 16 bits, the 12-bit conversion in the low bits and the ADC
+// channel in the top four, as the built-in ADC mode delivers them
+esp_err_t i2s_driver_install(i2s_port_t port, const i2s_config_t* config, int queueSize, void* queue);
+esp_err_t i2s_driver_uninstall(i2s_port_t port);
+esp_err_t i2s_set_adc_mode(adc_unit_t unit, adc1_channel_t channel);
+esp_err_t i2s_adc_enable(i2s_port_t port);
+esp_err_t i2s_adc_disable(i2s_port_t port);
+esp_err_t i2s_read(i2s_port_t port, void* dest, size_t size, size_t* bytesRead, TickType_t ticksToWait);
+
+#endif
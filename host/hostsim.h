@@ -0,0 +1,72 @@
+/*
+ * DriftRiff Mini - Host HAL Control Interface
+ *
+ * Knobs the simulator and host tools use to drive the stand-ins: the
+ * clock behind millis()/micros(), the ledcWrite() audio sink, the I2S ADC
+ * input, the SD root directory, the display framebuffer and draw-call
+ * trace, and the scripted touch input.
+ */
+
+#ifndef HOSTSIM_H
+#define HOSTSIM_H
+
+#include <stdint.h>
+
+// Clock
+enum HostClockMode {
+  HOST_CLOCK_VIRTUAL,  // Advances only via hostClockAdvance() and delay()
+  HOST_CLOCK_REAL      // Wall clock, delay() sleeps
+};
+
+void hostClockSetMode(HostClockMode mode);
+HostClockMode hostClockGetMode();
+uint64_t hostClockMicros();
+void hostClockAdvance(uint32_t us);
+
+// Audio sink: ledcWrite(0, duty) held and resampled to an 8-bit mono WAV
+bool hostAudioSinkOpen(const char* path, uint32_t sampleRate);
+void hostAudioSinkClose();
+uint32_t hostAudioSinkFrames();
+
+// Called with every value written to the audio PWM channel, for render checks
+typedef void (*HostAudioTap)(uint8_t level);
+void hostAudioSetTap(HostAudioTap tap);
+
+// Audio input behind the I2S built-in ADC stand-in: an 8 or 16-bit PCM WAV
+// file playing from clock zero, first channel only
+bool hostAudioInputOpen(const char* path);
+void hostAudioInputClose();
+uint32_t hostAudioInputOverruns();    // Frames lost to a slow reader
+
+// SD card backed by a host directory
+void hostSDSetRoot(const char* dir);
+const char* hostSDGetRoot();
+
+// SD card timing model. Each operation charges its cost to the clock
+// (advancing the virtual clock, or sleeping in real-time mode). All zero,
+// the default, makes the card instant.
+struct HostSDTiming {
+  uint32_t openUs;        // Path lookup, on open() and exists()
+  uint32_t dirEntryUs;    // Per entry scanned: the parent's entries on a
+                          // lookup, all entries when a directory is opened
+  uint32_t commandUs;     // Per read or write call
+  uint32_t seekUs;        // Extra when an access does not continue the last one
+  uint32_t bytesPerMs;    // Transfer rate, 0 = unlimited
+};
+
+void hostSDSetTiming(const HostSDTiming& timing);
+
+// Display framebuffer (RGB565, as seen after setRotation)
+bool hostDisplayDumpPPM(const char* path);
+
+// Every drawPixel() and fillRect() reaching the panel, one text line each
+// with the clock time, so two runs' draw calls can be diffed
+bool hostDisplayTraceOpen(const char* path);
+void hostDisplayTraceClose();
+
+// Touch input, raw ADC coordinates like the real panel reports
+bool hostTouchLoadScript(const char* path);
+void hostTouchSet(int16_t rawX, int16_t rawY, int16_t pressure);
+void hostTouchRelease();
+
+#endif
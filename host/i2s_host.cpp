@@ -0,0 +1,169 @@
+/*
+ * DriftRiff Mini - Host HAL: I2S ADC Capture Implementation
+ */
+
+#include "driver/i2s.h"
+#include "hostsim.h"
+
+#include <stdio.h>
+#include <vector>
+
+// ---- Input source ----
+
+static std::vector<uint16_t> inputFrames;   // 12-bit ADC values
+static uint32_t inputRate = 0;
+static uint32_t inputOverruns = 0;
+
+static uint32_t readLE32(const uint8_t* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint16_t readLE16(const uint8_t* p) {
+  return p[0] | (p[1] << 8);
+}
+
+bool hostAudioInputOpen(const char* path) {
+  FILE* f = fopen(path, "rb");
+  if (!f) return false;
+
+  std::vector<uint8_t> file;
+  uint8_t buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+    file.insert(file.end(), buffer, buffer + n);
+  }
+  fclose(f);
+
+  if (file.size() < 12 || memcmp(file.data(), "RIFF", 4) != 0 || memcmp(file.data() + 8, "WAVE", 4) != 0) {
+    return false;
+  }
+
+  // Walk the chunks for the format and the data, 8 or 16-bit PCM only
+  uint16_t channels = 0;
+  uint16_t bits = 0;
+  uint32_t rate = 0;
+  size_t pos = 12;
+  while (pos + 8 <= file.size()) {
+    const uint8_t* chunk = file.data() + pos;
+    uint32_t length = readLE32(chunk + 4);
+    size_t body = pos + 8;
+    if (body + length > file.size()) length = (uint32_t)(file.size() - body);
+
+    if (memcmp(chunk, "fmt ", 4) == 0 && length >= 16) {
+      if (readLE16(chunk + 8) != 1) return false;
+      channels = readLE16(chunk + 10);
+      rate = readLE32(chunk + 12);
+      bits = readLE16(chunk + 22);
+    } else if (memcmp(chunk, "data", 4) == 0 && channels > 0) {
+      if (bits != 8 && bits != 16) return false;
+      uint32_t frameBytes = channels * bits / 8;
+      inputFrames.clear();
+      for (uint32_t i = 0; i + frameBytes <= length; i += frameBytes) {
+        // First channel only, rescaled to the ADC's unsigned 12 bits
+        const uint8_t* sample = file.data() + body + i;
+        uint16_t value = bits == 8 ? sample[0] << 4 : (uint16_t)((int16_t)readLE16(sample) + 32768) >> 4;
+        inputFrames.push_back(value);
+      }
+      inputRate = rate;
+      return true;
+    }
+    pos = body + length + (length & 1);
+  }
+  return false;
+}
+
+void hostAudioInputClose() {
+  inputFrames.clear();
+  inputRate = 0;
+}
+
+uint32_t hostAudioInputOverruns() {
+  return inputOverruns;
+}
+
+// ---- Driver ----
+
+static bool installed = false;
+static bool enabled = false;
+static uint32_t sampleRate = 0;
+static uint32_t capacity = 0;       // Frames the DMA ring holds
+static uint32_t bufferLength = 0;
+static uint64_t enableFrame = 0;
+static uint64_t consumedFrames = 0; // Frames delivered or overwritten since enable
+static uint16_t channelBits = 0;
+
+// The input plays from clock zero whether or not anything captures it
+static uint64_t frameAt(uint64_t micros) {
+  return micros * sampleRate / 1000000;
+}
+
+static uint16_t inputAt(uint64_t frame) {
+  if (inputFrames.empty() || inputRate == 0) return 2048;
+
+  // Nearest-sample resample, silence once the file has played
+  uint64_t index = frame * inputRate / sampleRate;
+  return index < inputFrames.size() ? inputFrames[index] : 2048;
+}
+
+esp_err_t i2s_driver_install(i2s_port_t, const i2s_config_t* config, int, void*) {
+  if (!config || config->sample_rate == 0 || config->dma_buf_count <= 0 || config->dma_buf_len <= 0) {
+    return ESP_FAIL;
+  }
+  installed = true;
+  enabled = false;
+  sampleRate = config->sample_rate;
+  bufferLength = config->dma_buf_len;
+  capacity = config->dma_buf_count * config->dma_buf_len;
+  return ESP_OK;
+}
+
+esp_err_t i2s_driver_uninstall(i2s_port_t) {
+  installed = false;
+  enabled = false;
+  return ESP_OK;
+}
+
+esp_err_t i2s_set_adc_mode(adc_unit_t, adc1_channel_t channel) {
+  channelBits = (uint16_t)(channel << 12);
+  return ESP_OK;
+}
+
+esp_err_t i2s_adc_enable(i2s_port_t) {
+  if (!installed) return ESP_FAIL;
+  enabled = true;
+  enableFrame = frameAt(hostClockMicros());
+  consumedFrames = 0;
+  return ESP_OK;
+}
+
+esp_err_t i2s_adc_disable(i2s_port_t) {
+  enabled = false;
+  return ESP_OK;
+}
+
+esp_err_t i2s_read(i2s_port_t, void* dest, size_t size, size_t* bytesRead, TickType_t) {
+  *bytesRead = 0;
+  if (!enabled) return ESP_FAIL;
+
+  uint64_t produced = frameAt(hostClockMicros()) - enableFrame;
+
+  // Whole buffers the reader was too slow for are gone
+  uint64_t pending = produced - consumedFrames;
+  if (pending > capacity) {
+    uint64_t lost = (pending - capacity + bufferLength - 1) / bufferLength * bufferLength;
+    consumedFrames += lost;
+    inputOverruns += (uint32_t)lost;
+    pending -= lost;
+  }
+
+  size_t frames = size / sizeof(uint16_t);
+  if (frames > pending) frames = (size_t)pending;
+
+  uint16_t* out = (uint16_t*)dest;
+  for (size_t i = 0; i < frames; i++) {
+    out[i] = channelBits | inputAt(enableFrame + consumedFrames + i);
+  }
+  consumedFrames += frames;
+  *bytesRead = frames * sizeof(uint16_t);
+  return ESP_OK;
+}
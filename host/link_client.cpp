@@ -0,0 +1,288 @@
+/*
+ * DriftRiff Mini - Serial Link Client
+ *
+ * Talks the framed protocol in seriallink.h to the device, or to the
+ * simulator started with --serial-pty. Sends one command, or watches the
+ * telemetry, or measures round trips with pings. Text the firmware prints
+ * outside frames is passed through to stdout.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "seriallink.h"
+
+static const char* const messageNames[] = {"ok", "bad arguments", "failed", "unknown command"};
+
+static void usage(const char* argv0) {
+  fprintf(stderr,
+          "Usage: %s PORT COMMAND [args]\n"
+          "  monitor SECONDS        Print telemetry and log lines\n"
+          "  ping COUNT [SIZE]      Round-trip latency and throughput, SIZE payload bytes\n"
+          "  step TRACK STEP 0|1    Set a step in the current pattern (0-based)\n"
+          "  bpm N                  Set the tempo\n"
+          "  load SLOT FILE         Load a sample file into a slot (0-based)\n"
+          "  play | stop            Transport\n",
+          argv0);
+}
+
+static uint64_t nowMicros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+class LinkClient {
+private:
+  int fd;
+  uint8_t seq;
+
+  // Same receive rules as the firmware: zeros open and close frames
+  uint8_t buffer[LINK_MAX_ENCODED];
+  size_t length;
+  bool inFrame;
+  bool skipping;
+
+  // Read from the port but not yet looked at
+  uint8_t input[256];
+  size_t inputLength;
+  size_t inputPosition;
+
+  bool feed(uint8_t data, LinkFrame& frame) {
+    if (!inFrame) {
+      if (data == 0) {
+        inFrame = true;
+        skipping = false;
+        length = 0;
+      } else {
+        fputc(data, stdout);
+      }
+      return false;
+    }
+
+    if (data != 0) {
+      if (length < sizeof(buffer)) {
+        buffer[length++] = data;
+      } else {
+        skipping = true;
+      }
+      return false;
+    }
+    if (length == 0 && !skipping) return false;
+
+    inFrame = false;
+    if (skipping || !linkDecodeFrame(buffer, length, frame)) {
+      errors++;
+      return false;
+    }
+    return true;
+  }
+
+public:
+  uint32_t errors;    // Frames that failed to decode
+
+  LinkClient(int port) {
+    fd = port;
+    seq = 0;
+    length = 0;
+    inFrame = false;
+    skipping = false;
+    inputLength = 0;
+    inputPosition = 0;
+    errors = 0;
+  }
+
+  bool send(uint8_t type, const void* payload, uint8_t size) {
+    uint8_t encoded[LINK_MAX_ENCODED];
+    size_t count = linkEncodeFrame(type, seq++, payload, size, encoded);
+    return count > 0 && write(fd, encoded, count) == (ssize_t)count;
+  }
+
+  uint8_t lastSeq() { return seq - 1; }
+
+  // Next frame within timeoutMs, printing any text on the way
+  bool receive(LinkFrame& frame, int timeoutMs) {
+    uint64_t deadline = nowMicros() + (uint64_t)timeoutMs * 1000;
+    while (true) {
+      while (inputPosition < inputLength) {
+        if (feed(input[inputPosition++], frame)) return true;
+      }
+
+      ssize_t n = read(fd, input, sizeof(input));
+      if (n > 0) {
+        inputLength = n;
+        inputPosition = 0;
+        continue;
+      }
+      int64_t left = (int64_t)(deadline - nowMicros());
+      if (left <= 0) return false;
+      struct pollfd pfd = { fd, POLLIN, 0 };
+      poll(&pfd, 1, (int)(left / 1000) + 1);
+    }
+  }
+};
+
+static void printFrame(const LinkFrame& frame) {
+  if (frame.type == LINK_TLM_STATUS && frame.length == sizeof(LinkStatus)) {
+    LinkStatus status;
+    memcpy(&status, frame.payload, sizeof(status));
+    printf("[status] %u ms, %u BPM %s, %u voices, %u underruns, render %u/%u us, dropped %u, errors %u\n",
+           status.millis, status.bpm, status.playing ? "playing" : "stopped", status.voices,
+           status.underruns, status.renderMeanMicros, status.renderMaxMicros, status.txDropped,
+           status.rxErrors);
+  } else if (frame.type == LINK_TLM_STEP && frame.length == sizeof(LinkStep)) {
+    LinkStep step;
+    memcpy(&step, frame.payload, sizeof(step));
+    printf("[step] pattern %u step %u, tick %u, frame %u\n", step.pattern + 1, step.step + 1, step.tick,
+           step.frame);
+  } else if (frame.type == LINK_TLM_LOG) {
+    printf("[log] %.*s\n", frame.length, (const char*)frame.payload);
+  } else if (frame.type == LINK_TLM_ACK && frame.length == sizeof(LinkAck)) {
+    LinkAck ack;
+    memcpy(&ack, frame.payload, sizeof(ack));
+    printf("[ack] command %u: %s\n", ack.seq, ack.status <= LINK_UNKNOWN ? messageNames[ack.status] : "?");
+  } else {
+    printf("[frame] type 0x%02x, %u bytes\n", frame.type, frame.length);
+  }
+}
+
+// Stop-and-wait pings: every round trip is timed on its own
+static int runPing(LinkClient& client, int count, int size) {
+  std::vector<double> times;
+  uint8_t payload[LINK_MAX_PAYLOAD];
+  uint64_t started = nowMicros();
+  int lost = 0;
+
+  for (int i = 0; i < count; i++) {
+    for (int b = 0; b < size; b++) {
+      payload[b] = (uint8_t)(i + b);
+    }
+    uint64_t sent = nowMicros();
+    client.send(LINK_CMD_PING, payload, size);
+
+    LinkFrame frame;
+    bool echoed = false;
+    while (client.receive(frame, 1000)) {
+      if (frame.type == LINK_TLM_PONG) {
+        echoed = frame.length == size && memcmp(frame.payload, payload, size) == 0;
+        break;
+      }
+    }
+    if (!echoed) {
+      lost++;
+      continue;
+    }
+    times.push_back((double)(nowMicros() - sent));
+  }
+
+  double seconds = (nowMicros() - started) / 1e6;
+  if (times.empty()) {
+    fprintf(stderr, "No replies\n");
+    return 1;
+  }
+  std::sort(times.begin(), times.end());
+  double frameBytes = size + LINK_FRAME_OVERHEAD + 3;
+  printf("%d pings of %d bytes, %d lost, %u bad frames\n", count, size, lost, client.errors);
+  printf("round trip us: min %.0f, median %.0f, p99 %.0f, max %.0f\n", times.front(),
+         times[times.size() / 2], times[std::min(times.size() - 1, times.size() * 99 / 100)], times.back());
+  printf("throughput: %.0f payload bytes/s each way, %.0f bytes/s on the line\n",
+         times.size() * size / seconds, times.size() * frameBytes * 2 / seconds);
+  return lost ? 1 : 0;
+}
+
+// Send a command and wait for its acknowledgement
+static int runCommand(LinkClient& client, uint8_t type, const void* payload, uint8_t size) {
+  client.send(type, payload, size);
+  uint8_t seq = client.lastSeq();
+
+  LinkFrame frame;
+  while (client.receive(frame, 5000)) {
+    if (frame.type != LINK_TLM_ACK) continue;
+    LinkAck ack;
+    memcpy(&ack, frame.payload, sizeof(ack));
+    if (ack.seq != seq) continue;
+    printFrame(frame);
+    return ack.status == LINK_OK ? 0 : 1;
+  }
+  fprintf(stderr, "No acknowledgement\n");
+  return 1;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  int fd = open(argv[1], O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (fd < 0) {
+    fprintf(stderr, "Cannot open '%s'\n", argv[1]);
+    return 1;
+  }
+  struct termios tio;
+  if (tcgetattr(fd, &tio) == 0) {
+    cfmakeraw(&tio);
+    cfsetspeed(&tio, B115200);
+    tcsetattr(fd, TCSANOW, &tio);
+  }
+
+  LinkClient client(fd);
+  const char* command = argv[2];
+
+  // Any valid frame connects, an empty ping will do
+  LinkFrame frame;
+  client.send(LINK_CMD_PING, nullptr, 0);
+  bool connected = false;
+  while (client.receive(frame, 2000)) {
+    if (frame.type == LINK_TLM_PONG) {
+      connected = true;
+      break;
+    }
+  }
+  if (!connected) {
+    fprintf(stderr, "No reply from '%s'\n", argv[1]);
+    return 1;
+  }
+
+  if (!strcmp(command, "monitor") && argc >= 4) {
+    uint64_t end = nowMicros() + (uint64_t)(atof(argv[3]) * 1e6);
+    while (nowMicros() < end) {
+      if (client.receive(frame, 100)) printFrame(frame);
+    }
+    return 0;
+  }
+  if (!strcmp(command, "ping") && argc >= 4) {
+    int size = argc >= 5 ? atoi(argv[4]) : 8;
+    return runPing(client, atoi(argv[3]), std::min(std::max(size, 0), LINK_MAX_PAYLOAD));
+  }
+  if (!strcmp(command, "step") && argc >= 6) {
+    LinkSetStep step = {(uint8_t)atoi(argv[3]), (uint8_t)atoi(argv[4]), (uint8_t)atoi(argv[5])};
+    return runCommand(client, LINK_CMD_SET_STEP, &step, sizeof(step));
+  }
+  if (!strcmp(command, "bpm") && argc >= 4) {
+    uint16_t bpm = atoi(argv[3]);
+    uint8_t payload[2] = {(uint8_t)bpm, (uint8_t)(bpm >> 8)};
+    return runCommand(client, LINK_CMD_SET_BPM, payload, sizeof(payload));
+  }
+  if (!strcmp(command, "load") && argc >= 5) {
+    uint8_t payload[LINK_MAX_PAYLOAD];
+    size_t name = std::min(strlen(argv[4]), (size_t)LINK_MAX_PAYLOAD - 1);
+    payload[0] = atoi(argv[3]);
+    memcpy(payload + 1, argv[4], name);
+    return runCommand(client, LINK_CMD_LOAD_SAMPLE, payload, name + 1);
+  }
+  if (!strcmp(command, "play") || !strcmp(command, "stop")) {
+    uint8_t run = !strcmp(command, "play");
+    return runCommand(client, LINK_CMD_TRANSPORT, &run, 1);
+  }
+
+  usage(argv[0]);
+  return 1;
+}
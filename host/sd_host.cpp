@@ -0,0 +1,250 @@
+/*
+ * DriftRiff Mini - Host HAL: SD Library Implementation
+ */
+
+#include "SD.h"
+#include "hostsim.h"
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+SDClass SD;
+
+static std::string sdRoot = "sdcard";
+static HostSDTiming sdTiming = {0, 0, 0, 0, 0};
+
+struct HostFileHandle {
+  FILE* fp;
+  std::string cardPath;
+  std::string leafName;
+  bool directory;
+  std::vector<std::string> entries;  // Directory listing, sorted for determinism
+  size_t nextEntry;
+  long lastAccessEnd;                // For the seek cost of the timing model
+
+  HostFileHandle() : fp(nullptr), directory(false), nextEntry(0), lastAccessEnd(0) {}
+  ~HostFileHandle() {
+    if (fp) fclose(fp);
+  }
+};
+
+static std::string hostPath(const char* cardPath) {
+  std::string p = cardPath ? cardPath : "";
+  if (p.empty() || p[0] != '/') p = "/" + p;
+  return sdRoot + p;
+}
+
+void hostSDSetRoot(const char* dir) {
+  sdRoot = dir ? dir : ".";
+  while (sdRoot.size() > 1 && sdRoot.back() == '/') {
+    sdRoot.pop_back();
+  }
+}
+
+const char* hostSDGetRoot() {
+  return sdRoot.c_str();
+}
+
+void hostSDSetTiming(const HostSDTiming& timing) {
+  sdTiming = timing;
+}
+
+static void chargeTime(uint64_t us) {
+  if (us > 0) delayMicroseconds((unsigned int)us);
+}
+
+// FAT finds a name by scanning its directory entry by entry
+static void chargeLookup(const std::string& full) {
+  uint64_t us = sdTiming.openUs;
+  if (sdTiming.dirEntryUs > 0) {
+    size_t slash = full.find_last_of('/');
+    std::string parent = slash == std::string::npos ? "." : full.substr(0, slash);
+    if (DIR* dir = opendir(parent.c_str())) {
+      while (readdir(dir)) us += sdTiming.dirEntryUs;
+      closedir(dir);
+    }
+  }
+  chargeTime(us);
+}
+
+// Cost of one read/write call of 'size' bytes at the handle's position
+static void chargeTransfer(HostFileHandle* h, size_t size) {
+  uint64_t us = sdTiming.commandUs;
+  long pos = ftell(h->fp);
+  if (pos != h->lastAccessEnd) us += sdTiming.seekUs;
+  if (sdTiming.bytesPerMs > 0) us += (uint64_t)size * 1000 / sdTiming.bytesPerMs;
+  h->lastAccessEnd = pos + (long)size;
+  chargeTime(us);
+}
+
+bool SDClass::begin(uint8_t) {
+  struct stat st;
+  return stat(sdRoot.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+File SDClass::open(const char* path, const char* mode) {
+  std::string full = hostPath(path);
+  chargeLookup(full);
+  struct stat st;
+  bool exists = stat(full.c_str(), &st) == 0;
+
+  std::shared_ptr<HostFileHandle> h = std::make_shared<HostFileHandle>();
+  h->cardPath = path ? path : "/";
+  size_t slash = h->cardPath.find_last_of('/');
+  h->leafName = slash == std::string::npos ? h->cardPath : h->cardPath.substr(slash + 1);
+
+  if (exists && S_ISDIR(st.st_mode)) {
+    DIR* dir = opendir(full.c_str());
+    if (!dir) return File();
+    while (struct dirent* e = readdir(dir)) {
+      if (strcmp(e->d_name, ".") != 0 && strcmp(e->d_name, "..") != 0) {
+        h->entries.push_back(e->d_name);
+      }
+    }
+    closedir(dir);
+    std::sort(h->entries.begin(), h->entries.end());
+    chargeTime((uint64_t)sdTiming.dirEntryUs * h->entries.size());
+    h->directory = true;
+    return File(h);
+  }
+
+  // Binary mode, plus read access on writable files like the ESP32 SD driver
+  const char* hostMode = "rb";
+  if (mode && mode[0] == 'w') hostMode = "w+b";
+  else if (mode && mode[0] == 'a') hostMode = "a+b";
+  else if (mode && mode[0] == 'r' && mode[1] == '+') hostMode = "r+b";
+
+  h->fp = fopen(full.c_str(), hostMode);
+  if (!h->fp) return File();
+  return File(h);
+}
+
+bool SDClass::exists(const char* path) {
+  std::string full = hostPath(path);
+  chargeLookup(full);
+  struct stat st;
+  return stat(full.c_str(), &st) == 0;
+}
+
+bool SDClass::remove(const char* path) {
+  return unlink(hostPath(path).c_str()) == 0;
+}
+
+bool SDClass::rename(const char* pathFrom, const char* pathTo) {
+  return ::rename(hostPath(pathFrom).c_str(), hostPath(pathTo).c_str()) == 0;
+}
+
+bool SDClass::mkdir(const char* path) {
+  return ::mkdir(hostPath(path).c_str(), 0755) == 0;
+}
+
+bool SDClass::rmdir(const char* path) {
+  return ::rmdir(hostPath(path).c_str()) == 0;
+}
+
+size_t File::write(uint8_t c) {
+  return write(&c, 1);
+}
+
+size_t File::write(const uint8_t* buffer, size_t size) {
+  if (!handle || !handle->fp) return 0;
+  chargeTransfer(handle.get(), size);
+  return fwrite(buffer, 1, size, handle->fp);
+}
+
+int File::available() {
+  if (!handle || !handle->fp) return 0;
+  long remaining = (long)size() - (long)position();
+  return remaining > 0 ? (int)remaining : 0;
+}
+
+int File::read() {
+  uint8_t c;
+  return read(&c, 1) == 1 ? c : -1;
+}
+
+int File::peek() {
+  if (!handle || !handle->fp) return -1;
+  int c = fgetc(handle->fp);
+  if (c != EOF) ungetc(c, handle->fp);
+  return c == EOF ? -1 : c;
+}
+
+void File::flush() {
+  if (handle && handle->fp) fflush(handle->fp);
+}
+
+size_t File::read(uint8_t* buffer, size_t size) {
+  if (!handle || !handle->fp) return 0;
+  chargeTransfer(handle.get(), size);
+  return fread(buffer, 1, size, handle->fp);
+}
+
+bool File::seek(uint32_t pos) {
+  if (!handle || !handle->fp) return false;
+  return fseek(handle->fp, (long)pos, SEEK_SET) == 0;
+}
+
+size_t File::position() const {
+  if (!handle || !handle->fp) return 0;
+  long pos = ftell(handle->fp);
+  return pos < 0 ? 0 : (size_t)pos;
+}
+
+size_t File::size() const {
+  if (!handle || !handle->fp) return 0;
+  struct stat st;
+  fflush(handle->fp);
+  if (fstat(fileno(handle->fp), &st) != 0) return 0;
+  return (size_t)st.st_size;
+}
+
+time_t File::getLastWrite() {
+  if (!handle || !handle->fp) return 0;
+  struct stat st;
+  fflush(handle->fp);
+  if (fstat(fileno(handle->fp), &st) != 0) return 0;
+  return st.st_mtime;
+}
+
+void File::close() {
+  if (handle && handle->fp) {
+    fclose(handle->fp);
+    handle->fp = nullptr;
+  }
+  handle.reset();
+}
+
+const char* File::name() const {
+  return handle ? handle->leafName.c_str() : "";
+}
+
+const char* File::path() const {
+  return handle ? handle->cardPath.c_str() : "";
+}
+
+bool File::isDirectory() const {
+  return handle && handle->directory;
+}
+
+File File::openNextFile(const char* mode) {
+  if (!handle || !handle->directory) return File();
+  if (handle->nextEntry >= handle->entries.size()) return File();
+
+  std::string child = handle->cardPath;
+  if (child.empty() || child.back() != '/') child += "/";
+  child += handle->entries[handle->nextEntry++];
+  return SD.open(child.c_str(), mode);
+}
+
+void File::rewindDirectory() {
+  if (handle) handle->nextEntry = 0;
+}
+
+File::operator bool() const {
+  return handle && (handle->fp || handle->directory);
+}
@@ -0,0 +1,276 @@
+/*
+ * DriftRiff Mini - Host Simulator Entry Point
+ *
+ * Runs the unmodified setup()/loop() from driftone_main.cpp against the
+ * host HAL. With the default virtual clock every loop() pass advances time
+ * by one audio sample period, so runs are fast and repeatable. A log the
+ * firmware recorded (inputlog.h) can be replayed in place of the live
+ * inputs, reproducing that session's audio, draw calls and final
+ * sequencer state. With --threads
+ * the audio and UI steps run on their own threads, as they do on the
+ * device's two cores, against the wall clock.
+ */
+
+#include <Arduino.h>
+#include <stdio.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <vector>
+
+#include "hostsim.h"
+#include "audioengine.h"
+#include "inputlog.h"
+#include "patternbank.h"
+#include "tasks.h"
+
+void setup();
+void loop();
+
+extern Sequencer sequencer;
+extern PatternBank patternBank;
+extern InputLog inputLog;
+extern Task audioTask;
+extern Task uiTask;
+
+static void usage(const char* argv0) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  --sd DIR         Directory used as the SD card root (default: sdcard)\n"
+          "  --seconds N      Simulated run length (default: 10)\n"
+          "  --wav FILE       Write the PWM audio output to an 8-bit WAV file\n"
+          "  --ppm FILE       Dump the display framebuffer when the run ends\n"
+          "  --draw-log FILE  Write every draw call reaching the display to a text file\n"
+          "  --state FILE     Write the sequencer state when the run ends, for comparing runs\n"
+          "  --touch FILE     Replay a touch script (start_ms duration_ms x y [z])\n"
+          "  --midi-in PATH   Read the MIDI port (Serial2) from a file, FIFO or pty\n"
+          "  --midi-out PATH  Write MIDI port output to a file, FIFO or pty\n"
+          "  --audio-in FILE  Feed a WAV file to the recorder's ADC input\n"
+          "  --serial-pty     Put the console port (Serial) on a new pty, for driftone_link\n"
+          "  --replay FILE    Replay an input log (inputs.log from the card) instead of live input\n"
+          "  --quantum-us N   Virtual time per loop() pass (default: one sample period)\n"
+          "  --realtime       Use the wall clock instead of the virtual clock\n"
+          "  --threads        Run the audio and UI tasks on their own threads (needs --realtime)\n",
+          argv0);
+}
+
+// Sequencer state at the end of a run
+struct __attribute__((packed)) SimState {
+  uint32_t playTick;
+  uint32_t editCount;
+  uint32_t randomSeed;
+  uint16_t bpm;
+  uint8_t playing;
+  uint8_t pattern;
+  uint8_t step;
+  uint8_t swing;
+  uint8_t audibleMask;
+  uint8_t fill;
+  uint8_t undoDepth;
+  uint8_t redoDepth;
+};
+
+// Every pattern as the bank has it, resident ones included, then SimState
+static bool writeState(const char* path) {
+  FILE* f = fopen(path, "wb");
+  if (!f) return false;
+
+  static Pattern pattern;
+  bool ok = true;
+  for (int i = 0; i < NUM_PATTERNS && ok; i++) {
+    ok = patternBank.read(i, pattern) && fwrite(&pattern, sizeof(pattern), 1, f) == 1;
+  }
+
+  SimState state;
+  state.playTick = sequencer.getPlayTick();
+  state.editCount = sequencer.getEditCount();
+  state.randomSeed = sequencer.getRandomSeed();
+  state.bpm = sequencer.getBPM();
+  state.playing = sequencer.isPlaying();
+  state.pattern = sequencer.getPatternIndex();
+  state.step = sequencer.getCurrentStep();
+  state.swing = sequencer.getSwing();
+  state.audibleMask = sequencer.getAudibleMask();
+  state.fill = sequencer.isFill();
+  state.undoDepth = sequencer.getUndoDepth();
+  state.redoDepth = sequencer.getRedoDepth();
+  ok = ok && fwrite(&state, sizeof(state), 1, f) == 1;
+  return fclose(f) == 0 && ok;
+}
+
+int main(int argc, char** argv) {
+  const char* sdRoot = "sdcard";
+  const char* wavPath = nullptr;
+  const char* ppmPath = nullptr;
+  const char* touchPath = nullptr;
+  const char* midiInPath = nullptr;
+  const char* midiOutPath = nullptr;
+  const char* audioInPath = nullptr;
+  const char* drawLogPath = nullptr;
+  const char* statePath = nullptr;
+  const char* replayPath = nullptr;
+  double seconds = 10.0;
+  uint32_t quantumMicros = 1000000 / SAMPLE_RATE;
+  bool realtime = false;
+  bool serialPty = false;
+  bool threads = false;
+
+  static const struct option options[] = {
+    {"sd",        required_argument, nullptr, 's'},
+    {"seconds",   required_argument, nullptr, 't'},
+    {"wav",       required_argument, nullptr, 'w'},
+    {"ppm",       required_argument, nullptr, 'p'},
+    {"draw-log",  required_argument, nullptr, 'd'},
+    {"state",     required_argument, nullptr, 'S'},
+    {"touch",     required_argument, nullptr, 'i'},
+    {"midi-in",   required_argument, nullptr, 'm'},
+    {"midi-out",  required_argument, nullptr, 'o'},
+    {"audio-in",  required_argument, nullptr, 'a'},
+    {"quantum-us", required_argument, nullptr, 'q'},
+    {"realtime",  no_argument,       nullptr, 'r'},
+    {"serial-pty", no_argument,      nullptr, 'y'},
+    {"replay",    required_argument, nullptr, 'l'},
+    {"threads",   no_argument,       nullptr, 'T'},
+    {"help",      no_argument,       nullptr, 'h'},
+    {nullptr, 0, nullptr, 0}
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", options, nullptr)) != -1) {
+    switch (opt) {
+      case 's': sdRoot = optarg; break;
+      case 't': seconds = atof(optarg); break;
+      case 'w': wavPath = optarg; break;
+      case 'p': ppmPath = optarg; break;
+      case 'd': drawLogPath = optarg; break;
+      case 'S': statePath = optarg; break;
+      case 'i': touchPath = optarg; break;
+      case 'm': midiInPath = optarg; break;
+      case 'o': midiOutPath = optarg; break;
+      case 'a': audioInPath = optarg; break;
+      case 'q': quantumMicros = (uint32_t)atoi(optarg); break;
+      case 'r': realtime = true; break;
+      case 'y': serialPty = true; break;
+      case 'l': replayPath = optarg; break;
+      case 'T': threads = true; break;
+      default:
+        usage(argv[0]);
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  // Threads only keep time with a clock that moves by itself, and a replay
+  // needs the one order the steps were recorded in
+  if (threads && (!realtime || replayPath)) {
+    fprintf(stderr, "--threads needs --realtime and cannot replay\n");
+    return 1;
+  }
+  tasksSetThreaded(threads);
+
+  // setup() spins forever on an SD failure, so refuse to start instead
+  struct stat st;
+  if (stat(sdRoot, &st) != 0 || !S_ISDIR(st.st_mode)) {
+    fprintf(stderr, "SD root '%s' is not a directory\n", sdRoot);
+    return 1;
+  }
+  hostSDSetRoot(sdRoot);
+
+  if (touchPath && !hostTouchLoadScript(touchPath)) {
+    fprintf(stderr, "Cannot read touch script '%s'\n", touchPath);
+    return 1;
+  }
+
+  if (midiInPath || midiOutPath) {
+    int inFd = midiInPath ? open(midiInPath, O_RDONLY | O_NONBLOCK) : -1;
+    int outFd = midiOutPath ? open(midiOutPath, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    if ((midiInPath && inFd < 0) || (midiOutPath && outFd < 0)) {
+      fprintf(stderr, "Cannot open MIDI port files\n");
+      return 1;
+    }
+    Serial2.attach(inFd, outFd);
+  }
+
+  if (serialPty) {
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+      fprintf(stderr, "Cannot open a pty\n");
+      return 1;
+    }
+    
+    // Raw, so frames pass untouched and nothing is echoed back
+    struct termios tio;
+    tcgetattr(master, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(master, TCSANOW, &tio);
+    fprintf(stderr, "Serial on %s\n", ptsname(master));
+    Serial.attach(master, master);
+  }
+
+  if (audioInPath && !hostAudioInputOpen(audioInPath)) {
+    fprintf(stderr, "Cannot read WAV input '%s'\n", audioInPath);
+    return 1;
+  }
+
+  // Read whole, the log stays in memory for the run
+  std::vector<uint8_t> replayData;
+  if (replayPath) {
+    FILE* f = fopen(replayPath, "rb");
+    if (f) {
+      uint8_t chunk[4096];
+      size_t n;
+      while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+        replayData.insert(replayData.end(), chunk, chunk + n);
+      }
+      fclose(f);
+    }
+    if (!inputLog.beginReplay(replayData.data(), replayData.size())) {
+      fprintf(stderr, "Cannot replay '%s'\n", replayPath);
+      return 1;
+    }
+  }
+
+  if (drawLogPath && !hostDisplayTraceOpen(drawLogPath)) {
+    fprintf(stderr, "Cannot open '%s' for writing\n", drawLogPath);
+    return 1;
+  }
+
+  hostClockSetMode(realtime ? HOST_CLOCK_REAL : HOST_CLOCK_VIRTUAL);
+  if (quantumMicros == 0) quantumMicros = 1;
+
+  if (wavPath && !hostAudioSinkOpen(wavPath, SAMPLE_RATE)) {
+    fprintf(stderr, "Cannot open '%s' for writing\n", wavPath);
+    return 1;
+  }
+
+  uint64_t endMicros = (uint64_t)(seconds * 1000000.0);
+
+  setup();
+  while (hostClockMicros() < endMicros) {
+    loop();
+    hostClockAdvance(quantumMicros);
+  }
+
+  // UI first, it may be waiting on the audio task for a command
+  uiTask.stop();
+  audioTask.stop();
+
+  // Whatever the recording still holds goes to the card
+  inputLog.close();
+  if (replayPath && !inputLog.isReplayDone()) {
+    fprintf(stderr, "Replay stopped with events left in the log\n");
+  }
+
+  hostAudioSinkClose();
+  hostDisplayTraceClose();
+  if (ppmPath && !hostDisplayDumpPPM(ppmPath)) {
+    fprintf(stderr, "Cannot write '%s'\n", ppmPath);
+    return 1;
+  }
+  if (statePath && !writeState(statePath)) {
+    fprintf(stderr, "Cannot write '%s'\n", statePath);
+    return 1;
+  }
+
+  return 0;
+}
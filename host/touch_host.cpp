@@ -0,0 +1,86 @@
+/*
+ * DriftRiff Mini - Host HAL: Touch Input Implementation
+ *
+ * Touch scripts are text files, one press per line:
+ *   <start_ms> <duration_ms> <raw_x> <raw_y> [pressure]
+ * Lines starting with '#' are ignored. Presses must be in start order.
+ */
+
+#include "TouchScreen.h"
+#include "hostsim.h"
+
+#include <stdio.h>
+#include <vector>
+
+struct ScriptedTouch {
+  uint64_t startMicros;
+  uint64_t endMicros;
+  TSPoint point;
+};
+
+static std::vector<ScriptedTouch> script;
+static size_t scriptCursor = 0;
+static TSPoint manualPoint(0, 0, 0);
+
+bool hostTouchLoadScript(const char* path) {
+  FILE* f = fopen(path, "r");
+  if (!f) return false;
+
+  script.clear();
+  scriptCursor = 0;
+
+  char line[128];
+  while (fgets(line, sizeof(line), f)) {
+    if (line[0] == '#') continue;
+
+    unsigned long start, duration;
+    int x, y, z = 500;
+    if (sscanf(line, "%lu %lu %d %d %d", &start, &duration, &x, &y, &z) >= 4) {
+      ScriptedTouch t;
+      t.startMicros = (uint64_t)start * 1000;
+      t.endMicros = t.startMicros + (uint64_t)duration * 1000;
+      t.point = TSPoint((int16_t)x, (int16_t)y, (int16_t)z);
+      script.push_back(t);
+    }
+  }
+
+  fclose(f);
+  return true;
+}
+
+void hostTouchSet(int16_t rawX, int16_t rawY, int16_t pressure) {
+  manualPoint = TSPoint(rawX, rawY, pressure);
+}
+
+void hostTouchRelease() {
+  manualPoint = TSPoint(0, 0, 0);
+}
+
+TouchScreen::TouchScreen(uint8_t, uint8_t, uint8_t, uint8_t, uint16_t) {
+}
+
+TSPoint TouchScreen::getPoint() {
+  uint64_t now = hostClockMicros();
+
+  // Skip presses that already ended
+  while (scriptCursor < script.size() && script[scriptCursor].endMicros <= now) {
+    scriptCursor++;
+  }
+  if (scriptCursor < script.size() && script[scriptCursor].startMicros <= now) {
+    return script[scriptCursor].point;
+  }
+
+  return manualPoint;
+}
+
+uint16_t TouchScreen::pressure() {
+  return (uint16_t)getPoint().z;
+}
+
+int TouchScreen::readTouchX() {
+  return getPoint().x;
+}
+
+int TouchScreen::readTouchY() {
+  return getPoint().y;
+}
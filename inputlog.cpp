@@ -0,0 +1,367 @@
+/*
+ * DriftRiff Mini - Input Log Implementation
+ */
+
+#include "inputlog.h"
+#include "debuglog.h"
+
+// ---- Encoding ----
+
+static uint8_t putVarint(uint8_t* out, uint32_t value) {
+  uint8_t length = 0;
+  while (value >= 0x80) {
+    out[length++] = (value & 0x7F) | 0x80;
+    value >>= 7;
+  }
+  out[length++] = value;
+  return length;
+}
+
+static bool getVarint(const uint8_t* data, size_t size, size_t& position, uint32_t& value) {
+  value = 0;
+  for (int shift = 0; shift < 35; shift += 7) {
+    if (position >= size) return false;
+    uint8_t byte = data[position++];
+    value |= (uint32_t)(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) return true;
+  }
+  return false;
+}
+
+// Signed values, small either side of zero in few bytes
+static uint8_t putSigned(uint8_t* out, int32_t value) {
+  return putVarint(out, ((uint32_t)value << 1) ^ (uint32_t)(value >> 31));
+}
+
+static bool getSigned(const uint8_t* data, size_t size, size_t& position, int32_t& value) {
+  uint32_t raw;
+  if (!getVarint(data, size, position, raw)) return false;
+  value = (int32_t)(raw >> 1) ^ -(int32_t)(raw & 1);
+  return true;
+}
+
+// ---- Log ----
+
+InputLog::InputLog() {
+  mode = INPUT_LOG_OFF;
+  passTime = 0;
+  bufferLength = 0;
+  lastTime = 0;
+  lastFlushTime = 0;
+  full = false;
+  recordedBytes = 0;
+  stageOverflow.store(false);
+  replayData = nullptr;
+  replaySize = 0;
+  replayPosition = 0;
+  eventReady = false;
+  memset(&next, 0, sizeof(next));
+  memset(&replayHeader, 0, sizeof(replayHeader));
+}
+
+void InputLog::beginRecording(ProjectStore& project, bool loaded) {
+  if (mode != INPUT_LOG_OFF) return;
+  
+  // Only the latest session is kept, and the first save keeps its project
+  SD.remove(INPUT_LOG_PROJECT_PATH);
+  SD.remove(INPUT_LOG_PATH);
+  project.keepBootProject(INPUT_LOG_PROJECT_PATH);
+  
+  file = SD.open(INPUT_LOG_PATH, FILE_WRITE);
+  if (!file) {
+    LOG_WARN("Input log: cannot create ", INPUT_LOG_PATH);
+    return;
+  }
+  
+  InputLogHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = INPUT_LOG_MAGIC;
+  header.version = INPUT_LOG_VERSION;
+  header.headerSize = sizeof(InputLogHeader);
+  header.projectCrc = loaded ? project.getLoadedCrc() : 0;
+  header.projectLoaded = loaded;
+  if (file.write((const uint8_t*)&header, sizeof(header)) != sizeof(header)) {
+    LOG_WARN("Input log: write failed");
+    file.close();
+    return;
+  }
+  
+  mode = INPUT_LOG_RECORD;
+  bufferLength = 0;
+  lastTime = 0;
+  lastFlushTime = millis();
+  full = false;
+  recordedBytes = sizeof(header);
+  lastTouch = TSPoint(0, 0, 0);
+  consoleOutput().println("Input log recording");
+}
+
+bool InputLog::beginReplay(const uint8_t* data, size_t size) {
+  if (!data || size < sizeof(InputLogHeader)) return false;
+  
+  memcpy(&replayHeader, data, sizeof(replayHeader));
+  if (replayHeader.magic != INPUT_LOG_MAGIC || replayHeader.version != INPUT_LOG_VERSION ||
+      replayHeader.headerSize != sizeof(InputLogHeader)) {
+    return false;
+  }
+  
+  mode = INPUT_LOG_REPLAY;
+  replayData = data;
+  replaySize = size;
+  replayPosition = sizeof(InputLogHeader);
+  next.time = 0;
+  replayTouch = TSPoint(0, 0, 0);
+  decodeNext();
+  return true;
+}
+
+bool InputLog::restoreProject(ProjectStore& project) {
+  // The recording's boot project was moved aside by its first save, if any
+  const char* path = nullptr;
+  if (replayHeader.projectLoaded) {
+    path = SD.exists(INPUT_LOG_PROJECT_PATH) ? INPUT_LOG_PROJECT_PATH : PROJECT_PATH;
+  }
+  bool loaded = project.load(path);
+  
+  if (loaded != (replayHeader.projectLoaded != 0) ||
+      (loaded && project.getLoadedCrc() != replayHeader.projectCrc)) {
+    LOG_WARN("Replay: project differs from the recording, output will too");
+    return false;
+  }
+  return true;
+}
+
+void InputLog::beginPass(uint32_t now) {
+  passTime = now;
+  
+  // What the audio task received since the last pass, as if seen in this one
+  StagedMidiByte staged;
+  while (stagedMidi.pop(staged)) {
+    logMidi(staged.data, staged.timestamp);
+  }
+  if (stageOverflow.load() && !full) {
+    full = true;
+    LOG_WARN("Input log: MIDI bytes lost, recording stopped");
+  }
+}
+
+void InputLog::record(uint8_t type, const uint8_t* fields, uint8_t length) {
+  if (mode != INPUT_LOG_RECORD || full) return;
+  
+  uint8_t event[INPUT_LOG_MAX_EVENT];
+  uint8_t size = 0;
+  if (passTime == lastTime) {
+    event[size++] = type | INPUT_SAME_PASS;
+  } else {
+    event[size++] = type;
+    size += putVarint(event + size, passTime - lastTime);
+  }
+  memcpy(event + size, fields, length);
+  size += length;
+  
+  // Events after a lost one would replay out of context, so stop here
+  if (bufferLength + size > INPUT_LOG_BUFFER) {
+    full = true;
+    LOG_WARN("Input log full, recording stopped");
+    return;
+  }
+  memcpy(buffer + bufferLength, event, size);
+  bufferLength += size;
+  lastTime = passTime;
+}
+
+TSPoint InputLog::touch(TSPoint point) {
+  if (mode == INPUT_LOG_REPLAY) {
+    // At most one reading per pass, as the panel gives
+    InputEvent event;
+    if (takeEvent(INPUT_TOUCH, event)) {
+      replayTouch = TSPoint(event.x, event.y, event.z);
+    } else if (takeEvent(INPUT_RELEASE, event)) {
+      replayTouch = TSPoint(0, 0, 0);
+    }
+    return replayTouch;
+  }
+  
+  if (mode == INPUT_LOG_RECORD) {
+    // Position wanders with nothing pressing, only the release matters
+    if (point.z == 0) {
+      if (lastTouch.z != 0) record(INPUT_RELEASE, nullptr, 0);
+    } else if (point != lastTouch) {
+      uint8_t fields[9];
+      uint8_t length = putSigned(fields, point.x);
+      length += putSigned(fields + length, point.y);
+      length += putSigned(fields + length, point.z);
+      record(INPUT_TOUCH, fields, length);
+    }
+    lastTouch = point;
+  }
+  return point;
+}
+
+void InputLog::recordSerial(uint8_t data) {
+  record(INPUT_SERIAL, &data, 1);
+}
+
+int InputLog::replaySerial() {
+  InputEvent event;
+  if (!takeEvent(INPUT_SERIAL, event)) return -1;
+  return event.data;
+}
+
+void InputLog::recordMidi(uint8_t data, uint32_t timestamp) {
+  if (mode != INPUT_LOG_RECORD) return;
+  
+  // The log belongs to the UI task, another task leaves the byte for it
+  if (!onUiTask()) {
+    StagedMidiByte staged = {data, timestamp};
+    if (!stagedMidi.push(staged)) {
+      stageOverflow.store(true);
+    }
+    return;
+  }
+  logMidi(data, timestamp);
+}
+
+void InputLog::logMidi(uint8_t data, uint32_t timestamp) {
+  uint8_t fields[6];
+  fields[0] = data;
+  uint8_t length = 1 + putSigned(fields + 1, (int32_t)(passTime - timestamp));
+  record(INPUT_MIDI, fields, length);
+}
+
+bool InputLog::replayMidi(uint8_t& data, uint32_t& timestamp) {
+  InputEvent event;
+  if (!takeEvent(INPUT_MIDI, event)) return false;
+  data = event.data;
+  timestamp = event.time - event.age;
+  return true;
+}
+
+bool InputLog::updateLoader(SDLoader& loader) {
+  if (mode != INPUT_LOG_REPLAY) {
+    int slot = loader.getStreamSlot();
+    bool busy = loader.update();
+    if (slot >= 0 && loader.getStreamSlot() != slot) {
+      uint8_t finished = slot;
+      record(INPUT_SAMPLE_LOADED, &finished, 1);
+    }
+    return busy;
+  }
+  
+  // Only the wrap-up after the last slot is left, nothing to hold back
+  if (!loader.isLoading()) {
+    return loader.update();
+  }
+  
+  // Otherwise nothing lands until the pass the recording finished a slot
+  // in, and then that slot is read in full
+  InputEvent event;
+  bool finished = false;
+  while (takeEvent(INPUT_SAMPLE_LOADED, event)) {
+    while (true) {
+      int slot = loader.getStreamSlot();
+      if (!loader.update()) break;
+      if (slot == event.data && loader.getStreamSlot() != slot) break;
+    }
+    finished = true;
+  }
+  
+  // The next slot is opened the pass after, as the recording opened it,
+  // so it shows as loading for as long as it did
+  if (!finished && loader.getStreamSlot() < 0) {
+    return loader.update();
+  }
+  return true;
+}
+
+bool InputLog::flush(unsigned long now) {
+  if (mode != INPUT_LOG_RECORD || bufferLength == 0) return false;
+  
+  // Full chunks as they fill, a short one at most INPUT_LOG_FLUSH_MS late
+  if (bufferLength < INPUT_LOG_CHUNK && now - lastFlushTime < INPUT_LOG_FLUSH_MS) return false;
+  
+  writeChunk(min(bufferLength, (uint16_t)INPUT_LOG_CHUNK));
+  lastFlushTime = now;
+  return true;
+}
+
+void InputLog::writeChunk(uint16_t length) {
+  bool ok = file.write(buffer, length) == length;
+  
+  // Flushed every time, so the log survives the power being pulled
+  file.flush();
+  
+  if (!ok) {
+    LOG_WARN("Input log write failed, recording stopped");
+    file.close();
+    mode = INPUT_LOG_OFF;
+    bufferLength = 0;
+    return;
+  }
+  recordedBytes += length;
+  bufferLength -= length;
+  memmove(buffer, buffer + length, bufferLength);
+}
+
+void InputLog::close() {
+  if (mode != INPUT_LOG_RECORD) return;
+  
+  while (bufferLength > 0 && mode == INPUT_LOG_RECORD) {
+    writeChunk(min(bufferLength, (uint16_t)INPUT_LOG_CHUNK));
+  }
+  if (file) {
+    file.close();
+  }
+  mode = INPUT_LOG_OFF;
+}
+
+// ---- Replay ----
+
+bool InputLog::decodeNext() {
+  eventReady = false;
+  if (replayPosition >= replaySize) return false;
+  
+  size_t position = replayPosition;
+  uint8_t type = replayData[position++];
+  uint32_t delta = 0;
+  if (!(type & INPUT_SAME_PASS) && !getVarint(replayData, replaySize, position, delta)) {
+    LOG_WARN("Replay: log cut short at byte ", (uint32_t)replayPosition);
+    return false;
+  }
+  type &= ~INPUT_SAME_PASS;
+  
+  bool ok = true;
+  int32_t value;
+  if (type == INPUT_TOUCH) {
+    ok = getSigned(replayData, replaySize, position, value);
+    next.x = value;
+    ok = ok && getSigned(replayData, replaySize, position, value);
+    next.y = value;
+    ok = ok && getSigned(replayData, replaySize, position, value);
+    next.z = value;
+  } else if (type == INPUT_SERIAL || type == INPUT_SAMPLE_LOADED || type == INPUT_MIDI) {
+    ok = position < replaySize;
+    if (ok) next.data = replayData[position++];
+    if (ok && type == INPUT_MIDI) ok = getSigned(replayData, replaySize, position, next.age);
+  } else if (type != INPUT_RELEASE) {
+    ok = false;
+  }
+  
+  if (!ok) {
+    LOG_WARN("Replay: log damaged at byte ", (uint32_t)replayPosition);
+    return false;
+  }
+  next.type = type;
+  next.time += delta;
+  replayPosition = position;
+  eventReady = true;
+  return true;
+}
+
+bool InputLog::takeEvent(uint8_t type, InputEvent& event) {
+  // Events come back in recorded order, each hook taking its own when due
+  if (!eventReady || next.type != type || (int32_t)(passTime - next.time) < 0) return false;
+  event = next;
+  decodeNext();
+  return true;
+}
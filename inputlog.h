@@ -0,0 +1,159 @@
+/*
+ * DriftRiff Mini - Input Log Header
+ *
+ * Records everything that reaches the firmware from outside during a
+ * session: touch readings, console and link bytes, MIDI clock and
+ * transport bytes with their arrival times, and the passes in which
+ * background sample loads finished. Events carry the micros() time of the
+ * loop() pass that saw them. Replaying the log on the host simulator's
+ * virtual clock, against the same card, puts every input into the same
+ * pass again, so audio and display output repeat exactly and a glitch
+ * from the field becomes a deterministic regression.
+ *
+ * Log layout, little endian:
+ *   InputLogHeader
+ *   events: type byte, pass time delta (varint, left out when the type has
+ *           INPUT_SAME_PASS set), then the fields of the type
+ * The first save of a recorded session moves the project it booted with
+ * to INPUT_LOG_PROJECT_PATH, so a replay can start from it.
+ */
+
+#ifndef INPUTLOG_H
+#define INPUTLOG_H
+
+#include <Arduino.h>
+#include <SD.h>
+#include <TouchScreen.h>
+#include "sdloader.h"
+#include "project.h"
+#include "tasks.h"
+
+// Record every session unless built with DRIFTONE_INPUT_LOG=0
+#ifndef DRIFTONE_INPUT_LOG
+#define DRIFTONE_INPUT_LOG 1
+#endif
+
+#define INPUT_LOG_PATH          "/inputs.log"
+#define INPUT_LOG_PROJECT_PATH  "/inputs.prj"
+#define INPUT_LOG_MAGIC         0x4C495244    // "DRIL"
+#define INPUT_LOG_VERSION       1
+#define INPUT_LOG_BUFFER        2048          // Events waiting for the card
+#define INPUT_LOG_CHUNK         512           // Bytes written per flush() call
+#define INPUT_LOG_FLUSH_MS      1000          // Longest a short chunk waits for the card
+#define INPUT_LOG_MAX_EVENT     16
+#define INPUT_LOG_MIDI_STAGE    64            // MIDI bytes from the audio task awaiting the UI pass
+
+// Event types, INPUT_SAME_PASS or'd in when the time is unchanged
+enum InputEventType {
+  INPUT_TOUCH = 1,            // x, y, z as read from the panel
+  INPUT_RELEASE,              // Pressure back to zero
+  INPUT_SERIAL,               // Byte from the console port
+  INPUT_MIDI,                 // Byte from the MIDI port, its arrival before the pass
+  INPUT_SAMPLE_LOADED         // Slot whose background load finished
+};
+
+#define INPUT_SAME_PASS 0x80
+
+enum InputLogMode {
+  INPUT_LOG_OFF,
+  INPUT_LOG_RECORD,
+  INPUT_LOG_REPLAY
+};
+
+struct InputLogHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t headerSize;
+  uint32_t projectCrc;        // Payload CRC of the project booted with
+  uint8_t projectLoaded;      // 0 when the session started from the default pattern
+  uint8_t reserved[3];
+};
+
+// A MIDI byte the audio task saw, logged by the next UI pass
+struct StagedMidiByte {
+  uint8_t data;
+  uint32_t timestamp;
+};
+
+// One decoded event
+struct InputEvent {
+  uint8_t type;
+  uint32_t time;              // micros() at the start of the pass
+  int16_t x, y, z;
+  uint8_t data;               // Serial or MIDI byte, or sample slot
+  int32_t age;                // MIDI arrival, microseconds before the pass
+};
+
+class InputLog {
+private:
+  uint8_t mode;
+  uint32_t passTime;
+  
+  // Recording, events buffered until the loop has time for the card
+  File file;
+  uint8_t buffer[INPUT_LOG_BUFFER];
+  uint16_t bufferLength;
+  uint32_t lastTime;          // Pass of the last event recorded
+  unsigned long lastFlushTime;
+  bool full;                  // An event was lost, nothing more is kept
+  TSPoint lastTouch;
+  uint32_t recordedBytes;
+  SpscQueue<StagedMidiByte, INPUT_LOG_MIDI_STAGE> stagedMidi;
+  std::atomic<bool> stageOverflow;
+  
+  // Replay
+  const uint8_t* replayData;
+  size_t replaySize;
+  size_t replayPosition;
+  InputEvent next;
+  bool eventReady;
+  TSPoint replayTouch;
+  InputLogHeader replayHeader;
+  
+  void record(uint8_t type, const uint8_t* fields, uint8_t length);
+  void logMidi(uint8_t data, uint32_t timestamp);
+  void writeChunk(uint16_t length);
+  bool decodeNext();
+  bool takeEvent(uint8_t type, InputEvent& event);
+  
+public:
+  InputLog();
+  
+  // Start a new log for this session, after the project has loaded.
+  // loaded is what ProjectStore::load() returned.
+  void beginRecording(ProjectStore& project, bool loaded);
+  
+  // Feed a log back instead of the live inputs, call before setup().
+  // The data stays owned by the caller.
+  bool beginReplay(const uint8_t* data, size_t size);
+  
+  // Restore the project the recording booted with
+  bool restoreProject(ProjectStore& project);
+  
+  // Start of each loop() pass, or UI task pass with the tasks running
+  void beginPass(uint32_t now);
+  
+  // Hooks for each input, recording it or substituting the logged one
+  TSPoint touch(TSPoint point);
+  void recordSerial(uint8_t data);
+  int replaySerial();
+  void recordMidi(uint8_t data, uint32_t timestamp);
+  bool replayMidi(uint8_t& data, uint32_t& timestamp);
+  
+  // Background sample loading in place of SDLoader::update(). A replay
+  // finishes loads in the passes the recording did, whatever the card.
+  bool updateLoader(SDLoader& loader);
+  
+  // Write at most one chunk to the card, false when there was nothing to do
+  bool flush(unsigned long now);
+  
+  // Write out everything buffered and close the file
+  void close();
+  
+  bool isRecording() { return mode == INPUT_LOG_RECORD; }
+  bool isReplaying() { return mode == INPUT_LOG_REPLAY; }
+  bool isReplayDone() { return mode == INPUT_LOG_REPLAY && !eventReady; }
+  uint32_t getRecordedBytes() { return recordedBytes; }
+};
+
+#endif
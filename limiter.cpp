@@ -0,0 +1,91 @@
+/*
+ * DriftRiff Mini - Master Limiter Implementation
+ */
+
+#include "limiter.h"
+
+Limiter::Limiter() {
+  reset();
+}
+
+void Limiter::reset() {
+  for (int i = 0; i < LIMITER_LOOKAHEAD; i++) {
+    delay[i] = 0;
+    history[i] = ENV_LEVEL_FULL;
+  }
+  frame = 0;
+  peakHead = 0;
+  peakTail = 0;
+  released = ENV_LEVEL_FULL;
+  historySum = ENV_LEVEL_FULL * LIMITER_LOOKAHEAD;
+  minGain = ENV_LEVEL_FULL;
+}
+
+void Limiter::process(int16_t* buffer, int frames) {
+  // Nothing loud in the window or the block and the gain back at unity,
+  // the block only has to go through the delay
+  if (peakHead == peakTail && historySum == ENV_LEVEL_FULL * LIMITER_LOOKAHEAD) {
+    int16_t loudest = 0;
+    for (int i = 0; i < frames; i++) {
+      loudest = max(loudest, (int16_t)abs(buffer[i]));
+    }
+    if (loudest <= LIMITER_CEILING) {
+      for (int i = 0; i < frames; i++) {
+        uint8_t slot = (frame + i) % LIMITER_LOOKAHEAD;
+        int16_t delayed = delay[slot];
+        delay[slot] = buffer[i];
+        buffer[i] = delayed;
+      }
+      frame += frames;
+      return;
+    }
+  }
+  
+  for (int i = 0; i < frames; i++) {
+    int16_t input = buffer[i];
+    uint16_t level = abs(input);
+    
+    // Only frames over the ceiling need any gain. Anything no louder than
+    // the new frame can never be the maximum again.
+    if (level > LIMITER_CEILING) {
+      while (peakTail != peakHead && peakLevels[(peakTail - 1) % LIMITER_WINDOW] <= level) {
+        peakTail--;
+      }
+      peakFrames[peakTail % LIMITER_WINDOW] = frame;
+      peakLevels[peakTail % LIMITER_WINDOW] = level;
+      peakTail++;
+    }
+    
+    // The window holds this frame and the LIMITER_LOOKAHEAD still in the delay
+    int32_t required = ENV_LEVEL_FULL;
+    if (peakTail != peakHead) {
+      if (frame - peakFrames[peakHead % LIMITER_WINDOW] > LIMITER_LOOKAHEAD) {
+        peakHead++;
+      }
+      if (peakTail != peakHead) {
+        required = (LIMITER_CEILING << ENV_LEVEL_BITS) / peakLevels[peakHead % LIMITER_WINDOW];
+      }
+    }
+    
+    // Straight down, back up slowly; the +1 makes it reach unity
+    released += ((ENV_LEVEL_FULL - released) >> LIMITER_RELEASE_SHIFT) + 1;
+    if (released > required) released = required;
+    
+    uint8_t slot = frame % LIMITER_LOOKAHEAD;
+    historySum += released - history[slot];
+    history[slot] = released;
+    int32_t gain = historySum >> LIMITER_LOOKAHEAD_BITS;
+    if (gain < minGain) minGain = gain;
+    
+    int16_t delayed = delay[slot];
+    delay[slot] = input;
+    buffer[i] = gain >= ENV_LEVEL_FULL ? delayed : (int16_t)((delayed * gain) >> ENV_LEVEL_BITS);
+    frame++;
+  }
+}
+
+int32_t Limiter::takeMinGain() {
+  int32_t gain = minGain;
+  minGain = ENV_LEVEL_FULL;
+  return gain;
+}
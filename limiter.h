@@ -0,0 +1,55 @@
+/*
+ * DriftRiff Mini - Master Limiter Header
+ *
+ * Peak limiter on the mixed bus, run once per block in place of hard
+ * clipping. The output is delayed by LIMITER_LOOKAHEAD frames so the gain
+ * can come down smoothly before a peak arrives: the gain each peak needs
+ * is held for the whole look-ahead window (a sliding maximum), released
+ * exponentially, then averaged over the window. Every gain that average
+ * takes in was low enough for the peak leaving the delay, so the output
+ * never goes past full scale.
+ */
+
+#ifndef LIMITER_H
+#define LIMITER_H
+
+#include <Arduino.h>
+#include "envelope.h"
+
+#define LIMITER_LOOKAHEAD       64    // Frames of delay, 2.9 ms, a power of two
+#define LIMITER_LOOKAHEAD_BITS  6
+#define LIMITER_WINDOW          128   // Ring for the sliding maximum, above LIMITER_LOOKAHEAD
+#define LIMITER_CEILING         127   // Largest level out, either side of the centre
+#define LIMITER_RELEASE_SHIFT   9     // Release time constant of 512 frames, 23 ms
+
+class Limiter {
+private:
+  int16_t delay[LIMITER_LOOKAHEAD];
+  uint32_t frame;             // Frames processed, indexes the rings
+  
+  // Sliding maximum of |input| over the look-ahead: frames over the
+  // ceiling kept with levels in decreasing order, the oldest at the head
+  uint32_t peakFrames[LIMITER_WINDOW];
+  uint16_t peakLevels[LIMITER_WINDOW];
+  uint32_t peakHead;
+  uint32_t peakTail;
+  
+  int32_t released;           // Required gain after release, Q15
+  int32_t history[LIMITER_LOOKAHEAD];
+  int32_t historySum;         // Of history, the averaged gain times LIMITER_LOOKAHEAD
+  int32_t minGain;            // Lowest gain applied since the last read
+  
+public:
+  Limiter();
+  
+  void reset();
+  
+  // Limit a block of the mix in place, centred on zero. What comes out is
+  // what went in LIMITER_LOOKAHEAD frames earlier.
+  void process(int16_t* buffer, int frames);
+  
+  // Deepest gain reduction since the last call, Q15 (ENV_LEVEL_FULL = none)
+  int32_t takeMinGain();
+};
+
+#endif
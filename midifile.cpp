@@ -0,0 +1,597 @@
+/*
+ * DriftRiff Mini - MIDI File Implementation
+ */
+
+#include "midifile.h"
+#include "debuglog.h"
+#include "profiler.h"
+
+// Meta events
+#define META_TRACK_NAME     0x03
+#define META_MARKER         0x06
+#define META_END_OF_TRACK   0x2F
+#define META_TEMPO          0x51
+#define META_TIME_SIGNATURE 0x58
+#define META_SEQUENCER      0x7F
+
+// Sequencer-specific meta event, one per pattern in order: the
+// non-commercial manufacturer ID, "DR", a version, the pattern's start in
+// master ticks (big endian) and each track's length, rate and direction
+#define DEVICE_META_ID      0x7D
+#define DEVICE_META_VERSION 1
+#define DEVICE_META_LENGTH  (8 + NUM_TRACKS * 3)
+
+// Write order at one tick, so a pattern's marker leads and a note ends
+// before the next one on the same key starts
+#define EVENT_MARKER        0
+#define EVENT_NOTE_OFF      1
+#define EVENT_NOTE_ON       2
+
+// Kick, snare, closed hat, clap, low tom, high tom
+static const uint8_t trackNotes[NUM_TRACKS] = {36, 38, 42, 39, 45, 50};
+
+// Other GM drum notes and the track they land on
+static const uint8_t noteAliases[][2] = {
+  {35, 0}, {37, 1}, {40, 1}, {44, 2}, {46, 2}, {41, 4}, {43, 4}, {47, 5}, {48, 5}
+};
+
+MidiFile::MidiFile() {
+  bufferLength = 0;
+  bufferPosition = 0;
+  failed = false;
+  eventCount = 0;
+  trackStart = 0;
+  lastTick = 0;
+  runningStatus = 0;
+  chunkLeft = 0;
+  division = MIDIFILE_PPQN;
+  declared = 0;
+  importCount = 0;
+  prepared = 0;
+}
+
+int MidiFile::trackForNote(uint8_t note) {
+  for (int track = 0; track < NUM_TRACKS; track++) {
+    if (trackNotes[track] == note) return track;
+  }
+  for (size_t i = 0; i < sizeof(noteAliases) / sizeof(noteAliases[0]); i++) {
+    if (noteAliases[i][0] == note) return noteAliases[i][1];
+  }
+  return -1;
+}
+
+uint8_t MidiFile::noteForTrack(int track) {
+  return trackNotes[constrain(track, 0, NUM_TRACKS - 1)];
+}
+
+uint32_t MidiFile::patternTicks(const Pattern& pattern) {
+  uint32_t ticks = TICKS_PER_STEP;
+  for (int track = 0; track < NUM_TRACKS; track++) {
+    const TrackSettings& settings = pattern.tracks[track];
+    ticks = max(ticks, (uint32_t)settings.length * Sequencer::ticksPerTrackStep(settings.rate));
+  }
+  return ticks;
+}
+
+// ---- Export ----
+
+bool MidiFile::exportPatterns(const char* path, PatternBank& bank, int first, int count, uint8_t format,
+                              uint16_t bpm) {
+  if (first < 0 || count < 1 || first + count > NUM_PATTERNS || format > MIDIFILE_MULTI_TRACK) return false;
+  
+  PROF_SCOPE(PROF_SD_IO);
+  SD.remove(path);
+  file = SD.open(path, FILE_WRITE);
+  if (!file) return false;
+  
+  bufferLength = 0;
+  failed = false;
+  eventCount = 0;
+  
+  // Patterns follow one another, each as long as its longest track
+  uint32_t starts[NUM_PATTERNS + 1];
+  starts[0] = 0;
+  for (int i = 0; i < count; i++) {
+    if (!bank.read(first + i, exportPattern)) failed = true;
+    starts[i + 1] = starts[i] + patternTicks(exportPattern);
+  }
+  
+  uint16_t tracks = format == MIDIFILE_SINGLE_TRACK ? 1 : 1 + NUM_TRACKS;
+  const uint8_t header[14] = {
+    'M', 'T', 'h', 'd', 0, 0, 0, 6,
+    0, format, (uint8_t)(tracks >> 8), (uint8_t)tracks, MIDIFILE_PPQN >> 8, MIDIFILE_PPQN & 0xFF
+  };
+  writeBytes(header, sizeof(header));
+  
+  beginTrack();
+  writeConductor(bank, first, count, starts, bpm);
+  if (format == MIDIFILE_SINGLE_TRACK) {
+    writeNotes(bank, first, count, starts, ALL_TRACKS_MASK, true);
+    endTrack();
+  } else {
+    writeNotes(bank, first, count, starts, 0, true);
+    endTrack();
+    for (int track = 0; track < NUM_TRACKS; track++) {
+      char name[12];
+      snprintf(name, sizeof(name), "Track %d", track + 1);
+      beginTrack();
+      writeMeta(0, META_TRACK_NAME, (const uint8_t*)name, strlen(name));
+      writeNotes(bank, first, count, starts, 1 << track, false);
+      endTrack();
+    }
+  }
+  
+  flushBuffer();
+  file.close();
+  if (failed) {
+    LOG_WARN("MIDI export failed: card error");
+    SD.remove(path);
+    return false;
+  }
+  return true;
+}
+
+void MidiFile::writeConductor(PatternBank& bank, int first, int count, const uint32_t* starts, uint16_t bpm) {
+  const char* name = "DriftRiff Mini";
+  writeMeta(0, META_TRACK_NAME, (const uint8_t*)name, strlen(name));
+  
+  uint32_t tempo = 60000000UL / constrain(bpm, (uint16_t)MIN_SYNC_BPM, (uint16_t)MAX_SYNC_BPM);
+  const uint8_t tempoData[3] = {(uint8_t)(tempo >> 16), (uint8_t)(tempo >> 8), (uint8_t)tempo};
+  writeMeta(0, META_TEMPO, tempoData, sizeof(tempoData));
+  
+  const uint8_t signature[4] = {4, 2, 24, 8};   // 4/4
+  writeMeta(0, META_TIME_SIGNATURE, signature, sizeof(signature));
+  
+  // Every pattern's layout up front, so a reader knows where each starts
+  // before any note arrives, whichever track it is in
+  for (int i = 0; i < count; i++) {
+    if (!bank.read(first + i, exportPattern)) failed = true;
+    uint8_t data[DEVICE_META_LENGTH] = {
+      DEVICE_META_ID, 'D', 'R', DEVICE_META_VERSION,
+      (uint8_t)(starts[i] >> 24), (uint8_t)(starts[i] >> 16), (uint8_t)(starts[i] >> 8), (uint8_t)starts[i]
+    };
+    for (int track = 0; track < NUM_TRACKS; track++) {
+      data[8 + track * 3] = exportPattern.tracks[track].length;
+      data[9 + track * 3] = exportPattern.tracks[track].rate;
+      data[10 + track * 3] = exportPattern.tracks[track].direction;
+    }
+    writeMeta(0, META_SEQUENCER, data, sizeof(data));
+  }
+}
+
+void MidiFile::writeNotes(PatternBank& bank, int first, int count, const uint32_t* starts, uint8_t trackMask,
+                          bool markers) {
+  for (int i = 0; i < count; i++) {
+    if (trackMask && !bank.read(first + i, exportPattern)) failed = true;
+    if (markers) {
+      queueEvent(starts[i], EVENT_MARKER, i, 0);
+    }
+    
+    // Each track once round in step order, at its rate, whatever its
+    // direction; the direction comes back from the meta event
+    for (int track = 0; track < NUM_TRACKS; track++) {
+      if (!(trackMask & (1 << track)) || !exportPattern.steps[track]) continue;
+      
+      uint8_t note = trackNotes[track];
+      uint16_t trackTicks = Sequencer::ticksPerTrackStep(exportPattern.tracks[track].rate);
+      uint32_t gate = min(trackTicks / 2, MIDIFILE_MAX_GATE);
+      for (int step = 0; step < exportPattern.tracks[track].length; step++) {
+        if (!(exportPattern.steps[track] & ((uint64_t)1 << step))) continue;
+        
+        // A hit pulled early on the very first step starts the file instead
+        int32_t tick = (int32_t)(starts[i] + step * trackTicks) + exportPattern.microTiming[track][step];
+        tick = max(tick, (int32_t)0);
+        
+        // Velocity 0 would read as a note off, the quietest a note can be is 1
+        uint8_t velocity = max(Sequencer::stepVelocity(exportPattern, track, step), (uint8_t)1);
+        queueEvent(tick, EVENT_NOTE_ON, note, velocity);
+        queueEvent(tick + gate, EVENT_NOTE_OFF, note, 0);
+      }
+    }
+    
+    // Nothing from a later pattern can sound before its first step pulled
+    // fully early
+    uint32_t next = starts[i + 1];
+    flushEvents(next > MAX_MICRO_OFFSET ? next - MAX_MICRO_OFFSET : 0);
+  }
+  flushEvents(UINT32_MAX);
+}
+
+void MidiFile::queueEvent(uint32_t tick, uint8_t kind, uint8_t data, uint8_t velocity) {
+  // Sized for a pattern and its carry, this is only a backstop
+  if (eventCount == MIDIFILE_MAX_EVENTS) {
+    writeEvent(events[0]);
+    memmove(events, events + 1, --eventCount * sizeof(Event));
+  }
+  
+  // Insertion from the back, steps mostly arrive in time order
+  int i = eventCount;
+  while (i > 0 && (events[i - 1].tick > tick || (events[i - 1].tick == tick && events[i - 1].kind > kind))) {
+    events[i] = events[i - 1];
+    i--;
+  }
+  events[i].tick = tick;
+  events[i].kind = kind;
+  events[i].data = data;
+  events[i].velocity = velocity;
+  eventCount++;
+}
+
+void MidiFile::flushEvents(uint32_t before) {
+  uint16_t written = 0;
+  while (written < eventCount && events[written].tick < before) {
+    writeEvent(events[written++]);
+  }
+  eventCount -= written;
+  memmove(events, events + written, eventCount * sizeof(Event));
+}
+
+void MidiFile::writeEvent(const Event& event) {
+  if (event.kind == EVENT_MARKER) {
+    char text[16];
+    snprintf(text, sizeof(text), "Pattern %d", event.data + 1);
+    writeMeta(event.tick, META_MARKER, (const uint8_t*)text, strlen(text));
+    return;
+  }
+  
+  // Note offs are note ons at velocity 0, so a whole track runs on one
+  // status byte
+  writeVarLength(event.tick - lastTick);
+  lastTick = event.tick;
+  uint8_t status = 0x90 | MIDIFILE_CHANNEL;
+  if (status != runningStatus) {
+    writeByte(status);
+    runningStatus = status;
+  }
+  const uint8_t data[2] = {event.data, event.velocity};
+  writeBytes(data, sizeof(data));
+}
+
+void MidiFile::writeMeta(uint32_t tick, uint8_t type, const uint8_t* data, uint8_t length) {
+  writeVarLength(tick - lastTick);
+  lastTick = tick;
+  const uint8_t head[3] = {0xFF, type, length};
+  writeBytes(head, sizeof(head));
+  writeBytes(data, length);
+  runningStatus = 0;
+}
+
+void MidiFile::writeVarLength(uint32_t value) {
+  // Seven bits a byte, most significant first, the top bit set on all but the last
+  uint8_t bytes[5];
+  int length = 0;
+  do {
+    bytes[4 - length] = (value & 0x7F) | (length ? 0x80 : 0);
+    value >>= 7;
+    length++;
+  } while (value);
+  writeBytes(bytes + 5 - length, length);
+}
+
+void MidiFile::writeBytes(const uint8_t* data, uint16_t length) {
+  while (length > 0) {
+    uint16_t room = min((uint16_t)(MIDIFILE_CHUNK - bufferLength), length);
+    memcpy(buffer + bufferLength, data, room);
+    bufferLength += room;
+    data += room;
+    length -= room;
+    if (bufferLength == MIDIFILE_CHUNK) {
+      flushBuffer();
+    }
+  }
+}
+
+void MidiFile::flushBuffer() {
+  if (bufferLength > 0 && file.write(buffer, bufferLength) != bufferLength) {
+    failed = true;
+  }
+  bufferLength = 0;
+}
+
+void MidiFile::beginTrack() {
+  flushBuffer();
+  trackStart = file.position();
+  lastTick = 0;
+  runningStatus = 0;
+  
+  // The length is filled in by endTrack()
+  const uint8_t head[8] = {'M', 'T', 'r', 'k', 0, 0, 0, 0};
+  writeBytes(head, sizeof(head));
+}
+
+void MidiFile::endTrack() {
+  writeMeta(lastTick, META_END_OF_TRACK, nullptr, 0);
+  flushBuffer();
+  
+  uint32_t end = file.position();
+  uint32_t length = end - trackStart - 8;
+  const uint8_t size[4] = {(uint8_t)(length >> 24), (uint8_t)(length >> 16), (uint8_t)(length >> 8), (uint8_t)length};
+  if (!file.seek(trackStart + 4) || file.write(size, sizeof(size)) != sizeof(size) || !file.seek(end)) {
+    failed = true;
+  }
+}
+
+// ---- Import ----
+
+bool MidiFile::importPatterns(const char* path, Pattern* patterns, int maxPatterns, MidiFileStats& stats) {
+  memset(&stats, 0, sizeof(stats));
+  if (maxPatterns < 1 || !SD.exists(path)) return false;
+  
+  PROF_SCOPE(PROF_SD_IO);
+  unsigned long start = micros();
+  file = SD.open(path, FILE_READ);
+  if (!file) return false;
+  
+  stats.bytes = file.size();
+  bufferLength = 0;
+  bufferPosition = 0;
+  declared = 0;
+  importCount = 0;
+  prepared = 0;
+  memset(usedSteps, 0, sizeof(usedSteps));
+  maxPatterns = min(maxPatterns, NUM_PATTERNS);
+  
+  uint8_t header[14];
+  chunkLeft = sizeof(header);
+  bool valid = readBytes(header, sizeof(header)) && memcmp(header, "MThd", 4) == 0;
+  uint32_t headerLength = (uint32_t)header[4] << 24 | (uint32_t)header[5] << 16 | header[6] << 8 | header[7];
+  stats.format = header[8] << 8 | header[9];
+  uint16_t trackCount = header[10] << 8 | header[11];
+  division = header[12] << 8 | header[13];
+  
+  // Ticks per quarter note only, SMPTE time codes have the top bit set
+  valid = valid && headerLength >= 6 && stats.format <= MIDIFILE_MULTI_TRACK &&
+          division != 0 && !(division & 0x8000);
+  if (valid) {
+    chunkLeft = headerLength - 6;
+    valid = skipBytes(chunkLeft);
+  }
+  
+  // Unknown chunks are skipped, as the standard asks
+  while (valid && stats.tracks < trackCount) {
+    uint8_t chunk[8];
+    chunkLeft = sizeof(chunk);
+    if (!readBytes(chunk, sizeof(chunk))) {
+      valid = false;
+      break;
+    }
+    chunkLeft = (uint32_t)chunk[4] << 24 | (uint32_t)chunk[5] << 16 | chunk[6] << 8 | chunk[7];
+    if (memcmp(chunk, "MTrk", 4) == 0) {
+      valid = readTrack(patterns, maxPatterns, stats);
+      stats.tracks++;
+    }
+    valid = valid && skipBytes(chunkLeft);
+  }
+  file.close();
+  
+  // Patterns from elsewhere get every track as long as the notes reach,
+  // to the next whole bar
+  stats.patterns = importCount;
+  preparePatterns(patterns, importCount);
+  if (declared == 0) {
+    for (int i = 0; i < importCount; i++) {
+      int length = constrain((usedSteps[i] + NUM_STEPS - 1) / NUM_STEPS * NUM_STEPS, NUM_STEPS, MAX_STEPS);
+      for (int track = 0; track < NUM_TRACKS; track++) {
+        patterns[i].tracks[track].length = length;
+      }
+    }
+  }
+  
+  stats.micros = micros() - start;
+  if (!valid) {
+    LOG_WARN("MIDI file invalid: ", path);
+  }
+  return valid;
+}
+
+bool MidiFile::readTrack(Pattern* patterns, int maxPatterns, MidiFileStats& stats) {
+  uint32_t tick = 0;
+  uint8_t status = 0;
+  
+  while (chunkLeft > 0) {
+    uint32_t delta;
+    if (!readVarLength(delta)) return false;
+    tick += delta;
+    
+    int data = readByte();
+    if (data < 0) return false;
+    
+    if (data == 0xFF) {
+      int type = readByte();
+      uint32_t length;
+      if (type < 0 || !readVarLength(length) || length > chunkLeft) return false;
+      if (type == META_END_OF_TRACK) return true;
+      if (!readMeta(type, length, patterns, maxPatterns, stats)) return false;
+      continue;
+    }
+    
+    // System exclusive carries its own length; it and meta events both
+    // cancel running status
+    if (data == 0xF0 || data == 0xF7) {
+      uint32_t length;
+      if (!readVarLength(length) || !skipBytes(length)) return false;
+      status = 0;
+      continue;
+    }
+    
+    if (data & 0x80) {
+      // System common and realtime messages have no place in a file
+      if (data >= 0xF0) return false;
+      status = data;
+      data = readByte();
+    } else if (status == 0) {
+      return false;
+    }
+    if (data < 0 || (data & 0x80)) return false;
+    
+    // Program change and channel pressure have one data byte, the rest two
+    uint8_t kind = status & 0xF0;
+    if (kind == 0xC0 || kind == 0xD0) continue;
+    int second = readByte();
+    if (second < 0 || (second & 0x80)) return false;
+    
+    if (kind == 0x90 && second > 0) {
+      placeNote(masterTicks(tick), data, second, patterns, maxPatterns, stats);
+    }
+  }
+  
+  // A track without an end marker is cut short
+  return false;
+}
+
+bool MidiFile::readMeta(uint8_t type, uint32_t length, Pattern* patterns, int maxPatterns, MidiFileStats& stats) {
+  if (type == META_TEMPO && length == 3 && stats.bpm == 0) {
+    uint8_t data[3];
+    if (!readBytes(data, sizeof(data))) return false;
+    uint32_t tempo = (uint32_t)data[0] << 16 | data[1] << 8 | data[2];
+    if (tempo > 0) {
+      stats.bpm = constrain((60000000UL + tempo / 2) / tempo, (uint32_t)1, (uint32_t)UINT16_MAX);
+    }
+    return true;
+  }
+  
+  if (type != META_SEQUENCER || length != DEVICE_META_LENGTH) {
+    return skipBytes(length);
+  }
+  
+  uint8_t data[DEVICE_META_LENGTH];
+  if (!readBytes(data, sizeof(data))) return false;
+  if (data[0] != DEVICE_META_ID || data[1] != 'D' || data[2] != 'R' || data[3] != DEVICE_META_VERSION ||
+      declared >= NUM_PATTERNS) {
+    return true;
+  }
+  
+  // Kept for every pattern described, so notes past the last one that
+  // fits are told apart from its own. Starts are master ticks whatever
+  // the file's division.
+  int index = declared++;
+  patternStarts[index] = (uint32_t)data[4] << 24 | (uint32_t)data[5] << 16 | data[6] << 8 | data[7];
+  if (index >= maxPatterns) return true;
+  
+  preparePatterns(patterns, index + 1);
+  importCount = max(importCount, (uint8_t)(index + 1));
+  for (int track = 0; track < NUM_TRACKS; track++) {
+    TrackSettings& settings = patterns[index].tracks[track];
+    settings.length = constrain(data[8 + track * 3], 1, MAX_STEPS);
+    settings.rate = data[9 + track * 3];
+    settings.direction = data[10 + track * 3];
+    if (settings.rate >= NUM_RATES) settings.rate = RATE_1;
+    if (settings.direction >= NUM_DIRECTIONS) settings.direction = DIR_FORWARD;
+  }
+  return true;
+}
+
+void MidiFile::placeNote(uint32_t tick, uint8_t note, uint8_t velocity, Pattern* patterns, int maxPatterns,
+                         MidiFileStats& stats) {
+  int track = trackForNote(note);
+  if (track < 0) {
+    stats.skipped++;
+    return;
+  }
+  
+  // The pattern whose first step, pulled fully early, is at or before the note
+  uint32_t reach = tick + MAX_MICRO_OFFSET;
+  int index;
+  uint32_t base;
+  if (declared > 0) {
+    int low = 0;
+    int high = declared - 1;
+    while (low < high) {
+      int middle = (low + high + 1) / 2;
+      if (patternStarts[middle] <= reach) {
+        low = middle;
+      } else {
+        high = middle - 1;
+      }
+    }
+    index = low;
+    base = patternStarts[index];
+  } else {
+    index = reach / (MAX_STEPS * TICKS_PER_STEP);
+    base = (uint32_t)index * MAX_STEPS * TICKS_PER_STEP;
+  }
+  if (index >= maxPatterns) {
+    stats.skipped++;
+    return;
+  }
+  
+  preparePatterns(patterns, index + 1);
+  importCount = max(importCount, (uint8_t)(index + 1));
+  Pattern& pattern = patterns[index];
+  
+  // Nearest step, a note exactly half a step out going to the earlier one,
+  // so MAX_MICRO_OFFSET at 1x comes back as it was; -MAX_MICRO_OFFSET is
+  // the same tick and comes back as the step before, pulled late
+  int32_t trackTicks = Sequencer::ticksPerTrackStep(pattern.tracks[track].rate);
+  int32_t offset = (int32_t)(tick - base);
+  int32_t step = max(offset + (trackTicks - 1) / 2, (int32_t)0) / trackTicks;
+  if (step >= MAX_STEPS) {
+    stats.skipped++;
+    return;
+  }
+  
+  pattern.steps[track] |= (uint64_t)1 << step;
+  pattern.microTiming[track][step] = constrain(offset - step * trackTicks, -MAX_MICRO_OFFSET, MAX_MICRO_OFFSET);
+  pattern.velocities[track][step] = MAX_VELOCITY - min(velocity, (uint8_t)MAX_VELOCITY);
+  usedSteps[index] = max(usedSteps[index], (uint8_t)(step + 1));
+  stats.notes++;
+}
+
+void MidiFile::preparePatterns(Pattern* patterns, int upTo) {
+  while (prepared < upTo) {
+    Sequencer::clearPattern(patterns[prepared++]);
+  }
+}
+
+uint32_t MidiFile::masterTicks(uint32_t fileTicks) {
+  if (division == MIDIFILE_PPQN) return fileTicks;
+  return (uint32_t)(((uint64_t)fileTicks * MIDIFILE_PPQN + division / 2) / division);
+}
+
+int MidiFile::readByte() {
+  if (chunkLeft == 0) return -1;
+  if (bufferPosition == bufferLength) {
+    // The next chunk of the file, never more than the buffer
+    bufferLength = file.read(buffer, MIDIFILE_CHUNK);
+    bufferPosition = 0;
+    if (bufferLength == 0) return -1;
+  }
+  chunkLeft--;
+  return buffer[bufferPosition++];
+}
+
+bool MidiFile::readBytes(uint8_t* data, uint32_t length) {
+  for (uint32_t i = 0; i < length; i++) {
+    int value = readByte();
+    if (value < 0) return false;
+    data[i] = value;
+  }
+  return true;
+}
+
+bool MidiFile::skipBytes(uint32_t length) {
+  if (length > chunkLeft) return false;
+  chunkLeft -= length;
+  
+  // Out of the buffer first, past it with a seek
+  uint32_t buffered = bufferLength - bufferPosition;
+  if (length <= buffered) {
+    bufferPosition += length;
+    return true;
+  }
+  length -= buffered;
+  bufferPosition = bufferLength;
+  return file.seek(file.position() + length);
+}
+
+bool MidiFile::readVarLength(uint32_t& value) {
+  // At most four bytes, 28 bits
+  value = 0;
+  for (int i = 0; i < 4; i++) {
+    int data = readByte();
+    if (data < 0) return false;
+    value = (value << 7) | (data & 0x7F);
+    if (!(data & 0x80)) return true;
+  }
+  return false;
+}
@@ -0,0 +1,135 @@
+/*
+ * DriftRiff Mini - MIDI File Header
+ *
+ * Standard MIDI File export and import of patterns. Each track is a note
+ * on the GM drum channel, at the time its step plays: steps at the track's
+ * rate, moved by micro-timing, velocity with any accent folded in. File
+ * ticks are master ticks (TICKS_PER_STEP per 16th), so nothing is rounded
+ * on the way out. A run of patterns plays end to end as a song, each one
+ * as long as its longest track and marked for a DAW's timeline.
+ *
+ * Both directions stream through one MIDIFILE_CHUNK buffer; a file is
+ * never held in RAM. An export reads the patterns from the bank one at a
+ * time, once for the layout and again for each track written. Track length, rate and direction go in a
+ * sequencer-specific meta event, so a file from the device loads back as
+ * it was saved. A file from anywhere else is cut into MAX_STEPS patterns
+ * at 1x. Trig conditions, ratchets and slices have no MIDI equivalent and
+ * are left out.
+ */
+
+#ifndef MIDIFILE_H
+#define MIDIFILE_H
+
+#include <Arduino.h>
+#include <SD.h>
+#include "sequencer.h"
+#include "patternbank.h"
+
+#define MIDIFILE_PATTERN_PATH "/pattern.mid"  // Console export of the current pattern
+#define MIDIFILE_SONG_PATH    "/song.mid"     // Console export of the song
+#define MIDIFILE_IMPORT_PATH  "/import.mid"
+#define MIDIFILE_CHUNK        256             // Bytes buffered between card reads or writes
+#define MIDIFILE_PPQN         (TICKS_PER_STEP * 4)
+#define MIDIFILE_CHANNEL      9               // GM drums, channel 10
+#define MIDIFILE_MAX_GATE     (TICKS_PER_STEP / 2)
+#define MIDIFILE_MAX_EVENTS   (NUM_TRACKS * MAX_STEPS * 3)  // A pattern's notes on and off, and the carry into the next
+
+enum MidiFileFormat {
+  MIDIFILE_SINGLE_TRACK,  // Type 0, everything in one track
+  MIDIFILE_MULTI_TRACK    // Type 1, a tempo track then one per sequencer track
+};
+
+// What an import found, for the console
+struct MidiFileStats {
+  uint16_t format;
+  uint16_t tracks;          // Track chunks read
+  uint16_t patterns;        // Patterns written
+  uint16_t bpm;             // From the first tempo event, 0 if there was none
+  uint32_t notes;           // Notes placed on steps
+  uint32_t skipped;         // Notes with no track, or past the last step or pattern
+  uint32_t bytes;           // File size
+  uint32_t micros;
+};
+
+class MidiFile {
+private:
+  // A write waiting for its turn. Micro-timing can move a hit past its
+  // neighbours, so writes are sorted by tick before they go out.
+  struct Event {
+    uint32_t tick;
+    uint8_t kind;           // Marker, note off, note on: the order at one tick
+    uint8_t data;           // Note, or the pattern a marker starts
+    uint8_t velocity;
+  };
+  
+  File file;
+  uint8_t buffer[MIDIFILE_CHUNK];
+  uint16_t bufferLength;    // Bytes waiting to be written, or read from the card
+  uint16_t bufferPosition;  // Next byte to read
+  bool failed;
+  
+  // Export
+  Pattern exportPattern;    // The one being written
+  Event events[MIDIFILE_MAX_EVENTS];
+  uint16_t eventCount;
+  uint32_t trackStart;      // File offset of the current MTrk header
+  uint32_t lastTick;
+  uint8_t runningStatus;
+  
+  // Import
+  uint32_t chunkLeft;       // Bytes left in the chunk being read
+  uint16_t division;        // File ticks per quarter note
+  uint8_t declared;         // Patterns described by the device's meta events
+  uint8_t importCount;      // Patterns written to so far
+  uint8_t prepared;         // Target patterns cleared so far
+  uint32_t patternStarts[NUM_PATTERNS];   // Master ticks, from the meta events
+  uint8_t usedSteps[NUM_PATTERNS];        // One past the last step given a note
+  
+  void writeBytes(const uint8_t* data, uint16_t length);
+  void writeByte(uint8_t data) { writeBytes(&data, 1); }
+  void writeVarLength(uint32_t value);
+  void writeMeta(uint32_t tick, uint8_t type, const uint8_t* data, uint8_t length);
+  void flushBuffer();
+  void beginTrack();
+  void endTrack();
+  void writeConductor(PatternBank& bank, int first, int count, const uint32_t* starts, uint16_t bpm);
+  void writeNotes(PatternBank& bank, int first, int count, const uint32_t* starts, uint8_t trackMask,
+                  bool markers);
+  void queueEvent(uint32_t tick, uint8_t kind, uint8_t data, uint8_t velocity);
+  void writeEvent(const Event& event);
+  void flushEvents(uint32_t before);
+  
+  int readByte();
+  bool readBytes(uint8_t* data, uint32_t length);
+  bool skipBytes(uint32_t length);
+  bool readVarLength(uint32_t& value);
+  bool readTrack(Pattern* patterns, int maxPatterns, MidiFileStats& stats);
+  bool readMeta(uint8_t type, uint32_t length, Pattern* patterns, int maxPatterns, MidiFileStats& stats);
+  void placeNote(uint32_t tick, uint8_t note, uint8_t velocity, Pattern* patterns, int maxPatterns,
+                 MidiFileStats& stats);
+  void preparePatterns(Pattern* patterns, int upTo);
+  uint32_t masterTicks(uint32_t fileTicks);
+  
+public:
+  MidiFile();
+  
+  // Write count patterns from first on as a song, type 0 or 1. Reads the
+  // patterns as they are, like the project save.
+  bool exportPatterns(const char* path, PatternBank& bank, int first, int count, uint8_t format, uint16_t bpm);
+  
+  // Read a type 0 or 1 file into up to maxPatterns patterns from the one
+  // given, clearing each before it is written. Notes on the same step
+  // keep the last one read. False for anything but a well-formed file;
+  // patterns already written by then stay written.
+  bool importPatterns(const char* path, Pattern* patterns, int maxPatterns, MidiFileStats& stats);
+  
+  // Sequencer track a note plays, -1 for none. GM drum neighbours of the
+  // exported notes are taken too.
+  static int trackForNote(uint8_t note);
+  static uint8_t noteForTrack(int track);
+  
+  // Master ticks one pattern lasts, its longest track once round
+  static uint32_t patternTicks(const Pattern& pattern);
+};
+
+#endif
@@ -0,0 +1,258 @@
+/*
+ * DriftRiff Mini - MIDI Clock Sync Implementation
+ */
+
+#include "midisync.h"
+#include "debuglog.h"
+#include "inputlog.h"
+
+MidiSync::MidiSync() {
+  port = nullptr;
+  inputLog = nullptr;
+  mode = MIDI_SYNC_MASTER;
+  rxDropped.store(0);
+  masterRunning = false;
+  clocksSent = 0;
+  externalRunning = false;
+  resetTracking();
+}
+
+void MidiSync::init(HardwareSerial* serial) {
+  port = serial;
+  port->begin(MIDI_BAUD, SERIAL_8N1, MIDI_RX_PIN, MIDI_TX_PIN);
+  
+#ifdef ARDUINO
+  // Timestamp every byte as it arrives rather than when loop() gets to it
+  port->setRxFIFOFull(1);
+  port->onReceive([this]() {
+    while (port->available() > 0) {
+      receiveByte(port->read(), micros());
+    }
+  });
+#endif
+
+  Serial.println("MIDI sync initialized");
+}
+
+void MidiSync::resetTracking() {
+  clockValid = false;
+  locked = false;
+  lockCount = 0;
+  haveLastClock = false;
+  lastClockMicros = 0;
+  predictedMicros = 0;
+  predictedFraction = 0;
+  filteredMicros = 0;
+  period = 0;
+  phaseError = 0;
+  clockCount = 0;
+}
+
+void MidiSync::setMode(int newMode) {
+  if (newMode < MIDI_SYNC_OFF || newMode > MIDI_SYNC_SLAVE) return;
+  
+  // Leave connected gear stopped rather than waiting on a dead clock
+  if (mode == MIDI_SYNC_MASTER && masterRunning) {
+    send(MIDI_STOP);
+  }
+  masterRunning = false;
+  externalRunning = false;
+  resetTracking();
+  mode = newMode;
+  
+  LOG_INFO("MIDI sync mode: ", mode == MIDI_SYNC_MASTER ? "master" : (mode == MIDI_SYNC_SLAVE ? "slave" : "off"));
+}
+
+void MidiSync::receiveByte(uint8_t data, uint32_t timestamp) {
+  // Only the transport and clock messages matter here
+  if (data != MIDI_CLOCK && data != MIDI_START &&
+      data != MIDI_CONTINUE && data != MIDI_STOP) {
+    return;
+  }
+  
+  MidiRxByte received = {data, timestamp};
+  if (!rxQueue.push(received)) {
+    rxDropped.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+void MidiSync::update(Sequencer& sequencer, uint32_t playFrame) {
+#ifndef ARDUINO
+  // No receive callback off-device, poll the port instead
+  if (port) {
+    while (port->available() > 0) {
+      receiveByte(port->read(), micros());
+    }
+  }
+#endif
+
+  uint8_t data;
+  uint32_t timestamp;
+  while (nextByte(data, timestamp)) {
+    if (mode == MIDI_SYNC_SLAVE) {
+      processByte(data, timestamp, sequencer);
+    }
+  }
+  
+  if (mode == MIDI_SYNC_SLAVE) {
+    followClock(sequencer, playFrame, micros());
+  } else if (mode == MIDI_SYNC_MASTER) {
+    sendClock(sequencer, playFrame);
+  }
+}
+
+bool MidiSync::nextByte(uint8_t& data, uint32_t& timestamp) {
+  // A replay supplies the bytes, whatever the port received is dropped
+  MidiRxByte received;
+  if (inputLog && inputLog->isReplaying()) {
+    while (rxQueue.pop(received)) {
+    }
+    return inputLog->replayMidi(data, timestamp);
+  }
+  if (!rxQueue.pop(received)) return false;
+  
+  data = received.data;
+  timestamp = received.timestamp;
+  if (inputLog) {
+    inputLog->recordMidi(data, timestamp);
+  }
+  return true;
+}
+
+void MidiSync::processByte(uint8_t data, uint32_t timestamp, Sequencer& sequencer) {
+  switch (data) {
+    case MIDI_CLOCK:
+      trackClock(timestamp);
+      if (externalRunning) clockCount++;
+      break;
+      
+    case MIDI_START:
+      // The next clock is the downbeat
+      sequencer.reset();
+      sequencer.play();
+      clockCount = 0;
+      externalRunning = true;
+      break;
+      
+    case MIDI_CONTINUE:
+      sequencer.play();
+      externalRunning = true;
+      break;
+      
+    case MIDI_STOP:
+      sequencer.pause();
+      externalRunning = false;
+      break;
+  }
+}
+
+void MidiSync::trackClock(uint32_t timestamp) {
+  if (clockValid) {
+    float error = (float)(int32_t)(timestamp - predictedMicros);
+    
+    if (fabsf(error) < period * 2) {
+      const float omega = 2.0f * PI * MIDI_DLL_BANDWIDTH;
+      const float b = 1.41421356f * omega;
+      const float c = omega * omega;
+      
+      // Filtered time of this clock is the prediction made one clock ago
+      filteredMicros = predictedMicros;
+      float next = predictedFraction + period + b * error;
+      int32_t whole = (int32_t)floorf(next);
+      predictedMicros += whole;
+      predictedFraction = next - whole;
+      period += c * error;
+      phaseError = error;
+      
+      // Lock after a run of clocks close to prediction, with some hysteresis
+      if (fabsf(error) < period / 8) {
+        if (lockCount < MIDI_LOCK_CLOCKS) lockCount++;
+        if (lockCount >= MIDI_LOCK_CLOCKS) locked = true;
+      } else if (fabsf(error) > period / 4) {
+        lockCount = 0;
+        locked = false;
+      }
+      
+      lastClockMicros = timestamp;
+      return;
+    }
+    
+    // Dropout or a tempo jump far outside the loop range, start over
+    LOG_DEBUG("MIDI clock lost, error: ", error);
+    clockValid = false;
+    locked = false;
+    lockCount = 0;
+  }
+  
+  // Seed the loop from the first plausible clock interval
+  uint32_t interval = timestamp - lastClockMicros;
+  if (haveLastClock && interval >= MIDI_MIN_PERIOD_US && interval <= MIDI_MAX_PERIOD_US) {
+    period = interval;
+    predictedMicros = timestamp + interval;
+    predictedFraction = 0;
+    filteredMicros = timestamp;
+    phaseError = 0;
+    clockValid = true;
+  }
+  
+  haveLastClock = true;
+  lastClockMicros = timestamp;
+}
+
+void MidiSync::followClock(Sequencer& sequencer, uint32_t playFrame, uint32_t nowMicros) {
+  // Follow the estimate as soon as there is one, locking only means it settled
+  if (!clockValid) return;
+  
+  float bpm = getBPM();
+  
+  if (externalRunning && clockCount > 0 && sequencer.isPlaying()) {
+    // Where the external clock says we should be, in master ticks
+    float sinceClock = (float)(int32_t)(nowMicros - filteredMicros) / period;
+    float target = (clockCount - 1 + sinceClock) * MIDI_TICKS_PER_CLOCK;
+    float error = target - (float)sequencer.tickAtFrame(playFrame);
+    
+    // Pull the phase in through a small tempo offset
+    float correction = MIDI_PHASE_GAIN * error / TICKS_PER_STEP;
+    correction = constrain(correction, -MIDI_MAX_CORRECTION, MIDI_MAX_CORRECTION);
+    bpm *= 1.0f + correction;
+  }
+  
+  sequencer.setTempo(bpm);
+}
+
+void MidiSync::sendClock(Sequencer& sequencer, uint32_t playFrame) {
+  bool running = sequencer.isPlaying();
+  int32_t tick = sequencer.tickAtFrame(playFrame);
+  
+  if (running && !masterRunning) {
+    if (tick <= 0) {
+      send(MIDI_START);
+      clocksSent = 0;
+    } else {
+      send(MIDI_CONTINUE);
+      clocksSent = (tick + MIDI_TICKS_PER_CLOCK - 1) / MIDI_TICKS_PER_CLOCK;
+    }
+  } else if (!running && masterRunning) {
+    send(MIDI_STOP);
+  }
+  masterRunning = running;
+  
+  if (!running) return;
+  
+  // One clock every MIDI_TICKS_PER_CLOCK ticks of the sample-locked position
+  while (tick - (int32_t)(clocksSent * MIDI_TICKS_PER_CLOCK) >= 0) {
+    send(MIDI_CLOCK);
+    clocksSent++;
+  }
+}
+
+void MidiSync::send(uint8_t data) {
+  if (port) {
+    port->write(data);
+  }
+}
+
+float MidiSync::getBPM() {
+  if (!clockValid) return 0;
+  return 60000000.0f / (period * MIDI_PPQN);
+}
@@ -0,0 +1,111 @@
+/*
+ * DriftRiff Mini - MIDI Clock Sync Header
+ */
+
+#ifndef MIDISYNC_H
+#define MIDISYNC_H
+
+#include <Arduino.h>
+#include "sequencer.h"
+#include "tasks.h"
+
+// MIDI UART (Serial2)
+#define MIDI_RX_PIN     16
+#define MIDI_TX_PIN     17
+#define MIDI_BAUD       31250
+
+// Realtime messages
+#define MIDI_CLOCK      0xF8
+#define MIDI_START      0xFA
+#define MIDI_CONTINUE   0xFB
+#define MIDI_STOP       0xFC
+
+#define MIDI_PPQN       24
+#define MIDI_TICKS_PER_CLOCK (TICKS_PER_STEP * 4 / MIDI_PPQN)
+#define MIDI_RX_QUEUE   64            // Power of two
+
+// Clock tracking loop, bandwidth in cycles per incoming clock
+#define MIDI_DLL_BANDWIDTH  0.02f
+#define MIDI_LOCK_CLOCKS    24        // Consecutive in-tolerance clocks before locking
+#define MIDI_MIN_PERIOD_US  8333      // 300 BPM
+#define MIDI_MAX_PERIOD_US  83333     // 30 BPM
+#define MIDI_PHASE_GAIN     0.25f     // Tempo correction per step of phase error
+#define MIDI_MAX_CORRECTION 0.08f
+
+class InputLog;
+
+// A realtime byte and when it arrived
+struct MidiRxByte {
+  uint8_t data;
+  uint32_t timestamp;
+};
+
+enum MidiSyncMode {
+  MIDI_SYNC_OFF,
+  MIDI_SYNC_MASTER,   // Send clock derived from the sample clock
+  MIDI_SYNC_SLAVE     // Follow incoming clock and transport
+};
+
+class MidiSync {
+private:
+  HardwareSerial* port;
+  InputLog* inputLog;
+  uint8_t mode;
+  
+  // Timestamped realtime bytes, written from the UART receive callback
+  SpscQueue<MidiRxByte, MIDI_RX_QUEUE> rxQueue;
+  std::atomic<uint32_t> rxDropped;
+  
+  // Second order delay-locked loop over clock arrival times (microseconds)
+  bool clockValid;
+  bool locked;
+  uint8_t lockCount;
+  bool haveLastClock;
+  uint32_t lastClockMicros;
+  uint32_t predictedMicros;   // Expected arrival of the next clock
+  float predictedFraction;
+  uint32_t filteredMicros;    // Filtered time of the last clock
+  float period;               // Microseconds per clock
+  float phaseError;           // Last arrival minus prediction
+  uint32_t clockCount;        // Clocks since start, clock 0 is the downbeat
+  bool externalRunning;
+  
+  // Master output
+  bool masterRunning;
+  uint32_t clocksSent;
+  
+  bool nextByte(uint8_t& data, uint32_t& timestamp);
+  void processByte(uint8_t data, uint32_t timestamp, Sequencer& sequencer);
+  void trackClock(uint32_t timestamp);
+  void followClock(Sequencer& sequencer, uint32_t playFrame, uint32_t nowMicros);
+  void sendClock(Sequencer& sequencer, uint32_t playFrame);
+  void send(uint8_t data);
+  
+public:
+  MidiSync();
+  
+  void init(HardwareSerial* serial);
+  
+  // Record received bytes with their times, or take them from a replay
+  void setInputLog(InputLog* log) { inputLog = log; }
+  
+  // Safe to call from the UART receive callback, drops bytes when full
+  void receiveByte(uint8_t data, uint32_t timestamp);
+  
+  // Apply received clock/transport, or send clock in master mode
+  void update(Sequencer& sequencer, uint32_t playFrame);
+  
+  void setMode(int newMode);
+  int getMode() { return mode; }
+  
+  // Tracking state
+  bool isLocked() { return locked; }
+  float getBPM();
+  float getPhaseError() { return phaseError; }
+  uint32_t getFilteredClockTime() { return filteredMicros; }
+  uint32_t getClockCount() { return clockCount; }
+  uint32_t getDroppedBytes() { return rxDropped.load(); }
+  void resetTracking();
+};
+
+#endif
@@ -0,0 +1,139 @@
+/*
+ * DriftRiff Mini - Modulation Matrix Implementation
+ */
+
+#include "modmatrix.h"
+
+// One cycle of sine, 256 steps of phase
+static const int8_t sineTable[256] = {
+     0,    3,    6,    9,   12,   16,   19,   22,   25,   28,   31,   34,   37,   40,   43,   46,
+    49,   51,   54,   57,   60,   63,   65,   68,   71,   73,   76,   78,   81,   83,   85,   88,
+    90,   92,   94,   96,   98,  100,  102,  104,  106,  107,  109,  111,  112,  113,  115,  116,
+   117,  118,  120,  121,  122,  122,  123,  124,  125,  125,  126,  126,  126,  127,  127,  127,
+   127,  127,  127,  127,  126,  126,  126,  125,  125,  124,  123,  122,  122,  121,  120,  118,
+   117,  116,  115,  113,  112,  111,  109,  107,  106,  104,  102,  100,   98,   96,   94,   92,
+    90,   88,   85,   83,   81,   78,   76,   73,   71,   68,   65,   63,   60,   57,   54,   51,
+    49,   46,   43,   40,   37,   34,   31,   28,   25,   22,   19,   16,   12,    9,    6,    3,
+     0,   -3,   -6,   -9,  -12,  -16,  -19,  -22,  -25,  -28,  -31,  -34,  -37,  -40,  -43,  -46,
+   -49,  -51,  -54,  -57,  -60,  -63,  -65,  -68,  -71,  -73,  -76,  -78,  -81,  -83,  -85,  -88,
+   -90,  -92,  -94,  -96,  -98, -100, -102, -104, -106, -107, -109, -111, -112, -113, -115, -116,
+  -117, -118, -120, -121, -122, -122, -123, -124, -125, -125, -126, -126, -126, -127, -127, -127,
+  -127, -127, -127, -127, -126, -126, -126, -125, -125, -124, -123, -122, -122, -121, -120, -118,
+  -117, -116, -115, -113, -112, -111, -109, -107, -106, -104, -102, -100,  -98,  -96,  -94,  -92,
+   -90,  -88,  -85,  -83,  -81,  -78,  -76,  -73,  -71,  -68,  -65,  -63,  -60,  -57,  -54,  -51,
+   -49,  -46,  -43,  -40,  -37,  -34,  -31,  -28,  -25,  -22,  -19,  -16,  -12,   -9,   -6,   -3
+};
+
+ModMatrix::ModMatrix() {
+  clear();
+}
+
+void ModMatrix::clear() {
+  for (int i = 0; i < MOD_LFOS; i++) {
+    lfos[i].shape = MOD_SINE;
+    lfos[i].cycleTicks = NUM_STEPS * TICKS_PER_STEP;
+    lfos[i].phase = 0;
+  }
+  for (int i = 0; i < MOD_STEP_SOURCES; i++) {
+    memset(sequences[i].values, 0, MOD_SEQUENCE_STEPS);
+    sequences[i].length = MOD_SEQUENCE_STEPS;
+  }
+  routeCount = 0;
+  memset(levels, 0, sizeof(levels));
+  memset(offsets, 0, sizeof(offsets));
+}
+
+void ModMatrix::setLfo(int index, int shape, int cycleSteps, int phase) {
+  if (index < 0 || index >= MOD_LFOS || shape < 0 || shape >= NUM_MOD_SHAPES) return;
+  
+  lfos[index].shape = shape;
+  lfos[index].cycleTicks = constrain(cycleSteps, 1, MOD_MAX_LFO_STEPS) * TICKS_PER_STEP;
+  lfos[index].phase = phase;
+}
+
+void ModMatrix::setSequenceStep(int index, int step, int value) {
+  if (index < 0 || index >= MOD_STEP_SOURCES || step < 0 || step >= MOD_SEQUENCE_STEPS) return;
+  sequences[index].values[step] = constrain(value, -MOD_LEVEL_MAX, MOD_LEVEL_MAX);
+}
+
+void ModMatrix::setSequenceLength(int index, int length) {
+  if (index < 0 || index >= MOD_STEP_SOURCES) return;
+  sequences[index].length = constrain(length, 1, MOD_SEQUENCE_STEPS);
+}
+
+bool ModMatrix::setRoute(int source, int track, int destination, int depth) {
+  if (source < 0 || source >= NUM_MOD_SOURCES || track < 0 || track >= NUM_TRACKS ||
+      destination < 0 || destination >= NUM_MOD_DESTINATIONS) {
+    return false;
+  }
+  depth = constrain(depth, -MOD_LEVEL_MAX, MOD_LEVEL_MAX);
+  
+  int index = 0;
+  while (index < routeCount && (routes[index].source != source || routes[index].track != track ||
+                                routes[index].destination != destination)) {
+    index++;
+  }
+  
+  if (depth == 0) {
+    // Keep the live routes packed so evaluate() walks only those
+    if (index < routeCount) {
+      routes[index] = routes[--routeCount];
+    }
+    return true;
+  }
+  if (index == routeCount) {
+    if (routeCount >= MAX_MOD_ROUTES) return false;
+    routeCount++;
+  }
+  routes[index].source = source;
+  routes[index].track = track;
+  routes[index].destination = destination;
+  routes[index].depth = depth;
+  return true;
+}
+
+int8_t ModMatrix::lfoLevel(const ModLfo& lfo, int32_t tick, int index) {
+  int32_t inCycle = tick % lfo.cycleTicks;
+  if (inCycle < 0) inCycle += lfo.cycleTicks;
+  uint8_t phase = (uint8_t)(((uint32_t)inCycle << 8) / lfo.cycleTicks + lfo.phase);
+  
+  switch (lfo.shape) {
+    case MOD_TRIANGLE:
+      // Up from the bottom over the first half, back down over the second
+      return phase < 128 ? phase * 2 - MOD_LEVEL_MAX : MOD_LEVEL_MAX - (phase - 128) * 2;
+    case MOD_SQUARE:
+      return phase < 128 ? MOD_LEVEL_MAX : -MOD_LEVEL_MAX;
+    case MOD_SAMPLE_HOLD: {
+      // Hash of the cycle number, so a level is the same every time round
+      uint32_t cycle = (uint32_t)((tick - inCycle) / lfo.cycleTicks) * 0x9E3779B9u + index * 0x85EBCA6Bu;
+      cycle ^= cycle >> 15;
+      cycle *= 0x2C1B3C6Du;
+      cycle ^= cycle >> 12;
+      return (int)(cycle % (2 * MOD_LEVEL_MAX + 1)) - MOD_LEVEL_MAX;
+    }
+    default:
+      return sineTable[phase];
+  }
+}
+
+void ModMatrix::evaluate(int32_t tick) {
+  for (int i = 0; i < MOD_LFOS; i++) {
+    levels[i] = lfoLevel(lfos[i], tick, i);
+  }
+  
+  int32_t step = tick >= 0 ? tick / TICKS_PER_STEP : 0;
+  for (int i = 0; i < MOD_STEP_SOURCES; i++) {
+    levels[MOD_SOURCE_STEP + i] = sequences[i].values[step % sequences[i].length];
+  }
+  
+  memset(offsets, 0, sizeof(offsets));
+  for (int i = 0; i < routeCount; i++) {
+    const ModRoute& route = routes[i];
+    int32_t level = levels[route.source];
+    if (route.destination == MOD_PITCH) {
+      offsets[route.destination][route.track] += level * route.depth / MOD_LEVEL_MAX;
+    } else {
+      offsets[route.destination][route.track] += (level + MOD_LEVEL_MAX) * route.depth / (2 * MOD_LEVEL_MAX);
+    }
+  }
+}
@@ -0,0 +1,102 @@
+/*
+ * DriftRiff Mini - Modulation Matrix Header
+ *
+ * Tempo-synced LFOs and short step sequences, routed with a depth to a
+ * track's volume, pitch, filter cutoff or sample start. Sources are read
+ * off the master tick once per audio block, so they stay locked to the
+ * pattern and cost the same at any sample rate. The sum of the routes is
+ * kept per destination across tracks, on the same 0-255 scale as the
+ * automation lanes it is added to.
+ */
+
+#ifndef MODMATRIX_H
+#define MODMATRIX_H
+
+#include <Arduino.h>
+#include "automation.h"
+
+#define MOD_LFOS            4
+#define MOD_STEP_SOURCES    2
+#define MOD_SEQUENCE_STEPS  16
+#define MAX_MOD_ROUTES      8
+#define MOD_MAX_LFO_STEPS   64    // Longest LFO cycle, in 16ths
+#define MOD_LEVEL_MAX       127   // Sources run -127 - 127
+
+enum ModShape {
+  MOD_SINE,
+  MOD_TRIANGLE,
+  MOD_SQUARE,
+  MOD_SAMPLE_HOLD,  // A new random level every cycle
+  NUM_MOD_SHAPES
+};
+
+// Sources, LFOs first, then the step sequences
+#define MOD_SOURCE_STEP     MOD_LFOS
+#define NUM_MOD_SOURCES     (MOD_LFOS + MOD_STEP_SOURCES)
+
+// Destinations line up with the automation parameters they are added to
+enum ModDestination {
+  MOD_VOLUME = AUTO_VOLUME,
+  MOD_PITCH = AUTO_PITCH,
+  MOD_CUTOFF = AUTO_CUTOFF,
+  MOD_START = NUM_AUTOMATION_PARAMS,  // 0 - 255 of the way into the sample
+  NUM_MOD_DESTINATIONS
+};
+
+struct ModLfo {
+  uint8_t shape;        // ModShape
+  uint16_t cycleTicks;  // Master ticks per cycle
+  uint8_t phase;        // Start of the cycle, 256ths
+};
+
+struct ModSequence {
+  int8_t values[MOD_SEQUENCE_STEPS];
+  uint8_t length;       // Steps before it wraps, advancing every 16th
+};
+
+// Pitch follows the source either way. The other destinations rest at an
+// end of their range, so the source is taken as 0 - 254 and the depth's
+// sign picks the direction: negative depth for volume and cutoff.
+struct ModRoute {
+  uint8_t source;
+  uint8_t track;
+  uint8_t destination;
+  int8_t depth;         // 0 turns the route off
+};
+
+class ModMatrix {
+private:
+  ModLfo lfos[MOD_LFOS];
+  ModSequence sequences[MOD_STEP_SOURCES];
+  ModRoute routes[MAX_MOD_ROUTES];
+  uint8_t routeCount;         // Routes with a depth, packed at the front
+  
+  // Evaluated each block: sources, then the route sums per destination
+  int8_t levels[NUM_MOD_SOURCES];
+  int16_t offsets[NUM_MOD_DESTINATIONS][NUM_TRACKS];
+  
+  int8_t lfoLevel(const ModLfo& lfo, int32_t tick, int index);
+  
+public:
+  ModMatrix();
+  
+  void clear();
+  
+  // LFO cycle of 1 - MOD_MAX_LFO_STEPS 16ths, phase in 256ths of a cycle
+  void setLfo(int index, int shape, int cycleSteps, int phase = 0);
+  void setSequenceStep(int index, int step, int value);
+  void setSequenceLength(int index, int length);
+  
+  // Add or replace the route from a source to a track's destination,
+  // depth 0 removes it. False when every route is taken.
+  bool setRoute(int source, int track, int destination, int depth);
+  int getRouteCount() { return routeCount; }
+  
+  // Work out every source at a master tick, call once per block
+  void evaluate(int32_t tick);
+  
+  int8_t getLevel(int source) { return levels[source]; }
+  int16_t getOffset(int destination, int track) { return offsets[destination][track]; }
+};
+
+#endif
@@ -0,0 +1,147 @@
+/*
+ * DriftRiff Mini - Pattern Bank Implementation
+ */
+
+#include "patternbank.h"
+#include "debuglog.h"
+#include "profiler.h"
+
+PatternBank::PatternBank() {
+  sequencer = nullptr;
+  swapHook = nullptr;
+  path = PATTERN_BANK_PATH;
+}
+
+void PatternBank::init(Sequencer* seq, const char* bankPath) {
+  sequencer = seq;
+  path = bankPath;
+}
+
+int PatternBank::swap(int index) {
+  if (swapHook) {
+    return swapHook(index, page);
+  }
+  return sequencer->loadPattern(index, page);
+}
+
+bool PatternBank::readFile(int index, Pattern& target) {
+  File file = SD.open(path, FILE_READ);
+  if (!file) return false;
+  
+  bool ok = file.seek((uint32_t)index * sizeof(Pattern)) &&
+            file.read((uint8_t*)&target, sizeof(Pattern)) == sizeof(Pattern);
+  file.close();
+  return ok;
+}
+
+bool PatternBank::writeFile(int index, const Pattern& source) {
+  File file = SD.open(path, PATTERN_BANK_UPDATE);
+  if (!file) return false;
+  
+  bool ok = file.seek((uint32_t)index * sizeof(Pattern)) &&
+            file.write((const uint8_t*)&source, sizeof(Pattern)) == sizeof(Pattern);
+  file.close();
+  return ok;
+}
+
+bool PatternBank::reset() {
+  PROF_SCOPE(PROF_SD_IO);
+  File file = SD.open(path, FILE_WRITE);
+  if (!file) {
+    LOG_WARN("Pattern bank: cannot create ", path);
+    return false;
+  }
+  
+  Sequencer::clearPattern(page);
+  bool ok = true;
+  for (int i = 0; i < NUM_PATTERNS && ok; i++) {
+    ok = file.write((const uint8_t*)&page, sizeof(Pattern)) == sizeof(Pattern);
+  }
+  file.close();
+  if (!ok) {
+    LOG_WARN("Pattern bank: write error");
+  }
+  return ok;
+}
+
+bool PatternBank::read(int index, Pattern& target) {
+  if (index < 0 || index >= NUM_PATTERNS) return false;
+  
+  const Pattern* resident = sequencer->getResidentPattern(index);
+  if (resident) {
+    memcpy(&target, resident, sizeof(Pattern));
+    return true;
+  }
+  return readFile(index, target);
+}
+
+bool PatternBank::write(int index, const Pattern& source) {
+  PROF_SCOPE(PROF_SD_IO);
+  if (index < 0 || index >= NUM_PATTERNS || !writeFile(index, source)) return false;
+  
+  if (sequencer->isPatternResident(index)) {
+    memcpy(&page, &source, sizeof(Pattern));
+    swap(index);
+  }
+  return true;
+}
+
+bool PatternBank::beginFill() {
+  fillFile = SD.open(path, FILE_WRITE);
+  if (!fillFile) {
+    LOG_WARN("Pattern bank: cannot create ", path);
+    return false;
+  }
+  return true;
+}
+
+bool PatternBank::fill(const Pattern& source) {
+  return fillFile && fillFile.write((const uint8_t*)&source, sizeof(Pattern)) == sizeof(Pattern);
+}
+
+void PatternBank::endFill() {
+  if (fillFile) {
+    fillFile.close();
+  }
+}
+
+bool PatternBank::reload() {
+  PROF_SCOPE(PROF_SD_IO);
+  bool ok = true;
+  for (int i = 0; i < NUM_PATTERNS; i++) {
+    if (!sequencer->isPatternResident(i)) continue;
+    if (readFile(i, page)) {
+      swap(i);
+    } else {
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+bool PatternBank::fetch(int index) {
+  if (index < 0 || index >= NUM_PATTERNS) return false;
+  if (sequencer->isPatternResident(index)) return true;
+  
+  PROF_SCOPE(PROF_SD_IO);
+  if (!readFile(index, page)) {
+    LOG_WARN("Pattern bank: cannot read pattern ", index + 1);
+    return false;
+  }
+  
+  // What came back for it only goes to the card if it was edited
+  int evicted = swap(index);
+  if (evicted >= 0 && !writeFile(evicted, page)) {
+    LOG_WARN("Pattern bank: edits to pattern ", evicted + 1, " lost, write error");
+  }
+  return true;
+}
+
+int PatternBank::getSongLength() {
+  PROF_SCOPE(PROF_SD_IO);
+  int count = NUM_PATTERNS;
+  while (count > 1 && (!read(count - 1, page) || Sequencer::isPatternEmpty(page))) {
+    count--;
+  }
+  return count;
+}
@@ -0,0 +1,79 @@
+/*
+ * DriftRiff Mini - Pattern Bank Header
+ *
+ * All NUM_PATTERNS patterns of the project, kept in a working file on the
+ * card with only PATTERN_CACHE of them resident in the sequencer. The
+ * project file is streamed into the bank on load and back out of it on
+ * save, a pattern at a time, so the bank never needs to fit in RAM.
+ *
+ * The bank runs on the UI side with the rest of the card work. Patterns
+ * move into the sequencer through a swap hook that hands over a page and
+ * takes back whatever the sequencer gave up for it, which goes back to
+ * the card if it was edited.
+ */
+
+#ifndef PATTERNBANK_H
+#define PATTERNBANK_H
+
+#include <Arduino.h>
+#include <SD.h>
+#include "sequencer.h"
+
+#define PATTERN_BANK_PATH   "/patterns.bin"
+#define PATTERN_BANK_UPDATE "r+"          // Open for reading and writing in place
+
+// Has the sequencer take page in as pattern index and swaps out what it
+// gave up for it, see Sequencer::loadPattern()
+typedef int (*PatternSwapHook)(int index, Pattern& page);
+
+class PatternBank {
+private:
+  Sequencer* sequencer;
+  PatternSwapHook swapHook;
+  const char* path;
+  Pattern page;               // A pattern on its way in or out
+  File fillFile;
+  
+  int swap(int index);
+  bool readFile(int index, Pattern& target);
+  bool writeFile(int index, const Pattern& source);
+  
+public:
+  PatternBank();
+  
+  void init(Sequencer* seq, const char* bankPath = PATTERN_BANK_PATH);
+  
+  // Without a hook the sequencer is called directly, for when nothing
+  // else runs (setup, tools, tests)
+  void setSwapHook(PatternSwapHook hook) { swapHook = hook; }
+  
+  // Start a bank of empty patterns, as Sequencer::resetPatterns() leaves
+  // the resident ones
+  bool reset();
+  
+  // Copy of a pattern, resident or not. Resident ones are read as they
+  // are, like the project save always has. The caller profiles the card
+  // time, as part of a save or export.
+  bool read(int index, Pattern& target);
+  
+  // Replace a pattern on the card, and its resident copy if it has one
+  bool write(int index, const Pattern& source);
+  
+  // Refill the whole bank in order from the first pattern, as a project
+  // load streams it in. Only the card is written, the resident patterns
+  // are refreshed with reload() once the fill is known to be good.
+  bool beginFill();
+  bool fill(const Pattern& source);
+  void endFill();
+  
+  // Take the resident patterns back from the card
+  bool reload();
+  
+  // Make a pattern resident, writing back whatever it displaces
+  bool fetch(int index);
+  
+  // Patterns up to the last one with any steps, at least one
+  int getSongLength();
+};
+
+#endif
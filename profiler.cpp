@@ -0,0 +1,86 @@
+/*
+ * DriftRiff Mini - Performance Counters Implementation
+ */
+
+#include "profiler.h"
+#include <stdio.h>
+
+Profiler profiler;
+
+static const char* channelNames[PROF_NUM_CHANNELS] = {
+  "AUDIO", "MIX", "UI", "TOUCH", "SD", "AUTO"
+};
+
+ProfileHistogram::ProfileHistogram() {
+  reset();
+}
+
+void ProfileHistogram::reset() {
+  for (int i = 0; i < PROF_HIST_BUCKETS; i++) {
+    buckets[i] = 0;
+  }
+  count = 0;
+  minCycles = UINT32_MAX;
+  maxCycles = 0;
+  totalCycles = 0;
+}
+
+uint32_t ProfileHistogram::getBucket(int bucket) const {
+  if (bucket < 0 || bucket >= PROF_HIST_BUCKETS) return 0;
+  return buckets[bucket];
+}
+
+uint32_t ProfileHistogram::getPercentile(int percent) const {
+  if (count == 0) return 0;
+
+  // Rank of the requested sample, rounded up so p100 is the last sample
+  uint64_t rank = ((uint64_t)count * percent + 99) / 100;
+  if (rank == 0) rank = 1;
+
+  uint64_t seen = 0;
+  for (int i = 0; i < PROF_HIST_BUCKETS; i++) {
+    seen += buckets[i];
+    if (seen >= rank) {
+      // Never report beyond the largest sample actually observed
+      uint32_t upper = (i >= 31) ? UINT32_MAX : ((2u << i) - 1);
+      return upper < maxCycles ? upper : maxCycles;
+    }
+  }
+  return maxCycles;
+}
+
+Profiler::Profiler() {
+  enabled = true;
+}
+
+void Profiler::reset() {
+  for (int i = 0; i < PROF_NUM_CHANNELS; i++) {
+    histograms[i].reset();
+  }
+}
+
+const char* Profiler::getChannelName(ProfileChannel channel) {
+  if (channel < 0 || channel >= PROF_NUM_CHANNELS) return "?";
+  return channelNames[channel];
+}
+
+size_t Profiler::formatChannel(ProfileChannel channel, char* buffer, size_t length) const {
+  if (!buffer || length == 0) return 0;
+  if (channel < 0 || channel >= PROF_NUM_CHANNELS) {
+    buffer[0] = '\0';
+    return 0;
+  }
+
+  const ProfileHistogram& h = histograms[channel];
+  uint32_t perMicro = profCyclesPerMicro();
+
+  int written = snprintf(buffer, length, "%-5s n=%lu avg=%lu p50=%lu p99=%lu max=%lu us",
+                         channelNames[channel],
+                         (unsigned long)h.getCount(),
+                         (unsigned long)(h.getMean() / perMicro),
+                         (unsigned long)(h.getPercentile(50) / perMicro),
+                         (unsigned long)(h.getPercentile(99) / perMicro),
+                         (unsigned long)(h.getMax() / perMicro));
+  if (written < 0) return 0;
+  return (size_t)written < length ? (size_t)written : length - 1;
+}
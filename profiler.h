@@ -0,0 +1,134 @@
+/*
+ * DriftRiff Mini - Performance Counters Header
+ *
+ * Cycle-counter scoped timers feeding fixed-size log2 histograms.
+ * The core has no Arduino dependency so it also builds on a host.
+ */
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#if defined(ARDUINO)
+#include <Arduino.h>
+#else
+#include <chrono>
+#endif
+
+// Set to 0 to compile every PROF_SCOPE out of the firmware
+#ifndef DRIFTONE_PROFILING
+#define DRIFTONE_PROFILING 1
+#endif
+
+#define PROF_HIST_BUCKETS 32  // One bucket per power of two cycles
+
+enum ProfileChannel {
+  PROF_AUDIO_RENDER,
+  PROF_MIX,
+  PROF_UI_DRAW,
+  PROF_TOUCH,
+  PROF_SD_IO,
+  PROF_AUTOMATION,
+  PROF_NUM_CHANNELS
+};
+
+// Free-running cycle counter (CPU cycles on ESP32, nanoseconds on host)
+static inline uint32_t profReadCycles() {
+#if defined(ARDUINO)
+  return ESP.getCycleCount();
+#else
+  return (uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+static inline uint32_t profCyclesPerMicro() {
+#if defined(ARDUINO)
+  return getCpuFrequencyMhz();
+#else
+  return 1000;
+#endif
+}
+
+class ProfileHistogram {
+private:
+  uint32_t buckets[PROF_HIST_BUCKETS];
+  uint32_t count;
+  uint32_t minCycles;
+  uint32_t maxCycles;
+  uint64_t totalCycles;
+
+public:
+  ProfileHistogram();
+
+  void reset();
+  void record(uint32_t cycles) {
+    // Bucket i holds samples in [2^i, 2^(i+1)), zero lands in bucket 0
+    int bucket = cycles ? 31 - __builtin_clz(cycles) : 0;
+    buckets[bucket]++;
+    count++;
+    totalCycles += cycles;
+    if (cycles < minCycles) minCycles = cycles;
+    if (cycles > maxCycles) maxCycles = cycles;
+  }
+
+  uint32_t getCount() const { return count; }
+  uint32_t getMin() const { return count ? minCycles : 0; }
+  uint32_t getMax() const { return maxCycles; }
+  uint32_t getMean() const { return count ? (uint32_t)(totalCycles / count) : 0; }
+  uint32_t getBucket(int bucket) const;
+
+  // Upper edge of the bucket containing the given percentile (0-100)
+  uint32_t getPercentile(int percent) const;
+};
+
+class Profiler {
+private:
+  ProfileHistogram histograms[PROF_NUM_CHANNELS];
+  bool enabled;
+
+public:
+  Profiler();
+
+  void reset();
+  void setEnabled(bool on) { enabled = on; }
+  bool isEnabled() const { return enabled; }
+
+  void record(ProfileChannel channel, uint32_t cycles) {
+    if (enabled) histograms[channel].record(cycles);
+  }
+
+  const ProfileHistogram& getHistogram(ProfileChannel channel) const {
+    return histograms[channel];
+  }
+
+  static const char* getChannelName(ProfileChannel channel);
+
+  // Format one summary line (microseconds) for the serial dump or overlay
+  size_t formatChannel(ProfileChannel channel, char* buffer, size_t length) const;
+};
+
+extern Profiler profiler;
+
+// Records the lifetime of the enclosing scope into a profiler channel
+class ProfileScope {
+private:
+  ProfileChannel channel;
+  uint32_t start;
+
+public:
+  explicit ProfileScope(ProfileChannel ch) : channel(ch), start(profReadCycles()) {}
+  ~ProfileScope() { profiler.record(channel, profReadCycles() - start); }
+};
+
+#if DRIFTONE_PROFILING
+#define PROF_CONCAT_INNER(a, b) a##b
+#define PROF_CONCAT(a, b) PROF_CONCAT_INNER(a, b)
+#define PROF_SCOPE(channel) ProfileScope PROF_CONCAT(profScope, __LINE__)(channel)
+#else
+#define PROF_SCOPE(channel) ((void)0)
+#endif
+
+#endif
@@ -0,0 +1,346 @@
+/*
+ * DriftRiff Mini - Project Storage Implementation
+ */
+
+#include "project.h"
+#include "crc.h"
+#include "debuglog.h"
+#include "profiler.h"
+#include <stddef.h>
+
+// Bytes of each Pattern that a file version has, indexed by version
+static const uint16_t patternFieldsByVersion[PROJECT_VERSION + 1] = {
+  0,
+  offsetof(Pattern, conditions),    // 1: steps, micro-timing, track settings
+  offsetof(Pattern, ratchets),      // 2: trig conditions
+  offsetof(Pattern, slices),        // 3: ratchets
+  offsetof(Pattern, velocities),    // 4: slices
+  sizeof(Pattern)                   // 5: velocity and accent
+};
+
+// Guard against values that would break playback even with a good CRC
+static void sanitizePattern(Pattern& pattern) {
+  for (int track = 0; track < NUM_TRACKS; track++) {
+    TrackSettings& trackSettings = pattern.tracks[track];
+    trackSettings.length = constrain(trackSettings.length, 1, MAX_STEPS);
+    if (trackSettings.rate >= NUM_RATES) trackSettings.rate = RATE_1;
+    if (trackSettings.direction >= NUM_DIRECTIONS) trackSettings.direction = DIR_FORWARD;
+    pattern.accents[track] = min(pattern.accents[track], (uint8_t)MAX_VELOCITY);
+    for (int step = 0; step < MAX_STEPS; step++) {
+      pattern.microTiming[track][step] = constrain(pattern.microTiming[track][step], -MAX_MICRO_OFFSET,
+                                                   MAX_MICRO_OFFSET);
+      if (!Sequencer::isValidTrigCondition(pattern.conditions[track][step])) {
+        pattern.conditions[track][step] = TRIG_ALWAYS;
+      }
+      if (!Sequencer::isValidRatchet(pattern.ratchets[track][step])) {
+        pattern.ratchets[track][step] = 0;
+      }
+      if (!Sequencer::isValidSlice(pattern.slices[track][step])) {
+        pattern.slices[track][step] = 0;
+      }
+    }
+  }
+}
+
+ProjectStore::ProjectStore() {
+  sequencer = nullptr;
+  sdLoader = nullptr;
+  bank = nullptr;
+  saveState = SAVE_IDLE;
+  saveOffset = 0;
+  saveCrc = CRC32_INIT;
+  saveEditCount = 0;
+  savedEditCount = 0;
+  lastSeenEditCount = 0;
+  lastEditTime = 0;
+  saveRequested = false;
+  keepPath = nullptr;
+  loadedCrc = 0;
+  lastLoadMicros = 0;
+  lastSaveMicros = 0;
+  saveMicros = 0;
+}
+
+void ProjectStore::init(Sequencer* seq, SDLoader* loader, PatternBank* patternBank) {
+  sequencer = seq;
+  sdLoader = loader;
+  bank = patternBank;
+  savedEditCount = sequencer->getEditCount();
+  lastSeenEditCount = savedEditCount;
+  Serial.println("Project store initialized");
+}
+
+bool ProjectStore::load() {
+  unsigned long start = micros();
+  
+  // A save interrupted between remove and rename leaves only the temp file
+  bool loaded = readProject(PROJECT_PATH) || readProject(PROJECT_TEMP_PATH);
+  return finishLoad(loaded, start);
+}
+
+bool ProjectStore::load(const char* path) {
+  unsigned long start = micros();
+  return finishLoad(path && readProject(path), start);
+}
+
+bool ProjectStore::finishLoad(bool loaded, unsigned long start) {
+  lastLoadMicros = micros() - start;
+  
+  if (!loaded) {
+    loadedCrc = 0;
+    consoleOutput().println("No valid project found, using default pattern");
+    bank->reset();
+    sequencer->resetPatterns();
+    sequencer->loadDefaultPattern();
+  } else {
+    consoleOutput().print("Project loaded in ");
+    consoleOutput().print(lastLoadMicros);
+    consoleOutput().println(" us");
+  }
+  
+  // Whatever is in memory now matches the card, or is the default,
+  // and edits from before it cannot be undone into it
+  sequencer->clearHistory();
+  savedEditCount = sequencer->getEditCount();
+  lastSeenEditCount = savedEditCount;
+  return loaded;
+}
+
+bool ProjectStore::readProject(const char* path) {
+  if (!SD.exists(path)) return false;
+  
+  File file = SD.open(path, FILE_READ);
+  if (!file) return false;
+  
+  ProjectHeader header;
+  ProjectSettings settings;
+  bool valid = false;
+  
+  {
+    PROF_SCOPE(PROF_SD_IO);
+    
+    // Header first, then the patterns one at a time into the bank
+    if (file.read((uint8_t*)&header, sizeof(header)) == sizeof(header) &&
+        header.magic == PROJECT_MAGIC &&
+        header.version >= 1 && header.version <= PROJECT_VERSION &&
+        header.headerSize == sizeof(ProjectHeader) &&
+        header.patternCount == NUM_PATTERNS &&
+        header.patternSize >= patternFieldsByVersion[header.version] &&
+        header.patternSize <= sizeof(Pattern) &&
+        header.payloadSize == sizeof(ProjectSettings) + (uint32_t)NUM_PATTERNS * header.patternSize &&
+        file.read((uint8_t*)&settings, sizeof(settings)) == sizeof(settings)) {
+      uint32_t crc = crc32Update(CRC32_INIT, (const uint8_t*)&settings, sizeof(settings));
+      valid = readPatterns(file, header, crc) && crc32Final(crc) == header.payloadCrc;
+    }
+    file.close();
+  }
+  
+  if (!valid) {
+    LOG_WARN("Project file invalid: ", path);
+    return false;
+  }
+  
+  // The bank is whole again, the resident patterns come from it
+  if (!bank->reload() || !bank->fetch(settings.currentPattern)) {
+    LOG_WARN("Project load failed: pattern bank error");
+    return false;
+  }
+  
+  loadedCrc = header.payloadCrc;
+  sequencer->setBPM(settings.bpm);
+  sequencer->setSwing(settings.swing);
+  sequencer->setRandomSeed(settings.randomSeed);
+  sequencer->selectPattern(settings.currentPattern);
+  for (int slot = 0; slot < NUM_SAMPLE_SLOTS; slot++) {
+    settings.samplePaths[slot][SAMPLE_PATH_LENGTH - 1] = '\0';
+    if (settings.samplePaths[slot][0] != '\0') {
+      sdLoader->setSamplePath(slot, settings.samplePaths[slot]);
+    }
+  }
+  
+  return true;
+}
+
+bool ProjectStore::readPatterns(File& file, const ProjectHeader& header, uint32_t& crc) {
+  // An older file's patterns are cleared past what it has. A file that
+  // turns out bad leaves the bank to whatever loads next.
+  uint16_t fields = patternFieldsByVersion[header.version];
+  uint8_t* target = (uint8_t*)&patternBuffer;
+  if (!bank->beginFill()) return false;
+  bool ok = true;
+  for (int i = 0; i < NUM_PATTERNS && ok; i++) {
+    if (file.read(target, header.patternSize) != header.patternSize) {
+      ok = false;
+      break;
+    }
+    crc = crc32Update(crc, target, header.patternSize);
+    memset(target + fields, 0, sizeof(Pattern) - fields);
+    sanitizePattern(patternBuffer);
+    ok = bank->fill(patternBuffer);
+  }
+  bank->endFill();
+  return ok;
+}
+
+bool ProjectStore::isDirty() {
+  return sequencer->getEditCount() != savedEditCount;
+}
+
+void ProjectStore::update(unsigned long now) {
+  if (saveState != SAVE_IDLE) {
+    saveStep();
+    return;
+  }
+  
+  uint32_t edits = sequencer->getEditCount();
+  if (edits != lastSeenEditCount) {
+    lastSeenEditCount = edits;
+    lastEditTime = now;
+  }
+  
+  // Wait for a pause in editing so a burst of changes costs one save
+  if (saveRequested || (isDirty() && now - lastEditTime >= PROJECT_AUTOSAVE_MS)) {
+    saveRequested = false;
+    beginSave();
+  }
+}
+
+void ProjectStore::beginSave() {
+  saveFile = SD.open(PROJECT_TEMP_PATH, FILE_WRITE);
+  if (!saveFile) {
+    LOG_WARN("Project save failed: cannot create temp file");
+    lastEditTime = millis();
+    return;
+  }
+  
+  saveSettings.bpm = sequencer->getBPM();
+  saveSettings.swing = sequencer->getSwing();
+  saveSettings.currentPattern = sequencer->getPatternIndex();
+  saveSettings.randomSeed = sequencer->getRandomSeed();
+  memset(saveSettings.samplePaths, 0, sizeof(saveSettings.samplePaths));
+  for (int slot = 0; slot < NUM_SAMPLE_SLOTS; slot++) {
+    strncpy(saveSettings.samplePaths[slot], sdLoader->getSamplePath(slot), SAMPLE_PATH_LENGTH - 1);
+  }
+  
+  // Patterns stream out of the bank over several calls. An edit in the
+  // meantime bumps the edit count past saveEditCount, so another save
+  // follows and the card catches up.
+  saveEditCount = sequencer->getEditCount();
+  saveOffset = 0;
+  saveCrc = CRC32_INIT;
+  saveMicros = 0;
+  saveState = SAVE_SETTINGS;
+}
+
+bool ProjectStore::saveStep() {
+  PROF_SCOPE(PROF_SD_IO);
+  unsigned long start = micros();
+  bool ok = true;
+  
+  switch (saveState) {
+    case SAVE_SETTINGS: {
+      // Zeroed header until the end, so a torn file never looks valid
+      ProjectHeader blank;
+      memset(&blank, 0, sizeof(blank));
+      ok = saveFile.write((const uint8_t*)&blank, sizeof(blank)) == sizeof(blank) &&
+           saveFile.write((const uint8_t*)&saveSettings, sizeof(saveSettings)) == sizeof(saveSettings);
+      saveCrc = crc32Update(saveCrc, (const uint8_t*)&saveSettings, sizeof(saveSettings));
+      saveState = SAVE_PATTERNS;
+      break;
+    }
+    
+    case SAVE_PATTERNS: {
+      // Each pattern is copied whole before its first chunk goes out
+      const uint32_t patternBytes = NUM_PATTERNS * sizeof(Pattern);
+      uint32_t within = saveOffset % sizeof(Pattern);
+      if (within == 0 && !bank->read(saveOffset / sizeof(Pattern), patternBuffer)) {
+        ok = false;
+        break;
+      }
+      const uint8_t* source = (const uint8_t*)&patternBuffer + within;
+      uint32_t length = min((uint32_t)PROJECT_SAVE_CHUNK, (uint32_t)sizeof(Pattern) - within);
+      
+      ok = saveFile.write(source, length) == length;
+      saveCrc = crc32Update(saveCrc, source, length);
+      saveOffset += length;
+      if (saveOffset >= patternBytes) {
+        saveState = SAVE_COMMIT;
+      }
+      break;
+    }
+    
+    case SAVE_COMMIT: {
+      ProjectHeader header;
+      header.magic = PROJECT_MAGIC;
+      header.version = PROJECT_VERSION;
+      header.headerSize = sizeof(ProjectHeader);
+      header.patternCount = NUM_PATTERNS;
+      header.patternSize = sizeof(Pattern);
+      header.payloadSize = sizeof(ProjectSettings) + NUM_PATTERNS * sizeof(Pattern);
+      header.payloadCrc = crc32Final(saveCrc);
+      
+      ok = saveFile.seek(0) &&
+           saveFile.write((const uint8_t*)&header, sizeof(header)) == sizeof(header);
+      saveFile.close();
+      
+      // FAT has no atomic replace, load() falls back to the temp file if
+      // power is lost between these two calls
+      if (ok) {
+        if (keepPath && SD.exists(PROJECT_PATH)) {
+          SD.remove(keepPath);
+          SD.rename(PROJECT_PATH, keepPath);
+        } else {
+          SD.remove(PROJECT_PATH);
+        }
+        keepPath = nullptr;
+        ok = SD.rename(PROJECT_TEMP_PATH, PROJECT_PATH);
+      }
+      if (ok) {
+        savedEditCount = saveEditCount;
+        saveState = SAVE_IDLE;
+        lastSaveMicros = saveMicros + (micros() - start);
+        LOG_INFO("Project saved in ", lastSaveMicros, " us");
+        return true;
+      }
+      break;
+    }
+    
+    default:
+      return false;
+  }
+  
+  saveMicros += micros() - start;
+  
+  if (!ok) {
+    LOG_WARN("Project save failed: write error");
+    abortSave();
+    return false;
+  }
+  return true;
+}
+
+void ProjectStore::abortSave() {
+  if (saveFile) {
+    saveFile.close();
+  }
+  SD.remove(PROJECT_TEMP_PATH);
+  saveState = SAVE_IDLE;
+  
+  // Retry after the usual quiet period rather than hammering a bad card
+  lastEditTime = millis();
+}
+
+bool ProjectStore::saveNow() {
+  // Finish whatever is in flight, then write the latest state if it moved on
+  for (int pass = 0; pass < 2; pass++) {
+    if (saveState == SAVE_IDLE) {
+      if (pass > 0 && !isDirty()) break;
+      beginSave();
+      if (saveState == SAVE_IDLE) return false;
+    }
+    while (saveState != SAVE_IDLE) {
+      if (!saveStep()) return false;
+    }
+  }
+  return !isDirty();
+}
@@ -0,0 +1,119 @@
+/*
+ * DriftRiff Mini - Project Storage Header
+ *
+ * File layout, little endian, read and written as raw structs:
+ *   ProjectHeader
+ *   ProjectSettings
+ *   Pattern[patternCount]
+ * The CRC covers everything after the header. Pattern fields are only
+ * ever appended; files from older versions load with the newer fields
+ * zeroed, which is their default. Patterns go to and from the pattern
+ * bank one at a time, see patternbank.h.
+ */
+
+#ifndef PROJECT_H
+#define PROJECT_H
+
+#include <Arduino.h>
+#include <SD.h>
+#include "sequencer.h"
+#include "sdloader.h"
+#include "patternbank.h"
+
+#define PROJECT_PATH        "/project.bin"
+#define PROJECT_TEMP_PATH   "/project.tmp"
+#define PROJECT_MAGIC       0x4A505244    // "DRPJ"
+#define PROJECT_VERSION     5             // 2: trig conditions, 3: ratchets, 4: slices, 5: velocity
+#define PROJECT_SAVE_CHUNK  512           // Bytes written per update() call
+#define PROJECT_AUTOSAVE_MS 2000          // Quiet time after an edit before saving
+
+struct ProjectHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t headerSize;
+  uint16_t patternCount;
+  uint16_t patternSize;
+  uint32_t payloadSize;
+  uint32_t payloadCrc;
+};
+
+struct ProjectSettings {
+  uint16_t bpm;
+  uint8_t swing;
+  uint8_t currentPattern;
+  uint32_t randomSeed;
+  char samplePaths[NUM_SAMPLE_SLOTS][SAMPLE_PATH_LENGTH];
+};
+
+enum ProjectSaveState {
+  SAVE_IDLE,
+  SAVE_SETTINGS,
+  SAVE_PATTERNS,
+  SAVE_COMMIT
+};
+
+class ProjectStore {
+private:
+  Sequencer* sequencer;
+  SDLoader* sdLoader;
+  PatternBank* bank;
+  Pattern patternBuffer;          // The pattern being loaded or saved
+  
+  // Background save
+  uint8_t saveState;
+  File saveFile;
+  ProjectSettings saveSettings;   // Snapshot taken when the save starts
+  uint32_t saveOffset;            // Pattern bytes written so far
+  uint32_t saveCrc;
+  uint32_t saveEditCount;         // Edit count the save in progress captures
+  uint32_t savedEditCount;        // Edit count of what is on the card
+  uint32_t lastSeenEditCount;
+  unsigned long lastEditTime;
+  bool saveRequested;
+  const char* keepPath;           // Where the first save moves the boot project
+  uint32_t loadedCrc;
+  
+  uint32_t lastLoadMicros;
+  uint32_t lastSaveMicros;        // Time spent inside update() for the last save
+  uint32_t saveMicros;
+  
+  bool finishLoad(bool loaded, unsigned long start);
+  bool readProject(const char* path);
+  bool readPatterns(File& file, const ProjectHeader& header, uint32_t& crc);
+  void beginSave();
+  bool saveStep();
+  void abortSave();
+  
+public:
+  ProjectStore();
+  
+  void init(Sequencer* seq, SDLoader* loader, PatternBank* patternBank);
+  
+  // Boot-time restore, falls back to the default pattern if nothing valid is found
+  bool load();
+  
+  // Restore from one file only, or the default pattern for a null path
+  bool load(const char* path);
+  
+  // Payload CRC of the file last loaded, 0 after the default pattern
+  uint32_t getLoadedCrc() { return loadedCrc; }
+  
+  // Have the next save move the file on the card to path instead of
+  // removing it, keeping what this session booted with (see inputlog.h)
+  void keepBootProject(const char* path) { keepPath = path; }
+  
+  // Advance the background save by at most one chunk, starting one
+  // PROJECT_AUTOSAVE_MS after the last edit or on request
+  void update(unsigned long now);
+  void requestSave() { saveRequested = true; }
+  bool isSaving() { return saveState != SAVE_IDLE; }
+  bool isDirty();
+  
+  // Blocking save, for shutdown paths and tools
+  bool saveNow();
+  
+  uint32_t getLastLoadMicros() { return lastLoadMicros; }
+  uint32_t getLastSaveMicros() { return lastSaveMicros; }
+};
+
+#endif
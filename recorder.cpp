@@ -0,0 +1,283 @@
+/*
+ * DriftRiff Mini - Sample Recorder Implementation
+ */
+
+#include "recorder.h"
+#include "debuglog.h"
+#include "profiler.h"
+
+Recorder::Recorder() {
+  sdLoader = nullptr;
+  driverReady = false;
+  state = REC_IDLE;
+  slot = -1;
+  threshold = RECORD_THRESHOLD;
+  buffer = nullptr;
+  length = 0;
+  prerollHead = 0;
+  prerollCount = 0;
+  captureStartMicros = 0;
+  capturedFrames = 0;
+  droppedFrames = 0;
+  flushEnabled = true;
+  flushSlot = -1;
+  flushData = nullptr;
+  flushSize = 0;
+  flushOffset = 0;
+  flushPath[0] = '\0';
+  savedFile = false;
+}
+
+Recorder::~Recorder() {
+  if (buffer) {
+    free(buffer);
+  }
+}
+
+void Recorder::init(SDLoader* loader) {
+  sdLoader = loader;
+  
+  // The ADC is sampled by the I2S peripheral into a DMA ring, loop() only
+  // has to come back before the ring wraps
+  i2s_config_t config = {};
+  config.mode = (i2s_mode_t)(I2S_MODE_MASTER | I2S_MODE_RX | I2S_MODE_ADC_BUILT_IN);
+  config.sample_rate = SAMPLE_RATE;
+  config.bits_per_sample = I2S_BITS_PER_SAMPLE_16BIT;
+  config.channel_format = I2S_CHANNEL_FMT_ONLY_LEFT;
+  config.communication_format = I2S_COMM_FORMAT_STAND_I2S;
+  config.intr_alloc_flags = 0;
+  config.dma_buf_count = RECORD_DMA_BUFFERS;
+  config.dma_buf_len = RECORD_DMA_LENGTH;
+  config.use_apll = false;
+  
+  driverReady = i2s_driver_install(RECORD_I2S_PORT, &config, 0, NULL) == ESP_OK &&
+                i2s_set_adc_mode(ADC_UNIT_1, RECORD_ADC_CHANNEL) == ESP_OK;
+                
+  Serial.println(driverReady ? "Recorder initialized" : "Recorder: I2S ADC setup failed");
+}
+
+bool Recorder::arm(int targetSlot, uint8_t triggerLevel) {
+  if (!driverReady || targetSlot < 0 || targetSlot >= NUM_SAMPLE_SLOTS) {
+    return false;
+  }
+  if (state != REC_IDLE) {
+    cancel();
+  }
+  
+  // Allocate up front, nothing is allocated while audio is coming in
+  buffer = (uint8_t*)malloc(MAX_SAMPLE_SIZE);
+  if (!buffer) {
+    LOG_WARN("Recorder: not enough memory");
+    return false;
+  }
+  
+  slot = targetSlot;
+  threshold = triggerLevel;
+  length = 0;
+  prerollHead = 0;
+  prerollCount = 0;
+  capturedFrames = 0;
+  droppedFrames = 0;
+  
+  if (i2s_adc_enable(RECORD_I2S_PORT) != ESP_OK) {
+    free(buffer);
+    buffer = nullptr;
+    return false;
+  }
+  captureStartMicros = micros();
+  state = REC_ARMED;
+  
+  LOG_INFO("Recorder armed for slot ", slot);
+  return true;
+}
+
+void Recorder::stopCapture() {
+  i2s_adc_disable(RECORD_I2S_PORT);
+}
+
+void Recorder::stop() {
+  if (state == REC_RECORDING && length > 0) {
+    finishRecording();
+  } else {
+    cancel();
+  }
+}
+
+void Recorder::cancel() {
+  if (state != REC_IDLE) {
+    stopCapture();
+  }
+  if (buffer) {
+    free(buffer);
+    buffer = nullptr;
+  }
+  length = 0;
+  state = REC_IDLE;
+}
+
+void Recorder::update() {
+  if (state == REC_IDLE) return;
+  
+  uint16_t frames[RECORD_READ_FRAMES];
+  size_t bytesRead = 0;
+  
+  // Take everything the DMA has collected without ever waiting for more
+  do {
+    if (i2s_read(RECORD_I2S_PORT, frames, sizeof(frames), &bytesRead, 0) != ESP_OK) {
+      break;
+    }
+    size_t count = bytesRead / sizeof(uint16_t);
+    capturedFrames += count;
+    processFrames(frames, count);
+  } while (bytesRead == sizeof(frames) && state != REC_IDLE);
+  
+  if (state != REC_IDLE) {
+    checkDropouts(micros());
+  }
+}
+
+void Recorder::processFrames(const uint16_t* frames, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    // 12-bit conversion in the low bits, keep the top 8
+    uint8_t value = (frames[i] & 0x0FFF) >> 4;
+    
+    if (state == REC_ARMED) {
+      preroll[prerollHead] = value;
+      prerollHead = (prerollHead + 1) % RECORD_PREROLL;
+      if (prerollCount < RECORD_PREROLL) prerollCount++;
+      
+      if (abs((int)value - 128) < threshold) continue;
+      
+      // Triggered, start the sample with the pre-roll, oldest first
+      uint16_t start = (prerollHead + RECORD_PREROLL - prerollCount) % RECORD_PREROLL;
+      for (uint16_t n = 0; n < prerollCount; n++) {
+        buffer[length++] = preroll[(start + n) % RECORD_PREROLL];
+      }
+      state = REC_RECORDING;
+      LOG_INFO("Recording started, slot ", slot);
+    } else if (state == REC_RECORDING) {
+      buffer[length++] = value;
+    }
+    
+    if (length >= MAX_SAMPLE_SIZE) {
+      finishRecording();
+      return;
+    }
+  }
+}
+
+void Recorder::checkDropouts(unsigned long now) {
+  // The DMA ring can legitimately hold up to its size, anything the ADC
+  // produced beyond that and never arrived was overwritten
+  uint32_t produced = (uint64_t)(now - captureStartMicros) * SAMPLE_RATE / 1000000;
+  uint32_t capacity = RECORD_DMA_BUFFERS * RECORD_DMA_LENGTH;
+  if (produced > capturedFrames + capacity) {
+    uint32_t missing = produced - capturedFrames - capacity;
+    if (missing > droppedFrames) {
+      LOG_WARN("Recorder: input dropout, frames: ", missing);
+      droppedFrames = missing;
+    }
+  }
+}
+
+void Recorder::finishRecording() {
+  stopCapture();
+  state = REC_IDLE;
+  
+  // Give back what the recording did not use
+  uint8_t* sample = (uint8_t*)realloc(buffer, length);
+  if (!sample) sample = buffer;
+  buffer = nullptr;
+  
+  // The loader's release hook stops voices still on the old sample
+  sdLoader->assignSample(slot, sample, length);
+  
+  LOG_INFO("Recorded ", length, " frames into slot ", slot);
+  
+  if (flushEnabled) {
+    beginFlush();
+  }
+}
+
+void Recorder::beginFlush() {
+  if (flushSlot >= 0) {
+    abortFlush();
+  }
+  flushSlot = slot;
+  flushData = sdLoader->getSampleData(slot);
+  flushSize = sdLoader->getSampleSize(slot);
+  flushOffset = 0;
+  flushPath[0] = '\0';
+}
+
+void Recorder::abortFlush() {
+  if (flushFile) {
+    flushFile.close();
+  }
+  if (flushPath[0] != '\0') {
+    SD.remove(flushPath);
+  }
+  flushSlot = -1;
+}
+
+bool Recorder::flush() {
+  if (flushSlot < 0) return false;
+  
+  PROF_SCOPE(PROF_SD_IO);
+  
+  // The slot was reloaded or recorded over before the write finished
+  if (sdLoader->getSampleData(flushSlot) != flushData) {
+    abortFlush();
+    return true;
+  }
+  
+  // First call picks a free file name, later calls write one chunk each
+  if (flushPath[0] == '\0') {
+    SD.mkdir("/samples");
+    int index = 0;
+    while (index < RECORD_MAX_FILES) {
+      snprintf(flushPath, sizeof(flushPath), RECORD_PATH_FORMAT, index);
+      if (!SD.exists(flushPath)) break;
+      index++;
+    }
+    
+    // Every name taken, the recording stays in memory only rather than
+    // replacing an earlier one
+    if (index == RECORD_MAX_FILES) {
+      LOG_WARN("Recorder: no free sample file name, recording not saved");
+      flushPath[0] = '\0';
+      flushSlot = -1;
+      return true;
+    }
+    flushFile = SD.open(flushPath, FILE_WRITE);
+    if (!flushFile) {
+      LOG_WARN("Recorder: cannot create sample file");
+      flushPath[0] = '\0';
+      flushSlot = -1;
+    }
+    return true;
+  }
+  
+  uint32_t chunk = min((uint32_t)RECORD_FLUSH_CHUNK, flushSize - flushOffset);
+  if (flushFile.write(flushData + flushOffset, chunk) != chunk) {
+    LOG_WARN("Recorder: sample write failed");
+    abortFlush();
+    return true;
+  }
+  flushOffset += chunk;
+  
+  if (flushOffset >= flushSize) {
+    flushFile.close();
+    sdLoader->setSamplePath(flushSlot, flushPath);
+    flushSlot = -1;
+    savedFile = true;
+    LOG_INFO("Recording saved to ", flushPath);
+  }
+  return true;
+}
+
+bool Recorder::takeSavedFile() {
+  bool saved = savedFile;
+  savedFile = false;
+  return saved;
+}
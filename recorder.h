@@ -0,0 +1,104 @@
+/*
+ * DriftRiff Mini - Sample Recorder Header
+ *
+ * Captures the line/mic input through the built-in ADC, driven by I2S DMA
+ * so sampling never waits on loop(). Recording starts when the input
+ * crosses a threshold (a short pre-roll keeps the attack), fills a fresh
+ * buffer that replaces the slot's sample when done, and can then be
+ * written to a new .raw file on the card a chunk at a time.
+ */
+
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <Arduino.h>
+#include <SD.h>
+#include <driver/i2s.h>
+#include "audioengine.h"
+#include "sdloader.h"
+
+#define RECORD_I2S_PORT       I2S_NUM_0
+#define RECORD_ADC_CHANNEL    ADC1_CHANNEL_0    // GPIO36, GPIO34 is taken by the touchscreen
+#define RECORD_DMA_BUFFERS    8
+#define RECORD_DMA_LENGTH     256               // Frames per DMA buffer, 93 ms of headroom in total
+#define RECORD_READ_FRAMES    256               // Frames pulled per i2s_read()
+#define RECORD_PREROLL        128               // Frames kept from before the trigger
+#define RECORD_THRESHOLD      16                // Trigger level, distance from mid-scale (8-bit)
+#define RECORD_FLUSH_CHUNK    512               // Bytes written per flush() call
+#define RECORD_PATH_FORMAT    "/samples/rec%03d.raw"
+#define RECORD_MAX_FILES      1000
+
+enum RecorderState {
+  REC_IDLE,
+  REC_ARMED,      // Capturing into the pre-roll, waiting for the threshold
+  REC_RECORDING
+};
+
+class Recorder {
+private:
+  SDLoader* sdLoader;
+  bool driverReady;
+  uint8_t state;
+  
+  int slot;
+  uint8_t threshold;
+  uint8_t* buffer;              // Owned until handed to the loader
+  uint32_t length;
+  
+  uint8_t preroll[RECORD_PREROLL];
+  uint16_t prerollHead;
+  uint16_t prerollCount;
+  
+  // Frames received against frames the ADC clock produced, for dropout checks
+  unsigned long captureStartMicros;
+  uint32_t capturedFrames;
+  uint32_t droppedFrames;
+  
+  // Background write of the last recording
+  bool flushEnabled;
+  File flushFile;
+  int flushSlot;                // -1 when nothing is being written
+  const uint8_t* flushData;
+  uint32_t flushSize;
+  uint32_t flushOffset;
+  char flushPath[SAMPLE_PATH_LENGTH];
+  bool savedFile;
+  
+  void processFrames(const uint16_t* frames, size_t count);
+  void checkDropouts(unsigned long now);
+  void finishRecording();
+  void beginFlush();
+  void abortFlush();
+  void stopCapture();
+  
+public:
+  Recorder();
+  ~Recorder();
+  
+  void init(SDLoader* loader);
+  
+  // Start capturing into a new buffer for the slot, recording begins
+  // once the input moves more than triggerLevel away from mid-scale
+  bool arm(int targetSlot, uint8_t triggerLevel = RECORD_THRESHOLD);
+  
+  // End the recording early and keep what was captured, or drop it
+  void stop();
+  void cancel();
+  
+  // Drain the DMA buffers, call every loop() pass
+  void update();
+  
+  // Write one chunk of the last recording to the card, false when idle
+  bool flush();
+  void setFlushEnabled(bool enabled) { flushEnabled = enabled; }
+  
+  // True once after a recording has been written, its path is then the slot's sample path
+  bool takeSavedFile();
+  
+  int getState() { return state; }
+  int getSlot() { return slot; }
+  uint32_t getRecordedFrames() { return length; }
+  uint32_t getDroppedFrames() { return droppedFrames; }
+};
+
+#endif
@@ -0,0 +1,121 @@
+/*
+ * DriftRiff Mini - Sample Analysis Implementation
+ */
+
+#include "sampleanalysis.h"
+
+void sampleStatsClear(SampleStats& stats, uint32_t size) {
+  stats.rawSize = size;
+  stats.trimStart = 0;
+  stats.trimEnd = 0;
+  stats.dcOffset = 0;
+  stats.peak = 0;
+  stats.rms = 0;
+  stats.gain = SAMPLE_GAIN_UNITY;
+  stats.analyzed = false;
+}
+
+void sampleMeasureBegin(SampleMeasure& measure) {
+  measure.sum = 0;
+  measure.squares = 0;
+  measure.count = 0;
+  measure.low = 255;
+  measure.high = 0;
+}
+
+void sampleMeasureUpdate(SampleMeasure& measure, const uint8_t* data, uint32_t length) {
+  int32_t sum = 0;
+  uint32_t squares = 0;
+  uint8_t low = measure.low;
+  uint8_t high = measure.high;
+  for (uint32_t i = 0; i < length; i++) {
+    int32_t value = (int32_t)data[i] - 128;
+    sum += value;
+    squares += value * value;
+    if (data[i] < low) low = data[i];
+    if (data[i] > high) high = data[i];
+  }
+  
+  // 32-bit totals are good for 256K frames a call, far past MAX_SAMPLE_SIZE
+  measure.sum += sum;
+  measure.squares += squares;
+  measure.count += length;
+  measure.low = low;
+  measure.high = high;
+}
+
+uint32_t sampleCorrect(uint8_t* data, const SampleMeasure& measure, SampleStats& stats) {
+  uint32_t size = measure.count;
+  sampleStatsClear(stats, size);
+  if (!data || size == 0) return size;
+  stats.analyzed = true;
+  
+  // The mean is the DC offset, the peak and RMS around it follow from the
+  // extremes and the sum of squares
+  int64_t half = measure.sum >= 0 ? size / 2 : -(int64_t)(size / 2);
+  int32_t dc = constrain((int32_t)((measure.sum + half) / (int64_t)size), -127, 127);
+  int32_t peak = max((int32_t)measure.high - 128 - dc, 128 + dc - (int32_t)measure.low);
+  float mean = (float)measure.sum / size;
+  float variance = (float)measure.squares / size - mean * mean;
+  stats.peak = min(peak, (int32_t)128);
+  stats.rms = (uint8_t)min(sqrtf(max(variance, 0.0f)) + 0.5f, 128.0f);
+  if (peak <= SAMPLE_SILENCE_LEVEL) return size;
+  
+  // Silent ends, judged around the corrected centre. Something is louder
+  // than the threshold, so both scans stop inside the buffer.
+  uint32_t first = 0;
+  while (abs((int32_t)data[first] - 128 - dc) <= SAMPLE_SILENCE_LEVEL) {
+    first++;
+  }
+  uint32_t last = size - 1;
+  while (abs((int32_t)data[last] - 128 - dc) <= SAMPLE_SILENCE_LEVEL) {
+    last--;
+  }
+  
+  // Moved down as it is corrected, reads stay ahead of writes
+  uint32_t kept = last - first + 1;
+  for (uint32_t i = 0; i < kept; i++) {
+    data[i] = (uint8_t)constrain((int32_t)data[first + i] - dc, 0, 255);
+  }
+  
+  stats.trimStart = first;
+  stats.trimEnd = size - 1 - last;
+  stats.dcOffset = dc;
+  stats.gain = min((int32_t)SAMPLE_TARGET_PEAK * SAMPLE_GAIN_UNITY / peak, (int32_t)SAMPLE_GAIN_MAX);
+  return kept;
+}
+
+uint32_t sampleAnalyze(uint8_t* data, uint32_t size, SampleStats& stats) {
+  SampleMeasure measure;
+  sampleMeasureBegin(measure);
+  if (data) {
+    sampleMeasureUpdate(measure, data, size);
+  }
+  return sampleCorrect(data, measure, stats);
+}
+
+void sampleThumbnail(const uint8_t* data, uint32_t size, uint16_t gain, SampleThumbnail& thumb) {
+  for (int column = 0; column < SAMPLE_THUMB_COLUMNS; column++) {
+    uint32_t start = (uint64_t)size * column / SAMPLE_THUMB_COLUMNS;
+    uint32_t end = (uint64_t)size * (column + 1) / SAMPLE_THUMB_COLUMNS;
+    
+    // A sample shorter than the thumbnail repeats frames across columns
+    if (end <= start) {
+      end = min(start + 1, size);
+    }
+    
+    uint8_t low = 128;
+    uint8_t high = 128;
+    if (data && start < end) {
+      low = 255;
+      high = 0;
+      for (uint32_t i = start; i < end; i++) {
+        if (data[i] < low) low = data[i];
+        if (data[i] > high) high = data[i];
+      }
+    }
+    
+    thumb.low[column] = constrain(128 + ((((int32_t)low - 128) * gain) >> 8), 0, 255);
+    thumb.high[column] = constrain(128 + ((((int32_t)high - 128) * gain) >> 8), 0, 255);
+  }
+}
@@ -0,0 +1,70 @@
+/*
+ * DriftRiff Mini - Sample Analysis Header
+ *
+ * Run once on each sample as it loads: measures peak and RMS, takes out
+ * any DC offset, cuts leading and trailing silence and works out the gain
+ * that brings the peak to full scale. The measuring is fed a chunk at a
+ * time as the file streams in, like the CRC, and one pass over the kept
+ * frames at the end corrects them. The gain is kept with the slot and
+ * folded into each hit's volume, so the mixer does nothing extra. A
+ * fixed-width min/max overview for the display is made at the same time.
+ */
+
+#ifndef SAMPLEANALYSIS_H
+#define SAMPLEANALYSIS_H
+
+#include <Arduino.h>
+
+#define SAMPLE_GAIN_UNITY     256   // Normalization gain is Q8
+#define SAMPLE_GAIN_MAX       1024  // At most +12 dB, so noise stays noise
+#define SAMPLE_TARGET_PEAK    127   // Normalized peak, 8-bit steps from the centre
+#define SAMPLE_SILENCE_LEVEL  2     // Trimmed while within this of the centre, about -36 dB
+#define SAMPLE_THUMB_COLUMNS  64    // Thumbnail width, one column per pixel
+
+struct SampleStats {
+  uint32_t rawSize;       // Bytes read from the card
+  uint32_t trimStart;     // Frames cut from the front
+  uint32_t trimEnd;       // Frames cut from the back
+  int8_t dcOffset;        // Removed from every frame, 8-bit steps
+  uint8_t peak;           // After DC removal, 0 to 128
+  uint8_t rms;            // Over the whole file, trimmed ends included
+  uint16_t gain;          // Q8, SAMPLE_GAIN_UNITY when untouched
+  bool analyzed;          // False for recordings and anything assigned directly
+};
+
+// Running totals over the frames seen so far
+struct SampleMeasure {
+  int64_t sum;            // Around the 8-bit centre
+  uint64_t squares;
+  uint32_t count;
+  uint8_t low;
+  uint8_t high;
+};
+
+// Lowest and highest frame in each 64th of a sample, 8-bit unsigned like
+// the data, so drawing one is a vertical line per column
+struct SampleThumbnail {
+  uint8_t low[SAMPLE_THUMB_COLUMNS];
+  uint8_t high[SAMPLE_THUMB_COLUMNS];
+};
+
+// Stats for a sample that was never analysed
+void sampleStatsClear(SampleStats& stats, uint32_t size);
+
+void sampleMeasureBegin(SampleMeasure& measure);
+void sampleMeasureUpdate(SampleMeasure& measure, const uint8_t* data, uint32_t length);
+
+// Correct 8-bit unsigned data in place once all of it has been measured.
+// The kept frames are moved to the front of the buffer; returns how many
+// there are. A sample that is silence throughout is left whole at unity
+// gain.
+uint32_t sampleCorrect(uint8_t* data, const SampleMeasure& measure, SampleStats& stats);
+
+// Both steps on a buffer already in memory
+uint32_t sampleAnalyze(uint8_t* data, uint32_t size, SampleStats& stats);
+
+// Overview of a sample as it plays, scaled by its Q8 gain. An empty
+// sample gives a flat line.
+void sampleThumbnail(const uint8_t* data, uint32_t size, uint16_t gain, SampleThumbnail& thumb);
+
+#endif
@@ -3,13 +3,35 @@
  */
 
 #include "sdloader.h"
+#include "crc.h"
+#include "profiler.h"
+#include "debuglog.h"
 
 SDLoader::SDLoader() {
   for (int i = 0; i < NUM_SAMPLE_SLOTS; i++) {
     sampleData[i] = nullptr;
     sampleSizes[i] = 0;
     samplesLoaded[i] = false;
+    sampleGains[i] = SAMPLE_GAIN_UNITY;
+    sampleStatsClear(sampleStats[i], 0);
+    sampleThumbnail(nullptr, 0, SAMPLE_GAIN_UNITY, thumbnails[i]);
+    thumbnailVersions[i] = 0;
   }
+  releaseHook = nullptr;
+  
+  manifestCount = 0;
+  manifestDirty = false;
+  queueLength = 0;
+  queuePosition = 0;
+  failedCount = 0;
+  streamSlot = -1;
+  streamEntry = -1;
+  streamOffset = 0;
+  streamCrc = CRC32_INIT;
+  sampleMeasureBegin(streamMeasure);
+  streamMtime = 0;
+  loadStartMicros = 0;
+  lastLoadMicros = 0;
 }
 
 SDLoader::~SDLoader() {
@@ -17,102 +39,295 @@ SDLoader::~SDLoader() {
 }
 
 void SDLoader::init() {
+  loadManifest();
   Serial.println("SD Loader initialized");
 }
 
 bool SDLoader::loadAllSamples() {
-  bool allLoaded = true;
+  // Blocking version of the background loader
+  beginLoading(0);
+  while (update()) {
+  }
+  return failedCount == 0;
+}
+
+void SDLoader::beginLoading(uint8_t priorityMask) {
+  if (isLoading()) return;
   
-  Serial.println("Loading samples...");
+  consoleOutput().println("Loading samples...");
   
+  // Slots the current pattern plays go first, the rest after
+  queueLength = 0;
+  for (int slot = 0; slot < NUM_SAMPLE_SLOTS; slot++) {
+    if (priorityMask & (1 << slot)) loadQueue[queueLength++] = slot;
+  }
   for (int slot = 0; slot < NUM_SAMPLE_SLOTS; slot++) {
-    if (!loadSample(slot, sampleFiles[slot])) {
-      allLoaded = false;
-      Serial.print("Failed to load sample for slot ");
-      Serial.print(slot);
-      Serial.print(": ");
-      Serial.println(sampleFiles[slot]);
+    if (!(priorityMask & (1 << slot))) loadQueue[queueLength++] = slot;
+  }
+  
+  queuePosition = 0;
+  failedCount = 0;
+  loadStartMicros = micros();
+}
+
+bool SDLoader::update() {
+  if (streamSlot >= 0) {
+    streamChunk();
+    return true;
+  }
+  
+  // Start the next queued slot, skipping ones that cannot be opened
+  while (queuePosition < queueLength) {
+    int slot = loadQueue[queuePosition++];
+    if (openSlot(slot)) {
+      return true;
     }
+    failedCount++;
+    LOG_WARN("Failed to load sample for slot ", slot, ": ", sampleFiles[slot]);
   }
   
-  if (allLoaded) {
-    Serial.println("All samples loaded successfully");
+  if (queueLength == 0) return false;
+  queueLength = 0;
+  queuePosition = 0;
+  lastLoadMicros = micros() - loadStartMicros;
+  
+  if (failedCount == 0) {
+    LOG_INFO("All samples loaded successfully");
   } else {
-    Serial.println("Some samples failed to load - check SD card content");
+    LOG_WARN("Some samples failed to load - check SD card content");
   }
+  LOG_INFO("Sample load took ", lastLoadMicros, " us, trimming saved ", getTrimmedBytes(), " bytes");
   
-  return allLoaded;
+  if (manifestDirty) {
+    saveManifest();
+  }
+  return false;
 }
 
-bool SDLoader::loadSample(int slot, const char* filename) {
-  if (slot < 0 || slot >= NUM_SAMPLE_SLOTS) {
-    return false;
-  }
+bool SDLoader::openSlot(int slot) {
+  const char* filename = sampleFiles[slot];
+  uint32_t fileSize = 0;
   
   // Free existing sample if loaded
   freeSample(slot);
   
-  // Check if file exists
-  if (!SD.exists(filename)) {
-    Serial.print("File not found: ");
-    Serial.println(filename);
-    return false;
+  // With a manifest entry there is no exists() check or size lookup, and a
+  // changed modification time sends the file down the full path below
+  streamEntry = findManifestEntry(filename);
+  if (streamEntry >= 0) {
+    streamFile = SD.open(filename, FILE_READ);
+    if (streamFile && (uint32_t)streamFile.getLastWrite() == manifest[streamEntry].mtime) {
+      fileSize = manifest[streamEntry].size;
+      streamMtime = manifest[streamEntry].mtime;
+    } else {
+      if (streamFile) streamFile.close();
+      streamEntry = -1;
+    }
   }
   
-  File file = SD.open(filename, FILE_READ);
-  if (!file) {
-    Serial.print("Failed to open file: ");
-    Serial.println(filename);
-    return false;
+  if (streamEntry < 0) {
+    // Check if file exists
+    if (!SD.exists(filename)) {
+      LOG_WARN("File not found: ", filename);
+      return false;
+    }
+    
+    streamFile = SD.open(filename, FILE_READ);
+    if (!streamFile) {
+      LOG_WARN("Failed to open file: ", filename);
+      return false;
+    }
+    
+    fileSize = streamFile.size();
+    streamMtime = (uint32_t)streamFile.getLastWrite();
+    if (fileSize == 0) {
+      LOG_WARN("Empty file: ", filename);
+      streamFile.close();
+      return false;
+    }
+    
+    if (fileSize > MAX_SAMPLE_SIZE) {
+      LOG_WARN("File too large (", fileSize, " bytes): ", filename);
+      fileSize = MAX_SAMPLE_SIZE;
+    }
   }
   
-  uint32_t fileSize = file.size();
-  if (fileSize == 0) {
-    Serial.print("Empty file: ");
-    Serial.println(filename);
-    file.close();
+  // Allocate memory for sample
+  sampleData[slot] = (uint8_t*)malloc(fileSize);
+  if (!sampleData[slot]) {
+    LOG_WARN("Failed to allocate memory for: ", filename);
+    streamFile.close();
     return false;
   }
   
-  if (fileSize > MAX_SAMPLE_SIZE) {
-    Serial.print("File too large (");
-    Serial.print(fileSize);
-    Serial.print(" bytes): ");
-    Serial.println(filename);
-    fileSize = MAX_SAMPLE_SIZE;
+  // Not playable until samplesLoaded is set at the end of the stream
+  sampleSizes[slot] = fileSize;
+  streamSlot = slot;
+  streamOffset = 0;
+  streamCrc = CRC32_INIT;
+  sampleMeasureBegin(streamMeasure);
+  return true;
+}
+
+void SDLoader::streamChunk() {
+  uint32_t length = min((uint32_t)SAMPLE_STREAM_CHUNK, sampleSizes[streamSlot] - streamOffset);
+  uint8_t* target = sampleData[streamSlot] + streamOffset;
+  uint32_t bytesRead;
+  {
+    PROF_SCOPE(PROF_SD_IO);
+    bytesRead = streamFile.read(target, length);
   }
   
-  // Allocate memory for sample
-  sampleData[slot] = (uint8_t*)malloc(fileSize);
-  if (!sampleData[slot]) {
-    Serial.print("Failed to allocate memory for: ");
-    Serial.println(filename);
-    file.close();
-    return false;
+  streamCrc = crc32Update(streamCrc, target, bytesRead);
+  sampleMeasureUpdate(streamMeasure, target, bytesRead);
+  streamOffset += bytesRead;
+  
+  if (bytesRead != length) {
+    finishSlot(false);
+  } else if (streamOffset >= sampleSizes[streamSlot]) {
+    finishSlot(true);
   }
+}
+
+void SDLoader::finishSlot(bool ok) {
+  int slot = streamSlot;
+  const char* filename = sampleFiles[slot];
+  uint32_t checksum = crc32Final(streamCrc);
+  streamFile.close();
+  streamSlot = -1;
   
-  // Read file data
-  uint32_t bytesRead = file.read(sampleData[slot], fileSize);
-  file.close();
+  if (streamEntry >= 0 && (!ok || checksum != manifest[streamEntry].checksum)) {
+    // Manifest was stale, forget the entry and load this slot again the slow way
+    LOG_WARN("Manifest out of date for: ", filename);
+    removeManifestEntry(streamEntry);
+    freeSample(slot);
+    queuePosition--;
+    return;
+  }
   
-  if (bytesRead != fileSize) {
-    Serial.print("Read error for file: ");
-    Serial.println(filename);
+  if (!ok) {
+    LOG_WARN("Read error for file: ", filename);
     freeSample(slot);
-    return false;
+    failedCount++;
+    return;
   }
   
-  sampleSizes[slot] = fileSize;
+  if (streamEntry < 0) {
+    updateManifestEntry(filename, sampleSizes[slot], streamMtime, checksum);
+  }
+  
+  // Still unplayable, so the buffer can be rewritten and shrunk in place
+  uint32_t kept = sampleCorrect(sampleData[slot], streamMeasure, sampleStats[slot]);
+  if (kept < sampleSizes[slot]) {
+    uint8_t* shrunk = (uint8_t*)realloc(sampleData[slot], kept);
+    if (shrunk) {
+      sampleData[slot] = shrunk;
+    }
+    sampleSizes[slot] = kept;
+  }
+  sampleGains[slot] = sampleStats[slot].gain;
+  refreshThumbnail(slot);
   samplesLoaded[slot] = true;
   
-  Serial.print("Loaded sample ");
-  Serial.print(slot);
-  Serial.print(" (");
-  Serial.print(fileSize);
-  Serial.print(" bytes): ");
-  Serial.println(filename);
+  LOG_INFO("Loaded sample ", slot, " (", sampleSizes[slot], " of ", sampleStats[slot].rawSize,
+           " bytes, gain ", sampleStats[slot].gain, "/256): ", filename);
+}
+
+int SDLoader::findManifestEntry(const char* name) {
+  for (int i = 0; i < manifestCount; i++) {
+    if (strncmp(manifest[i].name, name, SAMPLE_PATH_LENGTH) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void SDLoader::updateManifestEntry(const char* name, uint32_t size, uint32_t mtime, uint32_t checksum) {
+  int index = findManifestEntry(name);
+  if (index < 0) {
+    if (manifestCount >= MAX_MANIFEST_ENTRIES) {
+      // Full, drop the oldest entry
+      removeManifestEntry(0);
+    }
+    index = manifestCount++;
+  }
   
-  return true;
+  SampleManifestEntry& entry = manifest[index];
+  memset(&entry, 0, sizeof(entry));
+  strncpy(entry.name, name, SAMPLE_PATH_LENGTH - 1);
+  entry.size = size;
+  entry.mtime = mtime;
+  entry.checksum = checksum;
+  manifestDirty = true;
+}
+
+void SDLoader::removeManifestEntry(int index) {
+  if (index < 0 || index >= manifestCount) return;
+  
+  memmove(&manifest[index], &manifest[index + 1],
+          (manifestCount - index - 1) * sizeof(SampleManifestEntry));
+  manifestCount--;
+  manifestDirty = true;
+}
+
+void SDLoader::loadManifest() {
+  manifestCount = 0;
+  manifestDirty = false;
+  
+  File file = SD.open(SAMPLE_MANIFEST_PATH, FILE_READ);
+  if (!file) {
+    consoleOutput().println("No sample manifest, doing a full scan");
+    return;
+  }
+  
+  SampleManifestHeader header;
+  bool valid = false;
+  {
+    PROF_SCOPE(PROF_SD_IO);
+    if (file.read((uint8_t*)&header, sizeof(header)) == sizeof(header) &&
+        header.magic == SAMPLE_MANIFEST_MAGIC &&
+        header.version == SAMPLE_MANIFEST_VERSION &&
+        header.count <= MAX_MANIFEST_ENTRIES) {
+      uint32_t bytes = header.count * sizeof(SampleManifestEntry);
+      valid = file.read((uint8_t*)manifest, bytes) == bytes &&
+              crc32Final(crc32Update(CRC32_INIT, (const uint8_t*)manifest, bytes)) == header.entriesCrc;
+    }
+    file.close();
+  }
+  
+  if (!valid) {
+    consoleOutput().println("Sample manifest invalid, doing a full scan");
+    manifestDirty = true;
+    return;
+  }
+  
+  manifestCount = header.count;
+  for (int i = 0; i < manifestCount; i++) {
+    manifest[i].name[SAMPLE_PATH_LENGTH - 1] = '\0';
+  }
+}
+
+bool SDLoader::saveManifest() {
+  SampleManifestHeader header;
+  uint32_t bytes = manifestCount * sizeof(SampleManifestEntry);
+  header.magic = SAMPLE_MANIFEST_MAGIC;
+  header.version = SAMPLE_MANIFEST_VERSION;
+  header.count = manifestCount;
+  header.entriesCrc = crc32Final(crc32Update(CRC32_INIT, (const uint8_t*)manifest, bytes));
+  
+  // Only a cache, a torn write just fails the CRC and costs one slow boot
+  PROF_SCOPE(PROF_SD_IO);
+  File file = SD.open(SAMPLE_MANIFEST_PATH, FILE_WRITE);
+  if (!file) {
+    LOG_WARN("Failed to write sample manifest");
+    return false;
+  }
+  bool ok = file.write((const uint8_t*)&header, sizeof(header)) == sizeof(header) &&
+            file.write((const uint8_t*)manifest, bytes) == bytes;
+  file.close();
+  
+  manifestDirty = !ok;
+  return ok;
 }
 
 void SDLoader::freeSample(int slot) {
@@ -120,20 +335,41 @@ void SDLoader::freeSample(int slot) {
     return;
   }
   
+  // Unplayable first, so nothing new starts on the buffer while the hook
+  // stops what is already playing it
+  samplesLoaded[slot] = false;
   if (sampleData[slot]) {
+    if (releaseHook) {
+      releaseHook(sampleData[slot], sampleSizes[slot]);
+    }
     free(sampleData[slot]);
     sampleData[slot] = nullptr;
   }
   
   sampleSizes[slot] = 0;
-  samplesLoaded[slot] = false;
+  sampleGains[slot] = SAMPLE_GAIN_UNITY;
+  sampleStatsClear(sampleStats[slot], 0);
+  refreshThumbnail(slot);
+}
+
+void SDLoader::refreshThumbnail(int slot) {
+  sampleThumbnail(sampleData[slot], sampleSizes[slot], sampleGains[slot], thumbnails[slot]);
+  thumbnailVersions[slot]++;
 }
 
 void SDLoader::unloadAllSamples() {
+  // Abandon any background load first
+  if (streamSlot >= 0) {
+    streamFile.close();
+    streamSlot = -1;
+  }
+  queueLength = 0;
+  queuePosition = 0;
+  
   for (int slot = 0; slot < NUM_SAMPLE_SLOTS; slot++) {
     freeSample(slot);
   }
-  Serial.println("All samples unloaded");
+  consoleOutput().println("All samples unloaded");
 }
 
 uint8_t* SDLoader::getSampleData(int slot) {
@@ -157,24 +393,72 @@ bool SDLoader::isSampleLoaded(int slot) {
   return samplesLoaded[slot];
 }
 
+uint16_t SDLoader::getSampleGain(int slot) {
+  if (slot < 0 || slot >= NUM_SAMPLE_SLOTS) {
+    return SAMPLE_GAIN_UNITY;
+  }
+  return sampleGains[slot];
+}
+
+bool SDLoader::getSampleStats(int slot, SampleStats& stats) {
+  if (slot < 0 || slot >= NUM_SAMPLE_SLOTS || !samplesLoaded[slot]) {
+    return false;
+  }
+  stats = sampleStats[slot];
+  return true;
+}
+
+const SampleThumbnail& SDLoader::getThumbnail(int slot) {
+  return thumbnails[constrain(slot, 0, NUM_SAMPLE_SLOTS - 1)];
+}
+
+uint16_t SDLoader::getThumbnailVersion(int slot) {
+  if (slot < 0 || slot >= NUM_SAMPLE_SLOTS) {
+    return 0;
+  }
+  return thumbnailVersions[slot];
+}
+
+uint32_t SDLoader::getTrimmedBytes() {
+  uint32_t trimmed = 0;
+  for (int slot = 0; slot < NUM_SAMPLE_SLOTS; slot++) {
+    if (samplesLoaded[slot] && sampleStats[slot].analyzed) {
+      trimmed += sampleStats[slot].rawSize - sampleSizes[slot];
+    }
+  }
+  return trimmed;
+}
+
 void SDLoader::listSamples() {
-  Serial.println("Sample Status:");
+  consoleOutput().println("Sample Status:");
   const char* trackNames[] = {"KICK", "SNARE", "HIHAT", "PERC", "BASS", "LEAD"};
   
   for (int slot = 0; slot < NUM_SAMPLE_SLOTS; slot++) {
-    Serial.print(trackNames[slot]);
-    Serial.print(": ");
+    consoleOutput().print(trackNames[slot]);
+    consoleOutput().print(": ");
     
     if (samplesLoaded[slot]) {
-      Serial.print("LOADED (");
-      Serial.print(sampleSizes[slot]);
-      Serial.print(" bytes) - ");
-      Serial.println(sampleFiles[slot]);
+      consoleOutput().print("LOADED (");
+      consoleOutput().print(sampleSizes[slot]);
+      consoleOutput().print(" bytes) - ");
+      consoleOutput().println(sampleFiles[slot]);
+      
+      const SampleStats& stats = sampleStats[slot];
+      if (stats.analyzed) {
+        char line[80];
+        snprintf(line, sizeof(line), "  trimmed %u + %u, DC %d, peak %u, RMS %u, gain %u/256",
+                 (unsigned)stats.trimStart, (unsigned)stats.trimEnd, stats.dcOffset, stats.peak,
+                 stats.rms, stats.gain);
+        consoleOutput().println(line);
+      }
     } else {
-      Serial.print("NOT LOADED - ");
-      Serial.println(sampleFiles[slot]);
+      consoleOutput().print("NOT LOADED - ");
+      consoleOutput().println(sampleFiles[slot]);
     }
   }
+  consoleOutput().print("Trimming saved ");
+  consoleOutput().print(getTrimmedBytes());
+  consoleOutput().println(" bytes");
 }
 
 bool SDLoader::loadCustomSample(int slot, const char* filename) {
@@ -182,5 +466,66 @@ bool SDLoader::loadCustomSample(int slot, const char* filename) {
     return false;
   }
   
-  return loadSample(slot, filename);
+  // Let a background load finish rather than racing it for the slot
+  while (update()) {
+  }
+  
+  char previous[SAMPLE_PATH_LENGTH];
+  strcpy(previous, sampleFiles[slot]);
+  setSamplePath(slot, filename);
+  
+  queueLength = 0;
+  loadQueue[queueLength++] = slot;
+  queuePosition = 0;
+  failedCount = 0;
+  loadStartMicros = micros();
+  while (update()) {
+  }
+  
+  if (!samplesLoaded[slot]) {
+    setSamplePath(slot, previous);
+    return false;
+  }
+  return true;
+}
+
+void SDLoader::assignSample(int slot, uint8_t* data, uint32_t size) {
+  if (slot < 0 || slot >= NUM_SAMPLE_SLOTS || !data) {
+    return;
+  }
+  
+  // A pending file load for the slot would overwrite the new sample
+  if (streamSlot == slot) {
+    streamFile.close();
+    streamSlot = -1;
+  }
+  for (uint8_t i = queuePosition; i < queueLength; i++) {
+    if (loadQueue[i] == slot) {
+      memmove(&loadQueue[i], &loadQueue[i + 1], queueLength - i - 1);
+      queueLength--;
+      break;
+    }
+  }
+  
+  freeSample(slot);
+  sampleData[slot] = data;
+  sampleSizes[slot] = size;
+  sampleStatsClear(sampleStats[slot], size);
+  refreshThumbnail(slot);
+  samplesLoaded[slot] = true;
+}
+
+void SDLoader::setSamplePath(int slot, const char* filename) {
+  if (slot < 0 || slot >= NUM_SAMPLE_SLOTS || !filename) {
+    return;
+  }
+  
+  snprintf(sampleFiles[slot], SAMPLE_PATH_LENGTH, "%s", filename);
+}
+
+const char* SDLoader::getSamplePath(int slot) {
+  if (slot < 0 || slot >= NUM_SAMPLE_SLOTS) {
+    return "";
+  }
+  return sampleFiles[slot];
 }
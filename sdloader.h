@@ -7,17 +7,50 @@
 
 #include <Arduino.h>
 #include <SD.h>
+#include <atomic>
+#include "sampleanalysis.h"
 
 #define MAX_SAMPLE_SIZE     32768  // 32KB max per sample
 #define NUM_SAMPLE_SLOTS    6      // One per track
+#define SAMPLE_PATH_LENGTH  32     // Including the terminator
+
+#define SAMPLE_MANIFEST_PATH    "/manifest.bin"
+#define SAMPLE_MANIFEST_MAGIC   0x4E4D5244    // "DRMN"
+#define SAMPLE_MANIFEST_VERSION 2             // 2: entries dropped the unused data offset
+#define MAX_MANIFEST_ENTRIES    32
+#define SAMPLE_STREAM_CHUNK     512           // Bytes read per update() call
+
+// What a previous boot learned about a sample file, so later boots can
+// open and read it without exists() checks or size lookups
+struct SampleManifestEntry {
+  char name[SAMPLE_PATH_LENGTH];
+  uint32_t size;
+  uint32_t mtime;
+  uint32_t checksum;    // CRC-32 of the sample data, which starts the file
+};
+
+// Called with a buffer about to be freed, returns once nothing plays from it
+typedef void (*SampleReleaseHook)(const uint8_t* data, uint32_t size);
+
+struct SampleManifestHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t count;
+  uint32_t entriesCrc;
+};
 
 class SDLoader {
 private:
   uint8_t* sampleData[NUM_SAMPLE_SLOTS];
   uint32_t sampleSizes[NUM_SAMPLE_SLOTS];
-  bool samplesLoaded[NUM_SAMPLE_SLOTS];
+  std::atomic<bool> samplesLoaded[NUM_SAMPLE_SLOTS];   // Read by the audio task
+  std::atomic<uint16_t> sampleGains[NUM_SAMPLE_SLOTS];  // Q8, read by the audio task
+  SampleStats sampleStats[NUM_SAMPLE_SLOTS];
+  SampleThumbnail thumbnails[NUM_SAMPLE_SLOTS];
+  std::atomic<uint16_t> thumbnailVersions[NUM_SAMPLE_SLOTS];   // Bumped whenever a slot changes, read by the audio task
+  SampleReleaseHook releaseHook;
   
-  const char* sampleFiles[NUM_SAMPLE_SLOTS] = {
+  char sampleFiles[NUM_SAMPLE_SLOTS][SAMPLE_PATH_LENGTH] = {
     "/samples/kick.raw",
     "/samples/snare.raw", 
     "/samples/hihat.raw",
@@ -26,21 +59,82 @@ private:
     "/samples/lead.raw"
   };
   
-  bool loadSample(int slot, const char* filename);
+  // Cached directory manifest
+  SampleManifestEntry manifest[MAX_MANIFEST_ENTRIES];
+  uint8_t manifestCount;
+  bool manifestDirty;
+  
+  // Background streaming, one slot at a time in priority order
+  uint8_t loadQueue[NUM_SAMPLE_SLOTS];
+  uint8_t queueLength;
+  uint8_t queuePosition;
+  uint8_t failedCount;
+  File streamFile;
+  int streamSlot;             // -1 when no slot is being read
+  int streamEntry;            // Manifest entry being trusted, -1 if none
+  uint32_t streamOffset;
+  uint32_t streamCrc;
+  SampleMeasure streamMeasure;  // Analysis totals, fed alongside the CRC
+  uint32_t streamMtime;
+  unsigned long loadStartMicros;
+  uint32_t lastLoadMicros;
+  
+  bool openSlot(int slot);
+  void streamChunk();
+  void finishSlot(bool ok);
   void freeSample(int slot);
+  void refreshThumbnail(int slot);
+  
+  int findManifestEntry(const char* name);
+  void updateManifestEntry(const char* name, uint32_t size, uint32_t mtime, uint32_t checksum);
+  void removeManifestEntry(int index);
+  void loadManifest();
+  bool saveManifest();
   
 public:
   SDLoader();
   ~SDLoader();
   
   void init();
+  void setReleaseHook(SampleReleaseHook hook) { releaseHook = hook; }
   bool loadAllSamples();
   void unloadAllSamples();
   
+  // Queue every slot for background loading, slots in priorityMask first
+  void beginLoading(uint8_t priorityMask);
+  
+  // Do one step of background loading, false once there is nothing to do
+  bool update();
+  bool isLoading() { return streamSlot >= 0 || queuePosition < queueLength; }
+  int getStreamSlot() { return streamSlot; }
+  uint32_t getLastLoadMicros() { return lastLoadMicros; }
+  
   uint8_t* getSampleData(int slot);
   uint32_t getSampleSize(int slot);
   bool isSampleLoaded(int slot);
   
+  // Load-time analysis of a slot. Hits scale their volume by the gain;
+  // samples not loaded from a file play at SAMPLE_GAIN_UNITY.
+  uint16_t getSampleGain(int slot);
+  bool getSampleStats(int slot, SampleStats& stats);
+  uint32_t getTrimmedBytes();   // RAM given back by silence trimming, all slots
+  
+  // Waveform overview, made once per load. The version changes whenever the
+  // slot is loaded, replaced or freed, so a display redraws only that slot
+  // and the slicer rescans it.
+  const SampleThumbnail& getThumbnail(int slot);
+  uint16_t getThumbnailVersion(int slot);
+  
   void listSamples();
   bool loadCustomSample(int slot, const char* filename);
+  
+  // Replace a slot's sample with a malloc'd buffer the loader takes over,
+  // e.g. a recording. The sample path is left alone.
+  void assignSample(int slot, uint8_t* data, uint32_t size);
+  
+  // Sample assignment, applied by the next load
+  void setSamplePath(int slot, const char* filename);
+  const char* getSamplePath(int slot);
 };
+
+#endif
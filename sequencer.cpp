@@ -3,113 +3,811 @@
  */
 
 #include "sequencer.h"
+#include "debuglog.h"
+#include "audioengine.h"
+
+// Integer hash for the random direction, so positions stay a function of the tick
+static uint32_t hashStep(uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x7FEB352Du;
+  x ^= x >> 15;
+  x *= 0x846CA68Bu;
+  x ^= x >> 16;
+  return x;
+}
 
 Sequencer::Sequencer() {
-  currentStep = 0;
   bpm = DEFAULT_BPM;
+  swing = MIN_SWING;
   isRunning = true;
   
-  // Initialize all steps to false
-  for (int track = 0; track < NUM_TRACKS; track++) {
-    for (int step = 0; step < NUM_STEPS; step++) {
-      steps[track][step] = false;
-    }
-  }
+  // Start with every pattern empty, editing the first
+  useCount = 0;
+  currentPattern = 0;
+  currentSlot = 0;
+  pattern = &patterns[0];
+  resetPatterns();
+  editCount = 0;
+  journal.init((uint8_t*)journalSnapshots, sizeof(Pattern));
+  
+  nextStepFrame = 0;
+  nextStepFraction = 0;
+  scheduleTick = 0;
+  playTick = 0;
+  scheduleSynced = false;
+  playheadHead = 0;
+  playheadCount = 0;
+  fillActive = false;
+  muteMask = 0;
+  soloMask = 0;
+  rebuildConditionMasks();
+  setRandomSeed(0);
+  updateStepLength();
 }
 
 void Sequencer::init() {
+  loadDefaultPattern();
+  Serial.println("Sequencer initialized with default pattern");
+}
+
+void Sequencer::loadDefaultPattern() {
   // Set up some default pattern for demo
   // Track 0 (kick): steps 0, 4, 8, 12
-  steps[0][0] = true;
-  steps[0][4] = true;
-  steps[0][8] = true;
-  steps[0][12] = true;
+  setStep(0, 0, true);
+  setStep(0, 4, true);
+  setStep(0, 8, true);
+  setStep(0, 12, true);
   
   // Track 1 (snare): steps 4, 12
-  steps[1][4] = true;
-  steps[1][12] = true;
+  setStep(1, 4, true);
+  setStep(1, 12, true);
   
   // Track 2 (hihat): every other step
   for (int i = 1; i < NUM_STEPS; i += 2) {
-    steps[2][i] = true;
+    setStep(2, i, true);
   }
   
-  Serial.println("Sequencer initialized with default pattern");
+  // The starting point, not something to undo
+  journal.clear();
+}
+
+void Sequencer::clearPattern(Pattern& target) {
+  memset(&target, 0, sizeof(Pattern));
+  for (int track = 0; track < NUM_TRACKS; track++) {
+    target.tracks[track].length = NUM_STEPS;
+    target.tracks[track].rate = RATE_1;
+    target.tracks[track].direction = DIR_FORWARD;
+  }
+}
+
+bool Sequencer::isPatternEmpty(const Pattern& target) {
+  for (int track = 0; track < NUM_TRACKS; track++) {
+    if (target.steps[track]) return false;
+  }
+  return true;
+}
+
+void Sequencer::clearTrackData(Pattern& target, int track) {
+  target.steps[track] = 0;
+  memset(target.microTiming[track], 0, MAX_STEPS);
+  memset(target.conditions[track], TRIG_ALWAYS, MAX_STEPS);
+  memset(target.ratchets[track], 0, MAX_STEPS);
+  memset(target.slices[track], 0, MAX_STEPS);
+  memset(target.velocities[track], 0, MAX_STEPS);
+}
+
+bool Sequencer::hasOnlySteps(const Pattern& target, int track) {
+  for (int step = 0; step < MAX_STEPS; step++) {
+    if (target.microTiming[track][step] != 0 || target.conditions[track][step] != TRIG_ALWAYS ||
+        target.ratchets[track][step] != 0 || target.slices[track][step] != 0 ||
+        target.velocities[track][step] != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void Sequencer::resetPatterns() {
+  for (int slot = 0; slot < PATTERN_CACHE; slot++) {
+    clearPattern(patterns[slot]);
+    slotPattern[slot] = slot;
+    slotUsed[slot] = 0;
+    slotDirty[slot] = false;
+  }
+  
+  // The pattern playing keeps its slot if it has one
+  currentSlot = max(findSlot(currentPattern), 0);
+  currentPattern = slotPattern[currentSlot];
+  pattern = &patterns[currentSlot];
+  journal.clear();
+  rebuildConditionMasks();
+  editCount++;
+}
+
+int Sequencer::findSlot(int index) {
+  for (int slot = 0; slot < PATTERN_CACHE; slot++) {
+    if (slotPattern[slot] == index) return slot;
+  }
+  return -1;
+}
+
+const Pattern* Sequencer::getResidentPattern(int index) {
+  int slot = findSlot(index);
+  return slot < 0 ? nullptr : &patterns[slot];
+}
+
+int Sequencer::loadPattern(int index, Pattern& page) {
+  if (index < 0 || index >= NUM_PATTERNS) return -1;
+  
+  int slot = findSlot(index);
+  int evicted = -1;
+  if (slot >= 0) {
+    memcpy(&patterns[slot], &page, sizeof(Pattern));
+  } else {
+    // Least recently used, never the pattern playing
+    for (int candidate = 0; candidate < PATTERN_CACHE; candidate++) {
+      if (candidate == currentSlot) continue;
+      if (slot < 0 || slotUsed[candidate] < slotUsed[slot]) slot = candidate;
+    }
+    if (slotDirty[slot]) evicted = slotPattern[slot];
+    
+    // A piece at a time, a whole pattern is too much for the audio stack
+    uint8_t* resident = (uint8_t*)&patterns[slot];
+    uint8_t* incoming = (uint8_t*)&page;
+    uint8_t swapped[64];
+    for (size_t offset = 0; offset < sizeof(Pattern); offset += sizeof(swapped)) {
+      size_t length = min(sizeof(swapped), sizeof(Pattern) - offset);
+      memcpy(swapped, resident + offset, length);
+      memcpy(resident + offset, incoming + offset, length);
+      memcpy(incoming + offset, swapped, length);
+    }
+    slotPattern[slot] = index;
+  }
+  slotUsed[slot] = ++useCount;
+  slotDirty[slot] = false;
+  
+  if (slot == currentSlot) {
+    rebuildConditionMasks();
+  }
+  return evicted;
+}
+
+bool Sequencer::selectPattern(int index) {
+  int slot = findSlot(index);
+  if (slot < 0) {
+    LOG_WARN("Pattern not resident: ", index + 1);
+    return false;
+  }
+  
+  currentPattern = index;
+  currentSlot = slot;
+  pattern = &patterns[slot];
+  slotUsed[slot] = ++useCount;
+  rebuildConditionMasks();
+  editCount++;
+  
+  LOG_INFO("Pattern selected: ", index + 1);
+  return true;
 }
 
 void Sequencer::nextStep() {
   if (!isRunning) return;
   
-  currentStep++;
-  if (currentStep >= NUM_STEPS) {
-    currentStep = 0;
-  }
+  // Manual advance by one 16th, outside of scheduled playback
+  playTick += TICKS_PER_STEP;
 }
 
 void Sequencer::reset() {
-  currentStep = 0;
+  scheduleTick = 0;
+  playTick = 0;
+  scheduleSynced = false;
+  playheadCount = 0;
+  
+  // Same seed, same sequence of probability outcomes from the top
+  setRandomSeed(randomSeed);
+}
+
+void Sequencer::setRandomSeed(uint32_t seed) {
+  randomSeed = seed;
+  trigRandom = hashStep(seed ^ 0xA511E9B3u) | 1;  // xorshift never leaves zero
+  lastConditionMask = 0;
+}
+
+void Sequencer::updateStepLength() {
+  // Audio frames per 16th note in 16.16 fixed point
+  setStepFrames((uint32_t)(((uint64_t)SAMPLE_RATE * 60 << 16) / ((uint32_t)bpm * 4)));
+}
+
+void Sequencer::setStepFrames(uint32_t frames) {
+  // Part way through a 16th, the next tick stays where the old tempo put
+  // it and only the rest of the step runs at the new one: move the step's
+  // start to where the new tempo would have had to begin it
+  if (scheduleSynced) {
+    uint32_t tickInStep = scheduleTick % TICKS_PER_STEP;
+    int64_t start = ((int64_t)nextStepFrame << 16) + nextStepFraction
+                  + (int64_t)framesPerStep * tickInStep / TICKS_PER_STEP
+                  - (int64_t)frames * tickInStep / TICKS_PER_STEP;
+    nextStepFrame = (uint32_t)(start >> 16);
+    nextStepFraction = start & 0xFFFF;
+  }
+  framesPerStep = frames;
+}
+
+uint16_t Sequencer::ticksPerTrackStep(int rate) {
+  static const uint16_t rateTicks[NUM_RATES] = {
+    TICKS_PER_STEP * 8,      // 1/8x
+    TICKS_PER_STEP * 4,      // 1/4x
+    TICKS_PER_STEP * 2,      // 1/2x
+    TICKS_PER_STEP * 4 / 3,  // 3/4x
+    TICKS_PER_STEP,          // 1x
+    TICKS_PER_STEP * 2 / 3,  // 3/2x
+    TICKS_PER_STEP / 2,      // 2x
+    TICKS_PER_STEP / 4,      // 4x
+    TICKS_PER_STEP / 8       // 8x
+  };
+  if (rate < 0 || rate >= NUM_RATES) return TICKS_PER_STEP;
+  return rateTicks[rate];
+}
+
+int Sequencer::stepAtTick(int track, uint32_t tick) {
+  if (track < 0 || track >= NUM_TRACKS) return 0;
+  
+  const TrackSettings& settings = pattern->tracks[track];
+  uint32_t length = settings.length;
+  uint32_t advances = tick / ticksPerTrackStep(settings.rate);
+  
+  switch (settings.direction) {
+    case DIR_REVERSE:
+      return length - 1 - (advances % length);
+      
+    case DIR_PINGPONG: {
+      if (length == 1) return 0;
+      uint32_t period = 2 * length - 2;
+      uint32_t phase = advances % period;
+      return phase < length ? phase : period - phase;
+    }
+    
+    case DIR_RANDOM:
+      return hashStep(advances * 0x9E3779B9u + track * 0x85EBCA6Bu + randomSeed) % length;
+      
+    default:
+      return advances % length;
+  }
+}
+
+int Sequencer::schedule(uint32_t horizonFrame, SequencerTrigger* triggers, int maxTriggers) {
+  if (!isRunning) {
+    // Re-anchor to the audio clock on resume
+    scheduleSynced = false;
+    return 0;
+  }
+  
+  // Micro-timing can pull a hit up to half a step early, so each tick is
+  // resolved as soon as the horizon reaches half a step before its grid time
+  uint32_t halfStep = framesPerStep >> 17;
+  
+  if (!scheduleSynced) {
+    uint32_t tickOffset = (uint32_t)((uint64_t)framesPerStep * (scheduleTick % TICKS_PER_STEP) / TICKS_PER_STEP);
+    nextStepFrame = horizonFrame + halfStep - (tickOffset >> 16);
+    nextStepFraction = 0;
+    scheduleSynced = true;
+  }
+  
+  uint8_t audible = getAudibleMask();
+  int count = 0;
+  while (count + NUM_TRACKS <= maxTriggers) {
+    uint32_t tickInStep = scheduleTick % TICKS_PER_STEP;
+    int64_t tickTime = nextStepFraction + (int64_t)framesPerStep * tickInStep / TICKS_PER_STEP;
+    uint32_t tickFrame = nextStepFrame + (uint32_t)(tickTime >> 16);
+    
+    if ((int32_t)(horizonFrame - (tickFrame - halfStep)) < 0) break;
+    
+    // One modulo per track decides whether it advances on this tick
+    bool advanced = false;
+    for (int track = 0; track < NUM_TRACKS; track++) {
+      uint16_t trackTicks = ticksPerTrackStep(pattern->tracks[track].rate);
+      if (scheduleTick % trackTicks != 0) continue;
+      advanced = true;
+      
+      int step = stepAtTick(track, scheduleTick);
+      uint64_t bit = (uint64_t)1 << step;
+      if (!(pattern->steps[track] & bit)) continue;
+      if ((conditionMask[track] & bit) && !evaluateCondition(track, step, scheduleTick / trackTicks)) continue;
+      if (!(audible & (1 << track))) continue;
+      
+      // Swing delays every other step of the track, scaled to its step length
+      int64_t delay = (int64_t)framesPerStep * pattern->microTiming[track][step] / TICKS_PER_STEP;
+      if ((scheduleTick / trackTicks) & 1) {
+        delay += (int64_t)framesPerStep * trackTicks * (2 * swing - 100) / (TICKS_PER_STEP * 100);
+      }
+      int64_t rounded = tickTime + delay + 0x8000;
+      
+      triggers[count].frame = nextStepFrame + (int32_t)(rounded >> 16);
+      triggers[count].track = track;
+      triggers[count].step = step;
+      triggers[count].hits = 1;
+      triggers[count].interval = 0;
+      triggers[count].ramp = RAMP_NONE;
+      triggers[count].slice = pattern->slices[track][step];
+      triggers[count].velocity = stepVelocity(*pattern, track, step);
+      
+      uint8_t ratchet = pattern->ratchets[track][step];
+      if (ratchet != 0) {
+        // Spread the hits over the track step, at least a block apart
+        uint32_t stepFrames = (uint32_t)(((uint64_t)framesPerStep * trackTicks / TICKS_PER_STEP) >> 16);
+        uint8_t hits = (ratchet & RATCHET_HITS_MASK) + 1;
+        while (hits > 1 && stepFrames / hits < AUDIO_BLOCK_SIZE) hits--;
+        triggers[count].hits = hits;
+        triggers[count].interval = (uint16_t)min(stepFrames / hits, (uint32_t)UINT16_MAX);
+        triggers[count].ramp = ratchet >> RATCHET_RAMP_SHIFT;
+      }
+      count++;
+    }
+    
+    if (advanced) {
+      pushPlayhead(tickFrame, scheduleTick);
+    }
+    
+    scheduleTick++;
+    if (tickInStep == TICKS_PER_STEP - 1) {
+      uint32_t total = (uint32_t)nextStepFraction + framesPerStep;
+      nextStepFrame += total >> 16;
+      nextStepFraction = total & 0xFFFF;
+    }
+  }
+  
+  return count;
+}
+
+bool Sequencer::evaluateCondition(int track, int step, uint32_t advances) {
+  uint8_t condition = pattern->conditions[track][step];
+  uint8_t trackBit = 1 << track;
+  uint32_t pass = advances / pattern->tracks[track].length;
+  bool result;
+  
+  if (condition <= TRIG_PROB_MAX) {
+    // A uniform 32-bit draw under percent/100 of the range, no branches
+    result = nextRandom() < condition * TRIG_PROB_SCALE;
+  } else if (condition >= TRIG_LOOP_BASE) {
+    uint8_t index = condition - TRIG_LOOP_BASE;
+    result = pass % (index / 8 + 2) == index % 8;
+  } else {
+    switch (condition) {
+      case TRIG_FILL:      result = fillActive; break;
+      case TRIG_NOT_FILL:  result = !fillActive; break;
+      case TRIG_FIRST:     result = pass == 0; break;
+      case TRIG_NOT_FIRST: result = pass != 0; break;
+      
+      // Follow the last outcome without becoming it, so a chain of PRE
+      // trigs all track the trig that started it
+      case TRIG_PRE:       return (lastConditionMask & trackBit) != 0;
+      case TRIG_NOT_PRE:   return (lastConditionMask & trackBit) == 0;
+      default:             result = true; break;
+    }
+  }
+  
+  lastConditionMask = (lastConditionMask & ~trackBit) | (result ? trackBit : 0);
+  return result;
+}
+
+void Sequencer::rebuildConditionMasks() {
+  for (int track = 0; track < NUM_TRACKS; track++) {
+    uint64_t mask = 0;
+    for (int step = 0; step < MAX_STEPS; step++) {
+      if (pattern->conditions[track][step] != TRIG_ALWAYS) {
+        mask |= (uint64_t)1 << step;
+      }
+    }
+    conditionMask[track] = mask;
+  }
+}
+
+uint8_t Sequencer::trigLoopCondition(int a, int b) {
+  if (b < 2 || b > 8 || a < 1 || a > b) return TRIG_ALWAYS;
+  return TRIG_LOOP_BASE + (b - 2) * 8 + (a - 1);
+}
+
+bool Sequencer::isValidTrigCondition(uint8_t condition) {
+  if (condition <= TRIG_NOT_FIRST) return true;
+  if (condition < TRIG_LOOP_BASE) return false;
+  uint8_t index = condition - TRIG_LOOP_BASE;
+  return index / 8 <= 6 && index % 8 < index / 8 + 2;
+}
+
+void Sequencer::setTrigCondition(int track, int step, uint8_t condition) {
+  if (track < 0 || track >= NUM_TRACKS || step < 0 || step >= MAX_STEPS ||
+      !isValidTrigCondition(condition)) {
+    return;
+  }
+  journalEdit(EDIT_CONDITION, track, step, pattern->conditions[track][step], condition);
+  pattern->conditions[track][step] = condition;
+  rebuildConditionMasks();
+  patternEdited();
+}
+
+uint8_t Sequencer::getTrigCondition(int track, int step) {
+  if (track < 0 || track >= NUM_TRACKS || step < 0 || step >= MAX_STEPS) {
+    return TRIG_ALWAYS;
+  }
+  return pattern->conditions[track][step];
+}
+
+void Sequencer::setRatchet(int track, int step, int hits, int ramp) {
+  if (track < 0 || track >= NUM_TRACKS || step < 0 || step >= MAX_STEPS ||
+      ramp < 0 || ramp >= NUM_RAMPS) {
+    return;
+  }
+  hits = constrain(hits, 1, MAX_RATCHET);
+  uint8_t ratchet = hits > 1 ? (ramp << RATCHET_RAMP_SHIFT) | (hits - 1) : 0;
+  journalEdit(EDIT_RATCHET, track, step, pattern->ratchets[track][step], ratchet);
+  pattern->ratchets[track][step] = ratchet;
+  patternEdited();
+}
+
+int Sequencer::getRatchetHits(int track, int step) {
+  if (track < 0 || track >= NUM_TRACKS || step < 0 || step >= MAX_STEPS) {
+    return 1;
+  }
+  return (pattern->ratchets[track][step] & RATCHET_HITS_MASK) + 1;
+}
+
+int Sequencer::getRatchetRamp(int track, int step) {
+  if (track < 0 || track >= NUM_TRACKS || step < 0 || step >= MAX_STEPS) {
+    return RAMP_NONE;
+  }
+  return pattern->ratchets[track][step] >> RATCHET_RAMP_SHIFT;
+}
+
+bool Sequencer::isValidRatchet(uint8_t ratchet) {
+  return (ratchet & ~(0x03 << RATCHET_RAMP_SHIFT | RATCHET_HITS_MASK)) == 0 &&
+         (ratchet >> RATCHET_RAMP_SHIFT) < NUM_RAMPS;
+}
+
+void Sequencer::setStepSlice(int track, int step, int slice) {
+  if (track < 0 || track >= NUM_TRACKS || step < 0 || step >= MAX_STEPS ||
+      slice < 0 || slice > MAX_SLICES) {
+    return;
+  }
+  journalEdit(EDIT_SLICE, track, step, pattern->slices[track][step], slice);
+  pattern->slices[track][step] = slice;
+  patternEdited();
+}
+
+int Sequencer::getStepSlice(int track, int step) {
+  if (track < 0 || track >= NUM_TRACKS || step < 0 || step >= MAX_STEPS) {
+    return 0;
+  }
+  return pattern->slices[track][step];
+}
+
+void Sequencer::setStepVelocity(int track, int step, int velocity) {
+  if (track < 0 || track >= NUM_TRACKS || step < 0 || step >= MAX_STEPS ||
+      velocity < 0 || velocity > MAX_VELOCITY) {
+    return;
+  }
+  uint8_t level = (pattern->velocities[track][step] & STEP_ACCENT) | (MAX_VELOCITY - velocity);
+  journalEdit(EDIT_VELOCITY, track, step, pattern->velocities[track][step], level);
+  pattern->velocities[track][step] = level;
+  patternEdited();
+}
+
+int Sequencer::getStepVelocity(int track, int step) {
+  if (track < 0 || track >= NUM_TRACKS || step < 0 || step >= MAX_STEPS) {
+    return MAX_VELOCITY;
+  }
+  return MAX_VELOCITY - (pattern->velocities[track][step] & VELOCITY_MASK);
+}
+
+void Sequencer::setStepAccent(int track, int step, bool accent) {
+  if (track < 0 || track >= NUM_TRACKS || step < 0 || step >= MAX_STEPS) return;
+  uint8_t level = (pattern->velocities[track][step] & VELOCITY_MASK) | (accent ? STEP_ACCENT : 0);
+  journalEdit(EDIT_VELOCITY, track, step, pattern->velocities[track][step], level);
+  pattern->velocities[track][step] = level;
+  patternEdited();
+}
+
+bool Sequencer::isStepAccent(int track, int step) {
+  if (track < 0 || track >= NUM_TRACKS || step < 0 || step >= MAX_STEPS) return false;
+  return pattern->velocities[track][step] & STEP_ACCENT;
+}
+
+void Sequencer::setTrackAccent(int track, int amount) {
+  if (track < 0 || track >= NUM_TRACKS || amount < 0 || amount > MAX_VELOCITY) return;
+  journalEdit(EDIT_ACCENT, track, 0, pattern->accents[track], amount);
+  pattern->accents[track] = amount;
+  patternEdited();
+}
+
+int Sequencer::getTrackAccent(int track) {
+  if (track < 0 || track >= NUM_TRACKS) return 0;
+  return pattern->accents[track];
+}
+
+int32_t Sequencer::tickAtFrame(uint32_t frame) {
+  if (!isRunning || !scheduleSynced) return playTick;
+  
+  // Extrapolate from the 16th being scheduled, which is close to playback
+  int64_t offset = ((int64_t)(int32_t)(frame - nextStepFrame) << 16) - nextStepFraction;
+  int64_t ticks = offset * TICKS_PER_STEP;
+  if (ticks < 0) ticks -= framesPerStep - 1;
+  
+  return (int32_t)(scheduleTick - scheduleTick % TICKS_PER_STEP) + (int32_t)(ticks / framesPerStep);
+}
+
+void Sequencer::pushPlayhead(uint32_t frame, uint32_t tick) {
+  if (playheadCount >= PLAYHEAD_QUEUE) {
+    // Playback fell far behind, jump to the oldest pending tick
+    playTick = playheadTicks[playheadHead];
+    playheadHead = (playheadHead + 1) % PLAYHEAD_QUEUE;
+    playheadCount--;
+  }
+  
+  uint8_t tail = (playheadHead + playheadCount) % PLAYHEAD_QUEUE;
+  playheadFrames[tail] = frame;
+  playheadTicks[tail] = tick;
+  playheadCount++;
+}
+
+bool Sequencer::updatePlayhead(uint32_t playFrame) {
+  bool changed = false;
+  
+  while (playheadCount > 0 && (int32_t)(playFrame - playheadFrames[playheadHead]) >= 0) {
+    playTick = playheadTicks[playheadHead];
+    playheadHead = (playheadHead + 1) % PLAYHEAD_QUEUE;
+    playheadCount--;
+    changed = true;
+  }
+  
+  return changed;
 }
 
 bool Sequencer::isStepActive(int track, int step) {
-  if (track < 0 || track >= NUM_TRACKS || step < 0 || step >= NUM_STEPS) {
+  if (track < 0 || track >= NUM_TRACKS || step < 0 || step >= MAX_STEPS) {
     return false;
   }
-  return steps[track][step];
+  return (pattern->steps[track] >> step) & 1;
 }
 
 void Sequencer::toggleStep(int track, int step) {
-  if (track < 0 || track >= NUM_TRACKS || step < 0 || step >= NUM_STEPS) {
+  if (track < 0 || track >= NUM_TRACKS || step < 0 || step >= MAX_STEPS) {
     return;
   }
-  steps[track][step] = !steps[track][step];
+  bool active = isStepActive(track, step);
+  journalEdit(EDIT_STEP, track, step, active, !active);
+  pattern->steps[track] ^= (uint64_t)1 << step;
+  patternEdited();
   
-  Serial.print("Toggled step - Track: ");
-  Serial.print(track);
-  Serial.print(", Step: ");
-  Serial.print(step);
-  Serial.print(", Active: ");
-  Serial.println(steps[track][step]);
+  LOG_DEBUG("Toggled step - Track: ", track, ", Step: ", step,
+            ", Active: ", isStepActive(track, step));
 }
 
 void Sequencer::setStep(int track, int step, bool active) {
-  if (track < 0 || track >= NUM_TRACKS || step < 0 || step >= NUM_STEPS) {
+  if (track < 0 || track >= NUM_TRACKS || step < 0 || step >= MAX_STEPS) {
     return;
   }
-  steps[track][step] = active;
+  journalEdit(EDIT_STEP, track, step, isStepActive(track, step), active);
+  if (active) {
+    pattern->steps[track] |= (uint64_t)1 << step;
+  } else {
+    pattern->steps[track] &= ~((uint64_t)1 << step);
+  }
+  patternEdited();
 }
 
 void Sequencer::clearTrack(int track) {
   if (track < 0 || track >= NUM_TRACKS) return;
   
-  for (int step = 0; step < NUM_STEPS; step++) {
-    steps[track][step] = false;
+  // Steps alone fit in the record, anything more needs a snapshot
+  if (hasOnlySteps(*pattern, track)) {
+    if (pattern->steps[track] != 0) {
+      EditRecord record = {};
+      record.type = EDIT_CLEAR_STEPS;
+      record.pattern = currentPattern;
+      record.track = track;
+      record.steps = pattern->steps[track];
+      journal.push(record);
+    }
+  } else {
+    EditRecord record = {};
+    record.type = EDIT_SNAPSHOT;
+    record.pattern = currentPattern;
+    record.track = track;
+    record.snapshot = journal.takeSnapshot(pattern);
+    journal.push(record);
   }
   
-  Serial.print("Cleared track: ");
-  Serial.println(track);
+  clearTrackData(*pattern, track);
+  rebuildConditionMasks();
+  patternEdited();
+  
+  LOG_INFO("Cleared track: ", track);
 }
 
 void Sequencer::clearAll() {
+  bool onlySteps = true;
+  for (int track = 0; track < NUM_TRACKS; track++) {
+    onlySteps = onlySteps && hasOnlySteps(*pattern, track);
+  }
+  
+  // One undo brings back every track
+  EditRecord record = {};
+  record.pattern = currentPattern;
+  if (onlySteps) {
+    record.type = EDIT_CLEAR_STEPS;
+    for (int track = 0; track < NUM_TRACKS; track++) {
+      if (pattern->steps[track] == 0) continue;
+      record.track = track;
+      record.steps = pattern->steps[track];
+      journal.push(record);
+      record.flags = EDIT_GROUPED;
+    }
+  } else {
+    record.type = EDIT_SNAPSHOT;
+    record.track = JOURNAL_ALL_TRACKS;
+    record.snapshot = journal.takeSnapshot(pattern);
+    journal.push(record);
+  }
+  
   for (int track = 0; track < NUM_TRACKS; track++) {
-    clearTrack(track);
+    clearTrackData(*pattern, track);
+  }
+  rebuildConditionMasks();
+  patternEdited();
+  LOG_INFO("Cleared all tracks");
+}
+
+void Sequencer::journalEdit(uint8_t type, int track, int step, uint8_t before, uint8_t after) {
+  if (before == after) return;
+  
+  EditRecord record = {};
+  record.type = type;
+  record.pattern = currentPattern;
+  record.track = track;
+  record.step = step;
+  record.before = before;
+  record.after = after;
+  journal.push(record);
+}
+
+void Sequencer::applyEdit(const EditRecord& record, bool undoing) {
+  int slot = findSlot(record.pattern);
+  Pattern& target = patterns[slot];
+  slotDirty[slot] = true;
+  uint8_t value = undoing ? record.before : record.after;
+  int track = record.track;
+  int step = record.step;
+  
+  switch (record.type) {
+    case EDIT_STEP:
+      if (value) {
+        target.steps[track] |= (uint64_t)1 << step;
+      } else {
+        target.steps[track] &= ~((uint64_t)1 << step);
+      }
+      break;
+    case EDIT_MICRO:      target.microTiming[track][step] = (int8_t)value; break;
+    case EDIT_CONDITION:  target.conditions[track][step] = value; break;
+    case EDIT_RATCHET:    target.ratchets[track][step] = value; break;
+    case EDIT_SLICE:      target.slices[track][step] = value; break;
+    case EDIT_VELOCITY:   target.velocities[track][step] = value; break;
+    case EDIT_LENGTH:     target.tracks[track].length = value; break;
+    case EDIT_RATE:       target.tracks[track].rate = value; break;
+    case EDIT_DIRECTION:  target.tracks[track].direction = value; break;
+    case EDIT_ACCENT:     target.accents[track] = value; break;
+    case EDIT_CLEAR_STEPS:
+      target.steps[track] = undoing ? record.steps : 0;
+      break;
+    case EDIT_SNAPSHOT:
+      // Later edits are undone first, so the pattern is exactly as the
+      // clear left it and the whole snapshot can go back
+      if (undoing) {
+        memcpy(&target, journal.getSnapshot(record.snapshot), sizeof(Pattern));
+      } else if (track == JOURNAL_ALL_TRACKS) {
+        for (int t = 0; t < NUM_TRACKS; t++) {
+          clearTrackData(target, t);
+        }
+      } else {
+        clearTrackData(target, track);
+      }
+      break;
+  }
+  
+  if (&target == pattern && (record.type == EDIT_CONDITION || record.type == EDIT_SNAPSHOT)) {
+    rebuildConditionMasks();
   }
-  Serial.println("Cleared all tracks");
+}
+
+int Sequencer::getUndoPattern() {
+  const EditRecord* record = journal.peekUndo();
+  return record ? record->pattern : -1;
+}
+
+int Sequencer::getRedoPattern() {
+  const EditRecord* record = journal.peekRedo();
+  return record ? record->pattern : -1;
+}
+
+bool Sequencer::undo() {
+  // Every record of a group edits the same pattern
+  int target = getUndoPattern();
+  if (target < 0 || !isPatternResident(target)) return false;
+  
+  const EditRecord* record = journal.undo();
+  
+  applyEdit(*record, true);
+  while (record->flags & EDIT_GROUPED) {
+    record = journal.undo();
+    applyEdit(*record, true);
+  }
+  editCount++;
+  return true;
+}
+
+bool Sequencer::redo() {
+  int target = getRedoPattern();
+  if (target < 0 || !isPatternResident(target)) return false;
+  
+  const EditRecord* record = journal.redo();
+  
+  applyEdit(*record, false);
+  while ((record = journal.peekRedo()) != nullptr && (record->flags & EDIT_GROUPED)) {
+    journal.redo();
+    applyEdit(*record, false);
+  }
+  editCount++;
+  return true;
+}
+
+void Sequencer::setTrackLength(int track, int length) {
+  if (track < 0 || track >= NUM_TRACKS) return;
+  length = constrain(length, 1, MAX_STEPS);
+  journalEdit(EDIT_LENGTH, track, 0, pattern->tracks[track].length, length);
+  pattern->tracks[track].length = length;
+  patternEdited();
+}
+
+int Sequencer::getTrackLength(int track) {
+  if (track < 0 || track >= NUM_TRACKS) return 0;
+  return pattern->tracks[track].length;
+}
+
+void Sequencer::setTrackRate(int track, int rate) {
+  if (track < 0 || track >= NUM_TRACKS || rate < 0 || rate >= NUM_RATES) return;
+  journalEdit(EDIT_RATE, track, 0, pattern->tracks[track].rate, rate);
+  pattern->tracks[track].rate = rate;
+  patternEdited();
+}
+
+int Sequencer::getTrackRate(int track) {
+  if (track < 0 || track >= NUM_TRACKS) return RATE_1;
+  return pattern->tracks[track].rate;
+}
+
+void Sequencer::setTrackDirection(int track, int direction) {
+  if (track < 0 || track >= NUM_TRACKS || direction < 0 || direction >= NUM_DIRECTIONS) return;
+  journalEdit(EDIT_DIRECTION, track, 0, pattern->tracks[track].direction, direction);
+  pattern->tracks[track].direction = direction;
+  patternEdited();
+}
+
+int Sequencer::getTrackDirection(int track) {
+  if (track < 0 || track >= NUM_TRACKS) return DIR_FORWARD;
+  return pattern->tracks[track].direction;
 }
 
 void Sequencer::togglePlayback() {
   isRunning = !isRunning;
-  Serial.print("Playback ");
-  Serial.println(isRunning ? "started" : "paused");
+  LOG_INFO("Playback ", isRunning ? "started" : "paused");
 }
 
 void Sequencer::play() {
   isRunning = true;
-  Serial.println("Playback started");
+  LOG_INFO("Playback started");
 }
 
 void Sequencer::pause() {
   isRunning = false;
-  Serial.println("Playback paused");
+  LOG_INFO("Playback paused");
 }
 
 bool Sequencer::isPlaying() {
@@ -119,25 +817,61 @@ bool Sequencer::isPlaying() {
 void Sequencer::setBPM(int newBPM) {
   if (newBPM >= MIN_BPM && newBPM <= MAX_BPM) {
     bpm = newBPM;
-    Serial.print("BPM set to: ");
-    Serial.println(bpm);
+    updateStepLength();
+    editCount++;
+    LOG_INFO("BPM set to: ", bpm);
   }
 }
 
+void Sequencer::setTempo(float newBPM) {
+  // Called continuously by clock sync, so no logging here
+  newBPM = constrain(newBPM, (float)MIN_SYNC_BPM, (float)MAX_SYNC_BPM);
+  bpm = (int)(newBPM + 0.5f);
+  setStepFrames((uint32_t)((float)SAMPLE_RATE * 60.0f * 65536.0f / (newBPM * 4.0f)));
+}
+
 void Sequencer::increaseBPM() {
   if (bpm < MAX_BPM) {
     bpm += 5;
-    Serial.print("BPM increased to: ");
-    Serial.println(bpm);
+    updateStepLength();
+    editCount++;
+    LOG_INFO("BPM increased to: ", bpm);
   }
 }
 
 void Sequencer::decreaseBPM() {
   if (bpm > MIN_BPM) {
     bpm -= 5;
-    Serial.print("BPM decreased to: ");
-    Serial.println(bpm);
+    updateStepLength();
+    editCount++;
+    LOG_INFO("BPM decreased to: ", bpm);
+  }
+}
+
+void Sequencer::setSwing(int percent) {
+  swing = constrain(percent, MIN_SWING, MAX_SWING);
+  editCount++;
+}
+
+int Sequencer::getSwing() {
+  return swing;
+}
+
+void Sequencer::setMicroTiming(int track, int step, int offset) {
+  if (track < 0 || track >= NUM_TRACKS || step < 0 || step >= MAX_STEPS) {
+    return;
   }
+  offset = constrain(offset, -MAX_MICRO_OFFSET, MAX_MICRO_OFFSET);
+  journalEdit(EDIT_MICRO, track, step, pattern->microTiming[track][step], (int8_t)offset);
+  pattern->microTiming[track][step] = offset;
+  patternEdited();
+}
+
+int Sequencer::getMicroTiming(int track, int step) {
+  if (track < 0 || track >= NUM_TRACKS || step < 0 || step >= MAX_STEPS) {
+    return 0;
+  }
+  return pattern->microTiming[track][step];
 }
 
 int Sequencer::getBPM() {
@@ -145,5 +879,58 @@ int Sequencer::getBPM() {
 }
 
 int Sequencer::getCurrentStep() {
-  return currentStep;
+  return (playTick / TICKS_PER_STEP) % NUM_STEPS;
+}
+
+void Sequencer::setMute(int track, bool muted) {
+  if (track < 0 || track >= NUM_TRACKS) return;
+  if (muted) {
+    muteMask |= 1 << track;
+  } else {
+    muteMask &= ~(1 << track);
+  }
+}
+
+bool Sequencer::isMuted(int track) {
+  if (track < 0 || track >= NUM_TRACKS) return false;
+  return (muteMask >> track) & 1;
+}
+
+void Sequencer::setSolo(int track, bool soloed) {
+  if (track < 0 || track >= NUM_TRACKS) return;
+  if (soloed) {
+    soloMask |= 1 << track;
+  } else {
+    soloMask &= ~(1 << track);
+  }
+}
+
+bool Sequencer::isSoloed(int track) {
+  if (track < 0 || track >= NUM_TRACKS) return false;
+  return (soloMask >> track) & 1;
+}
+
+uint8_t Sequencer::getUsedTrackMask() {
+  uint8_t mask = 0;
+  for (int track = 0; track < NUM_TRACKS; track++) {
+    int length = pattern->tracks[track].length;
+    uint64_t inRange = length >= MAX_STEPS ? ~(uint64_t)0 : ((uint64_t)1 << length) - 1;
+    if (pattern->steps[track] & inRange) {
+      mask |= 1 << track;
+    }
+  }
+  return mask;
+}
+
+int Sequencer::getTrackPosition(int track) {
+  return stepAtTick(track, playTick);
+}
+
+void Sequencer::getGridState(GridState& state) {
+  for (int track = 0; track < NUM_TRACKS; track++) {
+    state.steps[track] = pattern->steps[track];
+    state.length[track] = pattern->tracks[track].length;
+    state.position[track] = stepAtTick(track, playTick);
+  }
+  state.audible = getAudibleMask();
 }
@@ -6,27 +6,228 @@
 #define SEQUENCER_H
 
 #include <Arduino.h>
+#include "editjournal.h"
 
 #define NUM_TRACKS 6
-#define NUM_STEPS 16
+#define ALL_TRACKS_MASK ((1 << NUM_TRACKS) - 1)
+#define NUM_STEPS 16          // Steps per grid page and default track length
+#define MAX_STEPS 64          // Longest track, one bit each in a uint64_t
 #define MIN_BPM 60
 #define MAX_BPM 200
 #define DEFAULT_BPM 120
+#define MIN_SYNC_BPM 30       // Range accepted from an external clock
+#define MAX_SYNC_BPM 300
+
+#define TICKS_PER_STEP 96     // Master clock ticks per 16th note
+#define MIN_SWING 50          // Percent, 50 = straight 16ths
+#define MAX_SWING 75
+#define MAX_MICRO_OFFSET (TICKS_PER_STEP / 2)
+#define PLAYHEAD_QUEUE 16
+#define NUM_PATTERNS 128      // Patterns in the project, see PatternBank
+#define PATTERN_CACHE 4       // Patterns in RAM at once, the one playing among them
+#define SEQUENCER_RAM_BUDGET 16384  // Bytes, a global next to the sample buffers on a classic ESP32
+
+// Trig conditions, one byte per step. Zero fires every time, so patterns
+// saved before conditions existed load unchanged.
+#define TRIG_ALWAYS      0
+#define TRIG_PROB_MAX    99     // 1 - 99: fire with that probability in percent
+#define TRIG_FILL        100    // Only while fill is on
+#define TRIG_NOT_FILL    101
+#define TRIG_PRE         102    // Same outcome as the track's last conditional trig
+#define TRIG_NOT_PRE     103
+#define TRIG_FIRST       104    // First pass through the track since reset
+#define TRIG_NOT_FIRST   105
+#define TRIG_LOOP_BASE   128    // A:B, see trigLoopCondition()
+#define TRIG_PROB_SCALE  42949673u  // 2^32 / 100, rounded up
+
+// Ratchets, one byte per step: hits - 1 in the low bits and the volume
+// ramp above them. Zero is a single hit.
+#define MAX_RATCHET         8
+#define RATCHET_HITS_MASK   0x07
+#define RATCHET_RAMP_SHIFT  4
+
+// Slices, one byte per step: 0 plays the whole sample, n plays slice n
+// of the track's sample as found by the Slicer
+#define MAX_SLICES          32
+
+// Velocity, one byte per step: MAX_VELOCITY minus the velocity in the low
+// bits, so zero plays at full velocity, and the accent flag on top. An
+// accented step adds its track's accent amount, capped at MAX_VELOCITY.
+#define MAX_VELOCITY        127
+#define VELOCITY_MASK       0x7F
+#define STEP_ACCENT         0x80
+
+enum RatchetRamp {
+  RAMP_NONE,
+  RAMP_UP,      // Quiet first hit, full volume on the last
+  RAMP_DOWN,
+  NUM_RAMPS
+};
+
+enum PlayDirection {
+  DIR_FORWARD,
+  DIR_REVERSE,
+  DIR_PINGPONG,
+  DIR_RANDOM,
+  NUM_DIRECTIONS
+};
+
+// Track clock relative to the 16th note grid
+enum TrackRate {
+  RATE_1_8,
+  RATE_1_4,
+  RATE_1_2,
+  RATE_3_4,
+  RATE_1,
+  RATE_3_2,
+  RATE_2,
+  RATE_4,
+  RATE_8,
+  NUM_RATES
+};
+
+struct TrackSettings {
+  uint8_t length;     // 1 - MAX_STEPS
+  uint8_t rate;       // TrackRate
+  uint8_t direction;  // PlayDirection
+};
+
+// One pattern as stored in RAM and, byte for byte, in the project file
+// New fields are only ever appended, see ProjectStore.
+struct Pattern {
+  uint64_t steps[NUM_TRACKS];  // Bit n set = step n active
+  int8_t microTiming[NUM_TRACKS][MAX_STEPS];
+  TrackSettings tracks[NUM_TRACKS];
+  uint8_t conditions[NUM_TRACKS][MAX_STEPS];  // TRIG_* codes
+  uint8_t ratchets[NUM_TRACKS][MAX_STEPS];
+  uint8_t slices[NUM_TRACKS][MAX_STEPS];
+  uint8_t velocities[NUM_TRACKS][MAX_STEPS];
+  uint8_t accents[NUM_TRACKS];                 // Velocity added by an accent, 0 - MAX_VELOCITY
+};
+
+// A track hit resolved to the audio frame it should sound at
+struct SequencerTrigger {
+  uint32_t frame;
+  uint8_t track;
+  uint8_t step;
+  uint8_t hits;       // 1, or a ratchet spread over the step
+  uint16_t interval;  // Frames between ratchet hits
+  uint8_t ramp;       // RatchetRamp
+  uint8_t slice;      // 0 = whole sample, else 1-based slice
+  uint8_t velocity;   // 0 - MAX_VELOCITY, accent included
+};
+
+// Everything the step grid shows, cheap to copy and compare
+struct GridState {
+  uint64_t steps[NUM_TRACKS];
+  uint8_t length[NUM_TRACKS];
+  uint8_t position[NUM_TRACKS];
+  uint8_t audible;            // Bit per track not muted or soloed out
+};
 
 class Sequencer {
 private:
-  bool steps[NUM_TRACKS][NUM_STEPS];
-  int currentStep;
+  // The resident patterns. The rest of the bank stays on the card and
+  // comes in through loadPattern(), from the UI side (patternbank.h).
+  Pattern patterns[PATTERN_CACHE];
+  int16_t slotPattern[PATTERN_CACHE];   // Bank index each slot holds
+  uint32_t slotUsed[PATTERN_CACHE];     // useCount when last selected or loaded
+  bool slotDirty[PATTERN_CACHE];        // Edited since it came off the card
+  uint32_t useCount;
+  Pattern* pattern;           // Pattern being played and edited
+  int currentPattern;
+  int currentSlot;
+  uint32_t editCount;         // Bumped on every change worth saving
   int bpm;
+  int swing;
   bool isRunning;
+  uint32_t randomSeed;
+  
+  // Master tick clock mapped onto audio frames (16.16 fixed point)
+  uint32_t framesPerStep;
+  uint32_t nextStepFrame;     // Frame of the 16th containing scheduleTick
+  uint16_t nextStepFraction;
+  uint32_t scheduleTick;      // Next tick to resolve
+  uint32_t playTick;          // Tick playback has reached
+  bool scheduleSynced;
+  
+  // Resolved ticks waiting for playback to reach them
+  uint32_t playheadFrames[PLAYHEAD_QUEUE];
+  uint32_t playheadTicks[PLAYHEAD_QUEUE];
+  uint8_t playheadHead;
+  uint8_t playheadCount;
+  
+  // Trig condition state. conditionMask marks the steps of the current
+  // pattern that need evaluating, every other active step just fires.
+  uint64_t conditionMask[NUM_TRACKS];
+  uint32_t trigRandom;        // xorshift32 state, reseeded on reset
+  uint8_t lastConditionMask;  // Bit per track, outcome of its last conditional trig
+  bool fillActive;
+  
+  // Mute and solo, bit per track. Performance state, neither saved with
+  // the project nor part of the undo history.
+  uint8_t muteMask;
+  uint8_t soloMask;
+  
+  // Undo/redo history of pattern edits
+  EditJournal journal;
+  Pattern journalSnapshots[JOURNAL_SNAPSHOTS];
+  
+  void updateStepLength();
+  void setStepFrames(uint32_t frames);
+  void rebuildConditionMasks();
+  bool evaluateCondition(int track, int step, uint32_t advances);
+  
+  uint32_t nextRandom() {
+    trigRandom ^= trigRandom << 13;
+    trigRandom ^= trigRandom >> 17;
+    trigRandom ^= trigRandom << 5;
+    return trigRandom;
+  }
+  void pushPlayhead(uint32_t frame, uint32_t tick);
+  int findSlot(int index);
+  void patternEdited() {
+    editCount++;
+    slotDirty[currentSlot] = true;
+  }
+  static void clearTrackData(Pattern& target, int track);
+  static bool hasOnlySteps(const Pattern& target, int track);
+  void journalEdit(uint8_t type, int track, int step, uint8_t before, uint8_t after);
+  void applyEdit(const EditRecord& record, bool undoing);
   
 public:
   Sequencer();
   
   void init();
+  void loadDefaultPattern();
   void nextStep();
   void reset();
   
+  // Pattern bank. Only a resident pattern can be selected, false for the
+  // others until they are loaded.
+  bool selectPattern(int index);
+  int getPatternIndex() { return currentPattern; }
+  
+  // Every pattern empty, the first PATTERN_CACHE of them resident
+  void resetPatterns();
+  
+  // Resident copy of a bank pattern, nullptr when it is only on the card
+  const Pattern* getResidentPattern(int index);
+  bool isPatternResident(int index) { return findSlot(index) >= 0; }
+  
+  // Take page in as bank pattern index. A resident copy is overwritten,
+  // edits and all; otherwise the least recently used slot other than the one
+  // playing is given up and its pattern swapped out into page. Returns
+  // the index of a swapped out pattern with edits the card does not have
+  // yet, -1 when there is nothing to write back.
+  int loadPattern(int index, Pattern& page);
+  
+  // An empty pattern with default track settings
+  static void clearPattern(Pattern& target);
+  static bool isPatternEmpty(const Pattern& target);   // No active steps
+  uint32_t getEditCount() { return editCount; }
+  void markEdited() { editCount++; }
+  
   // Step control
   bool isStepActive(int track, int step);
   void toggleStep(int track, int step);
@@ -34,6 +235,104 @@ public:
   void clearTrack(int track);
   void clearAll();
   
+  // Step back and forth through the edits above, on whichever pattern
+  // each was made. False when there is nothing to undo or redo.
+  bool undo();
+  bool redo();
+  
+  // Pattern the next undo or redo edits, -1 when there is none. It has
+  // to be resident for the undo or redo to go ahead.
+  int getUndoPattern();
+  int getRedoPattern();
+  void clearHistory() { journal.clear(); }
+  int getUndoDepth() { return journal.getUndoDepth(); }
+  int getRedoDepth() { return journal.getRedoDepth(); }
+  uint32_t getJournalMemory() { return journal.getMemoryUsage(); }
+  
+  // Per-track length, clock rate and play direction
+  void setTrackLength(int track, int length);
+  int getTrackLength(int track);
+  void setTrackRate(int track, int rate);
+  int getTrackRate(int track);
+  void setTrackDirection(int track, int direction);
+  int getTrackDirection(int track);
+  void setRandomSeed(uint32_t seed);
+  uint32_t getRandomSeed() { return randomSeed; }
+  
+  // Trig conditions
+  void setTrigCondition(int track, int step, uint8_t condition);
+  uint8_t getTrigCondition(int track, int step);
+  void setFill(bool active) { fillActive = active; }
+  bool isFill() { return fillActive; }
+  
+  // A:B fires on pass a of every b passes through the track, 1 <= a <= b <= 8
+  static uint8_t trigLoopCondition(int a, int b);
+  static bool isValidTrigCondition(uint8_t condition);
+  
+  // Mute and solo. Tracks left out still advance and evaluate their trig
+  // conditions, they just schedule nothing, so unmuting changes no other
+  // track's random outcomes.
+  void setMute(int track, bool muted);
+  bool isMuted(int track);
+  void setSolo(int track, bool soloed);
+  bool isSoloed(int track);
+  
+  // The soloed tracks if any are, otherwise every track not muted
+  uint8_t getAudibleMask() { return soloMask ? soloMask : (uint8_t)(~muteMask & ALL_TRACKS_MASK); }
+  
+  // Ratchets: 1 - MAX_RATCHET hits evenly spaced across the step. Hits
+  // closer than one audio block are merged, so fast tracks get fewer.
+  void setRatchet(int track, int step, int hits, int ramp = RAMP_NONE);
+  int getRatchetHits(int track, int step);
+  int getRatchetRamp(int track, int step);
+  static bool isValidRatchet(uint8_t ratchet);
+  
+  // Slice a step plays, 0 for the whole sample or 1 - MAX_SLICES
+  void setStepSlice(int track, int step, int slice);
+  int getStepSlice(int track, int step);
+  static bool isValidSlice(uint8_t slice) { return slice <= MAX_SLICES; }
+  
+  // Velocity 0 - MAX_VELOCITY and accent per step, and the velocity an
+  // accent adds on each track
+  void setStepVelocity(int track, int step, int velocity);
+  int getStepVelocity(int track, int step);
+  void setStepAccent(int track, int step, bool accent);
+  bool isStepAccent(int track, int step);
+  void setTrackAccent(int track, int amount);
+  int getTrackAccent(int track);
+  
+  // Velocity a step plays at, its accent included
+  static uint8_t stepVelocity(const Pattern& target, int track, int step) {
+    uint8_t level = target.velocities[track][step];
+    uint8_t velocity = MAX_VELOCITY - (level & VELOCITY_MASK);
+    if (level & STEP_ACCENT) {
+      velocity = min(velocity + target.accents[track], MAX_VELOCITY);
+    }
+    return velocity;
+  }
+  
+  // Master ticks per step of a track at the given rate
+  static uint16_t ticksPerTrackStep(int rate);
+  
+  // Step a track plays at a master tick, a pure function of the tick
+  int stepAtTick(int track, uint32_t tick);
+  
+  // Groove
+  void setSwing(int percent);
+  int getSwing();
+  void setMicroTiming(int track, int step, int offset);
+  int getMicroTiming(int track, int step);
+  
+  // Resolve every tick that can sound before horizonFrame into triggers.
+  // Returns the number written, never splitting a tick across calls.
+  int schedule(uint32_t horizonFrame, SequencerTrigger* triggers, int maxTriggers);
+  
+  // Move the play position along with audio playback, true if it changed
+  bool updatePlayhead(uint32_t playFrame);
+  
+  // Master tick sounding at an audio frame near the scheduling position
+  int32_t tickAtFrame(uint32_t frame);
+  
   // Playback control
   void togglePlayback();
   void play();
@@ -42,11 +341,21 @@ public:
   
   // BPM control
   void setBPM(int newBPM);
+  void setTempo(float newBPM);   // Fractional, for external clock sync
   void increaseBPM();
   void decreaseBPM();
   int getBPM();
   
   // Getters
   int getCurrentStep();
-  bool (*getSteps())[NUM_STEPS] { return steps; }
+  int getTrackPosition(int track);
+  uint8_t getUsedTrackMask();   // Bit per track with active steps in range
+  uint32_t getPlayTick() { return playTick; }
+  uint32_t getFramesPerStep() { return framesPerStep; }   // 16.16
+  void getGridState(GridState& state);
 };
+
+// Resident patterns plus the undo snapshots, everything else is small
+static_assert(sizeof(Sequencer) <= SEQUENCER_RAM_BUDGET, "Sequencer over its RAM budget, lower PATTERN_CACHE");
+
+#endif
@@ -0,0 +1,320 @@
+/*
+ * DriftRiff Mini - Serial Link Implementation
+ */
+
+#include "seriallink.h"
+#include "crc.h"
+#include "debuglog.h"
+#include "inputlog.h"
+
+// Receive states
+#define LINK_RX_IDLE     0    // Console keys, a zero starts a frame
+#define LINK_RX_FRAME_IN 1    // Collecting a frame up to the closing zero
+#define LINK_RX_SKIP     2    // Frame too long, dropped up to the closing zero
+
+SerialLink* SerialLink::logLink = nullptr;
+static DeferredLog deferredLog;
+
+// ---- Framing ----
+
+size_t cobsEncode(const uint8_t* in, size_t length, uint8_t* out) {
+  size_t code = 0;
+  size_t written = 1;
+  uint8_t run = 1;
+  for (size_t i = 0; i < length; i++) {
+    if (in[i] == 0) {
+      out[code] = run;
+      code = written++;
+      run = 1;
+      continue;
+    }
+    out[written++] = in[i];
+    if (++run == 0xFF) {
+      out[code] = run;
+      code = written++;
+      run = 1;
+    }
+  }
+  out[code] = run;
+  return written;
+}
+
+size_t cobsDecode(const uint8_t* in, size_t length, uint8_t* out) {
+  size_t read = 0;
+  size_t written = 0;
+  while (read < length) {
+    uint8_t code = in[read++];
+    if (code == 0 || read + code - 1 > length) return 0;
+    for (uint8_t i = 1; i < code; i++) {
+      if (in[read] == 0) return 0;
+      out[written++] = in[read++];
+    }
+    if (code < 0xFF && read < length) {
+      out[written++] = 0;
+    }
+  }
+  return written;
+}
+
+size_t linkEncodeFrame(uint8_t type, uint8_t seq, const void* payload, uint8_t length, uint8_t* out) {
+  if (length > LINK_MAX_PAYLOAD) return 0;
+  
+  uint8_t raw[LINK_MAX_PAYLOAD + LINK_FRAME_OVERHEAD];
+  raw[0] = type;
+  raw[1] = seq;
+  memcpy(raw + 2, payload, length);
+  uint32_t crc = crc32Final(crc32Update(CRC32_INIT, raw, length + 2));
+  for (int i = 0; i < 4; i++) {
+    raw[length + 2 + i] = crc >> (8 * i);
+  }
+  
+  out[0] = 0;
+  size_t encoded = cobsEncode(raw, length + LINK_FRAME_OVERHEAD, out + 1);
+  out[encoded + 1] = 0;
+  return encoded + 2;
+}
+
+bool linkDecodeFrame(const uint8_t* in, size_t length, LinkFrame& frame) {
+  uint8_t raw[LINK_MAX_ENCODED];
+  if (length > LINK_MAX_ENCODED) return false;
+  size_t size = cobsDecode(in, length, raw);
+  if (size < LINK_FRAME_OVERHEAD || size > LINK_MAX_PAYLOAD + LINK_FRAME_OVERHEAD) return false;
+  
+  size_t body = size - 4;
+  uint32_t crc = 0;
+  for (int i = 0; i < 4; i++) {
+    crc |= (uint32_t)raw[body + i] << (8 * i);
+  }
+  if (crc != crc32Final(crc32Update(CRC32_INIT, raw, body))) return false;
+  
+  frame.type = raw[0];
+  frame.seq = raw[1];
+  frame.length = body - 2;
+  memcpy(frame.payload, raw + 2, frame.length);
+  return true;
+}
+
+// ---- Link ----
+
+SerialLink::SerialLink() {
+  port = nullptr;
+  inputLog = nullptr;
+  connected = false;
+  rxLength = 0;
+  rxState = LINK_RX_IDLE;
+  rxErrors = 0;
+  txHead = 0;
+  txTail = 0;
+  txInFrame = false;
+  txSeq = 0;
+  txDropped = 0;
+  txPeak = 0;
+  logLength = 0;
+}
+
+void SerialLink::init(HardwareSerial* serial) {
+  port = serial;
+  logLink = this;
+}
+
+int SerialLink::readByte() {
+  // A replay supplies the bytes, the port is left alone
+  if (inputLog && inputLog->isReplaying()) {
+    return inputLog->replaySerial();
+  }
+  if (!port || port->available() <= 0) return -1;
+  
+  uint8_t data = port->read();
+  if (inputLog) {
+    inputLog->recordSerial(data);
+  }
+  return data;
+}
+
+int SerialLink::receive(LinkFrame& frame, char& key) {
+  int next;
+  while ((next = readByte()) >= 0) {
+    uint8_t data = next;
+    
+    if (rxState == LINK_RX_IDLE) {
+      if (data != 0) {
+        key = data;
+        return LINK_RX_KEY;
+      }
+      rxState = LINK_RX_FRAME_IN;
+      rxLength = 0;
+      continue;
+    }
+    
+    if (data != 0) {
+      if (rxState == LINK_RX_FRAME_IN && rxLength < LINK_MAX_ENCODED) {
+        rxBuffer[rxLength++] = data;
+      } else if (rxState == LINK_RX_FRAME_IN) {
+        rxState = LINK_RX_SKIP;
+        rxErrors++;
+      }
+      continue;
+    }
+    
+    // Back to back frames share a zero, an empty one is just the next opening
+    if (rxState == LINK_RX_FRAME_IN && rxLength == 0) continue;
+    
+    bool complete = rxState == LINK_RX_FRAME_IN;
+    rxState = LINK_RX_IDLE;
+    if (!complete) continue;
+    
+    if (!linkDecodeFrame(rxBuffer, rxLength, frame)) {
+      rxErrors++;
+      continue;
+    }
+    connected = true;
+    return LINK_RX_FRAME;
+  }
+  return LINK_RX_NONE;
+}
+
+bool SerialLink::send(uint8_t type, const void* payload, uint8_t length) {
+  if (!connected) return false;
+  
+  uint8_t encoded[LINK_MAX_ENCODED];
+  size_t size = linkEncodeFrame(type, txSeq, payload, length, encoded);
+  if (size == 0 || LINK_TX_RING - (txTail - txHead) < size) {
+    txDropped++;
+    return false;
+  }
+  
+  for (size_t i = 0; i < size; i++) {
+    txRing[(txTail + i) % LINK_TX_RING] = encoded[i];
+  }
+  txTail += size;
+  txSeq++;
+  if (txTail - txHead > txPeak) txPeak = txTail - txHead;
+  return true;
+}
+
+void SerialLink::acknowledge(const LinkFrame& command, uint8_t status) {
+  LinkAck ack = {command.seq, command.type, status};
+  send(LINK_TLM_ACK, &ack, sizeof(ack));
+}
+
+void SerialLink::drain() {
+  DeferredLogLine line;
+  while (deferredLog.takeLine(line)) {
+    logOutput().write((const uint8_t*)line.text, line.length);
+    logEnd();
+  }
+  
+  if (!port || txHead == txTail) return;
+  
+  uint32_t room = min(txTail - txHead, (uint32_t)LINK_DRAIN_BYTES);
+  room = min(room, (uint32_t)max(port->availableForWrite(), 0));
+  
+  // Whole frames only, so a frame is only left open when the port takes
+  // less than it said it had room for. Zeros alternate opening and
+  // closing, starting from a closing one when the last write stopped
+  // mid-frame.
+  uint8_t out[LINK_DRAIN_BYTES];
+  uint32_t count = 0;
+  int zeros = txInFrame ? 1 : 0;
+  for (uint32_t i = 0; i < room; i++) {
+    out[i] = txRing[(txHead + i) % LINK_TX_RING];
+    if (out[i] == 0 && (++zeros & 1) == 0) {
+      count = i + 1;
+    }
+  }
+  if (count == 0) return;
+  
+  writeOut(out, count);
+}
+
+uint32_t SerialLink::writeOut(const uint8_t* out, uint32_t count) {
+  // The port can take less than it said it had room for
+  uint32_t written = port->write(out, count);
+  for (uint32_t i = 0; i < written; i++) {
+    if (out[i] == 0) txInFrame = !txInFrame;
+  }
+  txHead += written;
+  return written;
+}
+
+void SerialLink::finishFrame() {
+  // Up to the closing zero, never more than a frame. A port that takes
+  // nothing at all is given up on rather than waited for.
+  while (port && txInFrame) {
+    uint8_t out[LINK_MAX_ENCODED];
+    uint32_t count = 0;
+    while (count < LINK_MAX_ENCODED && txHead + count != txTail) {
+      out[count] = txRing[(txHead + count) % LINK_TX_RING];
+      if (out[count++] == 0) break;
+    }
+    if (count == 0 || writeOut(out, count) == 0) return;
+  }
+}
+
+uint16_t SerialLink::getLogDropped() {
+  return deferredLog.getDropped();
+}
+
+size_t SerialLink::write(uint8_t c) {
+  // A line too long for a frame is cut short
+  if (c != '\r' && c != '\n' && logLength < LINK_LOG_LENGTH) {
+    logLine[logLength++] = c;
+  }
+  return 1;
+}
+
+void SerialLink::endLine() {
+  send(LINK_TLM_LOG, logLine, logLength);
+  logLength = 0;
+}
+
+// ---- Other tasks' log lines ----
+
+DeferredLog::DeferredLog() {
+  line.length = 0;
+  dropped.store(0);
+}
+
+size_t DeferredLog::write(uint8_t c) {
+  if (c != '\r' && c != '\n' && line.length < LINK_LOG_LENGTH) {
+    line.text[line.length++] = c;
+  }
+  return 1;
+}
+
+void DeferredLog::endLine() {
+  // Never waits on the UI task, a line with no room is lost
+  if (!lines.push(line)) {
+    dropped.fetch_add(1);
+  }
+  line.length = 0;
+}
+
+// ---- LOG_* output ----
+
+Print& logOutput() {
+  if (!onUiTask()) {
+    return deferredLog;
+  }
+  if (SerialLink::getLogLink() && SerialLink::getLogLink()->isConnected()) {
+    return *SerialLink::getLogLink();
+  }
+  return Serial;
+}
+
+Print& consoleOutput() {
+  if (SerialLink::getLogLink()) {
+    SerialLink::getLogLink()->finishFrame();
+  }
+  return Serial;
+}
+
+void logEnd() {
+  if (!onUiTask()) {
+    deferredLog.endLine();
+  } else if (SerialLink::getLogLink() && SerialLink::getLogLink()->isConnected()) {
+    SerialLink::getLogLink()->endLine();
+  } else {
+    Serial.println();
+  }
+}
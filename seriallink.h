@@ -0,0 +1,197 @@
+/*
+ * DriftRiff Mini - Serial Link Header
+ *
+ * Binary control and telemetry over the USB serial port. Each message is
+ * a frame of type, sequence number, payload and CRC-32, COBS-encoded and
+ * set between zero bytes, so a reader can pick frames out of anything else
+ * on the line. Bytes outside a frame are still console keys, and nothing
+ * binary is sent until a client has sent a valid frame, so the port stays
+ * usable from a terminal. Frames go out through a ring drained a little
+ * at a time from loop(); a full ring drops the frame, never blocks.
+ */
+
+#ifndef SERIALLINK_H
+#define SERIALLINK_H
+
+#include <Arduino.h>
+#include "tasks.h"
+
+#define LINK_MAX_PAYLOAD    64
+#define LINK_FRAME_OVERHEAD 6     // Type, sequence, CRC-32
+#define LINK_MAX_ENCODED    (LINK_MAX_PAYLOAD + LINK_FRAME_OVERHEAD + 3)   // COBS code byte and both zeros
+#define LINK_TX_RING        1024  // Power of two
+#define LINK_DRAIN_BYTES    128   // Most written per drain() call, one UART FIFO
+#define LINK_STATUS_MS      250   // Status telemetry period
+#define LINK_LOG_LENGTH     LINK_MAX_PAYLOAD
+#define LINK_DEFERRED_LINES 8     // LOG_* lines from the audio task waiting for drain()
+
+class InputLog;
+
+// Message types, commands from the client below 0x80
+enum LinkMessageType {
+  LINK_CMD_PING = 0x01,       // Any payload, echoed back in a PONG
+  LINK_CMD_SET_STEP = 0x02,   // LinkSetStep
+  LINK_CMD_SET_BPM = 0x03,    // uint16_t BPM
+  LINK_CMD_LOAD_SAMPLE = 0x04,  // Slot, then the file name (no terminator)
+  LINK_CMD_TRANSPORT = 0x05,  // 1 plays, 0 stops
+  
+  LINK_TLM_PONG = 0x81,
+  LINK_TLM_ACK = 0x82,        // LinkAck, for every command but PING
+  LINK_TLM_STEP = 0x83,       // LinkStep, each step the playhead reaches
+  LINK_TLM_STATUS = 0x84,     // LinkStatus, every LINK_STATUS_MS
+  LINK_TLM_LOG = 0x85         // One LOG_* line of text
+};
+
+enum LinkAckStatus {
+  LINK_OK,
+  LINK_BAD_ARGS,
+  LINK_FAILED,
+  LINK_UNKNOWN
+};
+
+// What receive() found
+enum LinkReceived {
+  LINK_RX_NONE,
+  LINK_RX_KEY,
+  LINK_RX_FRAME
+};
+
+struct LinkFrame {
+  uint8_t type;
+  uint8_t seq;
+  uint8_t length;
+  uint8_t payload[LINK_MAX_PAYLOAD];
+};
+
+// Payloads, little-endian on both ends
+struct __attribute__((packed)) LinkSetStep {
+  uint8_t track;
+  uint8_t step;
+  uint8_t active;
+};
+
+struct __attribute__((packed)) LinkAck {
+  uint8_t seq;                // Of the command
+  uint8_t type;
+  uint8_t status;             // LinkAckStatus
+};
+
+struct __attribute__((packed)) LinkStep {
+  uint8_t pattern;
+  uint8_t step;
+  uint32_t tick;              // Master tick the step is shown for
+  uint32_t frame;             // Audio frame being played at the time
+};
+
+struct __attribute__((packed)) LinkStatus {
+  uint32_t millis;
+  uint16_t bpm;
+  uint8_t playing;
+  uint8_t voices;
+  uint32_t underruns;         // Output samples written late
+  uint16_t renderMeanMicros;  // Block render time since the profiler was reset
+  uint16_t renderMaxMicros;
+  uint16_t txDropped;         // Frames the ring had no room for, wraps
+  uint16_t rxErrors;          // Frames that failed to decode, wraps
+};
+
+// COBS, without the delimiters. Decoding returns 0 for malformed input.
+size_t cobsEncode(const uint8_t* in, size_t length, uint8_t* out);
+size_t cobsDecode(const uint8_t* in, size_t length, uint8_t* out);
+
+// A whole frame with both delimiters into out (LINK_MAX_ENCODED bytes),
+// and back from the bytes between them
+size_t linkEncodeFrame(uint8_t type, uint8_t seq, const void* payload, uint8_t length, uint8_t* out);
+bool linkDecodeFrame(const uint8_t* in, size_t length, LinkFrame& frame);
+
+// LOG_* lines from a task other than the UI task, which owns the port.
+// Each line is kept whole and handed over to drain(). One such task.
+struct DeferredLogLine {
+  uint8_t length;
+  char text[LINK_LOG_LENGTH];
+};
+
+class DeferredLog : public Print {
+private:
+  DeferredLogLine line;
+  SpscQueue<DeferredLogLine, LINK_DEFERRED_LINES> lines;
+  std::atomic<uint16_t> dropped;
+  
+public:
+  DeferredLog();
+  
+  size_t write(uint8_t c) override;
+  using Print::write;
+  void endLine();
+  bool takeLine(DeferredLogLine& out) { return lines.pop(out); }
+  uint16_t getDropped() { return dropped.load(); }
+};
+
+class SerialLink : public Print {
+private:
+  HardwareSerial* port;
+  InputLog* inputLog;
+  bool connected;             // A valid frame has come in
+  
+  // Receive, the encoded bytes of the frame in progress
+  uint8_t rxBuffer[LINK_MAX_ENCODED];
+  uint8_t rxLength;
+  uint8_t rxState;
+  uint16_t rxErrors;
+  
+  // Transmit ring of encoded frames
+  uint8_t txRing[LINK_TX_RING];
+  uint32_t txHead;            // Next byte to write to the port
+  uint32_t txTail;            // Next free byte
+  bool txInFrame;             // A short write left txHead inside a frame
+  uint8_t txSeq;
+  uint16_t txDropped;
+  uint32_t txPeak;            // Most bytes the ring has held
+  
+  // LOG_* line being built while connected
+  char logLine[LINK_LOG_LENGTH];
+  uint8_t logLength;
+  
+  static SerialLink* logLink;
+  
+  int readByte();
+  uint32_t writeOut(const uint8_t* out, uint32_t count);
+  
+public:
+  SerialLink();
+  
+  void init(HardwareSerial* serial);
+  
+  // Record what comes in, or take it from a replay instead of the port
+  void setInputLog(InputLog* log) { inputLog = log; }
+  
+  // Take bytes off the port until a console key or a whole frame turns up
+  int receive(LinkFrame& frame, char& key);
+  
+  // Queue a frame, false (and counted) when the ring has no room
+  bool send(uint8_t type, const void* payload, uint8_t length);
+  void acknowledge(const LinkFrame& command, uint8_t status);
+  
+  // Write what the port can take without blocking, call every UI pass.
+  // LOG_* lines other tasks left are passed on first.
+  void drain();
+  
+  // Write out the rest of a frame a short write left open, blocking, so
+  // console text printed straight to the port goes in after it
+  void finishFrame();
+  
+  bool isConnected() { return connected; }
+  uint16_t getDropped() { return txDropped; }
+  uint16_t getErrors() { return rxErrors; }
+  uint32_t getQueued() { return txTail - txHead; }
+  uint32_t getPeakQueued() { return txPeak; }
+  uint16_t getLogDropped();
+  
+  // LOG_* text, sent as LINK_TLM_LOG frames once connected
+  size_t write(uint8_t c) override;
+  using Print::write;
+  void endLine();
+  static SerialLink* getLogLink() { return logLink; }
+};
+
+#endif
@@ -0,0 +1,206 @@
+/*
+ * DriftRiff Mini - Sample Slicer Implementation
+ */
+
+#include "slicer.h"
+#include "debuglog.h"
+
+Slicer::Slicer() {
+  sdLoader = nullptr;
+  for (int slot = 0; slot < NUM_SAMPLE_SLOTS; slot++) {
+    tables[slot].source = nullptr;
+    tables[slot].size = 0;
+    tables[slot].version = 0;
+    tables[slot].count = 0;
+    tables[slot].ready = false;
+  }
+  detectSlot = -1;
+  detectMicros = 0;
+}
+
+void Slicer::init(SDLoader* loader) {
+  sdLoader = loader;
+}
+
+void Slicer::beginTable(SliceTable& table, const uint8_t* data, uint32_t size, SliceDetector& state) {
+  // Withdrawn before anything changes, the audio task may be reading it
+  table.ready = false;
+  table.source = data;
+  table.size = size;
+  table.offsets[0] = 0;
+  table.count = 1;
+  
+  state.position = 0;
+  for (int i = 0; i < SLICE_HISTORY; i++) {
+    state.history[i] = 0;
+  }
+  state.lastOnset = 0;
+  state.previous = 128;
+}
+
+uint32_t Slicer::findAttack(const uint8_t* data, uint32_t start, uint32_t end) {
+  // What the window before still rings at, so a tail is not taken for the hit
+  uint32_t tail = 0;
+  for (uint32_t i = start >= SLICE_HOP ? start - SLICE_HOP : 0; i < start; i++) {
+    tail = max(tail, (uint32_t)abs((int)data[i] - 128));
+  }
+  uint32_t peak = 0;
+  for (uint32_t i = start; i < end; i++) {
+    peak = max(peak, (uint32_t)abs((int)data[i] - 128));
+  }
+  
+  uint32_t level = max(tail, peak / 4);
+  uint32_t attack = start;
+  for (uint32_t i = start; i < end; i++) {
+    if ((uint32_t)abs((int)data[i] - 128) > level) {
+      attack = i;
+      break;
+    }
+  }
+  
+  // Back up to the quietest frame just before it, so the slice starts
+  // without a click
+  uint32_t best = attack;
+  uint32_t limit = attack >= SLICE_HOP / 4 ? attack - SLICE_HOP / 4 : 0;
+  for (uint32_t i = attack; i > limit; i--) {
+    if (abs((int)data[i - 1] - 128) < abs((int)data[best] - 128)) {
+      best = i - 1;
+    }
+  }
+  return best;
+}
+
+bool Slicer::detectChunk(SliceTable& table, SliceDetector& state, int hops) {
+  const uint8_t* data = table.source;
+  
+  while (hops-- > 0) {
+    if (state.position + SLICE_HOP > table.size) {
+      return true;
+    }
+    
+    // Energy plus four times the energy of the first difference, which
+    // picks out a hat or snare attack over the low tail of a kick
+    uint32_t start = state.position;
+    uint32_t energy = 0;
+    uint8_t previous = state.previous;
+    for (uint32_t i = start; i < start + SLICE_HOP; i++) {
+      int32_t level = (int32_t)data[i] - 128;
+      int32_t change = (int32_t)data[i] - previous;
+      energy += level * level + ((change * change) << 2);
+      previous = data[i];
+    }
+    state.previous = previous;
+    state.position += SLICE_HOP;
+    
+    uint32_t before = 0;
+    for (int i = 0; i < SLICE_HISTORY; i++) {
+      before += state.history[i];
+    }
+    before /= SLICE_HISTORY;
+    
+    uint32_t window = start / SLICE_HOP;
+    if (energy >= SLICE_FLOOR && energy * 2 > SLICE_RISE * before &&
+        window - state.lastOnset >= SLICE_MIN_GAP && table.count < MAX_SLICES) {
+      table.offsets[table.count++] = findAttack(data, start, start + SLICE_HOP);
+      state.lastOnset = window;
+    }
+    
+    for (int i = 0; i < SLICE_HISTORY - 1; i++) {
+      state.history[i] = state.history[i + 1];
+    }
+    state.history[SLICE_HISTORY - 1] = energy;
+  }
+  return state.position + SLICE_HOP > table.size;
+}
+
+void Slicer::detect(const uint8_t* data, uint32_t size, SliceTable& table) {
+  SliceDetector state;
+  beginTable(table, data, size, state);
+  while (!detectChunk(table, state, SLICE_CHUNK_HOPS)) {
+  }
+  table.ready = true;
+}
+
+bool Slicer::update() {
+  if (detectSlot < 0) {
+    // Pick up the first slot loaded since its table was built. A new sample
+    // can land at the address and size of the one it replaced, so the slot
+    // version is what tells them apart.
+    for (int slot = 0; slot < NUM_SAMPLE_SLOTS; slot++) {
+      SliceTable& table = tables[slot];
+      if (sdLoader->getThumbnailVersion(slot) == table.version) continue;
+      
+      const uint8_t* data = sdLoader->getSampleData(slot);
+      if (!data) {
+        table.ready = false;
+        table.source = nullptr;
+        table.size = 0;
+        table.version = sdLoader->getThumbnailVersion(slot);
+        continue;
+      }
+      beginTable(table, data, sdLoader->getSampleSize(slot), detector);
+      table.version = sdLoader->getThumbnailVersion(slot);
+      detectSlot = slot;
+      detectMicros = 0;
+      break;
+    }
+    if (detectSlot < 0) return false;
+  }
+  
+  // Replaced or unloaded halfway through, start over from the top
+  SliceTable& table = tables[detectSlot];
+  if (sdLoader->getThumbnailVersion(detectSlot) != table.version) {
+    table.source = nullptr;
+    table.size = 0;
+    detectSlot = -1;
+    return true;
+  }
+  
+  unsigned long start = micros();
+  bool done = detectChunk(table, detector, SLICE_CHUNK_HOPS);
+  detectMicros += micros() - start;
+  
+  if (done) {
+    table.ready = true;
+    LOG_INFO("Sliced slot ", detectSlot, ", slices: ", table.count, ", us: ", detectMicros);
+    detectSlot = -1;
+  }
+  return true;
+}
+
+void Slicer::getSlice(int slot, int slice, uint8_t*& data, uint32_t& size) {
+  if (slot < 0 || slot >= NUM_SAMPLE_SLOTS) return;
+  
+  // A new sample in the slot keeps its whole length until it is scanned
+  const SliceTable& table = tables[slot];
+  if (!table.ready || table.source != data || table.size != size || slice < 0) return;
+  if (!sdLoader || table.version != sdLoader->getThumbnailVersion(slot)) return;
+  
+  // The UI task can start over on the table mid-read, whatever comes out
+  // has to stay inside the sample
+  uint8_t count = table.count;
+  if (count == 0) return;
+  slice %= count;
+  uint32_t start = table.offsets[slice];
+  uint32_t end = slice + 1 < count ? table.offsets[slice + 1] : size;
+  if (start >= end || end > size) return;
+  data += start;
+  size = end - start;
+}
+
+int Slicer::getSliceCount(int slot) {
+  if (slot < 0 || slot >= NUM_SAMPLE_SLOTS || !tables[slot].ready) return 0;
+  
+  // Not counted until the new sample in the slot has been scanned
+  if (!sdLoader || tables[slot].version != sdLoader->getThumbnailVersion(slot)) return 0;
+  return tables[slot].count;
+}
+
+uint32_t Slicer::getSliceOffset(int slot, int slice) {
+  if (slot < 0 || slot >= NUM_SAMPLE_SLOTS || slice < 0 || slice >= getSliceCount(slot)) return 0;
+  return tables[slot].offsets[slice];
+}
+
+bool Slicer::isReady(int slot) {
+  return getSliceCount(slot) > 0;
+}
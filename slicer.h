@@ -0,0 +1,75 @@
+/*
+ * DriftRiff Mini - Sample Slicer Header
+ *
+ * Finds the hits in each loaded sample (a break, say) with an onset
+ * detector run a chunk at a time from loop(), and keeps a table of where
+ * each slice starts. Slices are played straight out of the slot's buffer,
+ * nothing is copied.
+ */
+
+#ifndef SLICER_H
+#define SLICER_H
+
+#include <Arduino.h>
+#include <atomic>
+#include "sdloader.h"
+#include "sequencer.h"
+
+#define SLICE_HOP           64    // Frames per detection window, 2.9 ms
+#define SLICE_HISTORY       4     // Windows an onset is compared against
+#define SLICE_RISE          5     // Onset when a window has 5/2 the energy of the ones before
+#define SLICE_FLOOR         4096  // Ignore windows quieter than this, about -24 dB
+#define SLICE_MIN_GAP       16    // Windows between onsets, 46 ms
+#define SLICE_CHUNK_HOPS    16    // Windows analysed per update() call
+
+struct SliceTable {
+  const uint8_t* source;      // Sample the table was built from
+  uint32_t size;
+  uint16_t version;           // Slot version it was loaded as, see SDLoader::getThumbnailVersion()
+  uint32_t offsets[MAX_SLICES];
+  uint8_t count;              // The first slice always starts at 0
+  std::atomic<bool> ready;    // Read by the audio task
+};
+
+// Detector state between update() calls
+struct SliceDetector {
+  uint32_t position;          // Next frame to analyse
+  uint32_t history[SLICE_HISTORY];
+  uint32_t lastOnset;         // Window of the last slice start
+  uint8_t previous;           // Frame before position
+};
+
+class Slicer {
+private:
+  SDLoader* sdLoader;
+  SliceTable tables[NUM_SAMPLE_SLOTS];
+  SliceDetector detector;
+  int detectSlot;             // -1 when idle
+  uint32_t detectMicros;      // Time spent on the slot so far
+  
+  static void beginTable(SliceTable& table, const uint8_t* data, uint32_t size, SliceDetector& state);
+  static bool detectChunk(SliceTable& table, SliceDetector& state, int hops);
+  static uint32_t findAttack(const uint8_t* data, uint32_t start, uint32_t end);
+  
+public:
+  Slicer();
+  
+  void init(SDLoader* loader);
+  
+  // Slice any sample that is new or was replaced, one chunk per call.
+  // False when every loaded slot has its table.
+  bool update();
+  
+  // Blocking version for a single buffer
+  static void detect(const uint8_t* data, uint32_t size, SliceTable& table);
+  
+  // Narrow a slot's sample to one slice, 0-based, wrapping past the last.
+  // Left alone while the slot has no table for that buffer yet.
+  void getSlice(int slot, int slice, uint8_t*& data, uint32_t& size);
+  
+  int getSliceCount(int slot);
+  uint32_t getSliceOffset(int slot, int slice);
+  bool isReady(int slot);
+};
+
+#endif
@@ -0,0 +1,176 @@
+/*
+ * DriftRiff Mini - Task Layout Implementation
+ */
+
+#include "tasks.h"
+#include "profiler.h"
+
+#if !defined(ARDUINO)
+#include <chrono>
+#endif
+
+static bool threadedMode = DRIFTONE_TASKS;
+static Task* uiTask = nullptr;
+
+Task::Task() {
+  name = "";
+  step = nullptr;
+  core = 0;
+  priority = 0;
+  stackBytes = 0;
+  idleMs = 0;
+  running.store(false);
+  stopRequested.store(false);
+#if defined(ARDUINO)
+  handle = nullptr;
+#else
+  thread = nullptr;
+  threadId.store(std::thread::id());
+#endif
+  lastCycles = profReadCycles();
+  busyCycles = 0;
+  windowCycles = 0;
+  windowSteps = 0;
+}
+
+void Task::init(const char* taskName, TaskStep taskStep, uint8_t taskCore, uint8_t taskPriority,
+                uint32_t taskStackBytes, uint32_t taskIdleMs) {
+  name = taskName;
+  step = taskStep;
+  core = taskCore;
+  priority = taskPriority;
+  stackBytes = taskStackBytes;
+  idleMs = taskIdleMs;
+}
+
+bool Task::start() {
+  if (!step || running.load()) return false;
+  
+  stopRequested.store(false);
+  running.store(true);
+#if defined(ARDUINO)
+  // FreeRTOS on the ESP32 takes the stack size in bytes
+  if (xTaskCreatePinnedToCore(entry, name, stackBytes, this, priority, &handle, core) != pdPASS) {
+    running.store(false);
+    return false;
+  }
+#else
+  // Host threads are left to the scheduler, core and priority are only reported
+  thread = new std::thread(entry, this);
+#endif
+  return true;
+}
+
+void Task::entry(void* arg) {
+  Task* task = (Task*)arg;
+  
+  // Known before the first step, whatever start() is still doing
+#if defined(ARDUINO)
+  task->handle = xTaskGetCurrentTaskHandle();
+#else
+  task->threadId.store(std::this_thread::get_id());
+#endif
+  task->run();
+}
+
+void Task::stop() {
+#if !defined(ARDUINO)
+  if (!thread) return;
+  stopRequested.store(true);
+  thread->join();
+  delete thread;
+  thread = nullptr;
+  running.store(false);
+#endif
+}
+
+void Task::run() {
+  lastCycles = profReadCycles();
+  while (!stopRequested.load(std::memory_order_relaxed)) {
+    if (!runStep()) {
+      idle();
+    }
+  }
+}
+
+void Task::idle() {
+#if defined(ARDUINO)
+  if (idleMs > 0) {
+    vTaskDelay(max((TickType_t)1, (TickType_t)pdMS_TO_TICKS(idleMs)));
+  } else {
+    taskYIELD();
+  }
+#else
+  if (idleMs > 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(idleMs));
+  } else {
+    std::this_thread::yield();
+  }
+#endif
+}
+
+bool Task::runStep() {
+  uint32_t start = profReadCycles();
+  bool worked = step();
+  uint32_t end = profReadCycles();
+  
+  // Polling and sleeping count as idle, the window is everything since the
+  // last step ended
+  if (worked) busyCycles += end - start;
+  windowCycles += end - lastCycles;
+  lastCycles = end;
+  windowSteps++;
+  
+  uint64_t windowLength = (uint64_t)TASK_STATS_MS * 1000 * profCyclesPerMicro();
+  if (windowCycles >= windowLength) {
+    TaskStats window;
+    window.busyMicros = busyCycles / profCyclesPerMicro();
+    window.windowMicros = windowCycles / profCyclesPerMicro();
+    window.steps = windowSteps;
+#if defined(ARDUINO)
+    window.stackFree = running.load() ? uxTaskGetStackHighWaterMark(nullptr) : 0;
+#else
+    window.stackFree = 0;
+#endif
+    stats.publish(window);
+    busyCycles = 0;
+    windowCycles = 0;
+    windowSteps = 0;
+  }
+  return worked;
+}
+
+bool Task::isCurrent() {
+  if (!running.load()) return false;
+#if defined(ARDUINO)
+  return xTaskGetCurrentTaskHandle() == handle;
+#else
+  return std::this_thread::get_id() == threadId.load();
+#endif
+}
+
+void tasksSetThreaded(bool threaded) {
+  threadedMode = threaded;
+}
+
+bool tasksThreaded() {
+  return threadedMode;
+}
+
+void tasksSetUiTask(Task* task) {
+  uiTask = task;
+}
+
+bool onUiTask() {
+  // Before the tasks start, and without them, everything is the UI task
+  if (!uiTask || !uiTask->isRunning()) return true;
+  return uiTask->isCurrent();
+}
+
+void taskYield() {
+#if defined(ARDUINO)
+  taskYIELD();
+#else
+  std::this_thread::yield();
+#endif
+}
@@ -0,0 +1,194 @@
+/*
+ * DriftRiff Mini - Task Layout Header
+ *
+ * The firmware runs as two tasks: audio rendering and the sequencer clock
+ * pinned to core 1 at high priority, and the UI (touch, display, console)
+ * with the SD card work on core 0. They share nothing but lock-free
+ * single-producer queues and double-buffered snapshots. Each task is a
+ * step function the task calls over and over, so the same steps also run
+ * one after the other from loop(), the single-threaded layout the host
+ * simulator keeps by default for repeatable runs. FreeRTOS tasks on the
+ * device, std::thread on the host.
+ */
+
+#ifndef TASKS_H
+#define TASKS_H
+
+#include <Arduino.h>
+#include <atomic>
+
+#if !defined(ARDUINO)
+#include <thread>
+#endif
+
+// Threaded on the device, the host simulator opts in with --threads
+#ifndef DRIFTONE_TASKS
+#if defined(ARDUINO)
+#define DRIFTONE_TASKS 1
+#else
+#define DRIFTONE_TASKS 0
+#endif
+#endif
+
+#define TASK_AUDIO_CORE       1
+#define TASK_AUDIO_PRIORITY   5       // Above everything else on core 1
+#define TASK_AUDIO_STACK      4096    // Bytes
+#define TASK_UI_CORE          0
+#define TASK_UI_PRIORITY      1
+#define TASK_UI_STACK         8192
+#define TASK_UI_IDLE_MS       1       // Sleep after a UI step with nothing to do
+#define TASK_STATS_MS         1000    // CPU usage window
+
+// Lock-free ring for one producer task and one consumer task. N is a
+// power of two.
+template <typename T, uint16_t N>
+class SpscQueue {
+private:
+  static_assert((N & (N - 1)) == 0, "SpscQueue size must be a power of two");
+  
+  T items[N];
+  std::atomic<uint32_t> head;   // Next to pop, written by the consumer
+  std::atomic<uint32_t> tail;   // Next free, written by the producer
+  
+public:
+  SpscQueue() {
+    head.store(0);
+    tail.store(0);
+  }
+  
+  // False when full, nothing waits
+  bool push(const T& item) {
+    uint32_t position = tail.load(std::memory_order_relaxed);
+    if (position - head.load(std::memory_order_acquire) >= N) return false;
+    items[position & (N - 1)] = item;
+    tail.store(position + 1, std::memory_order_release);
+    return true;
+  }
+  
+  bool pop(T& item) {
+    uint32_t position = head.load(std::memory_order_relaxed);
+    if (position == tail.load(std::memory_order_acquire)) return false;
+    item = items[position & (N - 1)];
+    head.store(position + 1, std::memory_order_release);
+    return true;
+  }
+  
+  bool isEmpty() {
+    return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+  }
+};
+
+// State one task publishes and others read. The writer fills the buffer
+// readers are not on and then flips to it, so it never waits; a reader
+// copies again in the rare case the writer lapped it mid-copy.
+template <typename T>
+class Snapshot {
+private:
+  T buffers[2];
+  std::atomic<uint32_t> version;
+  
+public:
+  Snapshot() {
+    version.store(0);
+  }
+  
+  // Single writer
+  void publish(const T& value) {
+    uint32_t next = version.load(std::memory_order_relaxed) + 1;
+    buffers[next & 1] = value;
+    version.store(next, std::memory_order_release);
+  }
+  
+  // Copy of the latest published state, returns its version
+  uint32_t read(T& value) const {
+    while (true) {
+      uint32_t seen = version.load(std::memory_order_acquire);
+      value = buffers[seen & 1];
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (version.load(std::memory_order_relaxed) == seen) return seen;
+    }
+  }
+  
+  // Zero until the first publish
+  uint32_t getVersion() const { return version.load(std::memory_order_acquire); }
+};
+
+// Returns true when the step did some work, false when it only polled
+typedef bool (*TaskStep)();
+
+// One TASK_STATS_MS window of a task, published by the task itself
+struct TaskStats {
+  uint32_t busyMicros;        // Time in steps that did work
+  uint32_t windowMicros;
+  uint32_t steps;
+  uint32_t stackFree;         // Least stack left so far, bytes (0 on host)
+};
+
+class Task {
+private:
+  const char* name;
+  TaskStep step;
+  uint8_t core;
+  uint8_t priority;
+  uint32_t stackBytes;
+  uint32_t idleMs;            // 0 yields between idle steps instead of sleeping
+  std::atomic<bool> running;
+  std::atomic<bool> stopRequested;
+#if defined(ARDUINO)
+  TaskHandle_t handle;
+#else
+  std::thread* thread;
+  std::atomic<std::thread::id> threadId;
+#endif
+
+  // Current window, only touched by whoever runs the steps
+  uint32_t lastCycles;
+  uint64_t busyCycles;
+  uint64_t windowCycles;
+  uint32_t windowSteps;
+  Snapshot<TaskStats> stats;
+  
+  static void entry(void* arg);
+  void run();
+  void idle();
+  
+public:
+  Task();
+  
+  void init(const char* taskName, TaskStep taskStep, uint8_t taskCore, uint8_t taskPriority,
+            uint32_t taskStackBytes, uint32_t taskIdleMs);
+            
+  // Run the step on its own task, pinned to the core where there are cores
+  bool start();
+  
+  // Host only: finish the current step and join. A device task runs for good.
+  void stop();
+  
+  // One step, timed for the stats, for loop() while the task is not started
+  bool runStep();
+  
+  bool isRunning() { return running.load(); }
+  bool isCurrent();
+  
+  const char* getName() { return name; }
+  uint8_t getCore() { return core; }
+  uint8_t getPriority() { return priority; }
+  uint32_t getStackBytes() { return stackBytes; }
+  
+  // Last complete window, false before the first
+  bool getStats(TaskStats& out) { return stats.read(out) != 0; }
+};
+
+// Whether setup() starts the tasks (DRIFTONE_TASKS unless changed before it)
+void tasksSetThreaded(bool threaded);
+bool tasksThreaded();
+
+// The task that owns the console, display and card. Anything else that
+// wants them, LOG_* lines say, hands over through a queue instead.
+void tasksSetUiTask(Task* task);
+bool onUiTask();
+
+// Let another task have the core while waiting on one
+void taskYield();
+
+#endif
@@ -0,0 +1,46 @@
+/*
+ * DriftRiff Mini - Host Test Harness Header
+ *
+ * Each suite checks one module on the host HAL and is run by name, one
+ * ctest entry per suite. A failed check prints the expression and the
+ * suite carries on, so one run shows every failure.
+ */
+
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef void (*TestFunction)();
+
+struct TestSuite {
+  const char* name;
+  TestFunction run;
+};
+
+extern const TestSuite testSuites[];
+extern const int testSuiteCount;
+
+void testFail(const char* file, int line, const char* expression);
+void testFailValues(const char* file, int line, const char* expression,
+                    long long actual, long long expected);
+
+#define CHECK(condition) \
+  do { \
+    if (!(condition)) testFail(__FILE__, __LINE__, #condition); \
+  } while (0)
+
+#define CHECK_EQ(actual, expected) \
+  do { \
+    long long checkActual = (long long)(actual); \
+    long long checkExpected = (long long)(expected); \
+    if (checkActual != checkExpected) { \
+      testFailValues(__FILE__, __LINE__, #actual " == " #expected, checkActual, checkExpected); \
+    } \
+  } while (0)
+
+// Scratch SD card, emptied before each suite
+const char* testSDRoot();
+
+#endif
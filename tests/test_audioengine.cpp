@@ -0,0 +1,208 @@
+/*
+ * DriftRiff Mini - Audio Engine Tests
+ */
+
+#include <Arduino.h>
+#include <math.h>
+#include <vector>
+
+#include "test.h"
+#include "audioengine.h"
+#include "sdloader.h"
+#include "hostsim.h"
+
+#define DC_LEVEL  100     // Sample value of the DC test sample, under the limiter ceiling
+
+static std::vector<uint8_t> rendered;
+
+static void captureLevel(uint8_t level) {
+  rendered.push_back(level);
+}
+
+static void runFrames(AudioEngine& engine, int frames) {
+  for (int i = 0; i < frames; i++) {
+    hostClockAdvance(1000000 / SAMPLE_RATE);
+    engine.update();
+  }
+}
+
+// Output level, around the centre, once a hit on a DC sample has settled
+static int renderedDC(AudioEngine& engine, uint8_t* sample, uint32_t size, uint8_t velocity) {
+  engine.playSample(sample, size, 1.0f, ENVELOPE_NONE, velocity);
+  runFrames(engine, 2 * AUDIO_BLOCK_SIZE);
+  rendered.clear();
+  runFrames(engine, 4 * AUDIO_BLOCK_SIZE);
+  int lowest = 255;
+  int highest = 0;
+  for (uint8_t level : rendered) {
+    lowest = min(lowest, (int)level);
+    highest = max(highest, (int)level);
+  }
+  engine.stopSample(sample, size);
+  runFrames(engine, 2 * AUDIO_BLOCK_SIZE);
+  return lowest == highest ? lowest - 128 : -1000;
+}
+
+void testStopSample() {
+  static uint8_t freed[MAX_SAMPLE_SIZE];
+  static uint8_t kept[MAX_SAMPLE_SIZE];
+  for (uint32_t i = 0; i < MAX_SAMPLE_SIZE; i++) {
+    freed[i] = 128 + ((i & 16) ? 60 : -60);
+    kept[i] = 128 + ((i & 8) ? 40 : -40);
+  }
+  AudioEngine engine;
+  engine.init();
+
+  // A slice voice and a queued slice from inside the freed buffer, and a
+  // voice from another buffer that has to keep playing
+  engine.playSample(freed + 4096, 8192);
+  engine.playSample(kept, MAX_SAMPLE_SIZE);
+  CHECK(engine.scheduleSample(4 * AUDIO_BLOCK_SIZE, freed + 16384, 8192));
+  runFrames(engine, 2 * AUDIO_BLOCK_SIZE);
+  CHECK_EQ(engine.getActiveVoices(), 2);
+
+  engine.stopSample(freed, MAX_SAMPLE_SIZE);
+  runFrames(engine, 8 * AUDIO_BLOCK_SIZE);
+  CHECK_EQ(engine.getActiveVoices(), 1);
+
+  // The end of the buffer is outside it
+  CHECK(engine.scheduleSample(12 * AUDIO_BLOCK_SIZE, kept, MAX_SAMPLE_SIZE));
+  engine.stopSample(kept + MAX_SAMPLE_SIZE, MAX_SAMPLE_SIZE);
+  runFrames(engine, 4 * AUDIO_BLOCK_SIZE);
+  CHECK_EQ(engine.getActiveVoices(), 2);
+
+  engine.stopSample(kept, MAX_SAMPLE_SIZE);
+  runFrames(engine, 2 * AUDIO_BLOCK_SIZE);
+  CHECK_EQ(engine.getActiveVoices(), 0);
+}
+
+void testVelocityRender() {
+  static uint8_t dc[MAX_SAMPLE_SIZE];
+  for (uint32_t i = 0; i < MAX_SAMPLE_SIZE; i++) {
+    dc[i] = 128 + DC_LEVEL;
+  }
+  AudioEngine engine;
+  engine.init();
+  hostAudioSetTap(captureLevel);
+
+  // Full velocity is unity on both curves, 0 is silent
+  for (uint8_t curve = VELOCITY_LINEAR; curve < NUM_VELOCITY_CURVES; curve++) {
+    engine.setVelocityCurve(curve);
+    CHECK_EQ(renderedDC(engine, dc, MAX_SAMPLE_SIZE, MAX_VELOCITY), DC_LEVEL);
+    CHECK_EQ(renderedDC(engine, dc, MAX_SAMPLE_SIZE, 0), 0);
+  }
+
+  // What comes out follows each curve within a step of the output, and
+  // never gets quieter as velocity goes up
+  const float rangeDb = VELOCITY_RANGE_DB;
+  for (uint8_t curve = VELOCITY_LINEAR; curve < NUM_VELOCITY_CURVES; curve++) {
+    engine.setVelocityCurve(curve);
+    int last = 0;
+    for (int velocity = 1; velocity <= MAX_VELOCITY; velocity += 7) {
+      float gain = (float)velocity / MAX_VELOCITY;
+      if (curve == VELOCITY_EXP) {
+        gain = powf(10.0f, -rangeDb * (MAX_VELOCITY - velocity) / (MAX_VELOCITY - 1) / 20.0f);
+      }
+      int level = renderedDC(engine, dc, MAX_SAMPLE_SIZE, velocity);
+      CHECK(fabsf(level - DC_LEVEL * gain) <= 1.5f);
+      CHECK(level >= last);
+      last = level;
+    }
+  }
+
+  // Half way up, the exponential curve is well under the linear one:
+  // 20 dB down against 6 dB
+  engine.setVelocityCurve(VELOCITY_LINEAR);
+  int linearHalf = renderedDC(engine, dc, MAX_SAMPLE_SIZE, 64);
+  engine.setVelocityCurve(VELOCITY_EXP);
+  int expHalf = renderedDC(engine, dc, MAX_SAMPLE_SIZE, 64);
+  CHECK(linearHalf >= DC_LEVEL / 2 - 1 && linearHalf <= DC_LEVEL / 2 + 1);
+  CHECK(expHalf >= DC_LEVEL / 10 - 1 && expHalf <= DC_LEVEL / 10 + 1);
+  hostAudioSetTap(nullptr);
+}
+
+// Largest change between neighbouring output frames
+static int largestStep(const std::vector<uint8_t>& levels) {
+  int largest = 0;
+  for (size_t i = 1; i < levels.size(); i++) {
+    largest = max(largest, abs((int)levels[i] - (int)levels[i - 1]));
+  }
+  return largest;
+}
+
+// The frames rendered over the next blocks, following on from the last one
+// already out so a jump at the first of them counts
+static std::vector<uint8_t> renderBlocks(AudioEngine& engine, int blocks) {
+  uint8_t last = rendered.empty() ? 128 : rendered.back();
+  rendered.clear();
+  rendered.push_back(last);
+  runFrames(engine, blocks * AUDIO_BLOCK_SIZE);
+  return rendered;
+}
+
+void testMuteRender() {
+  // A 200 Hz tone starting on its peak, so a hit that is not faded in
+  // jumps straight to it
+  static uint8_t tone[MAX_SAMPLE_SIZE];
+  for (uint32_t i = 0; i < MAX_SAMPLE_SIZE; i++) {
+    tone[i] = 128 + (int)lroundf(60 * cosf(2 * PI * 200 * i / SAMPLE_RATE));
+  }
+  const int track = 2;
+  const uint8_t muted = ALL_TRACKS_MASK & ~(1 << track);
+  const int fadeBlocks = VOLUME_UNITY / MUTE_RAMP_STEP;
+
+  for (int limiter = 0; limiter < 2; limiter++) {
+    AudioEngine engine;
+    engine.init();
+    engine.setLimiterEnabled(limiter);
+    hostAudioSetTap(captureLevel);
+    rendered.clear();
+
+    // The tone's own largest step, once it is playing
+    engine.playSample(tone, MAX_SAMPLE_SIZE, 1.0f, track);
+    runFrames(engine, 4 * AUDIO_BLOCK_SIZE);
+    int toneStep = largestStep(renderBlocks(engine, 8));
+    CHECK(toneStep >= 3 && toneStep <= 8);
+
+    // Muted mid-tone it fades out over the ramp no faster than the tone
+    // moves, and the voice is freed once it is silent
+    engine.setAudibleTracks(muted);
+    std::vector<uint8_t> fade = renderBlocks(engine, fadeBlocks + 4);
+    CHECK(largestStep(fade) <= toneStep);
+    CHECK_EQ(engine.getActiveVoices(), 0);
+    int quiet = fade.size();
+    while (quiet > 0 && fade[quiet - 1] == 128) {
+      quiet--;
+    }
+    CHECK(quiet > (fadeBlocks - 1) * AUDIO_BLOCK_SIZE);
+    CHECK(quiet <= (fadeBlocks + 1) * AUDIO_BLOCK_SIZE + (limiter ? LIMITER_LOOKAHEAD : 0));
+
+    // Hits for a muted track, played or queued, never start
+    engine.playSample(tone, MAX_SAMPLE_SIZE, 1.0f, track);
+    CHECK(engine.scheduleSample(engine.getRenderFrame() + AUDIO_BLOCK_SIZE / 2, tone, MAX_SAMPLE_SIZE,
+                                1.0f, track));
+    std::vector<uint8_t> silent = renderBlocks(engine, 4);
+    CHECK_EQ(largestStep(silent), 0);
+    CHECK_EQ(engine.getActiveVoices(), 0);
+
+    // Unmuted, a hit on the peak fades in over the ramp without a click.
+    // Another track, never muted, still starts on the peak.
+    engine.setAudibleTracks(ALL_TRACKS_MASK);
+    engine.playSample(tone, MAX_SAMPLE_SIZE, 1.0f, track);
+    CHECK(largestStep(renderBlocks(engine, fadeBlocks + 4)) <= toneStep);
+    CHECK_EQ(engine.getActiveVoices(), 1);
+    engine.stopAllSamples();
+    renderBlocks(engine, 4);
+    engine.playSample(tone, MAX_SAMPLE_SIZE, 1.0f, track + 1);
+    CHECK(largestStep(renderBlocks(engine, 4)) >= 50);
+
+    // Stopping everything on the other hand cuts the tone dead, here
+    // near a peak
+    for (int i = 0; i < SAMPLE_RATE / 200 && abs((int)rendered.back() - 128) < 50; i++) {
+      runFrames(engine, 1);
+    }
+    engine.stopAllSamples();
+    CHECK(largestStep(renderBlocks(engine, 4)) > 2 * toneStep);
+    hostAudioSetTap(nullptr);
+  }
+}
@@ -0,0 +1,223 @@
+/*
+ * DriftRiff Mini - Automation Tests
+ */
+
+#include <Arduino.h>
+#include <memory>
+#include <vector>
+
+#include "test.h"
+#include "automation.h"
+
+#define LANE_TICKS  (10 * TICKS_PER_STEP)
+
+typedef std::vector<uint8_t> Gesture;   // Value at every tick of a pass
+typedef std::vector<bool> TouchMask;    // Ticks of the pass the finger is down
+
+static uint32_t nextValue(uint32_t& state) {
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+
+// Drags, jumps and holds, the way a finger moves
+static Gesture makeGesture(uint32_t seed, uint32_t ticks) {
+  Gesture gesture(ticks);
+  uint32_t random = seed;
+  int value = nextValue(random) & 0xFF;
+  int slope = 0;
+  for (uint32_t t = 0; t < ticks; t++) {
+    uint32_t roll = nextValue(random) % 100;
+    if (roll < 2) {
+      value = nextValue(random) & 0xFF;
+    } else if (roll < 10) {
+      slope = (int)(nextValue(random) % 7) - 3;
+    }
+    value = constrain(value + slope, 0, AUTOMATION_MAX_VALUE);
+    gesture[t] = value;
+  }
+  return gesture;
+}
+
+// Arm, let the pass it arms in go by, then record one pass a tick at a
+// time from the tick given, which starts a pass. Returns the tick after.
+static int32_t recordPass(Automation& automation, int track, int param, int32_t start,
+                          const Gesture& gesture, const TouchMask& touch) {
+  uint32_t ticks = gesture.size();
+  CHECK(automation.arm(track, param, ticks));
+  int32_t tick = start - (int32_t)ticks;
+  for (; tick < start; tick++) {
+    automation.record(tick, false, 0);
+  }
+  CHECK_EQ(automation.getState(), AUTO_ARMED);
+  for (uint32_t t = 0; t < ticks; t++, tick++) {
+    automation.record(tick, touch[t], gesture[t]);
+    if (touch[t]) {
+      CHECK_EQ(automation.getValue(track, param, tick), gesture[t]);
+    }
+  }
+  automation.record(tick, false, 0);
+  CHECK_EQ(automation.getState(), AUTO_IDLE);
+  return tick;
+}
+
+// Ticks where playback differs from what was expected, over two passes
+// so the wrap is covered
+static int laneErrors(Automation& automation, int track, int param, const Gesture& expected) {
+  int errors = 0;
+  for (uint32_t tick = 0; tick < 2 * expected.size(); tick++) {
+    errors += automation.getValue(track, param, tick) != expected[tick % expected.size()];
+  }
+  return errors;
+}
+
+void testAutomationGestures() {
+  std::unique_ptr<Automation> automation(new Automation());
+  Gesture gesture = makeGesture(0xa11ce, LANE_TICKS);
+  TouchMask all(LANE_TICKS, true);
+  recordPass(*automation, 1, AUTO_CUTOFF, 2 * LANE_TICKS, gesture, all);
+
+  // Every tick plays back as it was recorded, jumps included, and most
+  // points take a single byte
+  CHECK(automation->isLaneUsed(1, AUTO_CUTOFF));
+  CHECK_EQ(laneErrors(*automation, 1, AUTO_CUTOFF, gesture), 0);
+  CHECK(automation->getLaneBytes(1, AUTO_CUTOFF) < 2 * automation->getLanePoints(1, AUTO_CUTOFF));
+  CHECK_EQ(automation->getPoolUsed(), automation->getLaneBytes(1, AUTO_CUTOFF));
+
+  // Looked up out of order, the cursor finds its way back
+  uint32_t random = 77;
+  int errors = 0;
+  for (int i = 0; i < 2000; i++) {
+    uint32_t tick = nextValue(random) % (4 * LANE_TICKS);
+    errors += automation->getValue(1, AUTO_CUTOFF, tick) != gesture[tick % LANE_TICKS];
+  }
+  CHECK_EQ(errors, 0);
+
+  // Other lanes stay at their defaults
+  CHECK_EQ(automation->getValue(1, AUTO_PITCH, 100), 128);
+  CHECK_EQ(automation->getValue(0, AUTO_CUTOFF, 100), AUTOMATION_MAX_VALUE);
+  CHECK_EQ(automation->getValue(1, AUTO_CUTOFF, -1), AUTOMATION_MAX_VALUE);
+
+  // Going back to the start mid-pass cancels and keeps the old lane
+  CHECK(automation->arm(1, AUTO_CUTOFF, LANE_TICKS));
+  automation->record(0, false, 0);
+  automation->record(LANE_TICKS, true, 3);
+  automation->record(LANE_TICKS + 5, true, 9);
+  automation->record(10, true, 9);
+  CHECK_EQ(automation->getState(), AUTO_IDLE);
+  CHECK_EQ(laneErrors(*automation, 1, AUTO_CUTOFF, gesture), 0);
+}
+
+void testAutomationOverdub() {
+  // A second pass touched only in the middle replaces just that part
+  std::unique_ptr<Automation> automation(new Automation());
+  Gesture first = makeGesture(1, LANE_TICKS);
+  TouchMask all(LANE_TICKS, true);
+  int32_t tick = recordPass(*automation, 3, AUTO_VOLUME, LANE_TICKS, first, all);
+
+  Gesture second = makeGesture(2, LANE_TICKS);
+  TouchMask middle(LANE_TICKS, false);
+  Gesture expected = first;
+  for (uint32_t t = LANE_TICKS / 3; t < 2 * LANE_TICKS / 3; t++) {
+    middle[t] = true;
+    expected[t] = second[t];
+  }
+  tick = (tick / LANE_TICKS + 1) * LANE_TICKS;
+  recordPass(*automation, 3, AUTO_VOLUME, tick, second, middle);
+  CHECK_EQ(laneErrors(*automation, 3, AUTO_VOLUME, expected), 0);
+
+  // An untouched pass over an empty lane records the default
+  Gesture untouched(LANE_TICKS, 0);
+  recordPass(*automation, 4, AUTO_PITCH, LANE_TICKS, untouched, TouchMask(LANE_TICKS, false));
+  CHECK_EQ(laneErrors(*automation, 4, AUTO_PITCH, Gesture(LANE_TICKS, 128)), 0);
+}
+
+void testAutomationClear() {
+  // Lanes either side of one being recorded are cleared mid-pass; the
+  // pass moves with the pool and lands whole
+  std::unique_ptr<Automation> automation(new Automation());
+  TouchMask all(LANE_TICKS, true);
+  Gesture before = makeGesture(10, LANE_TICKS);
+  Gesture after = makeGesture(11, LANE_TICKS);
+  Gesture kept = makeGesture(12, LANE_TICKS);
+  recordPass(*automation, 0, AUTO_VOLUME, LANE_TICKS, before, all);
+  recordPass(*automation, 5, AUTO_CUTOFF, LANE_TICKS, after, all);
+  recordPass(*automation, 2, AUTO_PITCH, LANE_TICKS, kept, all);
+  uint16_t keptBytes = automation->getLaneBytes(2, AUTO_PITCH);
+
+  Gesture recorded = makeGesture(13, LANE_TICKS);
+  CHECK(automation->arm(1, AUTO_PITCH, LANE_TICKS));
+  int32_t tick = 0;
+  for (; tick < LANE_TICKS; tick++) {
+    automation->record(tick, false, 0);
+  }
+  for (uint32_t t = 0; t < LANE_TICKS; t++, tick++) {
+    automation->record(tick, true, recorded[t]);
+    if (t == LANE_TICKS / 4) automation->clearLane(0, AUTO_VOLUME);
+    if (t == LANE_TICKS / 2) automation->clearLane(5, AUTO_CUTOFF);
+  }
+  automation->record(tick, false, 0);
+  CHECK_EQ(automation->getState(), AUTO_IDLE);
+  CHECK(!automation->isLaneUsed(0, AUTO_VOLUME));
+  CHECK(!automation->isLaneUsed(5, AUTO_CUTOFF));
+  CHECK_EQ(laneErrors(*automation, 1, AUTO_PITCH, recorded), 0);
+  CHECK_EQ(laneErrors(*automation, 2, AUTO_PITCH, kept), 0);
+  CHECK_EQ(automation->getLaneBytes(2, AUTO_PITCH), keptBytes);
+  CHECK_EQ(automation->getPoolUsed(), keptBytes + automation->getLaneBytes(1, AUTO_PITCH));
+
+  // Clearing the lane being recorded cancels the pass and empties it
+  CHECK(automation->arm(2, AUTO_PITCH, LANE_TICKS));
+  tick = 0;
+  for (; tick < LANE_TICKS + 20; tick++) {
+    automation->record(tick, true, tick & 0xFF);
+  }
+  automation->clearLane(2, AUTO_PITCH);
+  CHECK_EQ(automation->getState(), AUTO_IDLE);
+  CHECK(!automation->isLaneUsed(2, AUTO_PITCH));
+  CHECK_EQ(automation->getValue(2, AUTO_PITCH, 20), 128);
+  CHECK_EQ(laneErrors(*automation, 1, AUTO_PITCH, recorded), 0);
+  CHECK_EQ(automation->getPoolUsed(), automation->getLaneBytes(1, AUTO_PITCH));
+}
+
+void testAutomationOverflow() {
+  // A gesture that jumps every tick, too far for one-byte points, fills
+  // the pool with a couple of bytes to spare. Small steps back to the
+  // last value kept would still fit there, but the pass holds that value
+  // to the end rather than play them at the wrong ticks, and the lane
+  // already there is untouched.
+  std::unique_ptr<Automation> automation(new Automation());
+  TouchMask all(LANE_TICKS, true);
+  Gesture small = makeGesture(20, LANE_TICKS);
+  recordPass(*automation, 0, AUTO_VOLUME, LANE_TICKS, small, all);
+  uint16_t smallBytes = automation->getPoolUsed();
+  CHECK_EQ((AUTOMATION_POOL_SIZE - smallBytes) % 3, 2);
+
+  const uint32_t ticks = 2 * AUTOMATION_POOL_SIZE / 3;
+  Gesture wild(ticks);
+  uint32_t random = 0xf00d;
+  for (uint32_t t = 0; t < ticks; t++) {
+    wild[t] = (t & 1 ? 40 : 200) + nextValue(random) % 4;
+  }
+  recordPass(*automation, 4, AUTO_CUTOFF, ticks, wild, TouchMask(ticks, true));
+  CHECK(automation->getPoolUsed() <= AUTOMATION_POOL_SIZE);
+  CHECK(automation->getPoolUsed() > AUTOMATION_POOL_SIZE - 3);
+
+  uint32_t kept = 0;
+  while (kept < ticks && automation->getValue(4, AUTO_CUTOFF, kept) == wild[kept]) {
+    kept++;
+  }
+  CHECK(kept > ticks / 3);
+  CHECK(kept < ticks);
+  int errors = 0;
+  for (uint32_t t = kept; t < ticks; t++) {
+    errors += automation->getValue(4, AUTO_CUTOFF, t) != wild[kept - 1];
+  }
+  CHECK_EQ(errors, 0);
+  CHECK_EQ(automation->getLaneBytes(0, AUTO_VOLUME), smallBytes);
+  CHECK_EQ(laneErrors(*automation, 0, AUTO_VOLUME, small), 0);
+
+  // Clearing it gives the room back
+  automation->clearLane(4, AUTO_CUTOFF);
+  CHECK_EQ(automation->getPoolUsed(), smallBytes);
+}
@@ -0,0 +1,261 @@
+/*
+ * DriftRiff Mini - Undo Journal Tests
+ */
+
+#include <Arduino.h>
+#include <string.h>
+#include <memory>
+#include <vector>
+
+#include "test.h"
+#include "sequencer.h"
+
+// The patterns random edits touch, compared as bytes. Few enough to stay
+// resident the whole time.
+#define JOURNAL_TEST_PATTERNS 2
+
+typedef std::vector<uint8_t> BankState;
+
+static BankState bankState(Sequencer& sequencer) {
+  BankState state;
+  for (int i = 0; i < JOURNAL_TEST_PATTERNS; i++) {
+    const uint8_t* bytes = (const uint8_t*)sequencer.getResidentPattern(i);
+    state.insert(state.end(), bytes, bytes + sizeof(Pattern));
+  }
+  return state;
+}
+
+// Give a track something besides steps, so clearing it needs a snapshot
+static void decorateTrack(Sequencer& sequencer, int track) {
+  sequencer.setStep(track, 1, true);
+  sequencer.setMicroTiming(track, 1, 7 + track);
+}
+
+void testJournalWraparound() {
+  std::unique_ptr<Sequencer> sequencer(new Sequencer());
+  std::vector<BankState> states;
+  states.push_back(bankState(*sequencer));
+  for (int i = 0; i < 200; i++) {
+    sequencer->toggleStep(i % NUM_TRACKS, i % MAX_STEPS);
+    states.push_back(bankState(*sequencer));
+  }
+
+  // Only the last JOURNAL_DEPTH edits are kept, whatever the ring position
+  CHECK_EQ(sequencer->getUndoDepth(), JOURNAL_DEPTH);
+  for (int i = 0; i < JOURNAL_DEPTH; i++) {
+    CHECK(sequencer->undo());
+    CHECK(bankState(*sequencer) == states[200 - 1 - i]);
+  }
+  CHECK(!sequencer->undo());
+  CHECK_EQ(sequencer->getRedoDepth(), JOURNAL_DEPTH);
+  for (int i = 0; i < JOURNAL_DEPTH; i++) {
+    CHECK(sequencer->redo());
+    CHECK(bankState(*sequencer) == states[200 - JOURNAL_DEPTH + 1 + i]);
+  }
+  CHECK(!sequencer->redo());
+
+  // A new edit after some undos drops the redo side
+  for (int i = 0; i < 10; i++) sequencer->undo();
+  sequencer->setTrackLength(3, 5);
+  CHECK_EQ(sequencer->getRedoDepth(), 0);
+  CHECK_EQ(sequencer->getUndoDepth(), JOURNAL_DEPTH - 10 + 1);
+  CHECK(!sequencer->redo());
+  CHECK(sequencer->undo());
+  CHECK(bankState(*sequencer) == states[190]);
+
+  // Edits that change nothing are not recorded
+  int depth = sequencer->getUndoDepth();
+  sequencer->setStep(0, 40, sequencer->isStepActive(0, 40));
+  sequencer->setTrackRate(2, sequencer->getTrackRate(2));
+  CHECK_EQ(sequencer->getUndoDepth(), depth);
+  CHECK(sequencer->getJournalMemory() >= JOURNAL_DEPTH * sizeof(EditRecord) + JOURNAL_SNAPSHOTS * sizeof(Pattern));
+}
+
+void testJournalGroups() {
+  // clearAll() of six step-only tracks is one group of six records
+  std::unique_ptr<Sequencer> sequencer(new Sequencer());
+  for (int track = 0; track < NUM_TRACKS; track++) {
+    sequencer->setStep(track, track, true);
+  }
+  sequencer->clearHistory();
+  BankState filled = bankState(*sequencer);
+  sequencer->clearAll();
+  BankState cleared = bankState(*sequencer);
+  CHECK_EQ(sequencer->getUndoDepth(), NUM_TRACKS);
+  CHECK(sequencer->undo());
+  CHECK(bankState(*sequencer) == filled);
+  CHECK_EQ(sequencer->getUndoDepth(), 0);
+  CHECK(sequencer->redo());
+  CHECK(bankState(*sequencer) == cleared);
+  CHECK_EQ(sequencer->getRedoDepth(), 0);
+
+  // Fill the ring behind the group, then one more edit evicts the whole
+  // group, never part of it
+  for (int i = 0; i < JOURNAL_DEPTH - NUM_TRACKS; i++) {
+    sequencer->toggleStep(i % NUM_TRACKS, 8 + i / NUM_TRACKS);
+  }
+  CHECK_EQ(sequencer->getUndoDepth(), JOURNAL_DEPTH);
+  sequencer->toggleStep(0, 63);
+  CHECK_EQ(sequencer->getUndoDepth(), JOURNAL_DEPTH - NUM_TRACKS + 1);
+  int undone = 0;
+  while (sequencer->undo()) undone++;
+  CHECK_EQ(undone, JOURNAL_DEPTH - NUM_TRACKS + 1);
+  CHECK(bankState(*sequencer) == cleared);
+
+  // And redone from there, the ring having wrapped
+  int redone = 0;
+  while (sequencer->redo()) redone++;
+  CHECK_EQ(redone, undone);
+  CHECK(sequencer->isStepActive(0, 63));
+}
+
+void testJournalSnapshots() {
+  std::unique_ptr<Sequencer> sequencer(new Sequencer());
+  for (int track = 0; track < NUM_TRACKS; track++) {
+    decorateTrack(*sequencer, track);
+  }
+  sequencer->clearHistory();
+
+  // Three clears that each need a snapshot, with two slots: the third
+  // forgets history up to and including the first
+  BankState beforeFirst = bankState(*sequencer);
+  sequencer->clearTrack(0);
+  BankState afterFirst = bankState(*sequencer);
+  sequencer->toggleStep(5, 20);
+  sequencer->clearTrack(1);
+  sequencer->toggleStep(5, 21);
+  BankState beforeThird = bankState(*sequencer);
+  sequencer->clearTrack(2);
+  BankState afterThird = bankState(*sequencer);
+  CHECK_EQ(sequencer->getUndoDepth(), 4);
+
+  CHECK(sequencer->undo());
+  CHECK(bankState(*sequencer) == beforeThird);
+  int undone = 1;
+  while (sequencer->undo()) undone++;
+  CHECK_EQ(undone, 4);
+  CHECK(bankState(*sequencer) == afterFirst);
+  CHECK(bankState(*sequencer) != beforeFirst);
+  while (sequencer->redo()) {
+  }
+  CHECK(bankState(*sequencer) == afterThird);
+
+  // Slots held by undone clears are free again once a new edit drops them
+  sequencer->undo();
+  sequencer->undo();
+  sequencer->undo();
+  BankState branch = bankState(*sequencer);
+  sequencer->clearTrack(3);
+  sequencer->clearTrack(4);
+  CHECK_EQ(sequencer->getUndoDepth(), 3);
+  CHECK(sequencer->undo());
+  CHECK(sequencer->undo());
+  CHECK(bankState(*sequencer) == branch);
+
+  // clearAll() with more than steps on a track keeps one snapshot for all
+  sequencer = std::unique_ptr<Sequencer>(new Sequencer());
+  decorateTrack(*sequencer, 2);
+  sequencer->setStep(4, 9, true);
+  BankState full = bankState(*sequencer);
+  sequencer->clearAll();
+  CHECK(sequencer->undo());
+  CHECK(bankState(*sequencer) == full);
+  CHECK(sequencer->redo());
+  CHECK(Sequencer::isPatternEmpty(*sequencer->getResidentPattern(0)));
+}
+
+static uint32_t nextValue(uint32_t& state) {
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+
+void testJournalRandom() {
+  // Random edits, undos and redos on two patterns against a list of every
+  // state the bank has been in
+  std::unique_ptr<Sequencer> sequencer(new Sequencer());
+  std::vector<BankState> states;
+  size_t cursor = 0;
+  states.push_back(bankState(*sequencer));
+  uint32_t random = 0x1234567;
+  int mismatches = 0;
+  int undos = 0;
+  int redos = 0;
+
+  for (int op = 0; op < 20000; op++) {
+    uint32_t value = nextValue(random);
+    int track = value % NUM_TRACKS;
+    int step = (value >> 8) % MAX_STEPS;
+    int kind = (value >> 16) % 20;
+
+    if (kind < 4) {
+      bool done = sequencer->undo();
+      if (done) {
+        undos++;
+        if (cursor == 0) {
+          mismatches++;
+        } else {
+          cursor--;
+        }
+        mismatches += bankState(*sequencer) != states[cursor];
+      } else {
+        mismatches += sequencer->getUndoDepth() != 0;
+      }
+      continue;
+    }
+    if (kind < 7) {
+      bool done = sequencer->redo();
+      if (done) {
+        redos++;
+        if (cursor + 1 >= states.size()) {
+          mismatches++;
+        } else {
+          cursor++;
+        }
+        mismatches += bankState(*sequencer) != states[cursor];
+      } else {
+        mismatches += cursor + 1 != states.size();
+      }
+      continue;
+    }
+    if (kind == 7) {
+      // Not an edit, later undos reach back into the other pattern
+      sequencer->selectPattern((value >> 24) % JOURNAL_TEST_PATTERNS);
+      continue;
+    }
+
+    switch (kind) {
+      case 8:  sequencer->setMicroTiming(track, step, (int)((value >> 24) % 97) - 48); break;
+      case 9:  sequencer->setTrigCondition(track, step, (value >> 24) % 4 == 0 ? TRIG_ALWAYS : 50); break;
+      case 10: sequencer->setRatchet(track, step, 1 + (value >> 24) % 4); break;
+      case 11: sequencer->setStepSlice(track, step, (value >> 24) % 4); break;
+      case 12: sequencer->setStepVelocity(track, step, (value >> 24) % 128); break;
+      case 13: sequencer->setStepAccent(track, step, (value >> 24) & 1); break;
+      case 14: sequencer->setTrackLength(track, 1 + (value >> 24) % MAX_STEPS); break;
+      case 15: sequencer->setTrackRate(track, (value >> 24) % NUM_RATES); break;
+      case 16: sequencer->setTrackDirection(track, (value >> 24) % NUM_DIRECTIONS); break;
+      case 17: sequencer->setTrackAccent(track, (value >> 24) % 128); break;
+      case 18:
+        if ((value >> 24) % 8 == 0) {
+          sequencer->clearAll();
+        } else {
+          sequencer->clearTrack(track);
+        }
+        break;
+      default: sequencer->toggleStep(track, step); break;
+    }
+
+    // Only edits that changed something are in the journal
+    BankState now = bankState(*sequencer);
+    if (now != states[cursor]) {
+      states.resize(cursor + 1);
+      states.push_back(now);
+      cursor++;
+    }
+  }
+
+  CHECK_EQ(mismatches, 0);
+  CHECK(undos > 1000);
+  CHECK(redos > 500);
+}
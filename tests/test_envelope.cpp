@@ -0,0 +1,195 @@
+/*
+ * DriftRiff Mini - Envelope Tests
+ */
+
+#include <Arduino.h>
+#include <vector>
+
+#include "test.h"
+#include "envelope.h"
+#include "audioengine.h"
+#include "sdloader.h"
+#include "hostsim.h"
+
+// Levels after each control block until the envelope is done
+static std::vector<int32_t> runEnvelope(Envelope& envelope, int maxBlocks) {
+  std::vector<int32_t> levels;
+  while (!envelope.isDone() && (int)levels.size() < maxBlocks) {
+    levels.push_back(envelope.advance());
+  }
+  return levels;
+}
+
+void testEnvelopeShapes() {
+  // 10 ms attack, 20 ms hold, 50 ms decay: 7, 14 and 34 blocks of 32
+  EnvelopeShape ahd;
+  envelopeSetup(ahd, ENV_AHD, 10, 20, 50);
+  CHECK_EQ(ahd.attack, 7);
+  CHECK_EQ(ahd.hold, 14);
+  CHECK_EQ(ahd.decay, 34);
+  CHECK_EQ(ahd.sustain, 0);
+
+  Envelope envelope;
+  envelope.start(&ahd);
+  CHECK_EQ(envelope.getLevel(), 0);
+  CHECK_EQ(envelope.getStage(), ENV_ATTACK);
+  std::vector<int32_t> levels = runEnvelope(envelope, 1000);
+  static const int32_t attack[] = {4681, 9362, 14043, 18724, 23405, 28086, ENV_LEVEL_FULL};
+  CHECK_EQ(levels.size(), 7 + 14 + 34);
+  if (levels.size() == 55) {
+    for (int i = 0; i < 7; i++) {
+      CHECK_EQ(levels[i], attack[i]);
+    }
+    for (int i = 7; i < 21; i++) {
+      CHECK_EQ(levels[i], ENV_LEVEL_FULL);
+    }
+    CHECK_EQ(levels[21], 31804);
+    CHECK_EQ(levels[40], 13492);
+    CHECK_EQ(levels[53], 963);
+    CHECK_EQ(levels[54], 0);
+    for (int i = 21; i < 55; i++) {
+      CHECK(levels[i] < levels[i - 1]);
+    }
+  }
+  CHECK(envelope.isDone());
+
+  // No attack starts at full level; 10 ms decay to 50%, held for a 20 ms
+  // gate, then a 30 ms release
+  EnvelopeShape adsr;
+  envelopeSetup(adsr, ENV_ADSR, 0, 20, 10, 50, 30);
+  CHECK_EQ(adsr.sustain, ENV_LEVEL_FULL / 2);
+  static const int32_t golden[] = {
+    30427, 28086, 25746, 23405, 21065, 18724, 16384,
+    16384, 16384, 16384, 16384, 16384, 16384, 16384, 16384, 16384, 16384, 16384, 16384, 16384,
+    16384, 15603, 14823, 14043, 13263, 12483, 11702, 10922, 10142, 9362, 8582, 7801, 7021,
+    6241, 5461, 4681, 3900, 3120, 2340, 1560, 780, 0
+  };
+  const int goldenCount = sizeof(golden) / sizeof(golden[0]);
+  envelope.start(&adsr);
+  CHECK_EQ(envelope.getLevel(), ENV_LEVEL_FULL);
+  CHECK_EQ(envelope.getStage(), ENV_DECAY);
+  levels = runEnvelope(envelope, 1000);
+  CHECK_EQ(levels.size(), goldenCount);
+  for (int i = 0; i < goldenCount && i < (int)levels.size(); i++) {
+    CHECK_EQ(levels[i], golden[i]);
+  }
+
+  // Without a gate the sustain holds until release()
+  EnvelopeShape held;
+  envelopeSetup(held, ENV_ADSR, 5, 0, 5, 40, 5);
+  envelope.start(&held);
+  levels = runEnvelope(envelope, 500);
+  CHECK_EQ(levels.size(), 500);
+  CHECK_EQ(envelope.getStage(), ENV_SUSTAIN);
+  CHECK_EQ(envelope.getLevel(), ENV_LEVEL_FULL * 40 / 100);
+  envelope.release();
+  CHECK_EQ(envelope.getStage(), ENV_RELEASE);
+  levels = runEnvelope(envelope, 500);
+  CHECK_EQ(levels.size(), 3);
+  CHECK(envelope.isDone());
+
+  // A sustain of zero ends the envelope rather than holding silence
+  EnvelopeShape silent;
+  envelopeSetup(silent, ENV_ADSR, 0, 0, 10, 0, 30);
+  envelope.start(&silent);
+  levels = runEnvelope(envelope, 500);
+  CHECK_EQ(levels.size(), 7);
+  CHECK(envelope.isDone());
+
+  // Off, or no shape at all, is unity until released, which ends it at once
+  EnvelopeShape off;
+  envelopeSetup(off, ENV_OFF, 10, 10, 10);
+  envelope.start(&off);
+  CHECK_EQ(envelope.advance(), ENV_LEVEL_FULL);
+  envelope.release();
+  CHECK(envelope.isDone());
+  envelope.start(nullptr);
+  CHECK_EQ(envelope.advance(), ENV_LEVEL_FULL);
+  CHECK(!envelope.isDone());
+}
+
+void testEnvelopeReshape() {
+  // Sustaining, the preset changes to one sustaining at zero: the voice
+  // decays with the new times and ends instead of holding silence
+  EnvelopeShape shape;
+  envelopeSetup(shape, ENV_ADSR, 0, 0, 5, 80, 5);
+  Envelope envelope;
+  envelope.start(&shape);
+  runEnvelope(envelope, 100);
+  CHECK_EQ(envelope.getStage(), ENV_SUSTAIN);
+  envelopeSetup(shape, ENV_ADSR, 0, 0, 10, 0, 5);
+  envelope.reshape();
+  CHECK_EQ(envelope.getStage(), ENV_DECAY);
+  std::vector<int32_t> levels = runEnvelope(envelope, 100);
+  CHECK_EQ(levels.size(), 7);
+  CHECK(envelope.isDone());
+
+  // And to another sustain level, reached over the new decay
+  envelopeSetup(shape, ENV_ADSR, 0, 0, 5, 80, 5);
+  envelope.start(&shape);
+  runEnvelope(envelope, 100);
+  envelopeSetup(shape, ENV_ADSR, 0, 0, 10, 25, 5);
+  envelope.reshape();
+  levels = runEnvelope(envelope, 100);
+  CHECK_EQ(levels.size(), 100);
+  CHECK_EQ(envelope.getStage(), ENV_SUSTAIN);
+  CHECK_EQ(envelope.getLevel(), ENV_LEVEL_FULL / 4);
+
+  // Off to AHD: a voice playing out at unity decays away
+  envelopeSetup(shape, ENV_OFF, 0, 0, 0);
+  envelope.start(&shape);
+  envelope.advance();
+  envelopeSetup(shape, ENV_AHD, 0, 0, 20);
+  envelope.reshape();
+  levels = runEnvelope(envelope, 100);
+  CHECK_EQ(levels.size(), 14);
+  CHECK(envelope.isDone());
+
+  // Mid attack, the new attack time applies from the level reached
+  envelopeSetup(shape, ENV_AHD, 50, 0, 50);
+  envelope.start(&shape);
+  for (int i = 0; i < 10; i++) envelope.advance();
+  int32_t reached = envelope.getLevel();
+  envelopeSetup(shape, ENV_AHD, 5, 0, 50);
+  envelope.reshape();
+  CHECK_EQ(envelope.getStage(), ENV_ATTACK);
+  CHECK_EQ(envelope.getLevel(), reached);
+  levels = runEnvelope(envelope, 3);
+  CHECK_EQ(levels[2], ENV_LEVEL_FULL);
+
+  // Off holds whatever level was reached, without a jump
+  envelopeSetup(shape, ENV_ADSR, 0, 0, 5, 60, 5);
+  envelope.start(&shape);
+  runEnvelope(envelope, 100);
+  envelopeSetup(shape, ENV_OFF, 0, 0, 0);
+  envelope.reshape();
+  CHECK_EQ(envelope.advance(), ENV_LEVEL_FULL * 60 / 100);
+  CHECK(!envelope.isDone());
+
+  // Through the engine: a long sample held by a sustain is freed soon
+  // after its track's preset changes to one sustaining at zero
+  static uint8_t data[MAX_SAMPLE_SIZE];
+  for (uint32_t i = 0; i < MAX_SAMPLE_SIZE; i++) {
+    data[i] = 128 + ((i & 16) ? 60 : -60);
+  }
+  AudioEngine engine;
+  engine.init();
+  EnvelopeShape sustained;
+  envelopeSetup(sustained, ENV_ADSR, 0, 0, 5, 70, 10);
+  engine.setEnvelope(2, sustained);
+  engine.playSample(data, MAX_SAMPLE_SIZE, 1.0, 2);
+  for (int i = 0; i < 40 * AUDIO_BLOCK_SIZE; i++) {
+    hostClockAdvance(1000000 / SAMPLE_RATE);
+    engine.update();
+  }
+  CHECK_EQ(engine.getActiveVoices(), 1);
+
+  EnvelopeShape gone;
+  envelopeSetup(gone, ENV_ADSR, 0, 0, 5, 0, 10);
+  engine.setEnvelope(2, gone);
+  for (int i = 0; i < 10 * AUDIO_BLOCK_SIZE; i++) {
+    hostClockAdvance(1000000 / SAMPLE_RATE);
+    engine.update();
+  }
+  CHECK_EQ(engine.getActiveVoices(), 0);
+}
@@ -0,0 +1,142 @@
+/*
+ * DriftRiff Mini - Limiter Tests
+ */
+
+#include <Arduino.h>
+#include <vector>
+
+#include "test.h"
+#include "limiter.h"
+#include "audioengine.h"
+
+#define QUIET_LEVEL   120   // Under the ceiling, passes untouched
+#define LOUD_LEVEL    254   // Twice the ceiling, needs half gain
+#define FULL_SCALE    (MAX_CONCURRENT_SAMPLES * 128)  // Every voice at its peak
+
+// Runs the signal through in the engine's block size
+static std::vector<int16_t> runLimiter(Limiter& limiter, const std::vector<int16_t>& input) {
+  std::vector<int16_t> output(input);
+  for (size_t i = 0; i < output.size(); i += AUDIO_BLOCK_SIZE) {
+    limiter.process(&output[i], min((int)(output.size() - i), AUDIO_BLOCK_SIZE));
+  }
+  return output;
+}
+
+static uint32_t nextValue(uint32_t& state) {
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+
+void testLimiterCeiling() {
+  // Full-scale transients of every length on either side, between quiet
+  // stretches and noise, never get past the ceiling
+  std::vector<int16_t> input;
+  uint32_t random = 0x2468ace;
+  for (int burst = 0; burst < 400; burst++) {
+    int gap = nextValue(random) % 300;
+    for (int i = 0; i < gap; i++) {
+      input.push_back((int16_t)(nextValue(random) % (2 * QUIET_LEVEL + 1)) - QUIET_LEVEL);
+    }
+    int length = 1 + nextValue(random) % 200;
+    int16_t level = (int16_t)(LIMITER_CEILING + 1 + nextValue(random) % (FULL_SCALE - LIMITER_CEILING));
+    bool square = nextValue(random) & 1;
+    for (int i = 0; i < length; i++) {
+      int16_t sign = (square ? (i & 4) : (nextValue(random) & 1)) ? 1 : -1;
+      input.push_back(sign * level);
+    }
+  }
+  input.resize((input.size() + AUDIO_BLOCK_SIZE - 1) / AUDIO_BLOCK_SIZE * AUDIO_BLOCK_SIZE, 0);
+
+  Limiter limiter;
+  std::vector<int16_t> output = runLimiter(limiter, input);
+  int loudest = 0;
+  for (size_t i = 0; i < output.size(); i++) {
+    loudest = max(loudest, abs(output[i]));
+  }
+  CHECK(loudest <= LIMITER_CEILING);
+  CHECK(limiter.takeMinGain() < ENV_LEVEL_FULL / 4);
+
+  // Single full-scale frames on their own as well
+  limiter.reset();
+  std::vector<int16_t> spikes(64 * AUDIO_BLOCK_SIZE, 0);
+  for (size_t i = 100; i < spikes.size(); i += 137) {
+    spikes[i] = (i & 1) ? FULL_SCALE : -FULL_SCALE;
+  }
+  output = runLimiter(limiter, spikes);
+  for (size_t i = 0; i < output.size(); i++) {
+    CHECK(abs(output[i]) <= LIMITER_CEILING);
+  }
+}
+
+void testLimiterAttack() {
+  // Quiet signal goes through delayed and untouched
+  const int loudFrame = 8 * AUDIO_BLOCK_SIZE;
+  std::vector<int16_t> input(24 * AUDIO_BLOCK_SIZE, QUIET_LEVEL);
+  for (size_t i = loudFrame; i < input.size(); i++) {
+    input[i] = LOUD_LEVEL;
+  }
+  Limiter limiter;
+  std::vector<int16_t> output = runLimiter(limiter, input);
+  for (int i = 0; i < LIMITER_LOOKAHEAD; i++) {
+    CHECK_EQ(output[i], 0);
+  }
+  for (int i = LIMITER_LOOKAHEAD; i < loudFrame; i++) {
+    CHECK_EQ(output[i], QUIET_LEVEL);
+  }
+
+  // The gain comes down over the look-ahead before the step arrives: a
+  // little at once, then steadily to half as the step leaves the delay
+  CHECK(output[loudFrame] < QUIET_LEVEL);
+  for (int i = loudFrame + 1; i < loudFrame + LIMITER_LOOKAHEAD; i++) {
+    CHECK(output[i] <= output[i - 1]);
+  }
+  int halfway = output[loudFrame + LIMITER_LOOKAHEAD / 2];
+  CHECK(halfway >= QUIET_LEVEL * 3 / 4 - 2 && halfway <= QUIET_LEVEL * 3 / 4);
+  CHECK_EQ(output[loudFrame + LIMITER_LOOKAHEAD - 1], QUIET_LEVEL / 2);
+
+  // The step comes out held at the ceiling
+  for (size_t i = loudFrame + LIMITER_LOOKAHEAD; i < output.size(); i++) {
+    CHECK(output[i] >= LIMITER_CEILING - 1 && output[i] <= LIMITER_CEILING);
+  }
+  CHECK_EQ(limiter.takeMinGain(), (LIMITER_CEILING << ENV_LEVEL_BITS) / LOUD_LEVEL);
+  CHECK_EQ(limiter.takeMinGain(), ENV_LEVEL_FULL);
+}
+
+void testLimiterRelease() {
+  // A burst, then quiet signal: the gain holds until the burst has left
+  // the look-ahead, then recovers with the release time constant
+  const int quietFrame = 4 * AUDIO_BLOCK_SIZE;
+  std::vector<int16_t> input(256 * AUDIO_BLOCK_SIZE, QUIET_LEVEL);
+  for (int i = 0; i < quietFrame; i++) {
+    input[i] = LOUD_LEVEL;
+  }
+  Limiter limiter;
+  std::vector<int16_t> output = runLimiter(limiter, input);
+
+  // The first quiet frames out are still at half gain, the average over
+  // the look-ahead only starts to rise once the burst is out
+  const int releaseStart = quietFrame + LIMITER_LOOKAHEAD;
+  CHECK(output[releaseStart - 1] >= LIMITER_CEILING - 1 && output[releaseStart - 1] <= LIMITER_CEILING);
+  for (int i = releaseStart; i < releaseStart + LIMITER_LOOKAHEAD / 2; i++) {
+    CHECK_EQ(output[i], QUIET_LEVEL / 2);
+  }
+
+  // Back up without ever dipping, by 1 - 1/e of the way one time constant
+  // later, and all the way within eight
+  for (size_t i = releaseStart + 1; i < output.size(); i++) {
+    CHECK(output[i] >= output[i - 1]);
+  }
+  int oneTimeConstant = output[releaseStart + (1 << LIMITER_RELEASE_SHIFT)];
+  CHECK(oneTimeConstant >= QUIET_LEVEL * 3 / 4 && oneTimeConstant <= QUIET_LEVEL * 17 / 20);
+  int settled = releaseStart;
+  while (settled < (int)output.size() && output[settled] != QUIET_LEVEL) {
+    settled++;
+  }
+  CHECK(settled > releaseStart + 3 * (1 << LIMITER_RELEASE_SHIFT));
+  CHECK(settled < releaseStart + 8 * (1 << LIMITER_RELEASE_SHIFT));
+  for (size_t i = settled; i < output.size(); i++) {
+    CHECK_EQ(output[i], QUIET_LEVEL);
+  }
+}
@@ -0,0 +1,188 @@
+/*
+ * DriftRiff Mini - Host Test Runner
+ *
+ * Runs the suites named on the command line, or all of them, on the host
+ * HAL with the virtual clock and a scratch SD card. Exits non-zero when
+ * any check failed.
+ */
+
+#include <Arduino.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <unistd.h>
+
+#include "test.h"
+#include "hostsim.h"
+
+void testProfiler();
+void testDebugLog();
+void testSwing();
+void testMicroTiming();
+void testTrackClock();
+void testRandomDirection();
+void testPolymeter();
+void testTempoChange();
+void testProjectRoundTrip();
+void testProjectCorruption();
+void testProjectVersions();
+void testEnvelopeShapes();
+void testEnvelopeReshape();
+void testTrigProbability();
+void testTrigLoopConditions();
+void testTrigStateConditions();
+void testJournalWraparound();
+void testJournalGroups();
+void testJournalSnapshots();
+void testJournalRandom();
+void testStopSample();
+void testLimiterCeiling();
+void testLimiterAttack();
+void testLimiterRelease();
+void testModSampleHold();
+void testModPhaseLock();
+void testLinkCobs();
+void testLinkFrames();
+void testLinkReceive();
+void testLinkShortWrites();
+void testMidiFileRoundTrip();
+void testMidiFileMalformed();
+void testMidiSync();
+void testPatternBankPaging();
+void testVelocityRender();
+void testRecorderCapture();
+void testRecorderDropouts();
+void testRatchetOnsets();
+void testRatchetVoices();
+void testAutomationGestures();
+void testAutomationOverdub();
+void testAutomationClear();
+void testAutomationOverflow();
+void testSliceDetect();
+void testSliceRescan();
+void testReplay();
+void testSampleAnalysis();
+void testMuteRender();
+
+const TestSuite testSuites[] = {
+  {"profiler", testProfiler},
+  {"debuglog", testDebugLog},
+  {"swing", testSwing},
+  {"microtiming", testMicroTiming},
+  {"trackclock", testTrackClock},
+  {"randomdirection", testRandomDirection},
+  {"polymeter", testPolymeter},
+  {"tempochange", testTempoChange},
+  {"project", testProjectRoundTrip},
+  {"projectcrc", testProjectCorruption},
+  {"projectversions", testProjectVersions},
+  {"envelope", testEnvelopeShapes},
+  {"envelopereshape", testEnvelopeReshape},
+  {"trigprobability", testTrigProbability},
+  {"trigloop", testTrigLoopConditions},
+  {"trigstate", testTrigStateConditions},
+  {"journalwrap", testJournalWraparound},
+  {"journalgroups", testJournalGroups},
+  {"journalsnapshots", testJournalSnapshots},
+  {"journalrandom", testJournalRandom},
+  {"stopsample", testStopSample},
+  {"limiterceiling", testLimiterCeiling},
+  {"limiterattack", testLimiterAttack},
+  {"limiterrelease", testLimiterRelease},
+  {"modsamplehold", testModSampleHold},
+  {"modphaselock", testModPhaseLock},
+  {"linkcobs", testLinkCobs},
+  {"linkframes", testLinkFrames},
+  {"linkreceive", testLinkReceive},
+  {"linkshortwrites", testLinkShortWrites},
+  {"midifile", testMidiFileRoundTrip},
+  {"midifilemalformed", testMidiFileMalformed},
+  {"midisync", testMidiSync},
+  {"patternbank", testPatternBankPaging},
+  {"velocity", testVelocityRender},
+  {"recorder", testRecorderCapture},
+  {"recorderdropouts", testRecorderDropouts},
+  {"ratchet", testRatchetOnsets},
+  {"ratchetvoices", testRatchetVoices},
+  {"automation", testAutomationGestures},
+  {"automationoverdub", testAutomationOverdub},
+  {"automationclear", testAutomationClear},
+  {"automationoverflow", testAutomationOverflow},
+  {"slicedetect", testSliceDetect},
+  {"slicerescan", testSliceRescan},
+  {"replay", testReplay},
+  {"sampleanalysis", testSampleAnalysis},
+  {"mutefade", testMuteRender},
+};
+const int testSuiteCount = sizeof(testSuites) / sizeof(testSuites[0]);
+
+static char sdRoot[] = "/tmp/driftone_test_XXXXXX";
+static int failures = 0;
+static int devNull = -1;
+
+const char* testSDRoot() {
+  return sdRoot;
+}
+
+void testFail(const char* file, int line, const char* expression) {
+  fprintf(stderr, "%s:%d: check failed: %s\n", file, line, expression);
+  failures++;
+}
+
+void testFailValues(const char* file, int line, const char* expression,
+                    long long actual, long long expected) {
+  fprintf(stderr, "%s:%d: check failed: %s (got %lld, expected %lld)\n",
+          file, line, expression, actual, expected);
+  failures++;
+}
+
+static int removeEntry(const char* path, const struct stat*, int, struct FTW*) {
+  // The root itself stays for the next suite
+  return strcmp(path, sdRoot) == 0 ? 0 : remove(path);
+}
+
+static bool runSuite(const TestSuite& suite) {
+  nftw(sdRoot, removeEntry, 8, FTW_DEPTH | FTW_PHYS);
+  Serial.attach(-1, devNull);
+  int before = failures;
+  suite.run();
+  printf("%-16s %s\n", suite.name, failures == before ? "ok" : "FAILED");
+  fflush(stdout);
+  return failures == before;
+}
+
+int main(int argc, char** argv) {
+  if (!mkdtemp(sdRoot)) {
+    perror("mkdtemp");
+    return 1;
+  }
+  hostSDSetRoot(sdRoot);
+  hostClockSetMode(HOST_CLOCK_VIRTUAL);
+
+  // Firmware log output is noise here, suites that read it attach their own
+  devNull = open("/dev/null", O_WRONLY);
+
+  int unknown = 0;
+  for (int arg = 1; arg < argc; arg++) {
+    int i = 0;
+    while (i < testSuiteCount && strcmp(testSuites[i].name, argv[arg]) != 0) i++;
+    if (i == testSuiteCount) {
+      fprintf(stderr, "Unknown suite '%s'\n", argv[arg]);
+      unknown++;
+      continue;
+    }
+    runSuite(testSuites[i]);
+  }
+  if (argc == 1) {
+    for (int i = 0; i < testSuiteCount; i++) {
+      runSuite(testSuites[i]);
+    }
+  }
+
+  close(devNull);
+  nftw(sdRoot, removeEntry, 8, FTW_DEPTH | FTW_PHYS);
+  rmdir(sdRoot);
+  return failures == 0 && unknown == 0 ? 0 : 1;
+}
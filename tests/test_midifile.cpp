@@ -0,0 +1,268 @@
+/*
+ * DriftRiff Mini - MIDI File Tests
+ */
+
+#include <Arduino.h>
+#include <SD.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "test.h"
+#include "midifile.h"
+#include "patternbank.h"
+#include "sequencer.h"
+
+#define SONG_PATTERNS  8
+#define SONG_BPM       137
+
+typedef std::vector<uint8_t> Bytes;
+
+static uint32_t nextValue(uint32_t& state) {
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+
+static std::string cardPath(const char* path) {
+  return std::string(testSDRoot()) + path;
+}
+
+static Bytes readCardFile(const char* path) {
+  Bytes data;
+  FILE* f = fopen(cardPath(path).c_str(), "rb");
+  if (!f) return data;
+  uint8_t buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+    data.insert(data.end(), buffer, buffer + n);
+  }
+  fclose(f);
+  return data;
+}
+
+static void writeCardFile(const char* path, const Bytes& data) {
+  FILE* f = fopen(cardPath(path).c_str(), "wb");
+  if (!f) return;
+  fwrite(data.data(), 1, data.size(), f);
+  fclose(f);
+}
+
+// Random tracks whose hits all come back: micro-timing stays nearer its
+// own step than the next, and fast tracks never reach past the end of the
+// pattern, where a hit could as well be the next pattern's pulled early
+static void fillSong(Pattern* patterns, uint32_t seed) {
+  uint32_t state = seed;
+  for (int i = 0; i < SONG_PATTERNS; i++) {
+    Pattern& pattern = patterns[i];
+    Sequencer::clearPattern(pattern);
+    for (int track = 0; track < NUM_TRACKS; track++) {
+      TrackSettings& settings = pattern.tracks[track];
+      settings.length = 1 + nextValue(state) % MAX_STEPS;
+      settings.rate = nextValue(state) % NUM_RATES;
+      settings.direction = nextValue(state) % NUM_DIRECTIONS;
+      pattern.steps[track] = ((uint64_t)nextValue(state) << 32) | nextValue(state);
+      pattern.accents[track] = nextValue(state) % (MAX_VELOCITY + 1);
+
+      int trackTicks = Sequencer::ticksPerTrackStep(settings.rate);
+      int early = min((trackTicks - 1) / 2, MAX_MICRO_OFFSET - 1);
+      int late = trackTicks < TICKS_PER_STEP ? 0 : early;
+      for (int step = 0; step < MAX_STEPS; step++) {
+        pattern.microTiming[track][step] = (int)(nextValue(state) % (early + late + 1)) - early;
+        pattern.velocities[track][step] = nextValue(state) & 0xFF;
+      }
+      if (i == 0) {
+        pattern.microTiming[track][0] = abs(pattern.microTiming[track][0]) % (late + 1);
+      }
+    }
+  }
+}
+
+static void checkSong(const Pattern* saved, const Pattern* loaded) {
+  for (int i = 0; i < SONG_PATTERNS; i++) {
+    for (int track = 0; track < NUM_TRACKS; track++) {
+      const TrackSettings& settings = saved[i].tracks[track];
+      CHECK_EQ(loaded[i].tracks[track].length, settings.length);
+      CHECK_EQ(loaded[i].tracks[track].rate, settings.rate);
+      CHECK_EQ(loaded[i].tracks[track].direction, settings.direction);
+
+      uint64_t played = settings.length == MAX_STEPS ? ~0ULL : ((uint64_t)1 << settings.length) - 1;
+      CHECK_EQ(loaded[i].steps[track], saved[i].steps[track] & played);
+      for (int step = 0; step < settings.length; step++) {
+        if (!(saved[i].steps[track] & ((uint64_t)1 << step))) continue;
+        CHECK_EQ(loaded[i].microTiming[track][step], saved[i].microTiming[track][step]);
+        uint8_t velocity = max(Sequencer::stepVelocity(saved[i], track, step), (uint8_t)1);
+        CHECK_EQ(Sequencer::stepVelocity(loaded[i], track, step), velocity);
+      }
+    }
+  }
+}
+
+static int countNotes(const Pattern* patterns) {
+  int notes = 0;
+  for (int i = 0; i < SONG_PATTERNS; i++) {
+    for (int track = 0; track < NUM_TRACKS; track++) {
+      for (int step = 0; step < patterns[i].tracks[track].length; step++) {
+        if (patterns[i].steps[track] & ((uint64_t)1 << step)) notes++;
+      }
+    }
+  }
+  return notes;
+}
+
+// Export goes through a bank on the card, as on the device. The first
+// patterns end up resident and the rest are read from the file.
+static bool exportSong(MidiFile& midiFile, const char* path, const Pattern* patterns, int count,
+                       uint8_t format) {
+  std::unique_ptr<Sequencer> sequencer(new Sequencer());
+  PatternBank bank;
+  bank.init(sequencer.get(), "/export.bin");
+  if (!bank.reset()) return false;
+  for (int i = 0; i < count; i++) {
+    if (!bank.write(i, patterns[i])) return false;
+  }
+  return midiFile.exportPatterns(path, bank, 0, count, format, SONG_BPM);
+}
+
+// A file from elsewhere: header, then one track chunk around the events
+static Bytes buildFile(uint16_t format, uint16_t division, const Bytes& events) {
+  Bytes file = {'M', 'T', 'h', 'd', 0, 0, 0, 6, (uint8_t)(format >> 8), (uint8_t)format, 0, 1,
+                (uint8_t)(division >> 8), (uint8_t)division};
+  uint32_t length = events.size();
+  Bytes chunk = {'M', 'T', 'r', 'k', (uint8_t)(length >> 24), (uint8_t)(length >> 16),
+                 (uint8_t)(length >> 8), (uint8_t)length};
+  file.insert(file.end(), chunk.begin(), chunk.end());
+  file.insert(file.end(), events.begin(), events.end());
+  return file;
+}
+
+void testMidiFileRoundTrip() {
+  std::unique_ptr<MidiFile> midiFile(new MidiFile());
+  std::vector<Pattern> saved(SONG_PATTERNS);
+  std::vector<Pattern> loaded(SONG_PATTERNS);
+  for (uint8_t format = MIDIFILE_SINGLE_TRACK; format <= MIDIFILE_MULTI_TRACK; format++) {
+    fillSong(saved.data(), 0x5eed + format);
+    CHECK(exportSong(*midiFile, MIDIFILE_SONG_PATH, saved.data(), SONG_PATTERNS, format));
+
+    MidiFileStats stats;
+    CHECK(midiFile->importPatterns(MIDIFILE_SONG_PATH, loaded.data(), SONG_PATTERNS, stats));
+    CHECK_EQ(stats.format, format);
+    CHECK_EQ(stats.tracks, format == MIDIFILE_SINGLE_TRACK ? 1 : 1 + NUM_TRACKS);
+    CHECK_EQ(stats.patterns, SONG_PATTERNS);
+    CHECK_EQ(stats.bpm, SONG_BPM);
+    CHECK_EQ(stats.notes, countNotes(saved.data()));
+    CHECK_EQ(stats.skipped, 0);
+    checkSong(saved.data(), loaded.data());
+
+    // Into fewer patterns the rest of the notes are skipped
+    CHECK(midiFile->importPatterns(MIDIFILE_SONG_PATH, loaded.data(), 3, stats));
+    CHECK_EQ(stats.patterns, 3);
+    CHECK(stats.skipped > 0);
+    CHECK_EQ(stats.notes + stats.skipped, countNotes(saved.data()));
+  }
+
+  // A full half step late at 1x comes back. A full half step early is the
+  // same tick as the step before it late, and comes back as that.
+  Sequencer::clearPattern(saved[0]);
+  saved[0].steps[1] = 0x0012;
+  saved[0].microTiming[1][1] = MAX_MICRO_OFFSET;
+  saved[0].microTiming[1][4] = -MAX_MICRO_OFFSET;
+  CHECK(exportSong(*midiFile, MIDIFILE_PATTERN_PATH, saved.data(), 1, MIDIFILE_SINGLE_TRACK));
+  MidiFileStats stats;
+  CHECK(midiFile->importPatterns(MIDIFILE_PATTERN_PATH, loaded.data(), 1, stats));
+  CHECK_EQ(loaded[0].steps[1], 0x000A);
+  CHECK_EQ(loaded[0].microTiming[1][1], MAX_MICRO_OFFSET);
+  CHECK_EQ(loaded[0].microTiming[1][3], MAX_MICRO_OFFSET);
+
+  // A file from elsewhere, 480 to the quarter note: a kick on the second
+  // beat, running status into a snare half a 16th late, a note off as
+  // velocity 0 and an unmapped note
+  uint8_t kick = MidiFile::noteForTrack(0);
+  uint8_t snare = MidiFile::noteForTrack(1);
+  Bytes events = {0x00, 0xFF, 0x51, 0x03, 0x07, 0xA1, 0x20,         // 120 BPM
+                  0x83, 0x60, 0x99, kick, 100,                      // 480: step 4
+                  0x82, 0x2C, snare, 64,                            // 780: step 6, half a step late
+                  0x00, snare, 0,
+                  0x00, 0x99, 1, 90,
+                  0x00, 0xFF, 0x2F, 0x00};
+  writeCardFile(MIDIFILE_IMPORT_PATH, buildFile(MIDIFILE_SINGLE_TRACK, 480, events));
+  CHECK(midiFile->importPatterns(MIDIFILE_IMPORT_PATH, loaded.data(), SONG_PATTERNS, stats));
+  CHECK_EQ(stats.patterns, 1);
+  CHECK_EQ(stats.bpm, 120);
+  CHECK_EQ(stats.notes, 2);
+  CHECK_EQ(stats.skipped, 1);
+  CHECK_EQ(loaded[0].steps[0], 1 << 4);
+  CHECK_EQ(loaded[0].steps[1], 1 << 6);
+  CHECK_EQ(loaded[0].microTiming[1][6], TICKS_PER_STEP / 2);
+  CHECK_EQ(Sequencer::stepVelocity(loaded[0], 0, 4), 100);
+  CHECK_EQ(loaded[0].tracks[0].length, NUM_STEPS);
+  CHECK_EQ(loaded[0].tracks[0].rate, RATE_1);
+}
+
+void testMidiFileMalformed() {
+  std::unique_ptr<MidiFile> midiFile(new MidiFile());
+  std::vector<Pattern> patterns(SONG_PATTERNS);
+  MidiFileStats stats;
+  CHECK(!midiFile->importPatterns("/missing.mid", patterns.data(), SONG_PATTERNS, stats));
+  CHECK_EQ(stats.patterns, 0);
+
+  // Cut short anywhere, a whole song is never taken as well-formed, and
+  // nothing lands past the patterns given
+  fillSong(patterns.data(), 0xbad);
+  CHECK(exportSong(*midiFile, MIDIFILE_SONG_PATH, patterns.data(), SONG_PATTERNS,
+                    MIDIFILE_MULTI_TRACK));
+  Bytes song = readCardFile(MIDIFILE_SONG_PATH);
+  CHECK(song.size() > 1000);
+  for (size_t cut = 0; cut < song.size(); cut += 1 + cut / 16) {
+    writeCardFile(MIDIFILE_IMPORT_PATH, Bytes(song.begin(), song.begin() + cut));
+    CHECK(!midiFile->importPatterns(MIDIFILE_IMPORT_PATH, patterns.data(), 2, stats));
+    CHECK(stats.patterns <= 2);
+  }
+  writeCardFile(MIDIFILE_IMPORT_PATH, Bytes(song.begin(), song.end() - 1));
+  CHECK(!midiFile->importPatterns(MIDIFILE_IMPORT_PATH, patterns.data(), SONG_PATTERNS, stats));
+
+  // Broken headers
+  Bytes end = {0x00, 0xFF, 0x2F, 0x00};
+  Bytes file = buildFile(MIDIFILE_SINGLE_TRACK, 96, end);
+  writeCardFile(MIDIFILE_IMPORT_PATH, file);
+  CHECK(midiFile->importPatterns(MIDIFILE_IMPORT_PATH, patterns.data(), SONG_PATTERNS, stats));
+  CHECK_EQ(stats.patterns, 0);
+  file[3] = 'x';
+  writeCardFile(MIDIFILE_IMPORT_PATH, file);
+  CHECK(!midiFile->importPatterns(MIDIFILE_IMPORT_PATH, patterns.data(), SONG_PATTERNS, stats));
+  writeCardFile(MIDIFILE_IMPORT_PATH, buildFile(2, 96, end));
+  CHECK(!midiFile->importPatterns(MIDIFILE_IMPORT_PATH, patterns.data(), SONG_PATTERNS, stats));
+  writeCardFile(MIDIFILE_IMPORT_PATH, buildFile(MIDIFILE_SINGLE_TRACK, 0, end));
+  CHECK(!midiFile->importPatterns(MIDIFILE_IMPORT_PATH, patterns.data(), SONG_PATTERNS, stats));
+  writeCardFile(MIDIFILE_IMPORT_PATH, buildFile(MIDIFILE_SINGLE_TRACK, 0xE728, end));   // SMPTE
+  CHECK(!midiFile->importPatterns(MIDIFILE_IMPORT_PATH, patterns.data(), SONG_PATTERNS, stats));
+
+  // Broken tracks: running status with nothing to run on, a system common
+  // message, a data byte with its top bit set, a meta event running past
+  // the chunk, a variable length that never ends, no end of track
+  const Bytes broken[] = {
+    {0x00, 0x24, 0x40, 0x00, 0xFF, 0x2F, 0x00},
+    {0x00, 0xF1, 0x00, 0x00, 0xFF, 0x2F, 0x00},
+    {0x00, 0x99, 0x24, 0x80, 0x00, 0xFF, 0x2F, 0x00},
+    {0x00, 0xFF, 0x01, 0x40, 'a', 0x00, 0xFF, 0x2F, 0x00},
+    {0x80, 0x80, 0x80, 0x80},
+    {0x00, 0x99, 0x24, 0x40},
+  };
+  for (const Bytes& events : broken) {
+    writeCardFile(MIDIFILE_IMPORT_PATH, buildFile(MIDIFILE_SINGLE_TRACK, 96, events));
+    CHECK(!midiFile->importPatterns(MIDIFILE_IMPORT_PATH, patterns.data(), SONG_PATTERNS, stats));
+  }
+
+  // Unknown chunks and system exclusive are passed over
+  Bytes extra = {0x00, 0xF0, 0x03, 0x7E, 0x7F, 0xF7, 0x00, 0x99, MidiFile::noteForTrack(2), 0x40,
+                 0x00, 0xFF, 0x2F, 0x00};
+  file = buildFile(MIDIFILE_SINGLE_TRACK, 96, extra);
+  Bytes unknown = {'X', 'y', 'z', 'w', 0, 0, 0, 3, 1, 2, 3};
+  file.insert(file.begin() + 14, unknown.begin(), unknown.end());
+  writeCardFile(MIDIFILE_IMPORT_PATH, file);
+  CHECK(midiFile->importPatterns(MIDIFILE_IMPORT_PATH, patterns.data(), SONG_PATTERNS, stats));
+  CHECK_EQ(stats.tracks, 1);
+  CHECK_EQ(stats.notes, 1);
+  CHECK_EQ(patterns[0].steps[2], 1);
+}
@@ -0,0 +1,120 @@
+/*
+ * DriftRiff Mini - MIDI Clock Sync Tests
+ */
+
+#include <Arduino.h>
+#include <math.h>
+#include <memory>
+
+#include "test.h"
+#include "midisync.h"
+#include "sequencer.h"
+#include "audioengine.h"
+#include "hostsim.h"
+
+#define SYNC_CLOCKS       2000
+#define SYNC_JITTER_US    2000    // Uniform, either side of the ideal time
+#define SYNC_LOCK_CLOCKS  96      // Locks within a bar
+
+static uint32_t nextValue(uint32_t& state) {
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+
+struct SyncResult {
+  int lockClock;          // First clock seen locked, -1 if never
+  double clockRms;        // Filtered clock time against the ideal grid, us
+  double sequencerRms;    // Sequencer position against the external one, us
+  float bpm;
+  uint32_t clocks;
+  uint32_t dropped;
+};
+
+// Feeds START and a jittery clock through the fake UART. The sync runs
+// every frame so bytes are timestamped about as closely as the receive
+// callback does on the device, the sequencer a block at a time, and the
+// play position follows the clock as the audio output would.
+static SyncResult runSync(float bpm, uint32_t seed) {
+  HardwareSerial port(-1, -1);
+  MidiSync sync;
+  sync.init(&port);
+  sync.setMode(MIDI_SYNC_SLAVE);
+  std::unique_ptr<Sequencer> sequencer(new Sequencer());
+
+  const double period = 60000000.0 / (bpm * MIDI_PPQN);
+  // The first clock after START is the downbeat, each due on the grid
+  // from there give or take the jitter
+  const uint64_t start = hostClockMicros() + 10000;
+  const double firstClock = start + 1000 + SYNC_JITTER_US;
+  uint32_t random = seed;
+  port.inject(MIDI_START, start);
+  for (int i = 0; i < SYNC_CLOCKS; i++) {
+    int jitter = (int)(nextValue(random) % (2 * SYNC_JITTER_US + 1)) - SYNC_JITTER_US;
+    port.inject(MIDI_CLOCK, (uint64_t)(firstClock + i * period) + jitter);
+  }
+
+  SyncResult result = {-1, 0, 0, 0, 0, 0};
+  double clockSquares = 0;
+  int clockSamples = 0;
+  double sequencerSquares = 0;
+  int sequencerSamples = 0;
+  uint32_t lastCount = 0;
+  SequencerTrigger triggers[NUM_TRACKS * 4];
+  const uint64_t end = firstClock + SYNC_CLOCKS * period;
+  const uint64_t origin = hostClockMicros();
+  uint32_t scheduled = 0;
+  while (hostClockMicros() < end) {
+    hostClockAdvance(1000000 / SAMPLE_RATE);
+    uint32_t playFrame = (hostClockMicros() - origin) * SAMPLE_RATE / 1000000;
+    if (playFrame >= scheduled) {
+      while (sequencer->schedule(playFrame + 2 * AUDIO_BLOCK_SIZE, triggers, NUM_TRACKS * 4) > 0) {
+      }
+      scheduled = playFrame + AUDIO_BLOCK_SIZE;
+    }
+    sync.update(*sequencer, playFrame);
+
+    uint32_t count = sync.getClockCount();
+    if (count == lastCount) continue;
+    lastCount = count;
+    if (sync.isLocked() && result.lockClock < 0) result.lockClock = count;
+    if (result.lockClock < 0 || count < (uint32_t)result.lockClock + SYNC_LOCK_CLOCKS) continue;
+
+    // Measured once the loop and the sequencer have had time to settle
+    double ideal = firstClock + (count - 1) * period;
+    double clockError = (double)sync.getFilteredClockTime() - ideal;
+    clockSquares += clockError * clockError;
+    clockSamples++;
+
+    double now = (double)hostClockMicros();
+    double externalTicks = (now - firstClock) / period * MIDI_TICKS_PER_CLOCK;
+    double ticksError = sequencer->tickAtFrame(playFrame) - externalTicks;
+    double microsError = ticksError * period / MIDI_TICKS_PER_CLOCK;
+    sequencerSquares += microsError * microsError;
+    sequencerSamples++;
+  }
+
+  result.clockRms = clockSamples ? sqrt(clockSquares / clockSamples) : 1e9;
+  result.sequencerRms = sequencerSamples ? sqrt(sequencerSquares / sequencerSamples) : 1e9;
+  result.bpm = sync.getBPM();
+  result.clocks = sync.getClockCount();
+  result.dropped = sync.getDroppedBytes();
+  return result;
+}
+
+void testMidiSync() {
+  // Two milliseconds of jitter either way is more than most gear has, the
+  // raw arrival times alone would be about 1.15 ms RMS off the grid
+  const float tempos[] = {60, 97.5f, 120, 174, 240};
+  uint32_t seed = 0x5eed;
+  for (float bpm : tempos) {
+    SyncResult result = runSync(bpm, seed++);
+    CHECK(result.lockClock >= 0 && result.lockClock <= SYNC_LOCK_CLOCKS);
+    CHECK(result.clockRms < 600);
+    CHECK(result.sequencerRms < 1500);
+    CHECK(fabsf(result.bpm - bpm) < bpm / 200);
+    CHECK_EQ(result.clocks, SYNC_CLOCKS);
+    CHECK_EQ(result.dropped, 0);
+  }
+}
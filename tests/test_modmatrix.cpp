@@ -0,0 +1,96 @@
+/*
+ * DriftRiff Mini - Modulation Matrix Tests
+ */
+
+#include <Arduino.h>
+#include <memory>
+#include <vector>
+
+#include "test.h"
+#include "modmatrix.h"
+#include "audioengine.h"
+#include "sequencer.h"
+#include "hostsim.h"
+
+void testModSampleHold() {
+  // One level per cycle, the same every time round, spread over the
+  // whole range on both sides
+  ModMatrix matrix;
+  matrix.setLfo(0, MOD_SAMPLE_HOLD, 1);
+  matrix.setLfo(1, MOD_SAMPLE_HOLD, 1);
+  const int cycles = 4096;
+  std::vector<int> levels;
+  int lowest = 0;
+  int highest = 0;
+  int differentFromOther = 0;
+  for (int cycle = 0; cycle < cycles; cycle++) {
+    int32_t start = cycle * TICKS_PER_STEP;
+    matrix.evaluate(start);
+    int level = matrix.getLevel(0);
+    levels.push_back(level);
+    if (level != matrix.getLevel(1)) differentFromOther++;
+    lowest = min(lowest, level);
+    highest = max(highest, level);
+    CHECK(level >= -MOD_LEVEL_MAX && level <= MOD_LEVEL_MAX);
+    matrix.evaluate(start + TICKS_PER_STEP - 1);
+    CHECK_EQ(matrix.getLevel(0), level);
+  }
+  CHECK(lowest < -MOD_LEVEL_MAX + 4);
+  CHECK(highest > MOD_LEVEL_MAX - 4);
+  CHECK(differentFromOther > cycles * 9 / 10);
+
+  // Half the levels below zero, give or take
+  int below = 0;
+  for (int level : levels) {
+    if (level < 0) below++;
+  }
+  CHECK(below > cycles * 45 / 100 && below < cycles * 55 / 100);
+
+  for (int cycle = 0; cycle < cycles; cycle += 97) {
+    matrix.evaluate(cycle * TICKS_PER_STEP + TICKS_PER_STEP / 2);
+    CHECK_EQ(matrix.getLevel(0), levels[cycle]);
+  }
+}
+
+void testModPhaseLock() {
+  // A one-step square LFO flips every half step of audio frames. 120 BPM
+  // is 2756.25 frames a step, so a clock that rounded anywhere would
+  // drift a frame or more every cycle. The engine's clock is refreshed
+  // from the sequencer every block, as loop() does.
+  std::unique_ptr<Sequencer> sequencer(new Sequencer());
+  sequencer->setBPM(120);
+  const uint32_t framesPerStep = sequencer->getFramesPerStep();
+  CHECK_EQ(framesPerStep, (uint32_t)(2756.25 * 65536));
+  const double halfStep = framesPerStep / 65536.0 / 2;
+  ModMatrix matrix;
+  matrix.setLfo(0, MOD_SQUARE, 1);
+  AudioEngine engine;
+  engine.init();
+  engine.setModMatrix(&matrix);
+
+  // Flips come out of whole blocks, a fixed render ahead of the output.
+  // The first step is left out, while the sequencer's clock starts.
+  const int flips = 1000;
+  std::vector<uint32_t> flipFrames;
+  SequencerTrigger triggers[NUM_TRACKS * 4];
+  int8_t level = matrix.getLevel(0);
+  for (uint32_t frame = 0; (int)flipFrames.size() < flips && frame < (flips + 4) * halfStep; frame++) {
+    if (frame % AUDIO_BLOCK_SIZE == 0) {
+      uint32_t playFrame = engine.getPlayFrame();
+      while (sequencer->schedule(playFrame + 2 * AUDIO_BLOCK_SIZE, triggers, NUM_TRACKS * 4) > 0) {
+      }
+      engine.setClock(playFrame, sequencer->tickAtFrame(playFrame), framesPerStep, true);
+    }
+    hostClockAdvance(1000000 / SAMPLE_RATE);
+    engine.update();
+    if (matrix.getLevel(0) != level) {
+      level = matrix.getLevel(0);
+      if (frame >= framesPerStep >> 16) flipFrames.push_back(frame);
+    }
+  }
+  CHECK_EQ(flipFrames.size(), flips);
+  for (size_t i = 1; i < flipFrames.size(); i++) {
+    double drift = (double)(flipFrames[i] - flipFrames[0]) - i * halfStep;
+    CHECK(drift > -AUDIO_BLOCK_SIZE && drift < AUDIO_BLOCK_SIZE);
+  }
+}
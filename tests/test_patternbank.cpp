@@ -0,0 +1,96 @@
+/*
+ * DriftRiff Mini - Pattern Bank Tests
+ */
+
+#include <Arduino.h>
+#include <string.h>
+#include <memory>
+
+#include "test.h"
+#include "patternbank.h"
+
+#define BANK_TEST_PATTERNS 24
+
+// A pattern telling which bank index it was written as
+static void markPattern(Pattern& target, int index) {
+  Sequencer::clearPattern(target);
+  target.steps[0] = (uint64_t)1 << (index % MAX_STEPS);
+  target.steps[1] = index;
+  target.accents[2] = index % (MAX_VELOCITY + 1);
+}
+
+static bool holds(PatternBank& bank, int index, const Pattern& expected) {
+  Pattern pattern;
+  return bank.read(index, pattern) && memcmp(&pattern, &expected, sizeof(Pattern)) == 0;
+}
+
+void testPatternBankPaging() {
+  std::unique_ptr<Sequencer> sequencer(new Sequencer());
+  PatternBank bank;
+  bank.init(sequencer.get(), "/bank.bin");
+  CHECK(bank.reset());
+  Pattern pattern;
+  for (int i = 0; i < BANK_TEST_PATTERNS; i++) {
+    markPattern(pattern, i);
+    CHECK(bank.write(i, pattern));
+  }
+  for (int i = 0; i < NUM_PATTERNS; i++) {
+    CHECK_EQ(sequencer->isPatternResident(i), i < PATTERN_CACHE);
+  }
+  CHECK(!sequencer->selectPattern(PATTERN_CACHE));
+
+  // Fetching more than fit keeps the playing one and the most recent
+  for (int i = PATTERN_CACHE; i < BANK_TEST_PATTERNS; i++) {
+    CHECK(bank.fetch(i));
+    CHECK(sequencer->isPatternResident(i));
+    CHECK(sequencer->isPatternResident(0));
+  }
+  for (int i = 1; i < BANK_TEST_PATTERNS - PATTERN_CACHE + 1; i++) {
+    CHECK(!sequencer->isPatternResident(i));
+  }
+  for (int i = 0; i < BANK_TEST_PATTERNS; i++) {
+    markPattern(pattern, i);
+    CHECK(holds(bank, i, pattern));
+  }
+  CHECK_EQ(bank.getSongLength(), BANK_TEST_PATTERNS);
+
+  // An edited pattern goes back to the card when it is pushed out
+  CHECK(bank.fetch(5));
+  CHECK(sequencer->selectPattern(5));
+  sequencer->setStep(3, 7, true);
+  sequencer->setStepVelocity(3, 7, 77);
+  Pattern edited;
+  memcpy(&edited, sequencer->getResidentPattern(5), sizeof(Pattern));
+  CHECK(sequencer->selectPattern(0));
+  for (int i = 8; i < 8 + PATTERN_CACHE; i++) {
+    CHECK(bank.fetch(i));
+  }
+  CHECK(!sequencer->isPatternResident(5));
+  CHECK(holds(bank, 5, edited));
+
+  // Undo waits for the pattern it edits to be resident again
+  CHECK_EQ(sequencer->getUndoPattern(), 5);
+  CHECK(!sequencer->undo());
+  CHECK(bank.fetch(5));
+  CHECK(sequencer->undo());
+  CHECK(sequencer->undo());
+  markPattern(pattern, 5);
+  CHECK(memcmp(sequencer->getResidentPattern(5), &pattern, sizeof(Pattern)) == 0);
+  CHECK_EQ(sequencer->getRedoPattern(), 5);
+  CHECK(sequencer->redo());
+  CHECK(sequencer->redo());
+  CHECK(holds(bank, 5, edited));
+
+  // Writing a resident pattern replaces what plays
+  markPattern(pattern, 40);
+  CHECK(bank.write(0, pattern));
+  CHECK(sequencer->isStepActive(0, 40));
+
+  // A fresh bank file refreshes the resident patterns too
+  CHECK(bank.reset());
+  CHECK(bank.reload());
+  CHECK(Sequencer::isPatternEmpty(*sequencer->getResidentPattern(0)));
+  CHECK(Sequencer::isPatternEmpty(*sequencer->getResidentPattern(5)));
+  CHECK_EQ(bank.getSongLength(), 1);
+  CHECK(!bank.fetch(NUM_PATTERNS));
+}
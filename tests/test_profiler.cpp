@@ -0,0 +1,112 @@
+/*
+ * DriftRiff Mini - Performance Counter and Log Level Tests
+ */
+
+#include <Arduino.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+// Below the firmware default, so INFO and DEBUG are compiled out here
+#define DRIFTONE_LOG_LEVEL LOG_LEVEL_WARN
+
+#include "test.h"
+#include "profiler.h"
+#include "debuglog.h"
+
+void testProfiler() {
+  ProfileHistogram h;
+  CHECK_EQ(h.getCount(), 0);
+  CHECK_EQ(h.getMin(), 0);
+  CHECK_EQ(h.getMax(), 0);
+  CHECK_EQ(h.getMean(), 0);
+  CHECK_EQ(h.getPercentile(50), 0);
+
+  // Power-of-two buckets, zero in the first
+  h.record(0);
+  h.record(1);
+  h.record(3);
+  h.record(1000);
+  h.record(UINT32_MAX);
+  CHECK_EQ(h.getBucket(0), 2);
+  CHECK_EQ(h.getBucket(1), 1);
+  CHECK_EQ(h.getBucket(9), 1);
+  CHECK_EQ(h.getBucket(31), 1);
+  CHECK_EQ(h.getBucket(-1), 0);
+  CHECK_EQ(h.getBucket(PROF_HIST_BUCKETS), 0);
+  CHECK_EQ(h.getCount(), 5);
+  CHECK_EQ(h.getMin(), 0);
+  CHECK_EQ(h.getMax(), UINT32_MAX);
+  CHECK_EQ(h.getMean(), ((uint64_t)UINT32_MAX + 1004) / 5);
+
+  // Percentiles report the bucket's upper edge, never past the largest sample
+  ProfileHistogram p;
+  for (int i = 0; i < 99; i++) p.record(100);
+  p.record(5000);
+  CHECK_EQ(p.getPercentile(50), 127);
+  CHECK_EQ(p.getPercentile(99), 127);
+  CHECK_EQ(p.getPercentile(100), 5000);
+  CHECK_EQ(p.getPercentile(0), 127);
+
+  p.reset();
+  CHECK_EQ(p.getCount(), 0);
+  CHECK_EQ(p.getMax(), 0);
+  CHECK_EQ(p.getBucket(6), 0);
+
+  // Channels record only while enabled
+  Profiler prof;
+  prof.record(PROF_MIX, 2000);
+  prof.setEnabled(false);
+  prof.record(PROF_MIX, 2000);
+  prof.setEnabled(true);
+  CHECK_EQ(prof.getHistogram(PROF_MIX).getCount(), 1);
+  CHECK_EQ(prof.getHistogram(PROF_AUDIO_RENDER).getCount(), 0);
+
+  char line[96];
+  size_t length = prof.formatChannel(PROF_MIX, line, sizeof(line));
+  CHECK_EQ(length, strlen(line));
+  CHECK(strcmp(line, "MIX   n=1 avg=2 p50=2 p99=2 max=2 us") == 0);
+  CHECK_EQ(prof.formatChannel(PROF_NUM_CHANNELS, line, sizeof(line)), 0);
+  CHECK_EQ(line[0], '\0');
+  CHECK_EQ(prof.formatChannel(PROF_MIX, line, 8), 7);
+  CHECK(strcmp(line, "MIX   n") == 0);
+  CHECK(strcmp(Profiler::getChannelName(PROF_SD_IO), "SD") == 0);
+
+  // A scope records into the global profiler once, when it closes
+  profiler.reset();
+  {
+    PROF_SCOPE(PROF_TOUCH);
+    CHECK_EQ(profiler.getHistogram(PROF_TOUCH).getCount(), 0);
+  }
+  CHECK_EQ(profiler.getHistogram(PROF_TOUCH).getCount(), DRIFTONE_PROFILING ? 1 : 0);
+  profiler.reset();
+}
+
+static int evaluated = 0;
+
+static int countEvaluation() {
+  return ++evaluated;
+}
+
+void testDebugLog() {
+  // Capture what reaches Serial through a pipe
+  int fds[2];
+  CHECK(pipe(fds) == 0);
+  Serial.attach(-1, fds[1]);
+
+  LOG_ERROR("error ", countEvaluation());
+  LOG_WARN("warn ", 2);
+  LOG_INFO("info ", countEvaluation());
+  LOG_DEBUG("debug ", countEvaluation());
+
+  // Compiled-out levels never evaluate their arguments
+  CHECK_EQ(evaluated, 1);
+
+  Serial.flush();
+  close(fds[1]);
+  char text[128];
+  ssize_t length = read(fds[0], text, sizeof(text) - 1);
+  close(fds[0]);
+  text[length > 0 ? length : 0] = '\0';
+  CHECK(strcmp(text, "error 1\r\nwarn 2\r\n") == 0);
+}
@@ -0,0 +1,332 @@
+/*
+ * DriftRiff Mini - Project File Tests
+ */
+
+#include <Arduino.h>
+#include <SD.h>
+#include <stdio.h>
+#include <string.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "test.h"
+#include "project.h"
+#include "crc.h"
+
+static uint32_t nextValue(uint32_t& state) {
+  state = state * 1664525u + 1013904223u;
+  return state >> 8;
+}
+
+// Every field set to something valid and unlikely to be a default
+static std::vector<Pattern> randomPatterns(uint32_t seed) {
+  std::vector<Pattern> patterns(NUM_PATTERNS);
+  uint32_t state = seed;
+  for (int i = 0; i < NUM_PATTERNS; i++) {
+    Pattern& pattern = patterns[i];
+    for (int track = 0; track < NUM_TRACKS; track++) {
+      pattern.steps[track] = ((uint64_t)nextValue(state) << 40) ^ ((uint64_t)nextValue(state) << 16) ^ nextValue(state);
+      pattern.tracks[track].length = 1 + nextValue(state) % MAX_STEPS;
+      pattern.tracks[track].rate = nextValue(state) % NUM_RATES;
+      pattern.tracks[track].direction = nextValue(state) % NUM_DIRECTIONS;
+      pattern.accents[track] = nextValue(state) % (MAX_VELOCITY + 1);
+      for (int step = 0; step < MAX_STEPS; step++) {
+        pattern.microTiming[track][step] = (int)(nextValue(state) % (2 * MAX_MICRO_OFFSET + 1)) - MAX_MICRO_OFFSET;
+        uint8_t condition = nextValue(state) & 0xFF;
+        pattern.conditions[track][step] = Sequencer::isValidTrigCondition(condition) ? condition : TRIG_ALWAYS;
+        pattern.ratchets[track][step] = (nextValue(state) & RATCHET_HITS_MASK) | (nextValue(state) % NUM_RAMPS) << RATCHET_RAMP_SHIFT;
+        pattern.slices[track][step] = nextValue(state) % (MAX_SLICES + 1);
+        pattern.velocities[track][step] = nextValue(state) & 0xFF;
+      }
+    }
+  }
+  return patterns;
+}
+
+// A new bank on the card holding the patterns, the first ones resident
+static void fillBank(PatternBank& bank, const std::vector<Pattern>& patterns) {
+  bank.reset();
+  for (int i = 0; i < NUM_PATTERNS; i++) {
+    bank.write(i, patterns[i]);
+  }
+}
+
+static std::vector<Pattern> bankPatterns(PatternBank& bank) {
+  std::vector<Pattern> patterns(NUM_PATTERNS);
+  for (int i = 0; i < NUM_PATTERNS; i++) {
+    CHECK(bank.read(i, patterns[i]));
+  }
+  return patterns;
+}
+
+static std::string cardPath(const char* path) {
+  return std::string(testSDRoot()) + path;
+}
+
+static std::vector<uint8_t> readCardFile(const char* path) {
+  std::vector<uint8_t> data;
+  FILE* f = fopen(cardPath(path).c_str(), "rb");
+  if (!f) return data;
+  uint8_t buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+    data.insert(data.end(), buffer, buffer + n);
+  }
+  fclose(f);
+  return data;
+}
+
+static void writeCardFile(const char* path, const std::vector<uint8_t>& data) {
+  FILE* f = fopen(cardPath(path).c_str(), "wb");
+  if (!f) return;
+  fwrite(data.data(), 1, data.size(), f);
+  fclose(f);
+}
+
+static bool samePatterns(PatternBank& a, PatternBank& b) {
+  std::vector<Pattern> left = bankPatterns(a);
+  std::vector<Pattern> right = bankPatterns(b);
+  return memcmp(left.data(), right.data(), NUM_PATTERNS * sizeof(Pattern)) == 0;
+}
+
+// A fresh sequencer and loader loading what is on the card, into a bank
+// file of its own
+struct ProjectReader {
+  std::unique_ptr<Sequencer> sequencer;
+  SDLoader loader;
+  PatternBank bank;
+  ProjectStore store;
+
+  ProjectReader() : sequencer(new Sequencer()) {
+    bank.init(sequencer.get(), "/reader.bin");
+    store.init(sequencer.get(), &loader, &bank);
+  }
+};
+
+void testProjectRoundTrip() {
+  std::unique_ptr<Sequencer> sequencer(new Sequencer());
+  SDLoader loader;
+  PatternBank bank;
+  ProjectStore store;
+  bank.init(sequencer.get());
+  fillBank(bank, randomPatterns(1));
+  sequencer->setBPM(137);
+  sequencer->setSwing(61);
+  sequencer->setRandomSeed(0xC0FFEE);
+  CHECK(bank.fetch(77));
+  CHECK(sequencer->selectPattern(77));
+  loader.setSamplePath(2, "/samples/break_amen.raw");
+  loader.setSamplePath(5, "/samples/a_name_far_too_long_for_the_slot.raw");
+  store.init(sequencer.get(), &loader, &bank);
+
+  sequencer->markEdited();
+  CHECK(store.isDirty());
+  CHECK(store.saveNow());
+  CHECK(!store.isDirty());
+  CHECK(!SD.exists(PROJECT_TEMP_PATH));
+  CHECK_EQ(readCardFile(PROJECT_PATH).size(),
+           sizeof(ProjectHeader) + sizeof(ProjectSettings) + NUM_PATTERNS * sizeof(Pattern));
+
+  ProjectReader reader;
+  CHECK(reader.store.load());
+  CHECK(samePatterns(bank, reader.bank));
+  CHECK_EQ(reader.sequencer->getBPM(), 137);
+  CHECK_EQ(reader.sequencer->getSwing(), 61);
+  CHECK_EQ(reader.sequencer->getRandomSeed(), 0xC0FFEE);
+  CHECK_EQ(reader.sequencer->getPatternIndex(), 77);
+  CHECK(strcmp(reader.loader.getSamplePath(2), "/samples/break_amen.raw") == 0);
+  CHECK(strcmp(reader.loader.getSamplePath(5), "/samples/a_name_far_too_long_fo") == 0);
+  CHECK(reader.store.getLoadedCrc() != 0);
+  CHECK(!reader.store.isDirty());
+  CHECK_EQ(reader.sequencer->getUndoDepth(), 0);
+
+  // The background save writes the same file a chunk per update()
+  std::vector<uint8_t> blocking = readCardFile(PROJECT_PATH);
+  store.requestSave();
+  int updates = 0;
+  store.update(millis());
+  while (store.isSaving() && updates < 10000) {
+    store.update(millis());
+    updates++;
+  }
+  CHECK(!store.isSaving());
+  CHECK(updates >= (int)(NUM_PATTERNS * sizeof(Pattern) / PROJECT_SAVE_CHUNK));
+  CHECK(readCardFile(PROJECT_PATH) == blocking);
+
+  // An edit during a background save makes another one follow
+  store.requestSave();
+  store.update(millis());
+  store.update(millis());
+  sequencer->setStep(0, 0, !sequencer->isStepActive(0, 0));
+  while (store.isSaving()) store.update(millis());
+  CHECK(store.isDirty());
+
+  // A save cut off before the rename still loads from the temp file
+  SD.remove(PROJECT_PATH);
+  writeCardFile(PROJECT_TEMP_PATH, blocking);
+  ProjectReader fromTemp;
+  CHECK(fromTemp.store.load());
+  CHECK_EQ(fromTemp.sequencer->getBPM(), 137);
+}
+
+void testProjectCorruption() {
+  std::unique_ptr<Sequencer> sequencer(new Sequencer());
+  SDLoader loader;
+  PatternBank bank;
+  ProjectStore store;
+  bank.init(sequencer.get());
+  fillBank(bank, randomPatterns(2));
+  sequencer->setBPM(90);
+  store.init(sequencer.get(), &loader, &bank);
+  CHECK(store.saveNow());
+  const std::vector<uint8_t> good = readCardFile(PROJECT_PATH);
+  CHECK(good.size() > sizeof(ProjectHeader));
+  if (good.size() <= sizeof(ProjectHeader)) return;
+
+  ProjectReader reader;
+  CHECK(reader.store.load());
+  CHECK(samePatterns(bank, reader.bank));
+
+  // A single flipped bit anywhere in the payload, or in the header, is
+  // refused and leaves the default pattern, never part of the file
+  std::vector<size_t> offsets = {0, 4, 6, 8, 10, 12, 16, 20, sizeof(ProjectHeader),
+                                 sizeof(ProjectHeader) + offsetof(ProjectSettings, samplePaths) + 3};
+  for (size_t offset = sizeof(ProjectHeader) + sizeof(ProjectSettings); offset < good.size(); offset += 997) {
+    offsets.push_back(offset);
+  }
+  offsets.push_back(good.size() - 1);
+  int accepted = 0;
+  for (size_t offset : offsets) {
+    std::vector<uint8_t> bad = good;
+    bad[offset] ^= 1 << (offset % 8);
+    writeCardFile(PROJECT_PATH, bad);
+
+    ProjectReader corrupt;
+    if (corrupt.store.load(PROJECT_PATH)) {
+      accepted++;
+      continue;
+    }
+    CHECK_EQ(corrupt.store.getLoadedCrc(), 0);
+    CHECK(corrupt.sequencer->isStepActive(0, 0));   // Default pattern's kick
+    CHECK_EQ(corrupt.sequencer->getBPM(), DEFAULT_BPM);
+  }
+  CHECK_EQ(accepted, 0);
+
+  // Cut short, or with bytes after the end of what the header describes
+  // lost to a failed write
+  std::vector<uint8_t> truncated(good.begin(), good.end() - 1);
+  writeCardFile(PROJECT_PATH, truncated);
+  ProjectReader shortFile;
+  CHECK(!shortFile.store.load(PROJECT_PATH));
+  writeCardFile(PROJECT_PATH, std::vector<uint8_t>(good.begin(), good.begin() + 10));
+  ProjectReader headerOnly;
+  CHECK(!headerOnly.store.load(PROJECT_PATH));
+  writeCardFile(PROJECT_PATH, std::vector<uint8_t>());
+  ProjectReader empty;
+  CHECK(!empty.store.load(PROJECT_PATH));
+
+  // A bad main file falls back to the temp file when there is one
+  writeCardFile(PROJECT_TEMP_PATH, good);
+  ProjectReader fallback;
+  CHECK(fallback.store.load());
+  CHECK_EQ(fallback.sequencer->getBPM(), 90);
+}
+
+// A file as an older version wrote it, patterns cut at patternSize
+static std::vector<uint8_t> buildProject(uint16_t version, uint16_t patternSize, const ProjectSettings& settings,
+                                         const Pattern* patterns) {
+  std::vector<uint8_t> payload(sizeof(settings) + (size_t)NUM_PATTERNS * patternSize);
+  memcpy(payload.data(), &settings, sizeof(settings));
+  for (int i = 0; i < NUM_PATTERNS; i++) {
+    memcpy(payload.data() + sizeof(settings) + (size_t)i * patternSize, &patterns[i], patternSize);
+  }
+
+  ProjectHeader header;
+  header.magic = PROJECT_MAGIC;
+  header.version = version;
+  header.headerSize = sizeof(ProjectHeader);
+  header.patternCount = NUM_PATTERNS;
+  header.patternSize = patternSize;
+  header.payloadSize = payload.size();
+  header.payloadCrc = crc32Final(crc32Update(CRC32_INIT, payload.data(), payload.size()));
+
+  std::vector<uint8_t> file(sizeof(header) + payload.size());
+  memcpy(file.data(), &header, sizeof(header));
+  memcpy(file.data() + sizeof(header), payload.data(), payload.size());
+  return file;
+}
+
+void testProjectVersions() {
+  std::vector<Pattern> source = randomPatterns(3);
+  ProjectSettings settings;
+  memset(&settings, 0, sizeof(settings));
+  settings.bpm = 100;
+  settings.swing = 55;
+
+  // Version 4 files predate velocity: it loads zeroed, full velocity, no accent
+  writeCardFile(PROJECT_PATH, buildProject(4, offsetof(Pattern, velocities), settings, source.data()));
+  ProjectReader v4;
+  CHECK(v4.store.load(PROJECT_PATH));
+  std::vector<Pattern> loadedV4 = bankPatterns(v4.bank);
+  int wrong = 0;
+  for (int i = 0; i < NUM_PATTERNS; i++) {
+    const Pattern& loaded = loadedV4[i];
+    const Pattern& saved = source[i];
+    wrong += memcmp(&loaded, &saved, offsetof(Pattern, velocities)) != 0;
+    for (int track = 0; track < NUM_TRACKS; track++) {
+      wrong += loaded.accents[track] != 0;
+      for (int step = 0; step < MAX_STEPS; step++) {
+        wrong += loaded.velocities[track][step] != 0;
+      }
+    }
+  }
+  CHECK_EQ(wrong, 0);
+  CHECK_EQ(v4.sequencer->getBPM(), 100);
+
+  // Version 1 keeps steps, micro-timing and track settings only
+  writeCardFile(PROJECT_PATH, buildProject(1, offsetof(Pattern, conditions), settings, source.data()));
+  ProjectReader v1;
+  CHECK(v1.store.load(PROJECT_PATH));
+  const Pattern& first = *v1.sequencer->getResidentPattern(0);
+  CHECK(memcmp(&first, &source[0], offsetof(Pattern, conditions)) == 0);
+  CHECK_EQ(first.conditions[0][0], TRIG_ALWAYS);
+  CHECK_EQ(first.ratchets[1][1], 0);
+
+  // Too short for its version, from the future, or a different bank size
+  writeCardFile(PROJECT_PATH, buildProject(4, offsetof(Pattern, slices), settings, source.data()));
+  ProjectReader shortPatterns;
+  CHECK(!shortPatterns.store.load(PROJECT_PATH));
+  std::vector<uint8_t> future = buildProject(PROJECT_VERSION, sizeof(Pattern), settings, source.data());
+  ((ProjectHeader*)future.data())->version = PROJECT_VERSION + 1;
+  writeCardFile(PROJECT_PATH, future);
+  ProjectReader newer;
+  CHECK(!newer.store.load(PROJECT_PATH));
+
+  // Out of range values behind a good CRC are put back in range
+  std::vector<Pattern> odd = source;
+  odd[3].tracks[1].length = 0;
+  odd[3].tracks[2].length = 200;
+  odd[3].tracks[3].rate = NUM_RATES;
+  odd[3].tracks[4].direction = 9;
+  odd[3].conditions[0][5] = TRIG_LOOP_BASE + 7;   // 1:9 does not exist
+  odd[3].ratchets[0][6] = 0xFF;
+  odd[3].slices[0][7] = MAX_SLICES + 1;
+  odd[3].accents[5] = 200;
+  odd[3].microTiming[5][8] = MAX_MICRO_OFFSET + 40;
+  odd[3].microTiming[5][9] = -MAX_MICRO_OFFSET - 1;
+  writeCardFile(PROJECT_PATH, buildProject(PROJECT_VERSION, sizeof(Pattern), settings, odd.data()));
+  ProjectReader clamped;
+  CHECK(clamped.store.load(PROJECT_PATH));
+  const Pattern& fixed = *clamped.sequencer->getResidentPattern(3);
+  CHECK_EQ(fixed.tracks[1].length, 1);
+  CHECK_EQ(fixed.tracks[2].length, MAX_STEPS);
+  CHECK_EQ(fixed.tracks[3].rate, RATE_1);
+  CHECK_EQ(fixed.tracks[4].direction, DIR_FORWARD);
+  CHECK_EQ(fixed.conditions[0][5], TRIG_ALWAYS);
+  CHECK_EQ(fixed.ratchets[0][6], 0);
+  CHECK_EQ(fixed.slices[0][7], 0);
+  CHECK_EQ(fixed.accents[5], MAX_VELOCITY);
+  CHECK_EQ(fixed.microTiming[5][8], MAX_MICRO_OFFSET);
+  CHECK_EQ(fixed.microTiming[5][9], -MAX_MICRO_OFFSET);
+}
@@ -0,0 +1,161 @@
+/*
+ * DriftRiff Mini - Ratchet Tests
+ */
+
+#include <Arduino.h>
+#include <string.h>
+#include <memory>
+#include <vector>
+
+#include "test.h"
+#include "sequencer.h"
+#include "audioengine.h"
+#include "hostsim.h"
+
+// 22050 * 60 / (105 * 4) = 3150 frames per 16th
+#define RATCHET_BPM         105
+#define RATCHET_STEP_FRAMES 3150
+#define CLICK_LEVEL         100   // The one non-silent frame of the test sample
+#define CLICK_SAMPLE_SIZE   2048  // Past the next hit, done before the next step
+#define ROLL_SAMPLE_SIZE    1024  // Past the next hit at MAX_BPM, done within a step
+
+static std::vector<uint8_t> rendered;
+
+static void captureLevel(uint8_t level) {
+  rendered.push_back(level);
+}
+
+struct RatchetRun {
+  std::vector<SequencerTrigger> triggers;
+  std::vector<uint32_t> onsets;     // Frames the output left the centre on
+  int maxVoices;
+  uint32_t dropped;
+};
+
+// The audio task's loop: the sequencer scheduled two blocks ahead and its
+// triggers queued the way driftone_main does, then one frame out at a time
+static RatchetRun runRatchets(Sequencer& sequencer, uint32_t sampleSize, uint32_t frames, bool reuse) {
+  static uint8_t click[CLICK_SAMPLE_SIZE];
+  memset(click, 128, sizeof(click));
+  click[0] = 128 + CLICK_LEVEL;
+
+  AudioEngine engine;
+  engine.init();
+  engine.setLimiterEnabled(false);
+  engine.setRetriggerReuse(reuse);
+  rendered.clear();
+  hostAudioSetTap(captureLevel);
+
+  RatchetRun run;
+  run.maxVoices = 0;
+  SequencerTrigger triggers[NUM_TRACKS * 4];
+  uint32_t scheduled = 0;
+  while (engine.getPlayFrame() < frames) {
+    uint32_t horizon = engine.getRenderFrame() + 2 * AUDIO_BLOCK_SIZE;
+    if (horizon != scheduled) {
+      int count;
+      while ((count = sequencer.schedule(horizon, triggers, NUM_TRACKS * 4)) > 0) {
+        for (int i = 0; i < count; i++) {
+          engine.scheduleRatchet(triggers[i].frame, click, sampleSize, 1.0f, triggers[i].track,
+                                 triggers[i].hits, triggers[i].interval, 0, triggers[i].velocity);
+          run.triggers.push_back(triggers[i]);
+        }
+      }
+      scheduled = horizon;
+    }
+    hostClockAdvance(1000000 / SAMPLE_RATE);
+    engine.update();
+    run.maxVoices = max(run.maxVoices, engine.getActiveVoices());
+  }
+  hostAudioSetTap(nullptr);
+
+  for (size_t i = 0; i < rendered.size(); i++) {
+    if (rendered[i] != 128) run.onsets.push_back(i);
+  }
+  run.dropped = engine.getDroppedHits();
+  return run;
+}
+
+// Every hit the triggers make before the end of the run
+static std::vector<uint32_t> expectedOnsets(const RatchetRun& run, uint32_t frames) {
+  std::vector<uint32_t> onsets;
+  for (const SequencerTrigger& trigger : run.triggers) {
+    for (int hit = 0; hit < trigger.hits; hit++) {
+      uint32_t frame = trigger.frame + hit * trigger.interval;
+      if (frame < frames) onsets.push_back(frame);
+    }
+  }
+  return onsets;
+}
+
+// Every step of the first track rolling at the most hits, at the top tempo
+static std::unique_ptr<Sequencer> rollingSequencer() {
+  std::unique_ptr<Sequencer> sequencer(new Sequencer());
+  sequencer->setBPM(MAX_BPM);
+  for (int step = 0; step < NUM_STEPS; step++) {
+    sequencer->setStep(0, step, true);
+    sequencer->setRatchet(0, step, MAX_RATCHET);
+  }
+  return sequencer;
+}
+
+void testRatchetOnsets() {
+  // One track, every other step a higher hit count: each hit restarts
+  // the sample on its own frame, evenly across the step, and a roll keeps
+  // to the voice it started on
+  std::unique_ptr<Sequencer> sequencer(new Sequencer());
+  sequencer->setBPM(RATCHET_BPM);
+  for (int hits = 1; hits <= MAX_RATCHET; hits++) {
+    sequencer->setStep(2, 2 * (hits - 1), true);
+    sequencer->setRatchet(2, 2 * (hits - 1), hits);
+  }
+  const uint32_t frames = 2 * MAX_RATCHET * RATCHET_STEP_FRAMES;
+  RatchetRun run = runRatchets(*sequencer, CLICK_SAMPLE_SIZE, frames, true);
+  for (const SequencerTrigger& trigger : run.triggers) {
+    CHECK_EQ(trigger.hits, trigger.step / 2 + 1);
+    if (trigger.hits > 1) {
+      CHECK_EQ(trigger.interval, RATCHET_STEP_FRAMES / trigger.hits);
+    }
+  }
+  std::vector<uint32_t> expected = expectedOnsets(run, frames);
+  CHECK_EQ(expected.size(), MAX_RATCHET * (MAX_RATCHET + 1) / 2);
+  CHECK(run.onsets == expected);
+  CHECK_EQ(run.maxVoices, 1);
+  CHECK_EQ(run.dropped, 0);
+}
+
+void testRatchetVoices() {
+  // Each hit still sounding when the next one comes: a roll keeps to one
+  // voice, the tail of the roll before it the only other, and every hit
+  // is heard
+  std::unique_ptr<Sequencer> sequencer = rollingSequencer();
+  const uint32_t frames = 2 * SAMPLE_RATE;
+  RatchetRun run = runRatchets(*sequencer, ROLL_SAMPLE_SIZE, frames, true);
+  std::vector<uint32_t> expected = expectedOnsets(run, frames);
+  CHECK(expected.size() > NUM_STEPS * MAX_RATCHET);
+  CHECK(run.onsets == expected);
+  CHECK(run.maxVoices <= 2);
+  CHECK_EQ(run.dropped, 0);
+
+  // A voice per hit runs out of voices and loses hits
+  sequencer = rollingSequencer();
+  run = runRatchets(*sequencer, ROLL_SAMPLE_SIZE, frames, false);
+  CHECK_EQ(run.maxVoices, MAX_CONCURRENT_SAMPLES);
+  CHECK(run.onsets.size() < expectedOnsets(run, frames).size());
+
+  // More ratchets due in one block than can be re-queued lose their later
+  // hits, and are counted
+  AudioEngine engine;
+  engine.init();
+  static uint8_t click[CLICK_SAMPLE_SIZE];
+  memset(click, 128 + CLICK_LEVEL, sizeof(click));
+  uint32_t frame = engine.getRenderFrame() + AUDIO_BLOCK_SIZE;
+  for (int i = 0; i < MAX_BLOCK_RETRIGGERS + 2; i++) {
+    CHECK(engine.scheduleRatchet(frame, click, CLICK_SAMPLE_SIZE, 1.0f, ENVELOPE_NONE, 3, 100, 0));
+  }
+  for (int i = 0; i < 8 * AUDIO_BLOCK_SIZE; i++) {
+    hostClockAdvance(1000000 / SAMPLE_RATE);
+    engine.update();
+  }
+  CHECK_EQ(engine.getDroppedHits(), 2 * 2);
+}
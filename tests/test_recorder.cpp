@@ -0,0 +1,179 @@
+/*
+ * DriftRiff Mini - Recorder Tests
+ */
+
+#include <Arduino.h>
+#include <SD.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "test.h"
+#include "recorder.h"
+#include "hostsim.h"
+
+#define INPUT_LEAD_FRAMES   2000    // Silence after arming, before the input moves
+#define INPUT_LEVEL         60      // Distance from mid-scale once it does
+#define LOOP_PASS_US        1000    // How often loop() comes round
+#define SLOW_PASS_US        150000  // Longer than the DMA ring lasts
+
+typedef std::vector<uint8_t> Bytes;
+
+static std::string cardPath(const char* path) {
+  return std::string(testSDRoot()) + path;
+}
+
+static Bytes readCardFile(const char* path) {
+  Bytes data;
+  FILE* f = fopen(cardPath(path).c_str(), "rb");
+  if (!f) return data;
+  uint8_t buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+    data.insert(data.end(), buffer, buffer + n);
+  }
+  fclose(f);
+  return data;
+}
+
+static uint32_t frameNow() {
+  return hostClockMicros() * SAMPLE_RATE / 1000000;
+}
+
+// The input plays from clock zero, so the WAV is silence up to the frame
+// given and then a signal with a different value on every frame for long
+// enough to fill a recording. Returns what the ADC reads from there on.
+static Bytes openInput(uint32_t onsetFrame) {
+  Bytes signal;
+  for (uint32_t i = 0; i < 2 * MAX_SAMPLE_SIZE; i++) {
+    int value = INPUT_LEVEL - (int)(i * 7 % (2 * INPUT_LEVEL));
+    signal.push_back((uint8_t)(128 + (value == 0 ? INPUT_LEVEL : value)));
+  }
+
+  uint32_t frames = onsetFrame + signal.size();
+  Bytes wav = {'R', 'I', 'F', 'F', 0, 0, 0, 0, 'W', 'A', 'V', 'E',
+               'f', 'm', 't', ' ', 16, 0, 0, 0, 1, 0, 1, 0,
+               (uint8_t)SAMPLE_RATE, (uint8_t)(SAMPLE_RATE >> 8), 0, 0,
+               (uint8_t)SAMPLE_RATE, (uint8_t)(SAMPLE_RATE >> 8), 0, 0, 1, 0, 8, 0,
+               'd', 'a', 't', 'a',
+               (uint8_t)frames, (uint8_t)(frames >> 8), (uint8_t)(frames >> 16), (uint8_t)(frames >> 24)};
+  wav.resize(wav.size() + onsetFrame, 128);
+  wav.insert(wav.end(), signal.begin(), signal.end());
+
+  std::string path = cardPath("/input.wav");
+  FILE* f = fopen(path.c_str(), "wb");
+  if (f) {
+    fwrite(wav.data(), 1, wav.size(), f);
+    fclose(f);
+  }
+  CHECK(hostAudioInputOpen(path.c_str()));
+  SD.remove("/input.wav");
+  return signal;
+}
+
+// loop() passes until the recording is done, or the pass limit
+static void runPasses(Recorder& recorder, uint32_t passUs, int passes) {
+  for (int i = 0; i < passes && recorder.getState() != REC_IDLE; i++) {
+    hostClockAdvance(passUs);
+    recorder.update();
+  }
+}
+
+static void flushAll(Recorder& recorder) {
+  for (int i = 0; i < 1000 && recorder.flush(); i++) {
+  }
+}
+
+void testRecorderCapture() {
+  SDLoader loader;
+  Recorder recorder;
+  recorder.init(&loader);
+
+  // Triggered on the first frame past the threshold, which ends the
+  // pre-roll of silence, then every frame the ADC produced, in order
+  Bytes signal = openInput(frameNow() + INPUT_LEAD_FRAMES);
+  uint32_t overruns = hostAudioInputOverruns();
+  CHECK(recorder.arm(2));
+  runPasses(recorder, LOOP_PASS_US, 100);
+  CHECK_EQ(recorder.getState(), REC_RECORDING);
+  runPasses(recorder, LOOP_PASS_US, 5000);
+  CHECK_EQ(recorder.getState(), REC_IDLE);
+  CHECK_EQ(recorder.getRecordedFrames(), MAX_SAMPLE_SIZE);
+  CHECK_EQ(recorder.getDroppedFrames(), 0);
+  CHECK_EQ(hostAudioInputOverruns(), overruns);
+
+  const uint8_t* sample = loader.getSampleData(2);
+  CHECK(sample != nullptr);
+  CHECK_EQ(loader.getSampleSize(2), MAX_SAMPLE_SIZE);
+  if (!sample) return;
+  int wrong = 0;
+  const int silence = RECORD_PREROLL - 1;
+  for (int i = 0; i < silence; i++) {
+    wrong += sample[i] != 128;
+  }
+  for (uint32_t i = silence; i < MAX_SAMPLE_SIZE; i++) {
+    wrong += sample[i] != signal[i - silence];
+  }
+  CHECK_EQ(wrong, 0);
+
+  // Written out in the background under the first free name
+  flushAll(recorder);
+  CHECK(recorder.takeSavedFile());
+  CHECK(!recorder.takeSavedFile());
+  CHECK(strcmp(loader.getSamplePath(2), "/samples/rec000.raw") == 0);
+  CHECK(readCardFile("/samples/rec000.raw") == Bytes(sample, sample + MAX_SAMPLE_SIZE));
+
+  // Quiet input never triggers, and stopping then keeps nothing
+  openInput(frameNow() + 10 * SAMPLE_RATE);
+  CHECK(recorder.arm(3));
+  runPasses(recorder, LOOP_PASS_US, 200);
+  CHECK_EQ(recorder.getState(), REC_ARMED);
+  recorder.stop();
+  CHECK_EQ(recorder.getState(), REC_IDLE);
+  CHECK(loader.getSampleData(3) == nullptr);
+  hostAudioInputClose();
+}
+
+void testRecorderDropouts() {
+  SDLoader loader;
+  Recorder recorder;
+  recorder.init(&loader);
+
+  // A loop() too slow for the DMA ring loses whole buffers, and the
+  // recorder notices
+  openInput(frameNow() + INPUT_LEAD_FRAMES);
+  uint32_t overruns = hostAudioInputOverruns();
+  CHECK(recorder.arm(1));
+  runPasses(recorder, LOOP_PASS_US, 100);
+  CHECK_EQ(recorder.getState(), REC_RECORDING);
+  runPasses(recorder, SLOW_PASS_US, 3);
+  CHECK(hostAudioInputOverruns() > overruns);
+  CHECK(recorder.getDroppedFrames() > 0);
+  recorder.stop();
+  CHECK_EQ(recorder.getState(), REC_IDLE);
+  CHECK(loader.getSampleData(1) != nullptr);
+
+  // With every file name taken the recording is not saved, and the last
+  // name is not written over
+  SD.mkdir("/samples");
+  for (int i = 0; i < RECORD_MAX_FILES; i++) {
+    char path[SAMPLE_PATH_LENGTH];
+    snprintf(path, sizeof(path), RECORD_PATH_FORMAT, i);
+    File file = SD.open(path, FILE_WRITE);
+    file.write((const uint8_t*)"old", 3);
+    file.close();
+  }
+  std::string path = loader.getSamplePath(4);
+  openInput(frameNow() + INPUT_LEAD_FRAMES);
+  CHECK(recorder.arm(4));
+  runPasses(recorder, LOOP_PASS_US, 200);
+  recorder.stop();
+  CHECK(loader.getSampleData(4) != nullptr);
+  flushAll(recorder);
+  CHECK(!recorder.flush());
+  CHECK(!recorder.takeSavedFile());
+  CHECK(path == loader.getSamplePath(4));
+  CHECK(readCardFile("/samples/rec999.raw") == (Bytes{'o', 'l', 'd'}));
+  hostAudioInputClose();
+}
@@ -0,0 +1,126 @@
+/*
+ * DriftRiff Mini - Input Log Replay Tests
+ */
+
+#include <Arduino.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+#include "test.h"
+#include "audioengine.h"
+#include "inputlog.h"
+
+#define SESSION_SECONDS "4"
+
+typedef std::vector<uint8_t> Bytes;
+
+static std::string cardPath(const char* path) {
+  return std::string(testSDRoot()) + path;
+}
+
+static Bytes readCardFile(const char* path) {
+  Bytes data;
+  FILE* f = fopen(cardPath(path).c_str(), "rb");
+  if (!f) return data;
+  uint8_t buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+    data.insert(data.end(), buffer, buffer + n);
+  }
+  fclose(f);
+  return data;
+}
+
+static void writeCardFile(const char* path, const std::string& data) {
+  FILE* f = fopen(cardPath(path).c_str(), "wb");
+  if (f) {
+    fwrite(data.data(), 1, data.size(), f);
+    fclose(f);
+  }
+}
+
+// A decaying tone per slot, long enough to take a good many passes to load
+static void writeSamples() {
+  const char* names[] = {"kick", "snare", "hihat", "perc", "bass", "lead"};
+  mkdir(cardPath("/samples").c_str(), 0755);
+  for (int slot = 0; slot < 6; slot++) {
+    std::string sample(8000 + slot * 1500, '\0');
+    for (size_t i = 0; i < sample.size(); i++) {
+      float t = (float)i / SAMPLE_RATE;
+      float value = sinf(2 * PI * (60 + 150 * slot) * t) * expf(-t * (8 + 4 * slot));
+      sample[i] = (char)(128 + (int)lroundf(100 * value));
+    }
+    std::string path = std::string("/samples/") + names[slot] + ".raw";
+    writeCardFile(path.c_str(), sample);
+  }
+}
+
+// Runs the simulator on the scratch card, output files named after the run
+static bool runSim(const char* run, const char* inputs) {
+  std::string root = testSDRoot();
+  std::string command = std::string("\"") + DRIFTONE_SIM_PATH + "\" --sd \"" + root + "\" --seconds " +
+                        SESSION_SECONDS + " " + inputs +
+                        " --wav \"" + root + "/" + run + ".wav\"" +
+                        " --draw-log \"" + root + "/" + run + ".draw\"" +
+                        " --state \"" + root + "/" + run + ".state\"" +
+                        " > \"" + root + "/" + run + ".txt\" 2>&1";
+  return system(command.c_str()) == 0;
+}
+
+static int differingBytes(const Bytes& a, const Bytes& b) {
+  int count = abs((int)a.size() - (int)b.size());
+  for (size_t i = 0; i < a.size() && i < b.size(); i++) {
+    count += a[i] != b[i];
+  }
+  return count;
+}
+
+void testReplay() {
+  // A session of presses on the transport, grid and tempo buttons, made
+  // on a card with no sample manifest so every sample loads the slow way,
+  // then replayed on the card as it left it, manifest and all. The audio,
+  // the draw calls and the sequencer state at the end come out the same.
+  writeSamples();
+  writeCardFile("/session.touch",
+                "300 80 511 844\n"      // PLAY
+                "700 60 304 277\n"      // Track 1, step 3
+                "1100 60 434 328\n"     // Track 2, step 6
+                "1500 60 694 380\n"     // Track 3, step 12
+                "1900 60 715 844\n"     // BPM +
+                "2300 60 715 844\n"
+                "2310 40 304 277\n"     // Track 1, step 3 again, in the pass right after
+                "3000 500 511 844\n");  // PLAY, held
+  CHECK(runSim("record", ("--touch \"" + cardPath("/session.touch") + "\"").c_str()));
+  Bytes log = readCardFile(INPUT_LOG_PATH);
+  CHECK(log.size() > sizeof(InputLogHeader));
+  CHECK(!readCardFile("/manifest.bin").empty());
+
+  CHECK(runSim("replay", ("--replay \"" + cardPath(INPUT_LOG_PATH) + "\"").c_str()));
+  CHECK(readCardFile(INPUT_LOG_PATH) == log);
+
+  Bytes recordWav = readCardFile("/record.wav");
+  Bytes replayWav = readCardFile("/replay.wav");
+  CHECK(recordWav.size() > 4 * SAMPLE_RATE);
+  CHECK_EQ(differingBytes(recordWav, replayWav), 0);
+  Bytes recordDraw = readCardFile("/record.draw");
+  CHECK(!recordDraw.empty());
+  CHECK_EQ(differingBytes(recordDraw, readCardFile("/replay.draw")), 0);
+  Bytes recordState = readCardFile("/record.state");
+  CHECK(!recordState.empty());
+  CHECK_EQ(differingBytes(recordState, readCardFile("/replay.state")), 0);
+
+  // The session did something worth repeating: the samples played and
+  // the presses changed the patterns from a run without them
+  int loud = 0;
+  for (size_t i = 44; i < recordWav.size(); i++) {
+    loud += abs((int)recordWav[i] - 128) > 16;
+  }
+  CHECK(loud > SAMPLE_RATE / 10);
+  remove(cardPath(INPUT_LOG_PATH).c_str());
+  CHECK(runSim("idle", ""));
+  CHECK(differingBytes(recordState, readCardFile("/idle.state")) > 0);
+}
@@ -0,0 +1,162 @@
+/*
+ * DriftRiff Mini - Sample Analysis Tests
+ */
+
+#include <Arduino.h>
+#include <math.h>
+#include <string.h>
+#include <vector>
+
+#include "test.h"
+#include "sampleanalysis.h"
+
+typedef std::vector<uint8_t> Bytes;
+
+static uint32_t nextValue(uint32_t& state) {
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+
+// A square wave of the given peak around centre, between runs of noise
+// that stays within the silence level of it and averages out to nothing
+static Bytes paddedSquare(int centre, int peak, uint32_t lead, uint32_t body, uint32_t tail) {
+  Bytes data;
+  for (uint32_t i = 0; i < lead; i++) {
+    data.push_back(centre + (int)(i % 5) - 2);
+  }
+  for (uint32_t i = 0; i < body; i++) {
+    data.push_back(centre + ((i & 1) ? -peak : peak));
+  }
+  for (uint32_t i = 0; i < tail; i++) {
+    data.push_back(centre + (int)(i % 5) - 2);
+  }
+  return data;
+}
+
+static bool sameStats(const SampleStats& a, const SampleStats& b) {
+  return a.rawSize == b.rawSize && a.trimStart == b.trimStart && a.trimEnd == b.trimEnd &&
+         a.dcOffset == b.dcOffset && a.peak == b.peak && a.rms == b.rms && a.gain == b.gain &&
+         a.analyzed == b.analyzed;
+}
+
+void testSampleAnalysis() {
+  SampleStats stats;
+
+  // DC offset: measured from the mean, taken out of every kept frame, and
+  // the silence around it judged from the corrected centre
+  Bytes data = paddedSquare(128 + 25, 60, 300, 1000, 200);
+  Bytes original = data;
+  uint32_t kept = sampleAnalyze(data.data(), data.size(), stats);
+  CHECK(stats.analyzed);
+  CHECK_EQ(stats.rawSize, original.size());
+  CHECK_EQ(stats.dcOffset, 25);
+  CHECK_EQ(stats.peak, 60);
+  CHECK_EQ(stats.trimStart, 300);
+  CHECK_EQ(stats.trimEnd, 200);
+  CHECK_EQ(kept, 1000);
+  int wrong = 0;
+  for (uint32_t i = 0; i < kept; i++) {
+    wrong += data[i] != original[300 + i] - 25;
+  }
+  CHECK_EQ(wrong, 0);
+  CHECK_EQ(stats.gain, SAMPLE_TARGET_PEAK * SAMPLE_GAIN_UNITY / 60);
+  double squares = 1000.0 * 60 * 60;
+  for (uint32_t i = 0; i < 300; i++) squares += ((int)(i % 5) - 2) * ((int)(i % 5) - 2);
+  for (uint32_t i = 0; i < 200; i++) squares += ((int)(i % 5) - 2) * ((int)(i % 5) - 2);
+  CHECK_EQ(stats.rms, (int)lround(sqrt(squares / original.size())));
+
+  // Below the centre as well
+  data = paddedSquare(128 - 40, 30, 10, 500, 10);
+  kept = sampleAnalyze(data.data(), data.size(), stats);
+  CHECK_EQ(stats.dcOffset, -40);
+  CHECK_EQ(stats.peak, 30);
+  CHECK_EQ(kept, 500);
+  CHECK_EQ(data[0], 128 + 30);
+
+  // Silence only, at the centre or off it, is left whole at unity gain
+  const int centres[] = {128, 128 + 50, 128 - 70};
+  for (int centre : centres) {
+    data = paddedSquare(centre, 0, 700, 0, 0);
+    original = data;
+    kept = sampleAnalyze(data.data(), data.size(), stats);
+    CHECK_EQ(kept, original.size());
+    CHECK(data == original);
+    CHECK(stats.analyzed);
+    CHECK_EQ(stats.gain, SAMPLE_GAIN_UNITY);
+    CHECK_EQ(stats.trimStart, 0);
+    CHECK_EQ(stats.trimEnd, 0);
+    CHECK(stats.peak <= SAMPLE_SILENCE_LEVEL);
+  }
+
+  // Nothing at all
+  CHECK_EQ(sampleAnalyze(nullptr, 0, stats), 0);
+  CHECK(!stats.analyzed);
+  CHECK_EQ(stats.gain, SAMPLE_GAIN_UNITY);
+
+  // The gain brings the peak to SAMPLE_TARGET_PEAK up to +12 dB, the last
+  // peak under the cap and the first over it either side of it
+  const int peaks[] = {3, 10, 31, 32, 64, 127};
+  for (int peak : peaks) {
+    data = paddedSquare(128, peak, 0, 100, 0);
+    sampleAnalyze(data.data(), data.size(), stats);
+    CHECK_EQ(stats.peak, peak);
+    int expected = min(SAMPLE_TARGET_PEAK * SAMPLE_GAIN_UNITY / peak, SAMPLE_GAIN_MAX);
+    CHECK_EQ(stats.gain, expected);
+    CHECK(stats.gain <= SAMPLE_GAIN_MAX);
+  }
+  data = paddedSquare(128, 31, 0, 100, 0);
+  sampleAnalyze(data.data(), data.size(), stats);
+  CHECK_EQ(stats.gain, SAMPLE_GAIN_MAX);
+  data = paddedSquare(128, 32, 0, 100, 0);
+  sampleAnalyze(data.data(), data.size(), stats);
+  CHECK(stats.gain < SAMPLE_GAIN_MAX);
+
+  // Full scale either way is never turned up
+  data = {0, 255, 128, 255, 0};
+  sampleAnalyze(data.data(), data.size(), stats);
+  CHECK_EQ(stats.peak, 128);
+  CHECK(stats.gain < SAMPLE_GAIN_UNITY);
+
+  // Measured in chunks of any size as the file streams in, the result is
+  // the same as in one go
+  uint32_t random = 0x5a5a;
+  for (int round = 0; round < 40; round++) {
+    uint32_t size = 1 + nextValue(random) % 20000;
+    int centre = 128 + (int)(nextValue(random) % 61) - 30;
+    uint32_t lead = nextValue(random) % (size / 4 + 1);
+    uint32_t tail = nextValue(random) % (size / 4 + 1);
+    int level = nextValue(random) % 100;
+    Bytes whole(size);
+    for (uint32_t i = 0; i < size; i++) {
+      int value = centre;
+      if (i >= lead && i + tail < size) {
+        value += (int)(nextValue(random) % (2 * level + 1)) - level;
+      }
+      whole[i] = constrain(value, 0, 255);
+    }
+    Bytes chunked = whole;
+
+    SampleStats wholeStats;
+    uint32_t wholeKept = sampleAnalyze(whole.data(), size, wholeStats);
+
+    SampleMeasure measure;
+    sampleMeasureBegin(measure);
+    uint32_t position = 0;
+    while (position < size) {
+      uint32_t length = min(size - position, round & 1 ? 1 + nextValue(random) % 700 : 1u);
+      sampleMeasureUpdate(measure, chunked.data() + position, length);
+      sampleMeasureUpdate(measure, chunked.data() + position, 0);
+      position += length;
+    }
+    SampleStats chunkedStats;
+    uint32_t chunkedKept = sampleCorrect(chunked.data(), measure, chunkedStats);
+
+    CHECK(sameStats(wholeStats, chunkedStats));
+    CHECK_EQ(chunkedKept, wholeKept);
+    CHECK(memcmp(whole.data(), chunked.data(), wholeKept) == 0);
+    CHECK(wholeStats.gain <= SAMPLE_GAIN_MAX);
+    CHECK_EQ(wholeStats.trimStart + wholeKept + wholeStats.trimEnd, size);
+  }
+}
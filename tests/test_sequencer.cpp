@@ -0,0 +1,642 @@
+/*
+ * DriftRiff Mini - Sequencer Tests
+ */
+
+#include <Arduino.h>
+#include <string.h>
+#include <memory>
+#include <vector>
+
+#include "test.h"
+#include "sequencer.h"
+#include "audioengine.h"
+
+// 22050 * 60 / (105 * 4) = 3150 frames per 16th, so every offset below is
+// an exact number of 1/65536 frames and the expected frames are exact
+#define TEST_BPM          105
+#define TEST_STEP_FRAMES  3150
+#define TEST_HALF_STEP    (TEST_STEP_FRAMES / 2)
+
+// Fresh sequencer with every pattern empty, playing from tick 0
+static std::unique_ptr<Sequencer> newSequencer(int bpm) {
+  std::unique_ptr<Sequencer> sequencer(new Sequencer());
+  sequencer->setBPM(bpm);
+  return sequencer;
+}
+
+// Schedule a block at a time, like the audio task, until count triggers
+// have come out or the frame limit is reached
+static std::vector<SequencerTrigger> collectTriggers(Sequencer& sequencer, size_t count,
+                                                     uint32_t frameLimit) {
+  std::vector<SequencerTrigger> result;
+  SequencerTrigger triggers[NUM_TRACKS * 4];
+  for (uint32_t horizon = 0; result.size() < count && horizon < frameLimit; horizon += AUDIO_BLOCK_SIZE) {
+    int written;
+    do {
+      written = sequencer.schedule(horizon, triggers, NUM_TRACKS * 4);
+      result.insert(result.end(), triggers, triggers + written);
+    } while (written > 0);
+  }
+  return result;
+}
+
+// Frames from the first grid step: half a step of look-ahead, then the
+// grid, micro-timing in 96ths of a step rounded half up, and swing on odd
+// steps
+static uint32_t expectedFrame(int step, int micro, int swing) {
+  int32_t frame = TEST_HALF_STEP + step * TEST_STEP_FRAMES;
+  int32_t microTimes32 = micro * TEST_STEP_FRAMES * 32 / TICKS_PER_STEP;  // Exact in 32nds of a frame
+  int32_t rounded = microTimes32 + 16;
+  frame += rounded >= 0 ? rounded / 32 : -((31 - rounded) / 32);
+  if (step & 1) {
+    frame += TEST_STEP_FRAMES * (2 * swing - 100) / 100;
+  }
+  return frame;
+}
+
+static void checkSwing(int swing) {
+  std::unique_ptr<Sequencer> sequencer = newSequencer(TEST_BPM);
+  sequencer->setSwing(swing);
+  for (int step = 0; step < NUM_STEPS; step++) {
+    sequencer->setStep(1, step, true);
+  }
+
+  std::vector<SequencerTrigger> triggers = collectTriggers(*sequencer, 64, 64 * TEST_STEP_FRAMES);
+  CHECK_EQ(triggers.size(), 64);
+  int effective = constrain(swing, MIN_SWING, MAX_SWING);
+  for (size_t i = 0; i < triggers.size(); i++) {
+    CHECK_EQ(triggers[i].track, 1);
+    CHECK_EQ(triggers[i].step, i % NUM_STEPS);
+    CHECK_EQ(triggers[i].frame, expectedFrame(i, 0, effective));
+  }
+}
+
+void testSwing() {
+  // Below the range is straight 16ths
+  checkSwing(0);
+  checkSwing(MIN_SWING);
+  checkSwing(62);
+  checkSwing(MAX_SWING);
+
+  // At the maximum an odd step lands half way to the next one
+  std::unique_ptr<Sequencer> sequencer = newSequencer(TEST_BPM);
+  sequencer->setSwing(MAX_SWING);
+  sequencer->setStep(0, 1, true);
+  std::vector<SequencerTrigger> triggers = collectTriggers(*sequencer, 1, 4 * TEST_STEP_FRAMES);
+  CHECK_EQ(triggers.size(), 1);
+  if (!triggers.empty()) {
+    CHECK_EQ(triggers[0].frame, TEST_HALF_STEP + TEST_STEP_FRAMES + TEST_STEP_FRAMES / 2);
+  }
+
+  // Swing follows the track's own steps: at 2x, odd half-steps are delayed
+  // by half the swing a 1x track gets, 787.5 frames rounded up
+  sequencer = newSequencer(TEST_BPM);
+  sequencer->setSwing(MAX_SWING);
+  sequencer->setTrackRate(0, RATE_2);
+  sequencer->setStep(0, 0, true);
+  sequencer->setStep(0, 1, true);
+  triggers = collectTriggers(*sequencer, 2, 4 * TEST_STEP_FRAMES);
+  CHECK_EQ(triggers.size(), 2);
+  if (triggers.size() == 2) {
+    CHECK_EQ(triggers[0].frame, TEST_HALF_STEP);
+    CHECK_EQ(triggers[1].frame, TEST_HALF_STEP + TEST_STEP_FRAMES / 2 + (TEST_STEP_FRAMES + 2) / 4);
+  }
+}
+
+void testMicroTiming() {
+  std::unique_ptr<Sequencer> sequencer = newSequencer(TEST_BPM);
+  static const int offsets[] = {-MAX_MICRO_OFFSET, -MAX_MICRO_OFFSET + 1, -1, 0, 1,
+                                MAX_MICRO_OFFSET - 1, MAX_MICRO_OFFSET, 0};
+  const int count = sizeof(offsets) / sizeof(offsets[0]);
+  for (int step = 0; step < count; step++) {
+    sequencer->setStep(2, step, true);
+    sequencer->setMicroTiming(2, step, offsets[step]);
+  }
+
+  // Out of range offsets are clamped to half a step
+  sequencer->setMicroTiming(3, 0, 200);
+  CHECK_EQ(sequencer->getMicroTiming(3, 0), MAX_MICRO_OFFSET);
+  sequencer->setMicroTiming(3, 0, -200);
+  CHECK_EQ(sequencer->getMicroTiming(3, 0), -MAX_MICRO_OFFSET);
+  sequencer->setMicroTiming(3, 0, 0);
+
+  std::vector<SequencerTrigger> triggers = collectTriggers(*sequencer, count, 2 * NUM_STEPS * TEST_STEP_FRAMES);
+  CHECK_EQ(triggers.size(), count);
+  for (int i = 0; i < count && i < (int)triggers.size(); i++) {
+    CHECK_EQ(triggers[i].step, i);
+    CHECK_EQ(triggers[i].frame, expectedFrame(i, offsets[i], MIN_SWING));
+  }
+
+  // Half a step early on the first step is the frame scheduling started
+  // at; half a step late meets the early half of the step after it
+  if (triggers.size() == (size_t)count) {
+    CHECK_EQ(triggers[0].frame, 0);
+    CHECK_EQ(triggers[2].frame, TEST_HALF_STEP + 2 * TEST_STEP_FRAMES - 33);
+    CHECK_EQ(triggers[4].frame, TEST_HALF_STEP + 4 * TEST_STEP_FRAMES + 33);
+    CHECK_EQ(triggers[6].frame, TEST_HALF_STEP + 6 * TEST_STEP_FRAMES + TEST_HALF_STEP);
+    CHECK_EQ(triggers[6].frame, TEST_HALF_STEP + 7 * TEST_STEP_FRAMES - TEST_HALF_STEP);
+  }
+
+  // Swing and micro-timing add up
+  sequencer = newSequencer(TEST_BPM);
+  sequencer->setSwing(MAX_SWING);
+  sequencer->setStep(0, 1, true);
+  sequencer->setMicroTiming(0, 1, -MAX_MICRO_OFFSET);
+  triggers = collectTriggers(*sequencer, 1, 4 * TEST_STEP_FRAMES);
+  CHECK_EQ(triggers.size(), 1);
+  if (!triggers.empty()) {
+    CHECK_EQ(triggers[0].frame, TEST_HALF_STEP + TEST_STEP_FRAMES);
+  }
+
+  // A tempo that is not a whole number of frames per step accumulates no
+  // drift: 120 BPM is 2756.25 frames per 16th
+  sequencer = newSequencer(120);
+  sequencer->setStep(0, 0, true);
+  triggers = collectTriggers(*sequencer, 1000, 1000 * NUM_STEPS * 2757);
+  CHECK_EQ(triggers.size(), 1000);
+  uint32_t halfStep = (uint32_t)(((uint64_t)SAMPLE_RATE * 60 << 16) / (120 * 4)) >> 17;
+  for (size_t i = 0; i < triggers.size(); i++) {
+    // Step 16 * i is at 2756.25 * 16 * i = 44100 * i frames, exactly
+    CHECK_EQ(triggers[i].frame, halfStep + 44100 * i);
+  }
+}
+
+// Step-by-step model of one track: moves only when the master tick count
+// reaches a multiple of its step length, turning at the ends
+struct ReferenceTrack {
+  int length;
+  int direction;
+  uint16_t ticks;
+  int position;
+  int heading;
+
+  void begin(int trackLength, int rate, int trackDirection) {
+    length = trackLength;
+    direction = trackDirection;
+    ticks = Sequencer::ticksPerTrackStep(rate);
+    position = direction == DIR_REVERSE ? length - 1 : 0;
+    heading = 1;
+  }
+
+  void tick(uint32_t masterTick) {
+    if (masterTick == 0 || masterTick % ticks != 0) return;
+    if (direction == DIR_REVERSE) {
+      position = position == 0 ? length - 1 : position - 1;
+    } else if (direction == DIR_PINGPONG) {
+      if (length == 1) return;
+      if (position + heading < 0 || position + heading >= length) heading = -heading;
+      position += heading;
+    } else {
+      position = (position + 1) % length;
+    }
+  }
+};
+
+#define TRACK_CLOCK_TICKS (1u << 21)   // 2M master ticks, about 23 minutes at 120 BPM
+
+void testTrackClock() {
+  static const int lengths[] = {1, 2, 3, 7, 13, 16, 63, MAX_STEPS};
+  static const int directions[] = {DIR_FORWARD, DIR_REVERSE, DIR_PINGPONG};
+  const int lengthCount = sizeof(lengths) / sizeof(lengths[0]);
+
+  // Rate divisors in master ticks
+  CHECK_EQ(Sequencer::ticksPerTrackStep(RATE_1_8), 768);
+  CHECK_EQ(Sequencer::ticksPerTrackStep(RATE_3_4), 128);
+  CHECK_EQ(Sequencer::ticksPerTrackStep(RATE_1), TICKS_PER_STEP);
+  CHECK_EQ(Sequencer::ticksPerTrackStep(RATE_3_2), 64);
+  CHECK_EQ(Sequencer::ticksPerTrackStep(RATE_8), 12);
+  CHECK_EQ(Sequencer::ticksPerTrackStep(NUM_RATES), TICKS_PER_STEP);
+
+  // Every length, rate and direction, NUM_TRACKS combinations at a time
+  std::unique_ptr<Sequencer> sequencer = newSequencer(DEFAULT_BPM);
+  std::vector<int> combos;
+  for (int length = 0; length < lengthCount; length++) {
+    for (int rate = 0; rate < NUM_RATES; rate++) {
+      for (int direction = 0; direction < 3; direction++) {
+        combos.push_back((length * NUM_RATES + rate) * 3 + direction);
+      }
+    }
+  }
+
+  int mismatches = 0;
+  for (size_t first = 0; first < combos.size(); first += NUM_TRACKS) {
+    ReferenceTrack reference[NUM_TRACKS];
+    int used = min((int)(combos.size() - first), NUM_TRACKS);
+    for (int track = 0; track < used; track++) {
+      int combo = combos[first + track];
+      int length = lengths[combo / 3 / NUM_RATES];
+      int rate = combo / 3 % NUM_RATES;
+      int direction = directions[combo % 3];
+      sequencer->setTrackLength(track, length);
+      sequencer->setTrackRate(track, rate);
+      sequencer->setTrackDirection(track, direction);
+      reference[track].begin(length, rate, direction);
+    }
+
+    for (uint32_t tick = 0; tick < TRACK_CLOCK_TICKS; tick++) {
+      for (int track = 0; track < used; track++) {
+        reference[track].tick(tick);
+        if (sequencer->stepAtTick(track, tick) != reference[track].position && mismatches++ < 8) {
+          CHECK_EQ(sequencer->stepAtTick(track, tick), reference[track].position);
+        }
+      }
+    }
+  }
+  CHECK_EQ(mismatches, 0);
+}
+
+void testRandomDirection() {
+  std::unique_ptr<Sequencer> sequencer = newSequencer(DEFAULT_BPM);
+  for (int track = 0; track < NUM_TRACKS; track++) {
+    sequencer->setTrackDirection(track, DIR_RANDOM);
+    sequencer->setTrackLength(track, track == 0 ? 1 : 5 + track * 7);
+  }
+  sequencer->setTrackRate(2, RATE_3_2);
+  sequencer->setRandomSeed(1234);
+
+  // In range, uniform over the track and held between advances
+  const uint32_t advances = 200000;
+  for (int track = 0; track < NUM_TRACKS; track++) {
+    int length = sequencer->getTrackLength(track);
+    uint16_t ticks = Sequencer::ticksPerTrackStep(sequencer->getTrackRate(track));
+    std::vector<uint32_t> counts(length, 0);
+    for (uint32_t advance = 0; advance < advances; advance++) {
+      int step = sequencer->stepAtTick(track, advance * ticks);
+      CHECK(step >= 0 && step < length);
+      if (step < 0 || step >= length) break;
+      counts[step]++;
+      if (advance % 1000 == 0) {
+        CHECK_EQ(sequencer->stepAtTick(track, advance * ticks + ticks - 1), step);
+      }
+    }
+    for (int step = 0; step < length; step++) {
+      uint32_t expected = advances / length;
+      CHECK(counts[step] > expected * 9 / 10 && counts[step] < expected * 11 / 10);
+    }
+  }
+
+  // A function of the seed and the tick only: the same again from any
+  // starting point, something else for another seed or track
+  std::vector<int> first;
+  for (uint32_t tick = 0; tick < 1000 * TICKS_PER_STEP; tick += TICKS_PER_STEP) {
+    first.push_back(sequencer->stepAtTick(3, tick));
+  }
+  sequencer->reset();
+  int same = 0;
+  int otherTrack = 0;
+  for (uint32_t i = 0; i < first.size(); i++) {
+    same += sequencer->stepAtTick(3, i * TICKS_PER_STEP) == first[i];
+  }
+  sequencer->setTrackLength(4, sequencer->getTrackLength(3));
+  for (uint32_t i = 0; i < first.size(); i++) {
+    otherTrack += sequencer->stepAtTick(4, i * TICKS_PER_STEP) == first[i];
+  }
+  sequencer->setRandomSeed(1235);
+  int otherSeed = 0;
+  for (uint32_t i = 0; i < first.size(); i++) {
+    otherSeed += sequencer->stepAtTick(3, i * TICKS_PER_STEP) == first[i];
+  }
+  CHECK_EQ(same, (int)first.size());
+  CHECK(otherTrack < (int)first.size() / 4);
+  CHECK(otherSeed < (int)first.size() / 4);
+}
+
+void testPolymeter() {
+  // A 12-step track against a 16-step one, a 5-step one at 3/2x in
+  // reverse and a 7-step ping-pong at 3/4x, every step on: the scheduled
+  // hits follow the same positions as the step model
+  std::unique_ptr<Sequencer> sequencer = newSequencer(DEFAULT_BPM);
+  sequencer->setTrackLength(0, 12);
+  sequencer->setTrackLength(2, 5);
+  sequencer->setTrackRate(2, RATE_3_2);
+  sequencer->setTrackDirection(2, DIR_REVERSE);
+  sequencer->setTrackLength(3, 7);
+  sequencer->setTrackRate(3, RATE_3_4);
+  sequencer->setTrackDirection(3, DIR_PINGPONG);
+  for (int track = 0; track < 4; track++) {
+    for (int step = 0; step < MAX_STEPS; step++) {
+      sequencer->setStep(track, step, true);
+    }
+  }
+
+  ReferenceTrack reference[4];
+  std::vector<int> expected[4];
+  const uint32_t ticks = 64 * NUM_STEPS * TICKS_PER_STEP;
+  for (int track = 0; track < 4; track++) {
+    reference[track].begin(sequencer->getTrackLength(track), sequencer->getTrackRate(track),
+                           sequencer->getTrackDirection(track));
+  }
+  for (uint32_t tick = 0; tick < ticks; tick++) {
+    for (int track = 0; track < 4; track++) {
+      reference[track].tick(tick);
+      if (tick % reference[track].ticks == 0) expected[track].push_back(reference[track].position);
+    }
+  }
+
+  std::vector<SequencerTrigger> triggers =
+      collectTriggers(*sequencer, SIZE_MAX, (uint32_t)(64 * NUM_STEPS * 2756.25));
+  std::vector<int> played[4];
+  for (size_t i = 0; i < triggers.size(); i++) {
+    if (i > 0) CHECK(triggers[i].frame >= triggers[i - 1].frame);
+    played[triggers[i].track].push_back(triggers[i].step);
+  }
+  for (int track = 0; track < 4; track++) {
+    // The last hits before the horizon cut may not have come out yet
+    CHECK(played[track].size() + 2 >= expected[track].size());
+    CHECK(played[track].size() <= expected[track].size() + 1);
+    size_t common = min(played[track].size(), expected[track].size());
+    int wrong = 0;
+    for (size_t i = 0; i < common; i++) {
+      wrong += played[track][i] != expected[track][i];
+    }
+    CHECK_EQ(wrong, 0);
+  }
+
+  // The grid shows each track's own position
+  GridState state;
+  sequencer->getGridState(state);
+  CHECK_EQ(state.length[0], 12);
+  CHECK_EQ(state.length[1], NUM_STEPS);
+  CHECK_EQ(state.length[2], 5);
+}
+
+// Hits of an 8x track, one every 12 ticks, scheduled up to the horizon
+static int scheduleUpTo(Sequencer& sequencer, uint32_t horizon, std::vector<SequencerTrigger>& out) {
+  SequencerTrigger triggers[NUM_TRACKS * 4];
+  int total = 0;
+  int written;
+  while ((written = sequencer.schedule(horizon, triggers, NUM_TRACKS * 4)) > 0) {
+    out.insert(out.end(), triggers, triggers + written);
+    total += written;
+  }
+  return total;
+}
+
+// Frame a tick sounds at, in 64ths of a frame, rounded half up. At 105 BPM
+// a tick is 2100/64 frames, at 210 BPM 1050/64.
+static uint32_t roundSixtyFourths(uint64_t sixtyFourths) {
+  return (uint32_t)((sixtyFourths + 32) / 64);
+}
+
+void testTempoChange() {
+  std::unique_ptr<Sequencer> sequencer = newSequencer(TEST_BPM);
+  sequencer->setTrackRate(0, RATE_8);
+  sequencer->setTrackLength(0, MAX_STEPS);
+  for (int step = 0; step < MAX_STEPS; step++) {
+    sequencer->setStep(0, step, true);
+  }
+
+  // Resolve up to tick 230, 38 ticks into the third 16th: a tick is
+  // resolved once the horizon reaches half a step before it
+  const uint32_t changeTick = 230;
+  std::vector<SequencerTrigger> hits;
+  scheduleUpTo(*sequencer, 0, hits);
+  scheduleUpTo(*sequencer, changeTick * 2100 / 64 - 1, hits);
+  CHECK_EQ(hits.size(), changeTick / 12 + 1);
+  for (size_t i = 0; i < hits.size(); i++) {
+    CHECK_EQ(hits[i].frame, roundSixtyFourths(TEST_HALF_STEP * 64 + i * 12 * 2100));
+  }
+
+  // Twice as fast from tick 230 on, through the rest of the step and the
+  // steps after it
+  sequencer->setTempo(TEST_BPM * 2);
+  size_t before = hits.size();
+  scheduleUpTo(*sequencer, 20 * TEST_STEP_FRAMES, hits);
+  CHECK(hits.size() > before + 40);
+  for (size_t i = before; i < hits.size(); i++) {
+    uint64_t tick = i * 12;
+    uint64_t expected = TEST_HALF_STEP * 64 + changeTick * 2100 + (tick - changeTick) * 1050;
+    CHECK_EQ(hits[i].frame, roundSixtyFourths(expected));
+    CHECK(hits[i].frame > hits[i - 1].frame);
+  }
+
+  // And back down with setBPM() part way through another step
+  sequencer = newSequencer(TEST_BPM);
+  sequencer->setStep(0, 0, true);
+  sequencer->setStep(0, 1, true);
+  hits.clear();
+  scheduleUpTo(*sequencer, 0, hits);
+  scheduleUpTo(*sequencer, 48 * 2100 / 64 - 1, hits);
+  CHECK_EQ(hits.size(), 1);
+  sequencer->setBPM(TEST_BPM + 35);   // 140 BPM, 2362.5 frames a step
+  scheduleUpTo(*sequencer, 4 * TEST_STEP_FRAMES, hits);
+  CHECK(hits.size() >= 2);
+  if (hits.size() >= 2) {
+    // Half a step at 105 BPM, then half a step at 140
+    CHECK_EQ(hits[1].frame, roundSixtyFourths(TEST_HALF_STEP * 64 + 48 * 2100 + 48 * 1575));
+  }
+
+}
+
+// Hits per track and step over the first advances of 8x tracks, each 12
+// master ticks, scheduled in large chunks. Scheduling runs half a step
+// ahead, so hits past the last advance are left out by their frame.
+struct HitCounts {
+  uint32_t steps[NUM_TRACKS][MAX_STEPS];
+  std::vector<SequencerTrigger> order;   // Kept when asked for
+};
+
+static void countHits(Sequencer& sequencer, uint32_t advances, HitCounts& counts, bool keepOrder = false) {
+  memset(counts.steps, 0, sizeof(counts.steps));
+  counts.order.clear();
+  uint64_t advanceFrames = (uint64_t)sequencer.getFramesPerStep() / 8;   // 16.16
+  uint32_t halfStep = sequencer.getFramesPerStep() >> 17;
+  uint32_t cutoff = halfStep + (uint32_t)((advanceFrames * advances - advanceFrames / 2) >> 16);
+  static SequencerTrigger triggers[1024];
+  for (uint32_t horizon = 0; ; horizon = min(horizon + 65536, cutoff)) {
+    int written;
+    while ((written = sequencer.schedule(horizon, triggers, 1024)) > 0) {
+      for (int i = 0; i < written; i++) {
+        if (triggers[i].frame >= cutoff) continue;
+        counts.steps[triggers[i].track][triggers[i].step]++;
+        if (keepOrder) counts.order.push_back(triggers[i]);
+      }
+    }
+    if (horizon == cutoff) break;
+  }
+}
+
+static std::unique_ptr<Sequencer> newConditionSequencer(uint32_t seed) {
+  std::unique_ptr<Sequencer> sequencer = newSequencer(MAX_BPM);
+  for (int track = 0; track < NUM_TRACKS; track++) {
+    sequencer->setTrackRate(track, RATE_8);
+    sequencer->setTrackLength(track, 1);
+  }
+  sequencer->setRandomSeed(seed);
+  return sequencer;
+}
+
+#define CONDITION_ADVANCES 1000000
+
+void testTrigProbability() {
+  // 1M passes of a one-step track at each probability, one always on.
+  // Five standard deviations is at most 2500 hits.
+  static const uint8_t percents[] = {1, 25, 50, 75, TRIG_PROB_MAX};
+  std::unique_ptr<Sequencer> sequencer = newConditionSequencer(12345);
+  for (int track = 0; track < 5; track++) {
+    sequencer->setStep(track, 0, true);
+    sequencer->setTrigCondition(track, 0, percents[track]);
+  }
+  sequencer->setStep(5, 0, true);
+
+  HitCounts counts;
+  countHits(*sequencer, CONDITION_ADVANCES, counts);
+  CHECK_EQ(counts.steps[5][0], CONDITION_ADVANCES);
+  for (int track = 0; track < 5; track++) {
+    int64_t expected = (int64_t)CONDITION_ADVANCES * percents[track] / 100;
+    int64_t error = (int64_t)counts.steps[track][0] - expected;
+    CHECK(error > -2500 && error < 2500);
+  }
+
+  // The same seed gives the same hits, from the top again after reset()
+  std::unique_ptr<Sequencer> again = newConditionSequencer(12345);
+  std::unique_ptr<Sequencer> other = newConditionSequencer(54321);
+  for (int track = 0; track < 5; track++) {
+    again->setStep(track, 0, true);
+    again->setTrigCondition(track, 0, percents[track]);
+    other->setStep(track, 0, true);
+    other->setTrigCondition(track, 0, percents[track]);
+  }
+  HitCounts first;
+  HitCounts second;
+  HitCounts third;
+  HitCounts replay;
+  countHits(*again, 20000, first, true);
+  countHits(*other, 20000, second, true);
+  again->reset();
+  countHits(*again, 20000, replay, true);
+  std::unique_ptr<Sequencer> fresh = newConditionSequencer(12345);
+  for (int track = 0; track < 5; track++) {
+    fresh->setStep(track, 0, true);
+    fresh->setTrigCondition(track, 0, percents[track]);
+  }
+  countHits(*fresh, 20000, third, true);
+
+  CHECK_EQ(first.order.size(), third.order.size());
+  CHECK_EQ(first.order.size(), replay.order.size());
+  int differ = 0;
+  for (size_t i = 0; i < first.order.size() && i < third.order.size() && i < replay.order.size(); i++) {
+    differ += first.order[i].frame != third.order[i].frame || first.order[i].track != third.order[i].track;
+    differ += first.order[i].track != replay.order[i].track;
+  }
+  CHECK_EQ(differ, 0);
+  int same = 0;
+  for (size_t i = 0; i < first.order.size() && i < second.order.size(); i++) {
+    same += first.order[i].frame == second.order[i].frame && first.order[i].track == second.order[i].track;
+  }
+  CHECK(same < (int)first.order.size() / 2);
+}
+
+void testTrigLoopConditions() {
+  // A:B fires on pass a of every b, 840 passes divide by every b used
+  static const int loops[NUM_TRACKS][2] = {{1, 2}, {2, 2}, {3, 4}, {1, 3}, {2, 7}, {8, 8}};
+  std::unique_ptr<Sequencer> sequencer = newConditionSequencer(1);
+  for (int track = 0; track < NUM_TRACKS; track++) {
+    sequencer->setStep(track, 0, true);
+    sequencer->setTrigCondition(track, 0, Sequencer::trigLoopCondition(loops[track][0], loops[track][1]));
+  }
+  HitCounts counts;
+  countHits(*sequencer, 840, counts, true);
+  for (int track = 0; track < NUM_TRACKS; track++) {
+    CHECK_EQ(counts.steps[track][0], 840 / loops[track][1]);
+  }
+
+  // Which passes: the first hit of 3:4 is on the third pass
+  uint32_t firstFrame[NUM_TRACKS] = {0};
+  bool seen[NUM_TRACKS] = {false};
+  for (const SequencerTrigger& trigger : counts.order) {
+    if (!seen[trigger.track]) firstFrame[trigger.track] = trigger.frame;
+    seen[trigger.track] = true;
+  }
+  uint32_t advanceFrames = sequencer->getFramesPerStep() / 8;
+  CHECK_EQ((uint32_t)((((uint64_t)(firstFrame[2] - firstFrame[0]) << 16) + advanceFrames / 2) / advanceFrames), 2);
+  CHECK_EQ((uint32_t)((((uint64_t)(firstFrame[5] - firstFrame[0]) << 16) + advanceFrames / 2) / advanceFrames), 7);
+
+  // Passes count whole trips through a longer track
+  sequencer = newConditionSequencer(1);
+  sequencer->setTrackLength(0, 5);
+  sequencer->setStep(0, 3, true);
+  sequencer->setTrigCondition(0, 3, Sequencer::trigLoopCondition(2, 3));
+  countHits(*sequencer, 5 * 300, counts);
+  CHECK_EQ(counts.steps[0][3], 100);
+
+  // Out of range A:B is no condition, and invalid codes are refused
+  CHECK_EQ(Sequencer::trigLoopCondition(3, 2), TRIG_ALWAYS);
+  CHECK_EQ(Sequencer::trigLoopCondition(1, 9), TRIG_ALWAYS);
+  CHECK(!Sequencer::isValidTrigCondition(TRIG_NOT_FIRST + 1));
+  CHECK(!Sequencer::isValidTrigCondition(TRIG_LOOP_BASE + 2));
+  sequencer->setTrigCondition(0, 3, TRIG_LOOP_BASE + 2);
+  CHECK_EQ(sequencer->getTrigCondition(0, 3), Sequencer::trigLoopCondition(2, 3));
+}
+
+void testTrigStateConditions() {
+  // Fill and not fill follow the fill switch
+  std::unique_ptr<Sequencer> sequencer = newConditionSequencer(1);
+  sequencer->setStep(0, 0, true);
+  sequencer->setTrigCondition(0, 0, TRIG_FILL);
+  sequencer->setStep(1, 0, true);
+  sequencer->setTrigCondition(1, 0, TRIG_NOT_FILL);
+  HitCounts counts;
+  countHits(*sequencer, 1000, counts);
+  CHECK_EQ(counts.steps[0][0], 0);
+  CHECK_EQ(counts.steps[1][0], 1000);
+  sequencer->reset();
+  sequencer->setFill(true);
+  countHits(*sequencer, 1000, counts);
+  CHECK_EQ(counts.steps[0][0], 1000);
+  CHECK_EQ(counts.steps[1][0], 0);
+
+  // First and not first, on the first trip through the track since reset
+  sequencer = newConditionSequencer(1);
+  sequencer->setTrackLength(0, 4);
+  sequencer->setStep(0, 1, true);
+  sequencer->setTrigCondition(0, 1, TRIG_FIRST);
+  sequencer->setStep(0, 3, true);
+  sequencer->setTrigCondition(0, 3, TRIG_NOT_FIRST);
+  countHits(*sequencer, 4 * 50, counts);
+  CHECK_EQ(counts.steps[0][1], 1);
+  CHECK_EQ(counts.steps[0][3], 49);
+  sequencer->reset();
+  countHits(*sequencer, 4 * 50, counts);
+  CHECK_EQ(counts.steps[0][1], 1);
+
+  // PRE and NOT PRE follow the track's last conditional trig: step 1
+  // plays exactly when step 0 did, step 2 exactly when it did not
+  sequencer = newConditionSequencer(99);
+  sequencer->setTrackLength(0, 3);
+  for (int step = 0; step < 3; step++) {
+    sequencer->setStep(0, step, true);
+  }
+  sequencer->setTrigCondition(0, 0, 50);
+  sequencer->setTrigCondition(0, 1, TRIG_PRE);
+  sequencer->setTrigCondition(0, 2, TRIG_NOT_PRE);
+  countHits(*sequencer, 3 * 10000, counts, true);
+  CHECK_EQ(counts.steps[0][0], counts.steps[0][1]);
+  CHECK_EQ(counts.steps[0][0] + counts.steps[0][2], 10000);
+  CHECK(counts.steps[0][0] > 4500 && counts.steps[0][0] < 5500);
+  int broken = 0;
+  for (size_t i = 0; i < counts.order.size(); i++) {
+    uint8_t step = counts.order[i].step;
+    if (step == 0 && (i + 1 == counts.order.size() || counts.order[i + 1].step != 1)) broken++;
+    if (step == 1 && (i == 0 || counts.order[i - 1].step != 0)) broken++;
+  }
+  CHECK_EQ(broken, 0);
+
+  // A muted track still draws its numbers, so muting one track leaves
+  // another's outcomes as they were
+  std::unique_ptr<Sequencer> open = newConditionSequencer(7);
+  std::unique_ptr<Sequencer> muted = newConditionSequencer(7);
+  for (int track = 0; track < 2; track++) {
+    open->setStep(track, 0, true);
+    open->setTrigCondition(track, 0, 50);
+    muted->setStep(track, 0, true);
+    muted->setTrigCondition(track, 0, 50);
+  }
+  muted->setMute(0, true);
+  HitCounts openCounts;
+  HitCounts mutedCounts;
+  countHits(*open, 5000, openCounts);
+  countHits(*muted, 5000, mutedCounts);
+  CHECK_EQ(mutedCounts.steps[0][0], 0);
+  CHECK_EQ(mutedCounts.steps[1][0], openCounts.steps[1][0]);
+}
@@ -0,0 +1,276 @@
+/*
+ * DriftRiff Mini - Serial Link Tests
+ */
+
+#include <Arduino.h>
+#include <stdint.h>
+#include <vector>
+
+#include "test.h"
+#include "seriallink.h"
+#include "crc.h"
+
+typedef std::vector<uint8_t> Bytes;
+
+// A port that keeps what is written, taking at most budget bytes a call
+// the way a UART FIFO filling up mid-write does
+class ShortWritePort : public HardwareSerial {
+public:
+  Bytes sent;
+  size_t budget;
+
+  ShortWritePort() : HardwareSerial(-1, -1), budget(SIZE_MAX) {}
+
+  size_t write(const uint8_t* buffer, size_t size) override {
+    size = min(size, budget);
+    sent.insert(sent.end(), buffer, buffer + size);
+    return size;
+  }
+  using HardwareSerial::write;
+};
+
+static Bytes encode(const Bytes& in) {
+  Bytes out(in.size() + in.size() / 254 + 2);
+  out.resize(cobsEncode(in.data(), in.size(), out.data()));
+  return out;
+}
+
+static Bytes decode(const Bytes& in) {
+  Bytes out(in.size() + 1);
+  out.resize(cobsDecode(in.data(), in.size(), out.data()));
+  return out;
+}
+
+static uint32_t nextValue(uint32_t& state) {
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+
+// Replays bytes into a port as if they had just arrived
+static void injectAll(HardwareSerial& port, const Bytes& bytes) {
+  for (uint8_t data : bytes) {
+    port.inject(data, 0);
+  }
+}
+
+// The last link initialised gets LOG_* output once connected, leave it
+// with one that never connects so later suites log to Serial
+static void detachLogLink() {
+  static SerialLink detached;
+  detached.init(nullptr);
+}
+
+void testLinkCobs() {
+  // Reference encodings
+  CHECK(encode(Bytes{0x00}) == (Bytes{0x01, 0x01}));
+  CHECK(encode(Bytes{0x00, 0x00}) == (Bytes{0x01, 0x01, 0x01}));
+  CHECK(encode(Bytes{0x11, 0x22, 0x00, 0x33}) == (Bytes{0x03, 0x11, 0x22, 0x02, 0x33}));
+  CHECK(encode(Bytes{0x11, 0x22, 0x33, 0x44}) == (Bytes{0x05, 0x11, 0x22, 0x33, 0x44}));
+  CHECK(encode(Bytes{0x11, 0x00, 0x00, 0x00}) == (Bytes{0x02, 0x11, 0x01, 0x01, 0x01}));
+  CHECK(encode(Bytes{}) == (Bytes{0x01}));
+
+  // Runs past 254 bytes split into blocks
+  Bytes run;
+  for (int i = 1; i <= 255; i++) {
+    run.push_back(i);
+  }
+  Bytes encoded = encode(run);
+  CHECK_EQ(encoded.size(), 257);
+  CHECK_EQ(encoded[0], 0xFF);
+  CHECK_EQ(encoded[255], 0x02);
+  CHECK(decode(encoded) == run);
+
+  // Round trips of every length up to a few blocks, with and without zeros
+  uint32_t random = 0x13579bd;
+  for (size_t length = 1; length < 600; length++) {
+    Bytes data(length);
+    for (size_t i = 0; i < length; i++) {
+      data[i] = (length & 1) ? nextValue(random) % 4 : 1 + nextValue(random) % 255;
+    }
+    encoded = encode(data);
+    CHECK(encoded.size() <= length + length / 254 + 1);
+    bool clean = true;
+    for (uint8_t byte : encoded) {
+      if (byte == 0) clean = false;
+    }
+    CHECK(clean);
+    CHECK(decode(encoded) == data);
+  }
+
+  // Malformed: a zero, a block running past the end
+  CHECK(decode(Bytes{0x00}).empty());
+  CHECK(decode(Bytes{0x03, 0x11, 0x00, 0x33}).empty());
+  CHECK(decode(Bytes{0x05, 0x11, 0x22}).empty());
+  CHECK(decode(Bytes{0xFF, 0x11}).empty());
+}
+
+void testLinkFrames() {
+  // The standard CRC-32 check value
+  const uint8_t check[] = {'1', '2', '3', '4', '5', '6', '7', '8', '9'};
+  CHECK_EQ(crc32Final(crc32Update(CRC32_INIT, check, sizeof(check))), 0xCBF43926u);
+  CHECK_EQ(crc32Final(crc32Update(crc32Update(CRC32_INIT, check, 4), check + 4, 5)), 0xCBF43926u);
+
+  // Every payload length, zeros in the payload included
+  uint8_t payload[LINK_MAX_PAYLOAD];
+  uint8_t out[LINK_MAX_ENCODED];
+  for (int length = 0; length <= LINK_MAX_PAYLOAD; length++) {
+    for (int i = 0; i < length; i++) {
+      payload[i] = (i * 37 + length) % 5;
+    }
+    size_t size = linkEncodeFrame(LINK_TLM_LOG, length, payload, length, out);
+    CHECK(size > 2 && size <= LINK_MAX_ENCODED);
+    CHECK_EQ(out[0], 0);
+    CHECK_EQ(out[size - 1], 0);
+    for (size_t i = 1; i + 1 < size; i++) {
+      CHECK(out[i] != 0);
+    }
+
+    LinkFrame frame;
+    CHECK(linkDecodeFrame(out + 1, size - 2, frame));
+    CHECK_EQ(frame.type, LINK_TLM_LOG);
+    CHECK_EQ(frame.seq, length);
+    CHECK_EQ(frame.length, length);
+    CHECK(memcmp(frame.payload, payload, length) == 0);
+
+    // Truncated anywhere, or any bit flipped, is rejected
+    for (size_t cut = 0; cut < size - 2; cut++) {
+      CHECK(!linkDecodeFrame(out + 1, cut, frame));
+    }
+    for (size_t bit = 0; bit < (size - 2) * 8; bit++) {
+      out[1 + bit / 8] ^= 1 << (bit % 8);
+      CHECK(!linkDecodeFrame(out + 1, size - 2, frame));
+      out[1 + bit / 8] ^= 1 << (bit % 8);
+    }
+  }
+  CHECK_EQ(linkEncodeFrame(LINK_TLM_LOG, 0, payload, LINK_MAX_PAYLOAD + 1, out), 0);
+
+  // Too long to have come from an encoder
+  Bytes tooLong(LINK_MAX_ENCODED + 1, 0x01);
+  LinkFrame frame;
+  CHECK(!linkDecodeFrame(tooLong.data(), tooLong.size(), frame));
+}
+
+void testLinkReceive() {
+  // Keys around frames, a corrupted frame and an over-long one in between
+  uint8_t out[LINK_MAX_ENCODED];
+  Bytes line = {'a'};
+  size_t size = linkEncodeFrame(LINK_CMD_PING, 1, "hi", 2, out);
+  line.insert(line.end(), out, out + size);
+  line.push_back('b');
+  size = linkEncodeFrame(LINK_CMD_TRANSPORT, 2, "\x01", 1, out);
+  out[3] ^= 0x40;
+  line.insert(line.end(), out, out + size);
+  line.push_back(0);
+  line.insert(line.end(), LINK_MAX_ENCODED + 10, 0x22);
+  line.push_back(0);
+  size = linkEncodeFrame(LINK_CMD_SET_BPM, 3, "\x78\x00", 2, out);
+  line.insert(line.end(), out, out + size);
+  line.push_back('c');
+
+  HardwareSerial port(-1, -1);
+  injectAll(port, line);
+  SerialLink link;
+  link.init(&port);
+  CHECK(!link.isConnected());
+
+  LinkFrame frame;
+  char key = 0;
+  CHECK_EQ(link.receive(frame, key), LINK_RX_KEY);
+  CHECK_EQ(key, 'a');
+  CHECK_EQ(link.receive(frame, key), LINK_RX_FRAME);
+  CHECK_EQ(frame.type, LINK_CMD_PING);
+  CHECK_EQ(frame.seq, 1);
+  CHECK(link.isConnected());
+  CHECK_EQ(link.receive(frame, key), LINK_RX_KEY);
+  CHECK_EQ(key, 'b');
+  CHECK_EQ(link.receive(frame, key), LINK_RX_FRAME);
+  CHECK_EQ(frame.type, LINK_CMD_SET_BPM);
+  CHECK_EQ(frame.seq, 3);
+  CHECK_EQ(frame.length, 2);
+  CHECK_EQ(frame.payload[0], 0x78);
+  CHECK_EQ(link.getErrors(), 2);
+  CHECK_EQ(link.receive(frame, key), LINK_RX_KEY);
+  CHECK_EQ(key, 'c');
+  CHECK_EQ(link.receive(frame, key), LINK_RX_NONE);
+  detachLogLink();
+}
+
+void testLinkShortWrites() {
+  // Frames drained through a port that sometimes takes only a few bytes
+  // all come out whole and in order. Console text printed once the frame
+  // a short write left open is finished stays between frames.
+  ShortWritePort port;
+  uint8_t out[LINK_MAX_ENCODED];
+  size_t size = linkEncodeFrame(LINK_CMD_PING, 0, nullptr, 0, out);
+  injectAll(port, Bytes(out, out + size));
+  SerialLink link;
+  link.init(&port);
+  LinkFrame frame;
+  char key;
+  CHECK_EQ(link.receive(frame, key), LINK_RX_FRAME);
+
+  std::vector<Bytes> payloads;
+  int keys = 0;
+  uint32_t random = 0xfeed;
+  for (int round = 0; round < 2000; round++) {
+    Bytes payload(nextValue(random) % (LINK_MAX_PAYLOAD + 1));
+    for (size_t i = 0; i < payload.size(); i++) {
+      payload[i] = nextValue(random) % 3;
+    }
+    if (link.send(LINK_TLM_LOG, payload.data(), payload.size())) {
+      payloads.push_back(payload);
+    }
+    port.budget = 1 + nextValue(random) % 60;
+    link.drain();
+    if (nextValue(random) & 1) {
+      link.finishFrame();
+      port.write('k');
+      keys++;
+    }
+  }
+  port.budget = SIZE_MAX;
+  for (int i = 0; i < LINK_TX_RING && link.getQueued() > 0; i++) {
+    link.drain();
+  }
+  CHECK_EQ(link.getQueued(), 0);
+  CHECK(payloads.size() > 1500);
+
+  HardwareSerial rxPort(-1, -1);
+  injectAll(rxPort, port.sent);
+  SerialLink receiver;
+  receiver.init(&rxPort);
+  size_t frames = 0;
+  int keysSeen = 0;
+  int received;
+  while ((received = receiver.receive(frame, key)) != LINK_RX_NONE) {
+    if (received == LINK_RX_KEY) {
+      CHECK_EQ(key, 'k');
+      keysSeen++;
+      continue;
+    }
+    CHECK(frames < payloads.size());
+    if (frames < payloads.size()) {
+      CHECK_EQ(frame.type, LINK_TLM_LOG);
+      CHECK_EQ(frame.seq, frames & 0xFF);
+      CHECK(Bytes(frame.payload, frame.payload + frame.length) == payloads[frames]);
+    }
+    frames++;
+  }
+  CHECK_EQ(frames, payloads.size());
+  CHECK_EQ(keysSeen, keys);
+  CHECK_EQ(receiver.getErrors(), 0);
+
+  // A port that takes nothing is not waited on forever
+  link.send(LINK_TLM_LOG, "stuck", 5);
+  port.budget = 3;
+  link.drain();
+  port.budget = 0;
+  link.finishFrame();
+  CHECK(link.getQueued() > 0);
+  port.budget = SIZE_MAX;
+  link.finishFrame();
+  CHECK_EQ(link.getQueued(), 0);
+  detachLogLink();
+}
@@ -0,0 +1,205 @@
+/*
+ * DriftRiff Mini - Sample Slicer Tests
+ */
+
+#include <Arduino.h>
+#include <math.h>
+#include <memory>
+#include <stdlib.h>
+#include <vector>
+
+#include "test.h"
+#include "slicer.h"
+#include "sdloader.h"
+#include "audioengine.h"
+
+#define BREAK_HITS        24
+#define BREAK_MIN_GAP     1800    // Frames between hits, 82 ms
+#define BREAK_MAX_GAP     5000
+#define ONSET_TOLERANCE   24      // Frames either side, about 1 ms
+
+typedef std::vector<uint32_t> Onsets;
+
+static uint32_t nextValue(uint32_t& state) {
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+
+// A break of kicks, snares and hats at random levels, starting on the
+// first and each ringing on under the next, with a little noise
+// throughout. Returns the samples as the loader keeps them and the frame
+// every hit starts on.
+static std::vector<uint8_t> makeBreak(uint32_t seed, Onsets& onsets) {
+  uint32_t random = seed;
+  onsets.clear();
+  uint32_t frame = 0;
+  for (int i = 0; i < BREAK_HITS; i++) {
+    onsets.push_back(frame);
+    frame += BREAK_MIN_GAP + nextValue(random) % (BREAK_MAX_GAP - BREAK_MIN_GAP);
+  }
+
+  std::vector<float> mix(frame + 2000, 0.0f);
+  for (uint32_t onset : onsets) {
+    float level = 40 + nextValue(random) % 80;
+    int kind = nextValue(random) % 3;
+    for (uint32_t i = 0; onset + i < mix.size(); i++) {
+      float t = (float)i / SAMPLE_RATE;
+      float noise = (float)(nextValue(random) % 2001) / 1000.0f - 1.0f;
+      float value;
+      if (kind == 0) {
+        // Kick, a falling sine
+        value = sinf(2 * PI * (50 + 100 * expf(-t * 30)) * t) * expf(-t * 12);
+      } else if (kind == 1) {
+        // Snare, a tone under noise
+        value = (0.4f * sinf(2 * PI * 190 * t) + 0.6f * noise) * expf(-t * 20);
+      } else {
+        // Hat, short noise
+        value = noise * expf(-t * 60);
+      }
+      mix[onset + i] += level * value;
+    }
+  }
+
+  std::vector<uint8_t> samples(mix.size());
+  for (size_t i = 0; i < mix.size(); i++) {
+    float noise = (float)(nextValue(random) % 5) - 2.0f;
+    samples[i] = (uint8_t)constrain((int)lroundf(mix[i] + noise) + 128, 0, 255);
+  }
+  return samples;
+}
+
+// Hits with a slice starting within the tolerance, and slices that start
+// on no hit at all
+static void matchOnsets(const SliceTable& table, const Onsets& onsets, int& found, int& extra) {
+  found = 0;
+  std::vector<bool> used(table.count, false);
+  for (uint32_t onset : onsets) {
+    for (int slice = 0; slice < table.count; slice++) {
+      if (!used[slice] && abs((int)table.offsets[slice] - (int)onset) <= ONSET_TOLERANCE) {
+        used[slice] = true;
+        found++;
+        break;
+      }
+    }
+  }
+  extra = 0;
+  for (bool hit : used) {
+    extra += !hit;
+  }
+}
+
+// Runs the slicer a chunk at a time until it has nothing left to do
+static int runSlicer(Slicer& slicer) {
+  int calls = 0;
+  while (slicer.update() && calls < 100000) {
+    calls++;
+  }
+  return calls;
+}
+
+// A malloc'd copy the loader can take over
+static uint8_t* adopt(const std::vector<uint8_t>& samples) {
+  uint8_t* data = (uint8_t*)malloc(samples.size());
+  memcpy(data, samples.data(), samples.size());
+  return data;
+}
+
+void testSliceDetect() {
+  // Nearly every hit found, at the frame it starts on give or take a
+  // millisecond, and hardly anything found that is not a hit
+  int hits = 0;
+  int found = 0;
+  int extra = 0;
+  for (uint32_t seed = 1; seed <= 8; seed++) {
+    Onsets onsets;
+    std::vector<uint8_t> samples = makeBreak(seed * 0x9e3779b9u, onsets);
+    std::unique_ptr<SliceTable> table(new SliceTable());
+    Slicer::detect(samples.data(), samples.size(), *table);
+    CHECK(table->ready);
+    CHECK(table->count <= MAX_SLICES);
+    for (int slice = 1; slice < table->count; slice++) {
+      CHECK(table->offsets[slice] > table->offsets[slice - 1]);
+      CHECK(table->offsets[slice] < samples.size());
+    }
+
+    int runFound, runExtra;
+    matchOnsets(*table, onsets, runFound, runExtra);
+    hits += onsets.size();
+    found += runFound;
+    extra += runExtra;
+  }
+  CHECK(found * 100 >= hits * 95);
+  CHECK(extra * 100 <= hits * 5);
+
+  // Silence and a steady tone have nothing to slice
+  std::unique_ptr<SliceTable> table(new SliceTable());
+  std::vector<uint8_t> flat(20000, 128);
+  Slicer::detect(flat.data(), flat.size(), *table);
+  CHECK_EQ(table->count, 1);
+  for (size_t i = 0; i < flat.size(); i++) {
+    flat[i] = 128 + (int)lroundf(80 * sinf(2 * PI * 220 * i / SAMPLE_RATE));
+  }
+  Slicer::detect(flat.data(), flat.size(), *table);
+  CHECK_EQ(table->count, 1);
+}
+
+void testSliceRescan() {
+  SDLoader loader;
+  std::unique_ptr<Slicer> slicer(new Slicer());
+  slicer->init(&loader);
+
+  // Scanned a chunk at a time, the table is the one detect() makes
+  Onsets onsets;
+  std::vector<uint8_t> first = makeBreak(101, onsets);
+  std::unique_ptr<SliceTable> expected(new SliceTable());
+  Slicer::detect(first.data(), first.size(), *expected);
+  loader.assignSample(3, adopt(first), first.size());
+  CHECK(!slicer->isReady(3));
+  CHECK(runSlicer(*slicer) > 1);
+  CHECK(slicer->isReady(3));
+  CHECK_EQ(slicer->getSliceCount(3), expected->count);
+  for (int slice = 0; slice < expected->count; slice++) {
+    CHECK_EQ(slicer->getSliceOffset(3, slice), expected->offsets[slice]);
+  }
+
+  // Another break the same length, most likely given the buffer just
+  // freed, is scanned again rather than played with the old slices
+  std::vector<uint8_t> second = makeBreak(202, onsets);
+  second.resize(first.size(), 128);
+  Slicer::detect(second.data(), second.size(), *expected);
+  loader.unloadAllSamples();
+  loader.assignSample(3, adopt(second), second.size());
+  CHECK_EQ(slicer->getSliceCount(3), 0);
+  uint8_t* data = loader.getSampleData(3);
+  uint32_t size = loader.getSampleSize(3);
+  slicer->getSlice(3, 2, data, size);
+  CHECK(data == loader.getSampleData(3));
+  CHECK_EQ(size, second.size());
+  runSlicer(*slicer);
+  CHECK_EQ(slicer->getSliceCount(3), expected->count);
+  for (int slice = 0; slice < expected->count; slice++) {
+    CHECK_EQ(slicer->getSliceOffset(3, slice), expected->offsets[slice]);
+  }
+
+  // Replaced halfway through a scan, the scan starts over on the new one
+  std::vector<uint8_t> third = makeBreak(303, onsets);
+  Slicer::detect(third.data(), third.size(), *expected);
+  loader.assignSample(3, adopt(first), first.size());
+  for (int i = 0; i < 3; i++) {
+    slicer->update();
+  }
+  loader.assignSample(3, adopt(third), third.size());
+  runSlicer(*slicer);
+  CHECK_EQ(slicer->getSliceCount(3), expected->count);
+  for (int slice = 0; slice < expected->count; slice++) {
+    CHECK_EQ(slicer->getSliceOffset(3, slice), expected->offsets[slice]);
+  }
+
+  // Unloaded, nothing is left to slice with
+  loader.unloadAllSamples();
+  runSlicer(*slicer);
+  CHECK(!slicer->isReady(3));
+  CHECK_EQ(slicer->getSliceCount(3), 0);
+}
@@ -4,6 +4,8 @@
 
 #include "touchscreen.h"
 #include "ui.h"
+#include "debuglog.h"
+#include "profiler.h"
 
 TouchHandler::TouchHandler() {
   touchScreen = nullptr;
@@ -35,6 +37,8 @@ TSPoint TouchHandler::getTouch() {
 }
 
 TouchAction TouchHandler::processTouchInput(int rawX, int rawY) {
+  PROF_SCOPE(PROF_TOUCH);
+  
   TouchAction action;
   action.type = TOUCH_NONE;
   action.track = -1;
@@ -47,16 +51,9 @@ TouchAction TouchHandler::processTouchInput(int rawX, int rawY) {
   action.x = screenX;
   action.y = screenY;
   
-  Serial.print("Touch: Raw(");
-  Serial.print(rawX);
-  Serial.print(",");
-  Serial.print(rawY);
-  Serial.print(") -> Screen(");
-  Serial.print(screenX);
-  Serial.print(",");
-  Serial.print(screenY);
-  Serial.println(")");
-  
+  LOG_DEBUG("Touch: Raw(", rawX, ",", rawY, ") -> Screen(",
+            screenX, ",", screenY, ")");
+            
   // Check if touch is in grid area
   int track, step;
   if (screenX >= GRID_START_X && screenY >= GRID_START_Y) {
@@ -68,7 +65,7 @@ TouchAction TouchHandler::processTouchInput(int rawX, int rawY) {
     track = relY / (STEP_HEIGHT + TRACK_SPACING);
     
     // Validate grid bounds and check if within step bounds
-    if (step >= 0 && step < 16 && track >= 0 && track < 6) {
+    if (step >= 0 && step < NUM_STEPS && track >= 0 && track < NUM_TRACKS) {
       int stepX = step * (STEP_WIDTH + STEP_SPACING);
       int stepY = track * (STEP_HEIGHT + TRACK_SPACING);
       
@@ -78,10 +75,7 @@ TouchAction TouchHandler::processTouchInput(int rawX, int rawY) {
         action.track = track;
         action.step = step;
         
-        Serial.print("Grid touch - Track: ");
-        Serial.print(track);
-        Serial.print(", Step: ");
-        Serial.println(step);
+        LOG_DEBUG("Grid touch - Track: ", track, ", Step: ", step);
         
         return action;
       }
@@ -92,18 +86,28 @@ TouchAction TouchHandler::processTouchInput(int rawX, int rawY) {
   if (screenY >= CONTROL_Y && screenY <= CONTROL_Y + 25) {
     if (screenX >= BPM_UP_X && screenX <= BPM_UP_X + 30) {
       action.type = TOUCH_BPM_UP;
-      Serial.println("BPM Up touched");
+      LOG_DEBUG("BPM Up touched");
     }
     else if (screenX >= BPM_DOWN_X && screenX <= BPM_DOWN_X + 30) {
       action.type = TOUCH_BPM_DOWN;
-      Serial.println("BPM Down touched");
+      LOG_DEBUG("BPM Down touched");
     }
     else if (screenX >= PLAY_X && screenX <= PLAY_X + 60) {
       action.type = TOUCH_PLAY_PAUSE;
-      Serial.println("Play/Pause touched");
+      LOG_DEBUG("Play/Pause touched");
     }
   }
   
+  // Step number row flips grid pages
+  if (screenY >= TITLE_HEIGHT && screenY < GRID_START_Y - 1 && screenX >= GRID_START_X) {
+    action.type = TOUCH_PAGE;
+  }
+  
+  // Title bar toggles the profiling overlay
+  if (screenY < TITLE_HEIGHT) {
+    action.type = TOUCH_PROFILER;
+  }
+  
   return action;
 }
 
@@ -28,7 +28,9 @@ enum TouchActionType {
   TOUCH_BPM_DOWN,
   TOUCH_PLAY_PAUSE,
   TOUCH_CLEAR_TRACK,
-  TOUCH_CLEAR_ALL
+  TOUCH_CLEAR_ALL,
+  TOUCH_PROFILER,
+  TOUCH_PAGE
 };
 
 struct TouchAction {
@@ -61,3 +63,5 @@ public:
   void calibrate();
   bool isValidTouch(TSPoint p);
 };
+
+#endif
@@ -3,12 +3,18 @@
  */
 
 #include "ui.h"
+#include "profiler.h"
 
 UI::UI() {
   display = nullptr;
-  lastCurrentStep = -1;
+  page = 0;
+  pageCount = 1;
+  invalidateGrid();
   lastBPM = -1;
   lastPlayState = false;
+  lastAudible = ALL_TRACKS_MASK;
+  profilerOverlay = false;
+  invalidateSamples();
 }
 
 void UI::init(Adafruit_ILI9341* tft) {
@@ -18,6 +24,8 @@ void UI::init(Adafruit_ILI9341* tft) {
 }
 
 void UI::drawInterface() {
+  PROF_SCOPE(PROF_UI_DRAW);
+  
   display->fillScreen(COLOR_BG);
   
   // Title
@@ -27,15 +35,7 @@ void UI::drawInterface() {
   display->println("DRIFTRIFT MINI");
   
   // Track labels
-  display->setTextSize(1);
-  display->setTextColor(COLOR_TEXT);
-  const char* trackNames[] = {"KICK", "SNARE", "HIHAT", "PERC", "BASS", "LEAD"};
-  
-  for (int track = 0; track < 6; track++) {
-    int y = GRID_START_Y + (track * (STEP_HEIGHT + TRACK_SPACING)) + 2;
-    display->setCursor(0, y);
-    display->println(trackNames[track]);
-  }
+  drawTrackLabels(ALL_TRACKS_MASK);
   
   // Draw grid outline
   int gridWidth = 16 * (STEP_WIDTH + STEP_SPACING) - STEP_SPACING;
@@ -43,17 +43,9 @@ void UI::drawInterface() {
   
   display->drawRect(GRID_START_X - 1, GRID_START_Y - 1, 
                    gridWidth + 2, gridHeight + 2, COLOR_GRID);
-  
+                   
   // Step numbers
-  display->setTextColor(COLOR_GRID);
-  for (int step = 0; step < 16; step++) {
-    int x = GRID_START_X + (step * (STEP_WIDTH + STEP_SPACING)) + 4;
-    display->setCursor(x, GRID_START_Y - 15);
-    if (step < 9) {
-      display->print("0");
-    }
-    display->print(step + 1);
-  }
+  drawStepNumbers();
   
   // Control buttons
   drawButton(BPM_X, CONTROL_Y, 80, 25, "BPM: 120");
@@ -67,37 +59,169 @@ void UI::drawInterface() {
       drawStep(track, step, false, false);
     }
   }
+  invalidateGrid();
+  invalidateSamples();
 }
 
-void UI::updateGrid(bool steps[][16], int currentStep) {
-  // Only redraw if current step changed
-  if (currentStep != lastCurrentStep) {
-    // Clear previous current step indicator
-    if (lastCurrentStep >= 0) {
-      for (int track = 0; track < 6; track++) {
-        drawStep(track, lastCurrentStep, steps[track][lastCurrentStep], false);
-      }
+void UI::updateGrid(const GridState& grid) {
+  PROF_SCOPE(PROF_UI_DRAW);
+  
+  // Pages needed for the longest track
+  int maxLength = 1;
+  for (int track = 0; track < NUM_TRACKS; track++) {
+    maxLength = max(maxLength, (int)grid.length[track]);
+  }
+  int pages = (maxLength + NUM_STEPS - 1) / NUM_STEPS;
+  if (pages != pageCount) {
+    pageCount = pages;
+    if (page >= pageCount) {
+      page = 0;
+      invalidateGrid();
     }
-    
-    // Draw new current step
-    for (int track = 0; track < 6; track++) {
-      drawStep(track, currentStep, steps[track][currentStep], true);
+    drawStepNumbers();
+  }
+  
+  // Muted tracks have grey labels. The labels run into the first column,
+  // so its cells go back over them.
+  if (grid.audible != lastAudible) {
+    drawTrackLabels(grid.audible);
+    for (int track = 0; track < NUM_TRACKS; track++) {
+      lastCell[track][0] = CELL_UNKNOWN;
     }
-    
-    lastCurrentStep = currentStep;
   }
   
-  // Update any changed steps
-  for (int track = 0; track < 6; track++) {
-    for (int step = 0; step < 16; step++) {
-      if (step != currentStep) {
-        drawStep(track, step, steps[track][step], false);
+  // Redraw only the cells whose state changed since the last call
+  int firstStep = page * NUM_STEPS;
+  for (int track = 0; track < NUM_TRACKS; track++) {
+    for (int column = 0; column < NUM_STEPS; column++) {
+      int step = firstStep + column;
+      
+      uint8_t state;
+      if (step >= grid.length[track]) {
+        state = CELL_OUT_OF_RANGE;
+      } else if (step == grid.position[track]) {
+        state = CELL_CURRENT;
+      } else if ((grid.steps[track] >> step) & 1) {
+        state = CELL_ON;
+      } else {
+        state = CELL_OFF;
       }
+      
+      if (state != lastCell[track][column]) {
+        drawCell(track, column, state);
+        lastCell[track][column] = state;
+      }
+    }
+  }
+}
+
+void UI::drawTrackLabels(uint8_t audible) {
+  const char* trackNames[] = {"KICK", "SNARE", "HIHAT", "PERC", "BASS", "LEAD"};
+  
+  display->setTextSize(1);
+  for (int track = 0; track < NUM_TRACKS; track++) {
+    int y = GRID_START_Y + (track * (STEP_HEIGHT + TRACK_SPACING)) + 2;
+    display->setTextColor((audible >> track) & 1 ? COLOR_TEXT : COLOR_STEP_OFF);
+    display->setCursor(0, y);
+    display->println(trackNames[track]);
+  }
+  lastAudible = audible;
+}
+
+void UI::nextPage() {
+  page = (page + 1) % pageCount;
+  drawStepNumbers();
+  invalidateGrid();
+}
+
+void UI::invalidateGrid() {
+  for (int track = 0; track < NUM_TRACKS; track++) {
+    for (int column = 0; column < NUM_STEPS; column++) {
+      lastCell[track][column] = CELL_UNKNOWN;
     }
   }
 }
 
+void UI::drawStepNumbers() {
+  int firstStep = page * NUM_STEPS;
+  
+  display->setTextSize(1);
+  display->setTextColor(COLOR_GRID, COLOR_BG);
+  for (int step = 0; step < NUM_STEPS; step++) {
+    int x = GRID_START_X + (step * (STEP_WIDTH + STEP_SPACING)) + 4;
+    display->setCursor(x, GRID_START_Y - 15);
+    if (firstStep + step < 9) {
+      display->print("0");
+    }
+    display->print(firstStep + step + 1);
+  }
+  
+  // Page indicator, blank when everything fits on one page
+  display->fillRect(PAGE_X, 10, 40, 8, COLOR_BG);
+  if (pageCount > 1) {
+    display->setCursor(PAGE_X, 10);
+    display->setTextColor(COLOR_TEXT, COLOR_BG);
+    display->print(page + 1);
+    display->print("/");
+    display->print(pageCount);
+  }
+}
+
+bool UI::updateSamples(SDLoader* loader) {
+  // The overlay has the area while it is up
+  if (profilerOverlay) return false;
+  
+  bool drawn = false;
+  for (int slot = 0; slot < NUM_SAMPLE_SLOTS; slot++) {
+    uint16_t version = loader->getThumbnailVersion(slot);
+    if (drawnThumbnail[slot] == version) continue;
+    
+    PROF_SCOPE(PROF_UI_DRAW);
+    drawSample(slot, loader->getThumbnail(slot), loader->getSamplePath(slot), loader->isSampleLoaded(slot));
+    drawnThumbnail[slot] = version;
+    drawn = true;
+  }
+  return drawn;
+}
+
+void UI::drawSample(int slot, const SampleThumbnail& thumb, const char* path, bool loaded) {
+  int x = THUMB_X + (slot % THUMB_PER_ROW) * THUMB_PITCH_X;
+  int y = THUMB_Y + (slot / THUMB_PER_ROW) * THUMB_PITCH_Y;
+  
+  // Track number and file name without folder or extension
+  char label[16];
+  const char* name = strrchr(path, '/');
+  name = name ? name + 1 : path;
+  int length = snprintf(label, sizeof(label), "%d %s", slot + 1, name);
+  char* dot = strrchr(label, '.');
+  if (dot && length < (int)sizeof(label) - 1) {
+    *dot = '\0';
+  }
+  
+  display->fillRect(x, y, THUMB_PITCH_X - 4, THUMB_LABEL + THUMB_HEIGHT, COLOR_BG);
+  display->setTextSize(1);
+  display->setTextColor(loaded ? COLOR_TEXT : COLOR_STEP_OFF);
+  display->setCursor(x, y);
+  display->print(label);
+  
+  // One vertical line per column, from the highest frame to the lowest
+  int top = y + THUMB_LABEL;
+  for (int column = 0; column < SAMPLE_THUMB_COLUMNS; column++) {
+    int high = top + (255 - thumb.high[column]) * (THUMB_HEIGHT - 1) / 255;
+    int low = top + (255 - thumb.low[column]) * (THUMB_HEIGHT - 1) / 255;
+    display->drawFastVLine(x + column, high, low - high + 1, loaded ? COLOR_WAVE : COLOR_STEP_OFF);
+  }
+}
+
+void UI::invalidateSamples() {
+  for (int slot = 0; slot < NUM_SAMPLE_SLOTS; slot++) {
+    drawnThumbnail[slot] = -1;
+  }
+}
+
 void UI::updateBPM(int bpm) {
+  PROF_SCOPE(PROF_UI_DRAW);
+  
   if (bpm != lastBPM) {
     // Clear previous BPM display
     display->fillRect(BPM_X + 1, CONTROL_Y + 1, 78, 23, COLOR_BG);
@@ -113,6 +237,8 @@ void UI::updateBPM(int bpm) {
 }
 
 void UI::updatePlayState(bool isPlaying) {
+  PROF_SCOPE(PROF_UI_DRAW);
+  
   if (isPlaying != lastPlayState) {
     // Clear button area
     display->fillRect(PLAY_X + 1, CONTROL_Y + 1, 58, 23, COLOR_BG);
@@ -126,6 +252,39 @@ void UI::updatePlayState(bool isPlaying) {
   }
 }
 
+void UI::toggleProfilerOverlay() {
+  profilerOverlay = !profilerOverlay;
+  
+  // Clear the overlay area either way, it is redrawn on the next refresh,
+  // or the thumbnails are
+  display->fillRect(0, OVERLAY_Y, 320, OVERLAY_HEIGHT, COLOR_BG);
+  invalidateSamples();
+}
+
+void UI::drawProfilerOverlay() {
+  if (!profilerOverlay) return;
+  
+  // Timed under the UI channel like any other draw
+  PROF_SCOPE(PROF_UI_DRAW);
+  
+  char line[64];
+  display->setTextSize(1);
+  display->setTextColor(COLOR_TEXT, COLOR_BG);
+  
+  for (int ch = 0; ch < PROF_NUM_CHANNELS; ch++) {
+    int len = profiler.formatChannel((ProfileChannel)ch, line, sizeof(line));
+    
+    // Pad to a fixed width so shorter lines overwrite older, longer ones
+    while (len < 52 && len < (int)sizeof(line) - 1) {
+      line[len++] = ' ';
+    }
+    line[len] = '\0';
+    
+    display->setCursor(2, OVERLAY_Y + ch * 11);
+    display->print(line);
+  }
+}
+
 void UI::drawStep(int track, int step, bool active, bool isCurrent) {
   int x = GRID_START_X + (step * (STEP_WIDTH + STEP_SPACING));
   int y = GRID_START_Y + (track * (STEP_HEIGHT + TRACK_SPACING));
@@ -147,6 +306,17 @@ void UI::drawStep(int track, int step, bool active, bool isCurrent) {
   }
 }
 
+void UI::drawCell(int track, int column, uint8_t state) {
+  if (state == CELL_OUT_OF_RANGE) {
+    int x = GRID_START_X + (column * (STEP_WIDTH + STEP_SPACING));
+    int y = GRID_START_Y + (track * (STEP_HEIGHT + TRACK_SPACING));
+    display->fillRect(x, y, STEP_WIDTH, STEP_HEIGHT, COLOR_STEP_OUT);
+    return;
+  }
+  
+  drawStep(track, column, state == CELL_ON, state == CELL_CURRENT);
+}
+
 void UI::drawButton(int x, int y, int w, int h, const char* text, bool pressed) {
   uint16_t bgColor = pressed ? COLOR_STEP_ON : COLOR_BG;
   uint16_t textColor = pressed ? COLOR_BG : COLOR_TEXT;
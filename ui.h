@@ -7,14 +7,18 @@
 
 #include <Adafruit_GFX.h>
 #include <Adafruit_ILI9341.h>
+#include "sequencer.h"
+#include "sdloader.h"
 
 // Colors (minimalist black/red theme)
 #define COLOR_BG        ILI9341_BLACK
 #define COLOR_GRID      0x2104        // Dark gray
 #define COLOR_STEP_OFF  0x4208        // Medium gray
 #define COLOR_STEP_ON   ILI9341_RED
+#define COLOR_STEP_OUT  0x1082        // Past the end of the track
 #define COLOR_CURRENT   ILI9341_WHITE
 #define COLOR_TEXT      ILI9341_WHITE
+#define COLOR_WAVE      ILI9341_RED
 
 // Layout constants
 #define GRID_START_X    20
@@ -30,24 +34,71 @@
 #define BPM_UP_X        220
 #define BPM_DOWN_X      260
 
+#define TITLE_HEIGHT    25            // Touching the title toggles the overlay
+#define PAGE_X          280           // Page indicator, touching step numbers flips pages
+#define OVERLAY_Y       134           // Below the grid, one 11 px line per profiler channel
+#define OVERLAY_HEIGHT  66
+
+// Sample thumbnails, two rows of three in the overlay's area, hidden while
+// it is up. Each has its file name above it.
+#define THUMB_X         20
+#define THUMB_Y         OVERLAY_Y
+#define THUMB_PITCH_X   100
+#define THUMB_PITCH_Y   33
+#define THUMB_PER_ROW   3
+#define THUMB_LABEL     10            // Name line above the waveform
+#define THUMB_HEIGHT    22
+
+// What a grid cell last showed, so unchanged cells are not redrawn
+enum CellState {
+  CELL_OFF,
+  CELL_ON,
+  CELL_CURRENT,
+  CELL_OUT_OF_RANGE,
+  CELL_UNKNOWN
+};
+
 class UI {
 private:
   Adafruit_ILI9341* display;
-  int lastCurrentStep;
+  uint8_t lastCell[NUM_TRACKS][NUM_STEPS];
+  int page;
+  int pageCount;
   int lastBPM;
   bool lastPlayState;
+  uint8_t lastAudible;          // Tracks whose labels are drawn as sounding
+  bool profilerOverlay;
+  int32_t drawnThumbnail[NUM_SAMPLE_SLOTS];   // Version last drawn, -1 for none
   
 public:
   UI();
   
   void init(Adafruit_ILI9341* tft);
   void drawInterface();
-  void updateGrid(bool steps[][16], int currentStep);
+  void updateGrid(const GridState& grid);
   void updateBPM(int bpm);
   void updatePlayState(bool isPlaying);
   
+  // Grid paging, 16 steps per page
+  void nextPage();
+  int getPage() { return page; }
+  
+  // Redraw the thumbnails of slots that changed, true if any did
+  bool updateSamples(SDLoader* loader);
+  void drawSample(int slot, const SampleThumbnail& thumb, const char* path, bool loaded);
+  void invalidateSamples();
+  
+  // Profiling overlay
+  void toggleProfilerOverlay();
+  bool isProfilerOverlayVisible() { return profilerOverlay; }
+  void drawProfilerOverlay();
+  
   // Helper functions
   void drawStep(int track, int step, bool active, bool isCurrent);
+  void drawCell(int track, int column, uint8_t state);
+  void drawStepNumbers();
+  void drawTrackLabels(uint8_t audible);
+  void invalidateGrid();
   void drawButton(int x, int y, int w, int h, const char* text, bool pressed = false);
   void clearGrid();
   
@@ -57,3 +108,5 @@ public:
   bool isInBPMDownArea(int x, int y);
   bool isInPlayArea(int x, int y);
 };
+
+#endif